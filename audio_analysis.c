@@ -0,0 +1,264 @@
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include "audio_analysis.h"
+
+/*
+ * Audio analysis helpers
+ *
+ * Silence searches run on 16 byte vectors of samples, using GCC vector
+ * extensions so they map to SSE2 or NEON. Channels are selected with a lane
+ * mask repeating every lcm(lanes, stride) samples; once a vector holds a
+ * selected sample above threshold, the matching frame is found with a scalar
+ * scan of that vector.
+ */
+
+typedef int16_t v8i16 __attribute__((vector_size(16)));
+typedef int32_t v4i32 __attribute__((vector_size(16)));
+
+#define AUDIO_MAX_MASKS		AUDIO_MAX_CHANNELS
+
+static size_t
+lcm(size_t a, size_t b)
+{
+	size_t x = a, y = b;
+
+	while (y) {
+		size_t t = x % y;
+		x = y;
+		y = t;
+	}
+
+	return a / x * b;
+}
+
+static bool
+vec_any(const void *v)
+{
+	uint64_t u[2];
+
+	memcpy(u, v, sizeof (u));
+
+	return (u[0] | u[1]) != 0;
+}
+
+static size_t
+find_non_silent_scalar_s16(const int16_t *data, size_t frame, size_t n_frames,
+			   int stride, int first, int count, int16_t threshold)
+{
+	for (; frame < n_frames; frame++) {
+		const int16_t *p = data + frame * stride + first;
+
+		for (int c = 0; c < count; c++) {
+			if (p[c] > threshold || p[c] < -threshold)
+				return frame;
+		}
+	}
+
+	return n_frames;
+}
+
+size_t
+audio_find_non_silent_s16(const int16_t *data, size_t n_frames, int stride,
+			  int first, int count, int16_t threshold)
+{
+	const size_t lanes = 8;
+	const size_t n_samples = n_frames * stride;
+	v8i16 masks[AUDIO_MAX_MASKS];
+	v8i16 thr = (v8i16){} + threshold;
+	size_t period, m = 0, i = 0;
+
+	if (count <= 0 || stride > AUDIO_MAX_CHANNELS)
+		return find_non_silent_scalar_s16(data, 0, n_frames, stride,
+						  first, count, threshold);
+
+	period = lcm(lanes, stride) / lanes;
+	for (size_t l = 0; l < period * lanes; l++) {
+		int c = l % stride;
+
+		masks[l / lanes][l % lanes] =
+			c >= first && c < first + count ? -1 : 0;
+	}
+
+	for (; i + lanes <= n_samples; i += lanes) {
+		v8i16 v, hit;
+
+		memcpy(&v, data + i, sizeof (v));
+		hit = ((v > thr) | (v < -thr)) & masks[m];
+		if (vec_any(&hit))
+			break;
+
+		if (++m == period)
+			m = 0;
+	}
+
+	return find_non_silent_scalar_s16(data, i / stride, n_frames, stride,
+					  first, count, threshold);
+}
+
+static size_t
+find_non_silent_scalar_s32(const int32_t *data, size_t frame, size_t n_frames,
+			   int stride, int first, int count, int32_t threshold)
+{
+	for (; frame < n_frames; frame++) {
+		const int32_t *p = data + frame * stride + first;
+
+		for (int c = 0; c < count; c++) {
+			if (p[c] > threshold || p[c] < -threshold)
+				return frame;
+		}
+	}
+
+	return n_frames;
+}
+
+size_t
+audio_find_non_silent_s32(const int32_t *data, size_t n_frames, int stride,
+			  int first, int count, int32_t threshold)
+{
+	const size_t lanes = 4;
+	const size_t n_samples = n_frames * stride;
+	v4i32 masks[AUDIO_MAX_MASKS];
+	v4i32 thr = (v4i32){} + threshold;
+	size_t period, m = 0, i = 0;
+
+	if (count <= 0 || stride > AUDIO_MAX_CHANNELS)
+		return find_non_silent_scalar_s32(data, 0, n_frames, stride,
+						  first, count, threshold);
+
+	period = lcm(lanes, stride) / lanes;
+	for (size_t l = 0; l < period * lanes; l++) {
+		int c = l % stride;
+
+		masks[l / lanes][l % lanes] =
+			c >= first && c < first + count ? -1 : 0;
+	}
+
+	for (; i + lanes <= n_samples; i += lanes) {
+		v4i32 v, hit;
+
+		memcpy(&v, data + i, sizeof (v));
+		hit = ((v > thr) | (v < -thr)) & masks[m];
+		if (vec_any(&hit))
+			break;
+
+		if (++m == period)
+			m = 0;
+	}
+
+	return find_non_silent_scalar_s32(data, i / stride, n_frames, stride,
+					  first, count, threshold);
+}
+
+size_t
+audio_find_silent_s16(const int16_t *data, size_t n_frames, int stride,
+		      int first, int count, int16_t threshold)
+{
+	for (size_t frame = 0; frame < n_frames; frame++) {
+		const int16_t *p = data + frame * stride + first;
+		int c;
+
+		for (c = 0; c < count; c++) {
+			if (p[c] > threshold || p[c] < -threshold)
+				break;
+		}
+
+		if (c == count)
+			return frame;
+	}
+
+	return n_frames;
+}
+
+/* the DC sum is kept in integers, exact for any buffer size */
+struct level_acc {
+	int64_t sum;
+	double sum_sq;
+	uint32_t peak;
+};
+
+static void
+levels_finish(struct audio_levels *levels, const struct level_acc *acc,
+	      int channels, size_t n_frames, double full_scale)
+{
+	levels->channels = channels;
+	levels->n_frames = n_frames;
+
+	for (int c = 0; c < channels; c++) {
+		if (n_frames == 0) {
+			levels->peak[c] = 0;
+			levels->rms[c] = 0;
+			levels->dc[c] = 0;
+			continue;
+		}
+
+		levels->peak[c] = acc[c].peak / full_scale;
+		levels->rms[c] = sqrt(acc[c].sum_sq / n_frames) / full_scale;
+		levels->dc[c] = acc[c].sum / (double)n_frames / full_scale;
+	}
+}
+
+int
+audio_get_levels_s16(const int16_t *data, size_t n_frames, int channels,
+		     struct audio_levels *levels)
+{
+	struct level_acc acc[AUDIO_MAX_CHANNELS] = {};
+
+	if (channels <= 0 || channels > AUDIO_MAX_CHANNELS)
+		return -1;
+
+	for (size_t f = 0; f < n_frames; f++, data += channels) {
+		for (int c = 0; c < channels; c++) {
+			int32_t s = data[c];
+			uint32_t a = abs(s);
+
+			acc[c].sum += s;
+			acc[c].sum_sq += (double)(s * s);
+			if (a > acc[c].peak)
+				acc[c].peak = a;
+		}
+	}
+
+	levels_finish(levels, acc, channels, n_frames, 32768.0);
+
+	return 0;
+}
+
+int
+audio_get_levels_s32(const int32_t *data, size_t n_frames, int channels,
+		     struct audio_levels *levels)
+{
+	struct level_acc acc[AUDIO_MAX_CHANNELS] = {};
+
+	if (channels <= 0 || channels > AUDIO_MAX_CHANNELS)
+		return -1;
+
+	for (size_t f = 0; f < n_frames; f++, data += channels) {
+		for (int c = 0; c < channels; c++) {
+			int64_t s = data[c];
+			uint32_t a = s < 0 ? -s : s;
+
+			acc[c].sum += s;
+			acc[c].sum_sq += (double)s * s;
+			if (a > acc[c].peak)
+				acc[c].peak = a;
+		}
+	}
+
+	levels_finish(levels, acc, channels, n_frames, 2147483648.0);
+
+	return 0;
+}
+
+bool
+audio_levels_check_dc(const struct audio_levels *levels, double max_dc)
+{
+	for (int c = 0; c < levels->channels; c++) {
+		if (fabs(levels->dc[c]) > max_dc)
+			return false;
+	}
+
+	return true;
+}
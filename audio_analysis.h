@@ -0,0 +1,48 @@
+#ifndef AUDIO_ANALYSIS_H_
+# define AUDIO_ANALYSIS_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* block-level helpers working on whole interleaved buffers, checking a range
+ * of channels of each frame */
+
+#define AUDIO_MAX_CHANNELS		16
+
+/* samples within +/-15 are considered silent */
+#define AUDIO_SILENCE_THRESHOLD_S16	15
+#define AUDIO_SILENCE_THRESHOLD_S32	(15 << 16)
+
+/* index of the first frame with a sample of channels [first, first + count)
+ * above threshold, or n_frames if all are silent */
+size_t audio_find_non_silent_s16(const int16_t *data, size_t n_frames,
+				 int stride, int first, int count,
+				 int16_t threshold);
+size_t audio_find_non_silent_s32(const int32_t *data, size_t n_frames,
+				 int stride, int first, int count,
+				 int32_t threshold);
+
+/* index of the first frame with all samples of channels [first, first +
+ * count) within threshold, or n_frames if none is */
+size_t audio_find_silent_s16(const int16_t *data, size_t n_frames, int stride,
+			     int first, int count, int16_t threshold);
+
+/* levels of each channel, relative to full scale */
+struct audio_levels {
+	int channels;
+	size_t n_frames;
+	double peak[AUDIO_MAX_CHANNELS];
+	double rms[AUDIO_MAX_CHANNELS];
+	double dc[AUDIO_MAX_CHANNELS];
+};
+
+int audio_get_levels_s16(const int16_t *data, size_t n_frames, int channels,
+			 struct audio_levels *levels);
+int audio_get_levels_s32(const int32_t *data, size_t n_frames, int channels,
+			 struct audio_levels *levels);
+
+/* true if the DC offset of every channel is within max_dc */
+bool audio_levels_check_dc(const struct audio_levels *levels, double max_dc);
+
+#endif /* !AUDIO_ANALYSIS_H_ */
@@ -26,7 +26,7 @@ mkdir -p "$CHROOT/usr/bin" \
 	"$CHROOT/lib"
 ln -s lib "$CHROOT/lib64"
 ln -s lib "$CHROOT/usr/lib64"
-cp qapdec qaptest "$CHROOT/usr/bin/"
+cp qapdec qapbench qaptest "$CHROOT/usr/bin/"
 cp "$BUILDROOT/usr/lib/libdolby_ms12_wrapper.so" "$CHROOT/usr/lib/"
 cp "$BUILDROOT/usr/lib/liblmclient.so" "$CHROOT/usr/lib/"
 
@@ -22,5 +22,5 @@ export SYSROOT="$QCA/apps_proc/poky/build/tmp-glibc/sysroots/apq8098"
 $SCRIPT_DIR/build-static.sh $@
 
 git archive --prefix="$NAME/" HEAD | tar x
-cp qapdec qaptest "$NAME/"
+cp qapdec qapbench qaptest "$NAME/"
 zip -r "$NAME.zip" "$NAME"
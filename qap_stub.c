@@ -0,0 +1,1432 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include <libavcodec/avcodec.h>
+#include <libavutil/channel_layout.h>
+#include <libswresample/swresample.h>
+
+#include <qap_defs.h>
+#include <dolby_ms12.h>
+
+/*
+ * Stand-in implementation of the QAP wrapper API, used for host builds
+ * where the vendor libraries are not available.
+ *
+ * Each session runs a single processing thread. PCM inputs are passed
+ * through, compressed inputs are decoded with libavcodec. The primary
+ * module (or the first started module if there is no primary one) drives
+ * the outputs: its audio is remixed to the channel count of every PCM
+ * output and delivered in fixed size blocks of 16 bits samples. Audio
+ * from the other modules is consumed at the same pace and discarded, so
+ * the output content only depends on the primary input. Encoded outputs
+ * are accepted but never produce data.
+ *
+ * AAC inputs may carry ADTS or LOAS/LATM framing, both announced as
+ * QAP_AUDIO_FORMAT_AAC_ADTS; the framing is detected from the first buffer
+ * after the decoder is opened or flushed, and must not change afterwards.
+ *
+ * Module input buffers are bounded: qap_module_process() returns -EAGAIN
+ * when full, and a SEND_INPUT_BUFFER event is sent once room is
+ * available again.
+ *
+ * Behaviour can be tuned with environment variables:
+ *  QAP_STUB_BUFFER_SIZE     default module input buffer size (32768)
+ *  QAP_STUB_BLOCK_FRAMES    frames per output buffer (1536)
+ *  QAP_STUB_CB_LATENCY_US   time spent before each output callback (0)
+ *  QAP_STUB_REALTIME        pace the outputs to the wall clock if set
+ */
+
+#define STUB_MAX_CHANNELS		8
+#define STUB_DEFAULT_BUFFER_SIZE	(32 * 1024)
+#define STUB_DEFAULT_BLOCK_FRAMES	1536
+#define STUB_MAX_BLOCK_FRAMES		8192
+#define STUB_INGEST_SIZE		4096
+#define STUB_LATENCY_MS			32
+
+struct stub_lib {
+	qap_log_callback_t log_cb;
+	int log_level;
+};
+
+struct stub_module;
+
+struct stub_session {
+	struct stub_lib *lib;
+	qap_session_t type;
+	qap_callback_t cb;
+	void *cb_data;
+
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	pthread_t tid;
+	bool terminated;
+
+	/* modules, in init order */
+	struct stub_module *modules;
+
+	/* module used by the thread while unlocked, cannot be deinit */
+	struct stub_module *busy_module;
+
+	qap_session_outputs_config_t outputs;
+	qap_output_config_t out_config[MAX_SUPPORTED_OUTPUTS];
+
+	/* owned by the session thread */
+	int64_t out_ts;
+	bool out_ts_valid;
+	int32_t *decoded;
+	uint32_t decoded_alloc;
+	uint64_t next_block_time;
+	int32_t block[STUB_MAX_BLOCK_FRAMES * STUB_MAX_CHANNELS];
+	int16_t out_buf[STUB_MAX_BLOCK_FRAMES * STUB_MAX_CHANNELS];
+};
+
+struct stub_module {
+	struct stub_session *session;
+	struct stub_module *next;
+	qap_module_config_t config;
+	qap_module_callback_t cb;
+	void *cb_data;
+
+	/* protected by the session lock */
+	bool started;
+	bool eos;
+	bool eos_sent;
+	bool full;
+	unsigned int generation;
+	uint8_t *in_buf;
+	uint32_t in_size;
+	uint32_t in_len;
+	int64_t in_ts;
+	bool in_ts_valid;
+	uint32_t pcm_frames;
+	uint64_t consumed_frames;
+	uint64_t decoded_frames;
+
+	/* owned by the session thread */
+	unsigned int decoder_generation;
+	int32_t *pcm;
+	uint32_t pcm_alloc;
+	int channels;
+	int sample_rate;
+	uint8_t ch_map[STUB_MAX_CHANNELS];
+	bool config_sent;
+	AVCodecContext *codec;
+	AVCodecParserContext *parser;
+	AVPacket *pkt;
+	AVFrame *frame;
+	SwrContext *swr;
+	int swr_format;
+	uint64_t swr_layout;
+	int swr_rate;
+};
+
+static int stub_block_frames = STUB_DEFAULT_BLOCK_FRAMES;
+static uint32_t stub_buffer_size = STUB_DEFAULT_BUFFER_SIZE;
+static unsigned int stub_cb_latency_us;
+static bool stub_realtime;
+static pthread_once_t stub_once = PTHREAD_ONCE_INIT;
+
+static void
+stub_init_once(void)
+{
+	const char *s;
+
+	if ((s = getenv("QAP_STUB_BUFFER_SIZE")) && atoi(s) > 0)
+		stub_buffer_size = atoi(s);
+
+	if ((s = getenv("QAP_STUB_BLOCK_FRAMES")) && atoi(s) > 0)
+		stub_block_frames = atoi(s) < STUB_MAX_BLOCK_FRAMES ?
+			atoi(s) : STUB_MAX_BLOCK_FRAMES;
+
+	if ((s = getenv("QAP_STUB_CB_LATENCY_US")))
+		stub_cb_latency_us = atoi(s);
+
+	if ((s = getenv("QAP_STUB_REALTIME")))
+		stub_realtime = atoi(s) != 0;
+}
+
+static uint64_t
+stub_get_time(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec * UINT64_C(1000000) + ts.tv_nsec / 1000;
+}
+
+static void
+stub_log(struct stub_lib *lib, qap_log_level_t level, const char *fmt, ...)
+{
+	char buf[256];
+	va_list ap;
+
+	if (!lib || !lib->log_cb || (int)level > lib->log_level)
+		return;
+
+	va_start(ap, fmt);
+	vsnprintf(buf, sizeof (buf), fmt, ap);
+	va_end(ap);
+
+	lib->log_cb(level, buf);
+}
+
+#define stub_err(s, fmt, ...) \
+	stub_log((s)->lib, QAP_LOG_ERROR, "stub: " fmt, ##__VA_ARGS__)
+#define stub_info(s, fmt, ...) \
+	stub_log((s)->lib, QAP_LOG_INFO, "stub: " fmt, ##__VA_ARGS__)
+#define stub_dbg(s, fmt, ...) \
+	stub_log((s)->lib, QAP_LOG_DEBUG, "stub: " fmt, ##__VA_ARGS__)
+
+static bool
+stub_format_is_pcm(qap_audio_format_t format)
+{
+	return format == QAP_AUDIO_FORMAT_PCM_16_BIT ||
+		format == QAP_AUDIO_FORMAT_PCM_32_BIT ||
+		format == QAP_AUDIO_FORMAT_PCM_8_24_BIT ||
+		format == QAP_AUDIO_FORMAT_PCM_24_BIT_PACKED;
+}
+
+static int
+stub_pcm_sample_size(const qap_module_config_t *config)
+{
+	switch (config->format) {
+	case QAP_AUDIO_FORMAT_PCM_16_BIT:
+		return 2;
+	case QAP_AUDIO_FORMAT_PCM_24_BIT_PACKED:
+		return 3;
+	case QAP_AUDIO_FORMAT_PCM_8_24_BIT:
+	case QAP_AUDIO_FORMAT_PCM_32_BIT:
+		return 4;
+	default:
+		return 0;
+	}
+}
+
+/* default channel order of interleaved pcm, same as ffmpeg */
+static void
+stub_default_chmap(uint8_t *map, int channels)
+{
+	static const uint8_t maps[STUB_MAX_CHANNELS][STUB_MAX_CHANNELS] = {
+		{ QAP_AUDIO_PCM_CHANNEL_C },
+		{ QAP_AUDIO_PCM_CHANNEL_L, QAP_AUDIO_PCM_CHANNEL_R },
+		{ QAP_AUDIO_PCM_CHANNEL_L, QAP_AUDIO_PCM_CHANNEL_R,
+		  QAP_AUDIO_PCM_CHANNEL_C },
+		{ QAP_AUDIO_PCM_CHANNEL_L, QAP_AUDIO_PCM_CHANNEL_R,
+		  QAP_AUDIO_PCM_CHANNEL_LS, QAP_AUDIO_PCM_CHANNEL_RS },
+		{ QAP_AUDIO_PCM_CHANNEL_L, QAP_AUDIO_PCM_CHANNEL_R,
+		  QAP_AUDIO_PCM_CHANNEL_C, QAP_AUDIO_PCM_CHANNEL_LS,
+		  QAP_AUDIO_PCM_CHANNEL_RS },
+		{ QAP_AUDIO_PCM_CHANNEL_L, QAP_AUDIO_PCM_CHANNEL_R,
+		  QAP_AUDIO_PCM_CHANNEL_C, QAP_AUDIO_PCM_CHANNEL_LFE,
+		  QAP_AUDIO_PCM_CHANNEL_LS, QAP_AUDIO_PCM_CHANNEL_RS },
+		{ QAP_AUDIO_PCM_CHANNEL_L, QAP_AUDIO_PCM_CHANNEL_R,
+		  QAP_AUDIO_PCM_CHANNEL_C, QAP_AUDIO_PCM_CHANNEL_LFE,
+		  QAP_AUDIO_PCM_CHANNEL_LS, QAP_AUDIO_PCM_CHANNEL_RS,
+		  QAP_AUDIO_PCM_CHANNEL_CS },
+		{ QAP_AUDIO_PCM_CHANNEL_L, QAP_AUDIO_PCM_CHANNEL_R,
+		  QAP_AUDIO_PCM_CHANNEL_C, QAP_AUDIO_PCM_CHANNEL_LFE,
+		  QAP_AUDIO_PCM_CHANNEL_LB, QAP_AUDIO_PCM_CHANNEL_RB,
+		  QAP_AUDIO_PCM_CHANNEL_LS, QAP_AUDIO_PCM_CHANNEL_RS },
+	};
+
+	memset(map, 0, STUB_MAX_CHANNELS);
+	if (channels > 0 && channels <= STUB_MAX_CHANNELS)
+		memcpy(map, maps[channels - 1], channels);
+}
+
+static uint8_t
+stub_convert_av_channel(uint64_t ch)
+{
+	switch (ch) {
+	case AV_CH_FRONT_LEFT:
+		return QAP_AUDIO_PCM_CHANNEL_L;
+	case AV_CH_FRONT_RIGHT:
+		return QAP_AUDIO_PCM_CHANNEL_R;
+	case AV_CH_FRONT_CENTER:
+		return QAP_AUDIO_PCM_CHANNEL_C;
+	case AV_CH_LOW_FREQUENCY:
+		return QAP_AUDIO_PCM_CHANNEL_LFE;
+	case AV_CH_BACK_LEFT:
+		return QAP_AUDIO_PCM_CHANNEL_LB;
+	case AV_CH_BACK_RIGHT:
+		return QAP_AUDIO_PCM_CHANNEL_RB;
+	case AV_CH_BACK_CENTER:
+		return QAP_AUDIO_PCM_CHANNEL_CS;
+	case AV_CH_SIDE_LEFT:
+		return QAP_AUDIO_PCM_CHANNEL_LS;
+	case AV_CH_SIDE_RIGHT:
+		return QAP_AUDIO_PCM_CHANNEL_RS;
+	default:
+		return 0;
+	}
+}
+
+static void
+stub_output_chmap(uint8_t *map, int channels)
+{
+	/* MS12 outputs use the surround channels for 5.1, and adds the back
+	 * channels for 7.1 */
+	static const uint8_t map_7dot1[] = {
+		QAP_AUDIO_PCM_CHANNEL_L, QAP_AUDIO_PCM_CHANNEL_R,
+		QAP_AUDIO_PCM_CHANNEL_C, QAP_AUDIO_PCM_CHANNEL_LFE,
+		QAP_AUDIO_PCM_CHANNEL_LS, QAP_AUDIO_PCM_CHANNEL_RS,
+		QAP_AUDIO_PCM_CHANNEL_LB, QAP_AUDIO_PCM_CHANNEL_RB,
+	};
+
+	if (channels == 2) {
+		stub_default_chmap(map, 2);
+		return;
+	}
+
+	memset(map, 0, STUB_MAX_CHANNELS);
+	memcpy(map, map_7dot1, channels <= 8 ? channels : 8);
+}
+
+/* index of a channel in a map, with surround/back fallbacks */
+static int
+stub_find_channel(const uint8_t *map, int channels, uint8_t ch)
+{
+	uint8_t alt;
+
+	for (int i = 0; i < channels; i++) {
+		if (map[i] == ch)
+			return i;
+	}
+
+	switch (ch) {
+	case QAP_AUDIO_PCM_CHANNEL_LS:
+		alt = QAP_AUDIO_PCM_CHANNEL_LB;
+		break;
+	case QAP_AUDIO_PCM_CHANNEL_RS:
+		alt = QAP_AUDIO_PCM_CHANNEL_RB;
+		break;
+	case QAP_AUDIO_PCM_CHANNEL_LB:
+		alt = QAP_AUDIO_PCM_CHANNEL_LS;
+		break;
+	case QAP_AUDIO_PCM_CHANNEL_RB:
+		alt = QAP_AUDIO_PCM_CHANNEL_RS;
+		break;
+	default:
+		return -1;
+	}
+
+	for (int i = 0; i < channels; i++) {
+		if (map[i] == alt)
+			return i;
+	}
+
+	return -1;
+}
+
+static void
+stub_send_module_event(struct stub_module *m,
+		       qap_module_callback_event_t event, int size, void *data)
+{
+	if (m->cb)
+		m->cb(m, m->cb_data, event, size, data);
+}
+
+static void
+stub_send_session_event(struct stub_session *s,
+			qap_callback_event_t event, int size, void *data)
+{
+	if (s->cb)
+		s->cb(s, s->cb_data, event, size, data);
+}
+
+/*
+ * decoding, only called from the session thread
+ */
+
+static void
+stub_decoder_close(struct stub_module *m)
+{
+	if (m->parser) {
+		av_parser_close(m->parser);
+		m->parser = NULL;
+	}
+	avcodec_free_context(&m->codec);
+	av_packet_free(&m->pkt);
+	av_frame_free(&m->frame);
+	swr_free(&m->swr);
+}
+
+/* LOAS AudioSyncStream, 11 bits sync word 0x2b7 */
+static bool
+stub_is_loas(const uint8_t *data, uint32_t size)
+{
+	return size >= 3 && data[0] == 0x56 && (data[1] & 0xe0) == 0xe0;
+}
+
+/* data is the first chunk that will be decoded, used to detect the framing */
+static int
+stub_decoder_open(struct stub_module *m, const uint8_t *data, uint32_t size)
+{
+	struct stub_session *s = m->session;
+	enum AVCodecID codec_id;
+	AVCodec *codec;
+
+	switch (m->config.format) {
+	case QAP_AUDIO_FORMAT_AC3:
+		codec_id = AV_CODEC_ID_AC3;
+		break;
+	case QAP_AUDIO_FORMAT_EAC3:
+		codec_id = AV_CODEC_ID_EAC3;
+		break;
+	case QAP_AUDIO_FORMAT_AAC:
+	case QAP_AUDIO_FORMAT_AAC_ADTS:
+		/* libqd sends LATM streams with the ADTS format */
+		if (stub_is_loas(data, size)) {
+			stub_dbg(s, "LOAS sync found, decode as LATM");
+			codec_id = AV_CODEC_ID_AAC_LATM;
+		} else {
+			codec_id = AV_CODEC_ID_AAC;
+		}
+		break;
+	case QAP_AUDIO_FORMAT_DTS:
+	case QAP_AUDIO_FORMAT_DTS_HD:
+		codec_id = AV_CODEC_ID_DTS;
+		break;
+	default:
+		stub_err(s, "unsupported format %d", m->config.format);
+		return -1;
+	}
+
+	codec = avcodec_find_decoder(codec_id);
+	if (!codec) {
+		stub_err(s, "no decoder for %s", avcodec_get_name(codec_id));
+		return -1;
+	}
+
+	m->codec = avcodec_alloc_context3(codec);
+	m->parser = av_parser_init(codec_id);
+	m->pkt = av_packet_alloc();
+	m->frame = av_frame_alloc();
+	if (!m->codec || !m->parser || !m->pkt || !m->frame)
+		goto fail;
+
+	if (avcodec_open2(m->codec, codec, NULL) < 0) {
+		stub_err(s, "failed to open %s decoder",
+			 avcodec_get_name(codec_id));
+		goto fail;
+	}
+
+	return 0;
+
+fail:
+	stub_decoder_close(m);
+	return -1;
+}
+
+static int
+stub_pcm_reserve(struct stub_module *m, uint32_t frames)
+{
+	uint32_t needed = m->pcm_frames + frames;
+	int32_t *p;
+
+	if (needed <= m->pcm_alloc)
+		return 0;
+
+	p = realloc(m->pcm, (size_t)needed * STUB_MAX_CHANNELS * sizeof (*p));
+	if (!p)
+		return -1;
+
+	m->pcm = p;
+	m->pcm_alloc = needed;
+
+	return 0;
+}
+
+/* append decoded frames, caller holds the session lock */
+static int
+stub_pcm_append(struct stub_module *m, const int32_t *data, uint32_t frames)
+{
+	if (stub_pcm_reserve(m, frames))
+		return -1;
+
+	memcpy(m->pcm + m->pcm_frames * m->channels, data,
+	       (size_t)frames * m->channels * sizeof (*data));
+	m->pcm_frames += frames;
+
+	return 0;
+}
+
+static void
+stub_pcm_consume(struct stub_module *m, uint32_t frames)
+{
+	if (frames > m->pcm_frames)
+		frames = m->pcm_frames;
+
+	memmove(m->pcm, m->pcm + frames * m->channels,
+		(size_t)(m->pcm_frames - frames) * m->channels *
+		sizeof (*m->pcm));
+	m->pcm_frames -= frames;
+}
+
+static void
+stub_send_input_config(struct stub_module *m)
+{
+	qap_input_config_t cfg;
+
+	memset(&cfg, 0, sizeof (cfg));
+	cfg.format = m->config.format;
+	cfg.sample_rate = m->sample_rate;
+	cfg.bit_width = 16;
+	cfg.channels = m->channels;
+	memcpy(cfg.ch_map, m->ch_map, m->channels);
+
+	stub_send_module_event(m, QAP_MODULE_CALLBACK_EVENT_INPUT_CFG_CHANGE,
+			       sizeof (cfg), &cfg);
+}
+
+/* convert raw pcm bytes to 32 bits samples */
+static uint32_t
+stub_convert_pcm(struct stub_module *m, const uint8_t *src, uint32_t size,
+		 int32_t *dst)
+{
+	int sample_size = stub_pcm_sample_size(&m->config);
+	uint32_t samples = size / sample_size;
+
+	for (uint32_t i = 0; i < samples; i++, src += sample_size) {
+		switch (m->config.format) {
+		case QAP_AUDIO_FORMAT_PCM_16_BIT:
+			dst[i] = (int32_t)(int16_t)(src[0] | src[1] << 8) << 16;
+			break;
+		case QAP_AUDIO_FORMAT_PCM_24_BIT_PACKED:
+			dst[i] = (int32_t)((uint32_t)src[0] << 8 |
+					   (uint32_t)src[1] << 16 |
+					   (uint32_t)src[2] << 24);
+			break;
+		case QAP_AUDIO_FORMAT_PCM_8_24_BIT:
+			dst[i] = (int32_t)((uint32_t)src[0] << 8 |
+					   (uint32_t)src[1] << 16 |
+					   (uint32_t)src[2] << 24);
+			break;
+		default:
+			dst[i] = (int32_t)((uint32_t)src[0] |
+					   (uint32_t)src[1] << 8 |
+					   (uint32_t)src[2] << 16 |
+					   (uint32_t)src[3] << 24);
+			break;
+		}
+	}
+
+	return samples / m->channels;
+}
+
+static int
+stub_receive_frames(struct stub_module *m, int32_t **out, uint32_t *out_frames,
+		    uint32_t *out_alloc)
+{
+	AVFrame *frame = m->frame;
+	uint64_t layout;
+	int ret;
+
+	while ((ret = avcodec_receive_frame(m->codec, frame)) == 0) {
+		int channels = frame->channels;
+		uint8_t *dst;
+
+		if (channels <= 0 || channels > STUB_MAX_CHANNELS) {
+			av_frame_unref(frame);
+			return -1;
+		}
+
+		layout = frame->channel_layout;
+		if (!layout)
+			layout = av_get_default_channel_layout(channels);
+
+		if (channels != m->channels ||
+		    frame->sample_rate != m->sample_rate) {
+			m->channels = channels;
+			m->sample_rate = frame->sample_rate;
+			for (int i = 0; i < channels; i++) {
+				m->ch_map[i] = stub_convert_av_channel(
+					av_channel_layout_extract_channel(layout,
+									  i));
+			}
+			m->config_sent = false;
+			*out_frames = 0;
+		}
+
+		if (!m->swr || m->swr_format != frame->format ||
+		    m->swr_layout != layout ||
+		    m->swr_rate != frame->sample_rate) {
+			swr_free(&m->swr);
+			m->swr = swr_alloc_set_opts(NULL,
+						    layout, AV_SAMPLE_FMT_S32,
+						    frame->sample_rate,
+						    layout, frame->format,
+						    frame->sample_rate,
+						    0, NULL);
+			if (!m->swr || swr_init(m->swr) < 0) {
+				av_frame_unref(frame);
+				return -1;
+			}
+			m->swr_format = frame->format;
+			m->swr_layout = layout;
+			m->swr_rate = frame->sample_rate;
+		}
+
+		if (*out_frames + frame->nb_samples > *out_alloc) {
+			uint32_t alloc = *out_frames + frame->nb_samples;
+			int32_t *p = realloc(*out, (size_t)alloc *
+					     STUB_MAX_CHANNELS * sizeof (*p));
+			if (!p) {
+				av_frame_unref(frame);
+				return -1;
+			}
+			*out = p;
+			*out_alloc = alloc;
+		}
+
+		dst = (uint8_t *)(*out + *out_frames * channels);
+		ret = swr_convert(m->swr, &dst, frame->nb_samples,
+				  (const uint8_t **)frame->extended_data,
+				  frame->nb_samples);
+		av_frame_unref(frame);
+		if (ret < 0)
+			return -1;
+
+		*out_frames += ret;
+	}
+
+	return ret == AVERROR(EAGAIN) || ret == AVERROR_EOF ? 0 : ret;
+}
+
+/* decode a chunk of compressed data, without the session lock held */
+static int
+stub_decode(struct stub_module *m, const uint8_t *data, int size,
+	    int32_t **out, uint32_t *out_frames, uint32_t *out_alloc)
+{
+	while (size > 0) {
+		int n;
+
+		n = av_parser_parse2(m->parser, m->codec,
+				     &m->pkt->data, &m->pkt->size,
+				     data, size,
+				     AV_NOPTS_VALUE, AV_NOPTS_VALUE, 0);
+		if (n < 0)
+			return -1;
+
+		data += n;
+		size -= n;
+
+		if (m->pkt->size == 0)
+			continue;
+
+		if (avcodec_send_packet(m->codec, m->pkt) < 0) {
+			/* skip broken frames like a real decoder would */
+			stub_dbg(m->session, "failed to decode packet");
+			continue;
+		}
+
+		if (stub_receive_frames(m, out, out_frames, out_alloc))
+			return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * feed the module decoder with some of its input data, returns true if
+ * some data was consumed, called with the session lock held
+ */
+static bool
+stub_module_ingest(struct stub_session *s, struct stub_module *m)
+{
+	uint8_t chunk[STUB_INGEST_SIZE];
+	uint32_t decoded_frames = 0;
+	unsigned int generation;
+	uint32_t frame_size = 0;
+	bool notify_room;
+	int channels;
+	bool pcm;
+	uint32_t n;
+	int ret = 0;
+
+	if (m->decoder_generation != m->generation) {
+		/* flushed, restart decoding from scratch */
+		stub_decoder_close(m);
+		m->pcm_frames = 0;
+		m->decoder_generation = m->generation;
+	}
+
+	pcm = stub_format_is_pcm(m->config.format);
+	if (pcm) {
+		frame_size = stub_pcm_sample_size(&m->config) *
+			m->config.channels;
+		n = m->in_len - m->in_len % frame_size;
+		if (n > sizeof (chunk) - sizeof (chunk) % frame_size)
+			n = sizeof (chunk) - sizeof (chunk) % frame_size;
+	} else {
+		n = m->in_len < sizeof (chunk) ? m->in_len : sizeof (chunk);
+	}
+
+	if (n == 0) {
+		/* drop partial pcm frames at EOS */
+		if (m->eos && m->in_len > 0) {
+			m->in_len = 0;
+			return true;
+		}
+		return false;
+	}
+
+	channels = m->channels;
+	memcpy(chunk, m->in_buf, n);
+	memmove(m->in_buf, m->in_buf + n, m->in_len - n);
+	m->in_len -= n;
+
+	notify_room = m->full;
+	m->full = false;
+	generation = m->generation;
+
+	s->busy_module = m;
+	pthread_mutex_unlock(&s->lock);
+
+	if (notify_room) {
+		qap_send_buffer_t send_buffer = {
+			.bytes_available = m->in_size - m->in_len,
+		};
+
+		stub_send_module_event(m,
+				       QAP_MODULE_CALLBACK_EVENT_SEND_INPUT_BUFFER,
+				       sizeof (send_buffer), &send_buffer);
+	}
+
+	if (pcm) {
+		if (m->channels != (int)m->config.channels ||
+		    m->sample_rate != (int)m->config.sample_rate) {
+			m->channels = m->config.channels;
+			m->sample_rate = m->config.sample_rate;
+			stub_default_chmap(m->ch_map, m->channels);
+			m->config_sent = false;
+		}
+
+		if (n / frame_size > s->decoded_alloc) {
+			int32_t *p = realloc(s->decoded, (size_t)(n / frame_size) *
+					     STUB_MAX_CHANNELS * sizeof (*p));
+			if (p) {
+				s->decoded = p;
+				s->decoded_alloc = n / frame_size;
+			} else {
+				ret = -1;
+			}
+		}
+
+		if (!ret)
+			decoded_frames = stub_convert_pcm(m, chunk, n,
+							  s->decoded);
+	} else {
+		if (!m->codec)
+			ret = stub_decoder_open(m, chunk, n);
+
+		if (!ret)
+			ret = stub_decode(m, chunk, n, &s->decoded,
+					  &decoded_frames, &s->decoded_alloc);
+	}
+
+	if (!m->config_sent && m->channels > 0) {
+		stub_send_input_config(m);
+		m->config_sent = true;
+	}
+
+	pthread_mutex_lock(&s->lock);
+	s->busy_module = NULL;
+	pthread_cond_broadcast(&s->cond);
+
+	if (ret) {
+		stub_err(s, "decode error, dropping %u bytes", n);
+		return true;
+	}
+
+	/* pending audio cannot be mixed with the new layout */
+	if (channels != m->channels)
+		m->pcm_frames = 0;
+
+	/* discard the result if the module was flushed meanwhile */
+	if (generation == m->generation) {
+		stub_pcm_append(m, s->decoded, decoded_frames);
+		m->consumed_frames += decoded_frames;
+	}
+
+	return true;
+}
+
+static struct stub_module *
+stub_session_primary(struct stub_session *s)
+{
+	struct stub_module *first = NULL;
+
+	for (struct stub_module *m = s->modules; m; m = m->next) {
+		if (!m->started)
+			continue;
+		if (m->config.flags & QAP_MODULE_FLAG_PRIMARY)
+			return m;
+		if (!first)
+			first = m;
+	}
+
+	return first;
+}
+
+static qap_callback_event_t
+stub_module_eos_event(struct stub_session *s, struct stub_module *module)
+{
+	if (module->config.flags & QAP_MODULE_FLAG_SECONDARY)
+		return QAP_CALLBACK_EVENT_EOS_ASSOC;
+
+	/* second primary module is MAIN2 */
+	for (struct stub_module *m = s->modules; m != module; m = m->next) {
+		if (m->config.flags & QAP_MODULE_FLAG_PRIMARY)
+			return QAP_CALLBACK_EVENT_MAIN_2_EOS;
+	}
+
+	return QAP_CALLBACK_EVENT_EOS;
+}
+
+/* remix a block to an output channel layout, with LFE dropped and
+ * center/surrounds folded into stereo when needed */
+static void
+stub_remix(const int32_t *src, const uint8_t *src_map, int src_channels,
+	   int16_t *dst, const uint8_t *dst_map, int dst_channels, int frames)
+{
+	float matrix[STUB_MAX_CHANNELS][STUB_MAX_CHANNELS] = { };
+
+	for (int o = 0; o < dst_channels; o++) {
+		int i = stub_find_channel(src_map, src_channels, dst_map[o]);
+		if (i >= 0)
+			matrix[o][i] = 1.f;
+	}
+
+	if (dst_channels == 2) {
+		static const struct {
+			uint8_t ch;
+			int out;
+		} folds[] = {
+			{ QAP_AUDIO_PCM_CHANNEL_C, -1 },
+			{ QAP_AUDIO_PCM_CHANNEL_LS, 0 },
+			{ QAP_AUDIO_PCM_CHANNEL_RS, 1 },
+			{ QAP_AUDIO_PCM_CHANNEL_LB, 0 },
+			{ QAP_AUDIO_PCM_CHANNEL_RB, 1 },
+			{ QAP_AUDIO_PCM_CHANNEL_CS, -1 },
+		};
+
+		for (unsigned int k = 0; k < sizeof (folds) / sizeof (*folds);
+		     k++) {
+			for (int i = 0; i < src_channels; i++) {
+				if (src_map[i] != folds[k].ch)
+					continue;
+				for (int o = 0; o < 2; o++) {
+					if (folds[k].out == -1 ||
+					    folds[k].out == o)
+						matrix[o][i] = 0.7071f;
+				}
+			}
+		}
+	}
+
+	for (int f = 0; f < frames; f++) {
+		for (int o = 0; o < dst_channels; o++) {
+			float v = 0.f;
+
+			for (int i = 0; i < src_channels; i++)
+				v += matrix[o][i] * (float)src[i];
+
+			v /= 65536.f;
+			if (v > INT16_MAX)
+				v = INT16_MAX;
+			else if (v < INT16_MIN)
+				v = INT16_MIN;
+			dst[o] = (int16_t)v;
+		}
+		src += src_channels;
+		dst += dst_channels;
+	}
+}
+
+/* deliver one block of the primary module to all outputs, called with the
+ * session lock held */
+static void
+stub_session_output(struct stub_session *s, struct stub_module *primary)
+{
+	qap_session_outputs_config_t outputs;
+	uint32_t frames;
+	int64_t duration;
+	int64_t ts;
+
+	frames = primary->pcm_frames;
+	if (frames > (uint32_t)stub_block_frames)
+		frames = stub_block_frames;
+
+	memcpy(s->block, primary->pcm,
+	       (size_t)frames * primary->channels * sizeof (*s->block));
+
+	for (struct stub_module *m = s->modules; m; m = m->next) {
+		if (m == primary || m->started)
+			stub_pcm_consume(m, frames);
+	}
+	primary->decoded_frames += frames;
+
+	if (!s->out_ts_valid) {
+		s->out_ts = primary->in_ts_valid ? primary->in_ts : 0;
+		s->out_ts_valid = true;
+	}
+
+	ts = s->out_ts;
+	duration = (int64_t)frames * 1000000 / primary->sample_rate;
+	s->out_ts += duration;
+	outputs = s->outputs;
+
+	s->busy_module = primary;
+	pthread_mutex_unlock(&s->lock);
+
+	if (stub_realtime) {
+		uint64_t now = stub_get_time();
+
+		if (s->next_block_time + 100000 < now)
+			s->next_block_time = now;
+		else if (s->next_block_time > now)
+			usleep(s->next_block_time - now);
+		s->next_block_time += duration;
+	}
+
+	if (stub_cb_latency_us)
+		usleep(stub_cb_latency_us);
+
+	for (unsigned int i = 0; i < outputs.num_output; i++) {
+		qap_output_config_t *cfg = &outputs.output_config[i];
+		qap_output_config_t *cur = &s->out_config[i];
+		qap_audio_buffer_t buffer;
+		int channels;
+
+		if (cfg->format == QAP_AUDIO_FORMAT_AC3 ||
+		    cfg->format == QAP_AUDIO_FORMAT_EAC3)
+			continue;
+
+		channels = cfg->channels ? (int)cfg->channels : 2;
+		if (channels > STUB_MAX_CHANNELS)
+			channels = STUB_MAX_CHANNELS;
+
+		memset(&buffer, 0, sizeof (buffer));
+		buffer.buffer_parms.output_buf_params.output_id = cfg->id;
+		buffer.buffer_parms.output_buf_params.output_config.id = cfg->id;
+		buffer.buffer_parms.output_buf_params.output_config.format =
+			QAP_AUDIO_FORMAT_PCM_16_BIT;
+		buffer.buffer_parms.output_buf_params.output_config.sample_rate =
+			primary->sample_rate;
+		buffer.buffer_parms.output_buf_params.output_config.bit_width = 16;
+		buffer.buffer_parms.output_buf_params.output_config.channels =
+			channels;
+		buffer.buffer_parms.output_buf_params.output_config.is_interleaved =
+			true;
+		stub_output_chmap(buffer.buffer_parms.output_buf_params.output_config.ch_map,
+				  channels);
+
+		if (memcmp(cur, &buffer.buffer_parms.output_buf_params.output_config,
+			   sizeof (*cur))) {
+			*cur = buffer.buffer_parms.output_buf_params.output_config;
+			stub_send_session_event(s,
+						QAP_CALLBACK_EVENT_OUTPUT_CFG_CHANGE,
+						sizeof (buffer), &buffer);
+		}
+
+		stub_remix(s->block, primary->ch_map, primary->channels,
+			   s->out_buf, cur->ch_map, channels, frames);
+
+		buffer.common_params.data = s->out_buf;
+		buffer.common_params.size = frames * channels *
+			sizeof (*s->out_buf);
+		buffer.common_params.timestamp = ts;
+
+		stub_send_session_event(s, QAP_CALLBACK_EVENT_DATA,
+					sizeof (buffer), &buffer);
+	}
+
+	pthread_mutex_lock(&s->lock);
+	s->busy_module = NULL;
+	pthread_cond_broadcast(&s->cond);
+}
+
+/* run one processing step, returns false when there is nothing to do */
+static bool
+stub_session_step(struct stub_session *s)
+{
+	struct stub_module *primary;
+
+	/* decode inputs until each module has a block of audio ready */
+	for (struct stub_module *m = s->modules; m; m = m->next) {
+		if (!m->started || m->pcm_frames >= (uint32_t)stub_block_frames)
+			continue;
+		if (stub_module_ingest(s, m))
+			return true;
+	}
+
+	primary = stub_session_primary(s);
+	if (primary && primary->channels > 0 && primary->sample_rate > 0 &&
+	    (primary->pcm_frames >= (uint32_t)stub_block_frames ||
+	     (primary->eos && primary->in_len == 0 &&
+	      primary->pcm_frames > 0))) {
+		stub_session_output(s, primary);
+		return true;
+	}
+
+	for (struct stub_module *m = s->modules; m; m = m->next) {
+		qap_callback_event_t event;
+
+		if (!m->eos || m->eos_sent || m->in_len > 0)
+			continue;
+
+		/* audio of non primary modules is not rendered */
+		if (m == primary && m->pcm_frames > 0)
+			continue;
+
+		m->pcm_frames = 0;
+		m->eos_sent = true;
+
+		if (!(m->config.flags & (QAP_MODULE_FLAG_PRIMARY |
+					 QAP_MODULE_FLAG_SECONDARY)))
+			continue;
+
+		event = stub_module_eos_event(s, m);
+		stub_info(s, "EOS");
+
+		s->busy_module = m;
+		pthread_mutex_unlock(&s->lock);
+		stub_send_session_event(s, event, 0, NULL);
+		pthread_mutex_lock(&s->lock);
+		s->busy_module = NULL;
+		pthread_cond_broadcast(&s->cond);
+
+		return true;
+	}
+
+	return false;
+}
+
+static void *
+stub_session_thread_func(void *userdata)
+{
+	struct stub_session *s = userdata;
+
+	pthread_mutex_lock(&s->lock);
+	while (!s->terminated) {
+		if (!stub_session_step(s))
+			pthread_cond_wait(&s->cond, &s->lock);
+	}
+	pthread_mutex_unlock(&s->lock);
+
+	return NULL;
+}
+
+/*
+ * library
+ */
+
+qap_lib_handle_t
+qap_load_library(const char *lib_name)
+{
+	struct stub_lib *lib;
+
+	pthread_once(&stub_once, stub_init_once);
+
+	lib = calloc(1, sizeof (*lib));
+	if (!lib)
+		return NULL;
+
+	lib->log_level = QAP_LOG_ERROR;
+
+	return lib;
+}
+
+qap_status_t
+qap_unload_library(qap_lib_handle_t handle)
+{
+	free(handle);
+	return 0;
+}
+
+void
+qap_lib_set_log_callback(qap_lib_handle_t handle, qap_log_callback_t cb)
+{
+	struct stub_lib *lib = handle;
+
+	lib->log_cb = cb;
+}
+
+void
+qap_lib_set_log_level(qap_lib_handle_t handle, int level)
+{
+	struct stub_lib *lib = handle;
+
+	lib->log_level = level;
+}
+
+/*
+ * session
+ */
+
+qap_session_handle_t
+qap_session_open(qap_session_t type, qap_lib_handle_t handle)
+{
+	struct stub_session *s;
+
+	s = calloc(1, sizeof (*s));
+	if (!s)
+		return NULL;
+
+	s->lib = handle;
+	s->type = type;
+
+	pthread_mutex_init(&s->lock, NULL);
+	pthread_cond_init(&s->cond, NULL);
+
+	if (pthread_create(&s->tid, NULL, stub_session_thread_func, s)) {
+		pthread_cond_destroy(&s->cond);
+		pthread_mutex_destroy(&s->lock);
+		free(s);
+		return NULL;
+	}
+
+	stub_info(s, "session opened, block=%d frames buffer=%u bytes",
+		  stub_block_frames, stub_buffer_size);
+
+	return s;
+}
+
+qap_status_t
+qap_session_close(qap_session_handle_t handle)
+{
+	struct stub_session *s = handle;
+
+	pthread_mutex_lock(&s->lock);
+	s->terminated = true;
+	pthread_cond_broadcast(&s->cond);
+	pthread_mutex_unlock(&s->lock);
+
+	pthread_join(s->tid, NULL);
+
+	while (s->modules)
+		qap_module_deinit(s->modules);
+
+	pthread_cond_destroy(&s->cond);
+	pthread_mutex_destroy(&s->lock);
+	free(s->decoded);
+	free(s);
+
+	return 0;
+}
+
+qap_status_t
+qap_session_set_callback(qap_session_handle_t handle, qap_callback_t cb,
+			 void *priv)
+{
+	struct stub_session *s = handle;
+
+	pthread_mutex_lock(&s->lock);
+	s->cb = cb;
+	s->cb_data = priv;
+	pthread_mutex_unlock(&s->lock);
+
+	return 0;
+}
+
+qap_status_t
+qap_session_cmd(qap_session_handle_t handle, qap_session_cmd_t cmd,
+		uint32_t size, void *data,
+		uint32_t *reply_size, void *reply_data)
+{
+	struct stub_session *s = handle;
+
+	switch (cmd) {
+	case QAP_SESSION_CMD_SET_OUTPUTS:
+		if (size != sizeof (qap_session_outputs_config_t))
+			return -EINVAL;
+		pthread_mutex_lock(&s->lock);
+		s->outputs = *(qap_session_outputs_config_t *)data;
+		if (s->outputs.num_output > MAX_SUPPORTED_OUTPUTS)
+			s->outputs.num_output = MAX_SUPPORTED_OUTPUTS;
+		memset(s->out_config, 0, sizeof (s->out_config));
+		pthread_mutex_unlock(&s->lock);
+		return 0;
+	case QAP_SESSION_CMD_SET_KVPAIRS:
+		stub_info(s, "ignoring kvpairs %.*s", (int)size,
+			  (const char *)data);
+		return 0;
+	default:
+		return 0;
+	}
+}
+
+/*
+ * modules
+ */
+
+qap_status_t
+qap_module_init(qap_session_handle_t handle, qap_module_config_t *config,
+		qap_module_handle_t *module_handle)
+{
+	struct stub_session *s = handle;
+	struct stub_module *m, **p;
+
+	if (stub_format_is_pcm(config->format) &&
+	    (config->channels == 0 ||
+	     config->channels > STUB_MAX_CHANNELS ||
+	     config->sample_rate == 0)) {
+		stub_err(s, "unsupported pcm config, %u channels %u Hz",
+			 config->channels, config->sample_rate);
+		return -EINVAL;
+	}
+
+	m = calloc(1, sizeof (*m));
+	if (!m)
+		return -ENOMEM;
+
+	m->session = s;
+	m->config = *config;
+	m->in_size = stub_buffer_size;
+	m->in_buf = malloc(m->in_size);
+	if (!m->in_buf) {
+		free(m);
+		return -ENOMEM;
+	}
+
+	pthread_mutex_lock(&s->lock);
+	for (p = &s->modules; *p; p = &(*p)->next)
+		;
+	*p = m;
+	pthread_mutex_unlock(&s->lock);
+
+	*module_handle = m;
+
+	return 0;
+}
+
+qap_status_t
+qap_module_deinit(qap_module_handle_t handle)
+{
+	struct stub_module *m = handle;
+	struct stub_session *s = m->session;
+	struct stub_module **p;
+
+	pthread_mutex_lock(&s->lock);
+	while (s->busy_module == m)
+		pthread_cond_wait(&s->cond, &s->lock);
+
+	for (p = &s->modules; *p; p = &(*p)->next) {
+		if (*p == m) {
+			*p = m->next;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&s->lock);
+
+	stub_decoder_close(m);
+	free(m->pcm);
+	free(m->in_buf);
+	free(m);
+
+	return 0;
+}
+
+qap_status_t
+qap_module_set_callback(qap_module_handle_t handle, qap_module_callback_t cb,
+			void *priv)
+{
+	struct stub_module *m = handle;
+
+	pthread_mutex_lock(&m->session->lock);
+	m->cb = cb;
+	m->cb_data = priv;
+	pthread_mutex_unlock(&m->session->lock);
+
+	return 0;
+}
+
+static int
+stub_module_get_param(struct stub_module *m, uint32_t param,
+		      uint32_t *reply_size, void *reply_data)
+{
+	switch (param) {
+	case MS12_STREAM_GET_INPUT_BUF_SIZE:
+		*(uint32_t *)reply_data = m->in_size;
+		*reply_size = sizeof (uint32_t);
+		return 0;
+	case MS12_STREAM_GET_AVAIL_BUF_SIZE:
+		*(uint32_t *)reply_data = m->in_size - m->in_len;
+		*reply_size = sizeof (uint32_t);
+		return 0;
+	case MS12_STREAM_GET_DECODER_OUTPUT_FRAME:
+		*(uint64_t *)reply_data = m->decoded_frames;
+		*reply_size = sizeof (uint64_t);
+		return 0;
+	case MS12_STREAM_GET_DECODER_IO_FRAMES_INFO: {
+		qap_report_frames_t *report = reply_data;
+
+		report->consumed_frames = m->consumed_frames;
+		report->decoded_frames = m->decoded_frames;
+		*reply_size = sizeof (*report);
+		return 0;
+	}
+	case MS12_STREAM_GET_LATENCY:
+		*(int64_t *)reply_data = STUB_LATENCY_MS;
+		*reply_size = sizeof (int64_t);
+		return 0;
+	default:
+		return -EINVAL;
+	}
+}
+
+static int
+stub_module_set_param(struct stub_module *m, uint32_t param, uint32_t value)
+{
+	uint8_t *p;
+
+	switch (param) {
+	case MS12_STREAM_SET_INPUT_BUF_SIZE:
+		if (value < m->in_len || value == 0)
+			return -EINVAL;
+		p = realloc(m->in_buf, value);
+		if (!p)
+			return -ENOMEM;
+		m->in_buf = p;
+		m->in_size = value;
+		return 0;
+	default:
+		return -EINVAL;
+	}
+}
+
+static void
+stub_module_flush(struct stub_module *m)
+{
+	m->in_len = 0;
+	m->pcm_frames = 0;
+	m->eos = false;
+	m->eos_sent = false;
+	m->in_ts_valid = false;
+	m->generation++;
+
+	if (m == stub_session_primary(m->session))
+		m->session->out_ts_valid = false;
+}
+
+qap_status_t
+qap_module_cmd(qap_module_handle_t handle, qap_module_cmd_t cmd,
+	       uint32_t size, void *data,
+	       uint32_t *reply_size, void *reply_data)
+{
+	struct stub_module *m = handle;
+	struct stub_session *s = m->session;
+	bool notify_room = false;
+	int ret = 0;
+
+	pthread_mutex_lock(&s->lock);
+
+	switch (cmd) {
+	case QAP_MODULE_CMD_START:
+		m->started = true;
+		break;
+	case QAP_MODULE_CMD_PAUSE:
+		m->started = false;
+		break;
+	case QAP_MODULE_CMD_STOP:
+		m->started = false;
+		stub_module_flush(m);
+		break;
+	case QAP_MODULE_CMD_FLUSH:
+		stub_module_flush(m);
+		notify_room = m->full;
+		m->full = false;
+		break;
+	case QAP_MODULE_CMD_GET_PARAM:
+		if (size < sizeof (uint32_t) || !reply_size || !reply_data) {
+			ret = -EINVAL;
+			break;
+		}
+		ret = stub_module_get_param(m, *(uint32_t *)data,
+					    reply_size, reply_data);
+		break;
+	case QAP_MODULE_CMD_SET_PARAM:
+		if (size < 2 * sizeof (uint32_t)) {
+			ret = -EINVAL;
+			break;
+		}
+		ret = stub_module_set_param(m, ((uint32_t *)data)[0],
+					    ((uint32_t *)data)[1]);
+		break;
+	default:
+		ret = -EINVAL;
+		break;
+	}
+
+	pthread_cond_broadcast(&s->cond);
+	pthread_mutex_unlock(&s->lock);
+
+	if (notify_room) {
+		qap_send_buffer_t send_buffer = {
+			.bytes_available = m->in_size,
+		};
+
+		stub_send_module_event(m,
+				       QAP_MODULE_CALLBACK_EVENT_SEND_INPUT_BUFFER,
+				       sizeof (send_buffer), &send_buffer);
+	}
+
+	return ret;
+}
+
+int
+qap_module_process(qap_module_handle_t handle, qap_audio_buffer_t *buffer)
+{
+	struct stub_module *m = handle;
+	struct stub_session *s = m->session;
+	qap_buffer_common_t *common = &buffer->common_params;
+	uint32_t flags = buffer->buffer_parms.input_buf_params.flags;
+	uint32_t size;
+
+	pthread_mutex_lock(&s->lock);
+
+	if (flags == QAP_BUFFER_EOS) {
+		m->eos = true;
+		pthread_cond_broadcast(&s->cond);
+		pthread_mutex_unlock(&s->lock);
+		return 0;
+	}
+
+	if (m->in_len == m->in_size) {
+		m->full = true;
+		pthread_mutex_unlock(&s->lock);
+		return -EAGAIN;
+	}
+
+	if (flags == QAP_BUFFER_TSTAMP && !m->in_ts_valid) {
+		m->in_ts = common->timestamp;
+		m->in_ts_valid = true;
+	}
+
+	size = common->size;
+	if (size > m->in_size - m->in_len)
+		size = m->in_size - m->in_len;
+
+	memcpy(m->in_buf + m->in_len,
+	       (uint8_t *)common->data + common->offset, size);
+	m->in_len += size;
+
+	/* more data after EOS restarts the stream */
+	m->eos = false;
+	m->eos_sent = false;
+
+	pthread_cond_broadcast(&s->cond);
+	pthread_mutex_unlock(&s->lock);
+
+	return size;
+}
@@ -0,0 +1,833 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <unistd.h>
+#include <time.h>
+#include <getopt.h>
+#include <errno.h>
+#include <limits.h>
+
+#include "qd.h"
+
+/*
+ * qapbench: run a matrix of decode scenarios and report throughput, latency
+ * and CPU usage for each of them
+ *
+ * A scenario is an input, a session type, an outputs configuration and an
+ * input buffer size. Each scenario gets its own session, and decodes its
+ * input for a number of warmup iterations, then for the measured iterations.
+ */
+
+#define BENCH_MAX_ITEMS		16
+#define BENCH_MAX_RESULTS	1024
+
+/* a percentile cannot be compared more precisely than the histogram bucket
+ * width, whatever the requested threshold */
+#define BENCH_LATENCY_MIN_THRESHOLD	0.25
+
+struct bench_input {
+	const char *name;
+	enum qd_input_id input_id;
+	const char *format;
+	const char *url;
+};
+
+static const struct bench_input builtin_inputs[] = {
+	{ "pcm", QD_INPUT_MAIN, "lavfi",
+		"sine=sample_rate=48000:frequency=997:duration=10" },
+	{ "pcm_5.1", QD_INPUT_MAIN, "lavfi",
+		"sine=sample_rate=48000:frequency=997:duration=10,"
+		"pan=5.1|c0=c0|c1=c0|c2=c0|c3=c0|c4=c0|c5=c0" },
+	{ "sys", QD_INPUT_SYS_SOUND, "lavfi",
+		"sine=sample_rate=48000:frequency=997:duration=10" },
+	{ "ott", QD_INPUT_OTT_SOUND, "lavfi",
+		"sine=sample_rate=48000:frequency=997:duration=10" },
+	{ "ext", QD_INPUT_EXT_PCM, "lavfi",
+		"sine=sample_rate=48000:frequency=997:duration=10" },
+	{ "ac3", QD_INPUT_MAIN, NULL,
+		"gen:tone:codec=ac3:freq=997:duration=10" },
+	{ "ac3_5.1", QD_INPUT_MAIN, NULL,
+		"gen:tone:codec=ac3:layout=5.1:freq=997:duration=10" },
+	{ "ddp", QD_INPUT_MAIN, NULL,
+		"gen:tone:codec=eac3:freq=997:duration=10" },
+	{ "ddp_5.1", QD_INPUT_MAIN, NULL,
+		"gen:tone:codec=eac3:layout=5.1:freq=997:duration=10" },
+	{ "ddp_chid", QD_INPUT_MAIN, NULL,
+		"gen:chid:codec=eac3:layout=stereo,5.1,stereo:duration=5" },
+	{ "aac", QD_INPUT_MAIN, NULL,
+		"gen:tone:codec=aac:freq=997:duration=10" },
+	{ "aac_5.1", QD_INPUT_MAIN, NULL,
+		"gen:tone:codec=aac:layout=5.1:freq=997:duration=10" },
+};
+
+static struct bench_input file_inputs[BENCH_MAX_ITEMS];
+static int n_file_inputs;
+
+struct bench_scenario {
+	const struct bench_input *input;
+	const char *session_name;
+	qap_session_t session_type;
+	const char *outputs_name;
+	enum qd_output_id outputs[QD_MAX_OUTPUTS];
+	int n_outputs;
+	int buffer_ms;
+};
+
+struct bench_result {
+	char name[128];
+	int iterations;
+	uint64_t duration;		/* media duration per iteration, in us */
+	double speed_mean;		/* x realtime */
+	double speed_min;
+	double speed_max;
+	uint64_t latency_p50;		/* input to output, in us */
+	uint64_t latency_p90;
+	uint64_t latency_p99;
+	uint64_t latency_max;
+	double cpu_load;		/* CPU time over elapsed time, in % */
+	double cpu_per_sec;		/* CPU ms per second of media */
+};
+
+enum output_format {
+	OUTPUT_FORMAT_CSV,
+	OUTPUT_FORMAT_JSON,
+};
+
+static struct bench_result results[BENCH_MAX_RESULTS];
+static int n_results;
+
+static uint64_t get_cpu_time(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts);
+	return ts.tv_sec * UINT64_C(1000000) + ts.tv_nsec / UINT64_C(1000);
+}
+
+static const struct bench_input *find_input(const char *name)
+{
+	for (size_t i = 0; i < QD_N_ELEMENTS(builtin_inputs); i++) {
+		if (!strcmp(builtin_inputs[i].name, name))
+			return &builtin_inputs[i];
+	}
+
+	for (int i = 0; i < n_file_inputs; i++) {
+		if (!strcmp(file_inputs[i].name, name))
+			return &file_inputs[i];
+	}
+
+	return NULL;
+}
+
+static int parse_session_type(const char *s, qap_session_t *type)
+{
+	if (!strcmp(s, "broadcast"))
+		*type = QAP_SESSION_BROADCAST;
+	else if (!strcmp(s, "decode"))
+		*type = QAP_SESSION_DECODE_ONLY;
+	else if (!strcmp(s, "ott"))
+		*type = QAP_SESSION_MS12_OTT;
+	else
+		return -1;
+
+	return 0;
+}
+
+/* exact match of a token that is not null terminated */
+static bool token_is(const char *s, size_t n, const char *name)
+{
+	return strlen(name) == n && !strncmp(s, name, n);
+}
+
+/* outputs combination, e.g. 2.0+5.1 */
+static int parse_outputs(const char *s, enum qd_output_id *outputs)
+{
+	int n_outputs = 0;
+	size_t n;
+
+	while (*s) {
+		enum qd_output_id id;
+
+		n = strcspn(s, "+");
+		if (n == 0) {
+			s++;
+			continue;
+		}
+
+		if (token_is(s, n, "2.0"))
+			id = QD_OUTPUT_STEREO;
+		else if (token_is(s, n, "5.1"))
+			id = QD_OUTPUT_5DOT1;
+		else if (token_is(s, n, "7.1"))
+			id = QD_OUTPUT_7DOT1;
+		else if (token_is(s, n, "ac3"))
+			id = QD_OUTPUT_AC3;
+		else if (token_is(s, n, "eac3"))
+			id = QD_OUTPUT_EAC3;
+		else if (token_is(s, n, "ac3_dec"))
+			id = QD_OUTPUT_AC3_DECODED;
+		else if (token_is(s, n, "eac3_dec"))
+			id = QD_OUTPUT_EAC3_DECODED;
+		else
+			return -1;
+
+		if (n_outputs >= QD_MAX_OUTPUTS)
+			return -1;
+
+		outputs[n_outputs++] = id;
+		s += n;
+	}
+
+	return n_outputs > 0 ? n_outputs : -1;
+}
+
+/* split a comma separated list in place */
+static int split_list(char *s, char **items)
+{
+	int n = 0;
+	char *tok;
+	char *saveptr;
+
+	for (tok = strtok_r(s, ",", &saveptr); tok;
+	     tok = strtok_r(NULL, ",", &saveptr)) {
+		if (n >= BENCH_MAX_ITEMS)
+			return -1;
+		items[n++] = tok;
+	}
+
+	return n;
+}
+
+/* samples added to a cumulative histogram between two snapshots */
+static void histogram_diff(const struct qd_histogram *before,
+			   const struct qd_histogram *after,
+			   struct qd_histogram *diff)
+{
+	diff->count = after->count - before->count;
+	diff->sum = after->sum - before->sum;
+	diff->max = after->max;
+	for (int i = 0; i < QD_HISTOGRAM_BUCKETS; i++)
+		diff->buckets[i] = after->buckets[i] - before->buckets[i];
+}
+
+/* generated inputs are only encoded on first use, then read from the
+ * cache */
+static struct ffmpeg_src *open_input(const struct bench_input *in)
+{
+	char path[PATH_MAX];
+
+	if (!qd_gen_is_spec(in->url))
+		return ffmpeg_src_create(in->url, in->format);
+
+	if (qd_gen_file(in->url, path, sizeof (path))) {
+		err("%s: failed to generate input", in->name);
+		return NULL;
+	}
+
+	return ffmpeg_src_create(path, NULL);
+}
+
+static enum qd_module_type get_input_module(const struct bench_input *in)
+{
+	enum qd_module_type module = QD_MODULE_DOLBY_MS12;
+	struct ffmpeg_src *src;
+	AVStream *avstream;
+
+	src = open_input(in);
+	if (!src)
+		return module;
+
+	avstream = ffmpeg_src_get_avstream(src, -1);
+	if (avstream && avstream->codecpar->codec_id == AV_CODEC_ID_DTS)
+		module = QD_MODULE_DTS_M8;
+
+	ffmpeg_src_destroy(src);
+
+	return module;
+}
+
+static int run_iteration(struct qd_session *session,
+			 const struct bench_input *in, uint64_t *elapsed,
+			 uint64_t *cpu_time, uint64_t *duration)
+{
+	static struct qd_session_stats stats;
+	struct ffmpeg_src *src;
+	uint64_t start_time;
+	uint64_t start_cpu;
+	int ret = -1;
+
+	src = open_input(in);
+	if (!src)
+		return -1;
+
+	if (!ffmpeg_src_add_input(src, -1, session, in->input_id))
+		goto fail;
+
+	start_time = qd_get_time();
+	start_cpu = get_cpu_time();
+
+	ffmpeg_src_thread_start(src);
+	if (ffmpeg_src_thread_join(src)) {
+		err("%s: decode failed", in->name);
+		goto fail;
+	}
+
+	if (ffmpeg_src_wait_eos(src, true, 2 * QD_SECOND)) {
+		err("%s: failed to drain input", in->name);
+		goto fail;
+	}
+
+	*elapsed = qd_get_time() - start_time;
+	*cpu_time = get_cpu_time() - start_cpu;
+
+	/* input counters are dropped along with the input */
+	qd_session_get_stats(session, &stats);
+	*duration = stats.input_counters[in->input_id].written_duration;
+
+	ret = 0;
+
+fail:
+	ffmpeg_src_destroy(src);
+	return ret;
+}
+
+static int run_scenario(const struct bench_scenario *sc, int warmup,
+			int iterations, struct bench_result *res)
+{
+	static struct qd_session_stats before;
+	static struct qd_session_stats after;
+	struct qd_histogram latency;
+	struct qd_session *session;
+	uint64_t total_elapsed = 0;
+	uint64_t total_cpu = 0;
+	uint64_t total_duration = 0;
+	double speed;
+	int ret = -1;
+
+	memset(res, 0, sizeof (*res));
+	snprintf(res->name, sizeof (res->name), "%s/%s/%s/%dms",
+		 sc->input->name, sc->session_name, sc->outputs_name,
+		 sc->buffer_ms);
+
+	notice("%s: running %d+%d iterations", res->name, warmup,
+	       iterations);
+
+	session = qd_session_create(get_input_module(sc->input),
+				    sc->session_type);
+	if (!session)
+		return -1;
+
+	if (qd_session_configure_outputs(session, sc->n_outputs,
+					 sc->outputs)) {
+		err("%s: unsupported outputs configuration", res->name);
+		goto out;
+	}
+
+	qd_session_set_buffer_size_ms(session, sc->buffer_ms);
+
+	for (int i = 0; i < warmup + iterations; i++) {
+		uint64_t elapsed;
+		uint64_t cpu_time;
+		uint64_t duration;
+
+		if (i == warmup)
+			qd_session_get_stats(session, &before);
+
+		if (run_iteration(session, sc->input, &elapsed, &cpu_time,
+				  &duration))
+			goto out;
+
+		if (i < warmup || elapsed == 0)
+			continue;
+
+		speed = (double)duration / (double)elapsed;
+		if (res->iterations == 0 || speed < res->speed_min)
+			res->speed_min = speed;
+		if (speed > res->speed_max)
+			res->speed_max = speed;
+
+		total_elapsed += elapsed;
+		total_cpu += cpu_time;
+		total_duration += duration;
+		res->iterations++;
+	}
+
+	if (res->iterations == 0 || total_duration == 0) {
+		err("%s: no data decoded", res->name);
+		goto out;
+	}
+
+	qd_session_get_stats(session, &after);
+
+	/* latency as seen on the first configured output */
+	histogram_diff(&before.outputs[sc->outputs[0]][QD_OUTPUT_STAGE_LATENCY],
+		       &after.outputs[sc->outputs[0]][QD_OUTPUT_STAGE_LATENCY],
+		       &latency);
+
+	res->duration = total_duration / res->iterations;
+	res->speed_mean = (double)total_duration / (double)total_elapsed;
+	res->latency_p50 = qd_histogram_percentile(&latency, 0.5);
+	res->latency_p90 = qd_histogram_percentile(&latency, 0.9);
+	res->latency_p99 = qd_histogram_percentile(&latency, 0.99);
+	res->latency_max = latency.count > 0 ? latency.max : 0;
+	res->cpu_load = 100. * total_cpu / total_elapsed;
+	res->cpu_per_sec = 1000. * total_cpu / total_duration;
+
+	notice("%s: %.2fx realtime, latency p50 %" PRIu64 "us "
+	       "p99 %" PRIu64 "us, CPU %.1f%%", res->name, res->speed_mean,
+	       res->latency_p50, res->latency_p99, res->cpu_load);
+
+	ret = 0;
+
+out:
+	qd_session_destroy(session);
+	return ret;
+}
+
+static void write_csv(FILE *f)
+{
+	fprintf(f, "scenario,iterations,duration_ms,speed_mean,speed_min,"
+		"speed_max,latency_p50_us,latency_p90_us,latency_p99_us,"
+		"latency_max_us,cpu_load,cpu_ms_per_s\n");
+
+	for (int i = 0; i < n_results; i++) {
+		const struct bench_result *r = &results[i];
+
+		fprintf(f, "%s,%d,%" PRIu64 ",%.3f,%.3f,%.3f,%" PRIu64
+			",%" PRIu64 ",%" PRIu64 ",%" PRIu64 ",%.2f,%.3f\n",
+			r->name, r->iterations, r->duration / QD_MSECOND,
+			r->speed_mean, r->speed_min, r->speed_max,
+			r->latency_p50, r->latency_p90, r->latency_p99,
+			r->latency_max, r->cpu_load, r->cpu_per_sec);
+	}
+}
+
+/* one scenario per line, so that baselines can be read back without a full
+ * JSON parser */
+static void write_json(FILE *f)
+{
+	fprintf(f, "{\"scenarios\":[\n");
+
+	for (int i = 0; i < n_results; i++) {
+		const struct bench_result *r = &results[i];
+
+		fprintf(f, "{\"name\":\"%s\",\"iterations\":%d"
+			",\"duration_ms\":%" PRIu64 ",\"speed_mean\":%.3f"
+			",\"speed_min\":%.3f,\"speed_max\":%.3f"
+			",\"latency_p50_us\":%" PRIu64
+			",\"latency_p90_us\":%" PRIu64
+			",\"latency_p99_us\":%" PRIu64
+			",\"latency_max_us\":%" PRIu64
+			",\"cpu_load\":%.2f,\"cpu_ms_per_s\":%.3f}%s\n",
+			r->name, r->iterations, r->duration / QD_MSECOND,
+			r->speed_mean, r->speed_min, r->speed_max,
+			r->latency_p50, r->latency_p90, r->latency_p99,
+			r->latency_max, r->cpu_load, r->cpu_per_sec,
+			i + 1 < n_results ? "," : "");
+	}
+
+	fprintf(f, "]}\n");
+}
+
+static bool json_get_number(const char *line, const char *key, double *value)
+{
+	char pattern[64];
+	const char *p;
+	char *end;
+
+	snprintf(pattern, sizeof (pattern), "\"%s\":", key);
+	p = strstr(line, pattern);
+	if (!p)
+		return false;
+
+	p += strlen(pattern);
+	*value = strtod(p, &end);
+
+	return end != p;
+}
+
+static bool json_get_string(const char *line, const char *key, char *value,
+			    size_t size)
+{
+	char pattern[64];
+	const char *p;
+	size_t n;
+
+	snprintf(pattern, sizeof (pattern), "\"%s\":\"", key);
+	p = strstr(line, pattern);
+	if (!p)
+		return false;
+
+	p += strlen(pattern);
+	n = strcspn(p, "\"");
+	if (p[n] != '"' || n >= size)
+		return false;
+
+	memcpy(value, p, n);
+	value[n] = '\0';
+
+	return true;
+}
+
+static bool check_change(const char *name, const char *metric, double base,
+			 double value, double threshold, bool higher_is_better)
+{
+	double change;
+	bool regression;
+
+	if (base <= 0)
+		return false;
+
+	change = (value - base) / base;
+	regression = higher_is_better ? change < -threshold : change > threshold;
+
+	if (regression || qd_log_enabled(2)) {
+		fprintf(stderr, "%s %s: %s %.3f -> %.3f (%+.1f%%)\n",
+			regression ? "REGRESSION" : "ok        ", name, metric,
+			base, value, change * 100.);
+	}
+
+	return regression;
+}
+
+/* returns the number of regressions, or -1 on error */
+static int compare_baseline(const char *path, double threshold)
+{
+	char line[1024];
+	char name[128];
+	int regressions = 0;
+	int matched = 0;
+	FILE *f;
+
+	f = fopen(path, "r");
+	if (!f) {
+		err("failed to open %s: %m", path);
+		return -1;
+	}
+
+	while (fgets(line, sizeof (line), f)) {
+		const struct bench_result *r = NULL;
+		double speed;
+		double latency;
+		double cpu;
+
+		if (!json_get_string(line, "name", name, sizeof (name)))
+			continue;
+
+		for (int i = 0; i < n_results; i++) {
+			if (!strcmp(results[i].name, name)) {
+				r = &results[i];
+				break;
+			}
+		}
+
+		if (!r) {
+			info("%s: not in this run, skipped", name);
+			continue;
+		}
+
+		if (!json_get_number(line, "speed_mean", &speed) ||
+		    !json_get_number(line, "latency_p99_us", &latency) ||
+		    !json_get_number(line, "cpu_ms_per_s", &cpu)) {
+			err("%s: invalid baseline entry for %s", path, name);
+			continue;
+		}
+
+		matched++;
+
+		regressions += check_change(name, "speed", speed,
+					    r->speed_mean, threshold, true);
+		regressions += check_change(name, "latency_p99_us", latency,
+					    r->latency_p99,
+					    QD_MAX(threshold,
+						   BENCH_LATENCY_MIN_THRESHOLD),
+					    false);
+		regressions += check_change(name, "cpu_ms_per_s", cpu,
+					    r->cpu_per_sec, threshold, false);
+	}
+
+	fclose(f);
+
+	if (matched == 0) {
+		err("%s: no scenario in common with this run", path);
+		return -1;
+	}
+
+	notice("%d scenarios compared, %d regressions", matched, regressions);
+
+	return regressions;
+}
+
+static void usage(void)
+{
+	fprintf(stderr, "usage: qapbench [OPTS]\n"
+		"Where OPTS is a combination of:\n"
+		"  -v, --verbose                increase debug verbosity\n"
+		"  -i, --inputs=<list>          inputs to decode, default pcm\n"
+		"                                (pcm, pcm_5.1, sys, ott, ext,\n"
+		"                                generated ac3, ac3_5.1, ddp,\n"
+		"                                ddp_5.1, ddp_chid, aac, aac_5.1,\n"
+		"                                or a name defined with --file)\n"
+		"  -F, --file=<name>=<path>     define a main input from a file, or\n"
+		"                                from a gen:<signal>[:opts] spec\n"
+		"  -t, --session-types=<list>   session types, default broadcast\n"
+		"                                (broadcast, decode, ott)\n"
+		"  -c, --outputs=<list>         outputs combinations, default 2.0\n"
+		"                                (e.g. 2.0,5.1,2.0+5.1,2.0+ac3)\n"
+		"  -b, --buffer-sizes=<list>    input buffer sizes in ms, default 32\n"
+		"  -n, --iterations=<n>         measured iterations, default 5\n"
+		"  -w, --warmup=<n>             warmup iterations, default 1\n"
+		"  -f, --format=<fmt>           report format (csv, json)\n"
+		"  -o, --output=<file>          write the report to a file\n"
+		"      --compare=<file>         compare with a JSON baseline, exit\n"
+		"                                with status 3 on regressions\n"
+		"      --threshold=<percent>    regression threshold, default 10\n"
+		"\n"
+		"Example usage to compare the decoding of a file with a baseline:\n"
+		"  qapbench -F ddp=/data/test.ec3 -i pcm,ddp -c 2.0,2.0+5.1 \\\n"
+		"           -f json -o new.json --compare baseline.json\n"
+		"\n");
+}
+
+enum {
+	OPT_COMPARE = 0x200,
+	OPT_THRESHOLD,
+};
+
+static int current_long_opt;
+
+static const struct option long_options[] = {
+	{ "verbose",           no_argument,       0, 'v' },
+	{ "inputs",            required_argument, 0, 'i' },
+	{ "file",              required_argument, 0, 'F' },
+	{ "session-types",     required_argument, 0, 't' },
+	{ "outputs",           required_argument, 0, 'c' },
+	{ "buffer-sizes",      required_argument, 0, 'b' },
+	{ "iterations",        required_argument, 0, 'n' },
+	{ "warmup",            required_argument, 0, 'w' },
+	{ "format",            required_argument, 0, 'f' },
+	{ "output",            required_argument, 0, 'o' },
+	{ "help",              no_argument,       0, 'h' },
+	{ "compare",           required_argument, &current_long_opt, OPT_COMPARE },
+	{ "threshold",         required_argument, &current_long_opt, OPT_THRESHOLD },
+	{ 0, 0, 0, 0 }
+};
+
+int main(int argc, char **argv)
+{
+	char default_inputs[] = "pcm";
+	char default_sessions[] = "broadcast";
+	char default_outputs[] = "2.0";
+	char default_buffers[] = "32";
+	char *inputs_list = default_inputs;
+	char *sessions_list = default_sessions;
+	char *outputs_list = default_outputs;
+	char *buffers_list = default_buffers;
+	char *inputs[BENCH_MAX_ITEMS];
+	char *sessions[BENCH_MAX_ITEMS];
+	char *outputs[BENCH_MAX_ITEMS];
+	char *buffers[BENCH_MAX_ITEMS];
+	int n_inputs, n_sessions, n_outputs, n_buffers;
+	enum output_format format = OUTPUT_FORMAT_CSV;
+	const char *output_path = NULL;
+	const char *compare_path = NULL;
+	double threshold = 0.1;
+	int iterations = 5;
+	int warmup = 1;
+	int failed = 0;
+	int regressions = 0;
+	FILE *f = stdout;
+	char *p;
+	int opt;
+
+	while ((opt = getopt_long(argc, argv, "b:c:f:F:hi:n:o:t:vw:",
+				  long_options, NULL)) != -1) {
+		if (!opt)
+			opt = current_long_opt;
+
+		switch (opt) {
+		case 'v':
+			qd_debug_level++;
+			break;
+		case 'i':
+			inputs_list = optarg;
+			break;
+		case 'F':
+			p = strchr(optarg, '=');
+			if (!p || p == optarg || !p[1] ||
+			    n_file_inputs >= BENCH_MAX_ITEMS) {
+				err("invalid file input %s", optarg);
+				usage();
+				return 1;
+			}
+			*p = '\0';
+			file_inputs[n_file_inputs].name = optarg;
+			file_inputs[n_file_inputs].input_id = QD_INPUT_MAIN;
+			file_inputs[n_file_inputs].url = p + 1;
+			n_file_inputs++;
+			break;
+		case 't':
+			sessions_list = optarg;
+			break;
+		case 'c':
+			outputs_list = optarg;
+			break;
+		case 'b':
+			buffers_list = optarg;
+			break;
+		case 'n':
+			iterations = atoi(optarg);
+			if (iterations <= 0) {
+				err("invalid iterations count %s", optarg);
+				usage();
+				return 1;
+			}
+			break;
+		case 'w':
+			warmup = atoi(optarg);
+			if (warmup < 0) {
+				err("invalid warmup count %s", optarg);
+				usage();
+				return 1;
+			}
+			break;
+		case 'f':
+			if (!strcmp(optarg, "csv"))
+				format = OUTPUT_FORMAT_CSV;
+			else if (!strcmp(optarg, "json"))
+				format = OUTPUT_FORMAT_JSON;
+			else {
+				err("invalid report format %s", optarg);
+				usage();
+				return 1;
+			}
+			break;
+		case 'o':
+			output_path = optarg;
+			break;
+		case OPT_COMPARE:
+			compare_path = optarg;
+			break;
+		case OPT_THRESHOLD:
+			threshold = atof(optarg) / 100.;
+			if (threshold <= 0) {
+				err("invalid threshold %s", optarg);
+				usage();
+				return 1;
+			}
+			break;
+		case 'h':
+			usage();
+			return 0;
+		default:
+			usage();
+			return 1;
+		}
+	}
+
+	n_inputs = split_list(inputs_list, inputs);
+	n_sessions = split_list(sessions_list, sessions);
+	n_outputs = split_list(outputs_list, outputs);
+	n_buffers = split_list(buffers_list, buffers);
+	if (n_inputs <= 0 || n_sessions <= 0 || n_outputs <= 0 ||
+	    n_buffers <= 0) {
+		err("invalid scenario list");
+		usage();
+		return 1;
+	}
+
+	if ((size_t)n_inputs * n_sessions * n_outputs * n_buffers >
+	    BENCH_MAX_RESULTS) {
+		err("too many scenarios");
+		return 1;
+	}
+
+	/* validate the whole matrix before running anything */
+	for (int i = 0; i < n_inputs; i++) {
+		if (!find_input(inputs[i])) {
+			err("unknown input %s", inputs[i]);
+			return 1;
+		}
+	}
+	for (int i = 0; i < n_sessions; i++) {
+		qap_session_t type;
+		if (parse_session_type(sessions[i], &type)) {
+			err("invalid session type %s", sessions[i]);
+			return 1;
+		}
+	}
+	for (int i = 0; i < n_outputs; i++) {
+		enum qd_output_id ids[QD_MAX_OUTPUTS];
+		if (parse_outputs(outputs[i], ids) < 0) {
+			err("invalid outputs %s", outputs[i]);
+			return 1;
+		}
+	}
+	for (int i = 0; i < n_buffers; i++) {
+		if (atoi(buffers[i]) <= 0) {
+			err("invalid buffer size %s", buffers[i]);
+			return 1;
+		}
+	}
+
+	qd_init();
+
+	for (int i = 0; i < n_inputs; i++) {
+		for (int j = 0; j < n_sessions; j++) {
+			for (int k = 0; k < n_outputs; k++) {
+				for (int l = 0; l < n_buffers; l++) {
+					struct bench_scenario sc = {
+						.input = find_input(inputs[i]),
+						.session_name = sessions[j],
+						.outputs_name = outputs[k],
+						.buffer_ms = atoi(buffers[l]),
+					};
+
+					parse_session_type(sessions[j],
+							   &sc.session_type);
+					sc.n_outputs = parse_outputs(outputs[k],
+								     sc.outputs);
+
+					if (run_scenario(&sc, warmup,
+							 iterations,
+							 &results[n_results]))
+						failed++;
+					else
+						n_results++;
+				}
+			}
+		}
+	}
+
+	if (output_path) {
+		f = fopen(output_path, "w");
+		if (!f) {
+			err("failed to open %s: %m", output_path);
+			return 1;
+		}
+	}
+
+	if (format == OUTPUT_FORMAT_JSON)
+		write_json(f);
+	else
+		write_csv(f);
+
+	if (f != stdout)
+		fclose(f);
+
+	if (compare_path) {
+		regressions = compare_baseline(compare_path, threshold);
+		if (regressions < 0)
+			return 1;
+	}
+
+	if (failed)
+		err("%d scenarios failed", failed);
+
+	qd_log_flush();
+
+	if (regressions > 0)
+		return 3;
+
+	return failed ? 1 : 0;
+}
@@ -11,10 +11,15 @@
 #include <getopt.h>
 #include <pthread.h>
 #include <sys/eventfd.h>
+#include <dirent.h>
+#include <errno.h>
+#include <limits.h>
+#include <stddef.h>
 
 #include "qd.h"
 
 volatile bool quit;
+static bool rt_failed;
 static bool qap_chmod_locking;
 
 enum kbd_command {
@@ -38,6 +43,620 @@ static uint64_t get_cpu_time(void)
 	return ts.tv_sec * UINT64_C(1000000) + ts.tv_nsec / UINT64_C(1000);
 }
 
+static void print_histogram(const char *prefix, const char *name,
+			    const char *stage, const struct qd_histogram *h)
+{
+	if (h->count == 0)
+		return;
+
+	info("%s: %s: %s: %" PRIu64 " samples, avg %" PRIu64 "us, "
+	     "p50 %" PRIu64 "us, p99 %" PRIu64 "us, p99.9 %" PRIu64 "us, "
+	     "max %" PRIu64 "us",
+	     prefix, name, stage, h->count, h->sum / h->count,
+	     qd_histogram_percentile(h, 0.5),
+	     qd_histogram_percentile(h, 0.99),
+	     qd_histogram_percentile(h, 0.999),
+	     h->max);
+}
+
+static void print_session_stats(struct qd_session *session)
+{
+	static struct qd_session_stats stats;
+
+	qd_session_get_stats(session, &stats);
+
+	for (int i = 0; i < QD_MAX_INPUTS; i++) {
+		for (int j = 0; j < QD_INPUT_STAGE_COUNT; j++) {
+			print_histogram(" in", qd_input_id_to_str(i),
+					qd_input_stage_to_str(j),
+					&stats.inputs[i][j]);
+		}
+	}
+
+	for (int i = 0; i < QD_MAX_OUTPUTS; i++) {
+		struct qd_output *output = qd_session_get_output(session, i);
+
+		for (int j = 0; j < QD_OUTPUT_STAGE_COUNT; j++) {
+			print_histogram("out", output->name,
+					qd_output_stage_to_str(j),
+					&stats.outputs[i][j]);
+		}
+	}
+}
+
+/*
+ * periodic stats export
+ */
+
+enum stats_format {
+	STATS_FORMAT_JSON,
+	STATS_FORMAT_PROMETHEUS,
+};
+
+#define STATS_MAX_THREADS	64
+
+struct thread_cpu {
+	int tid;
+	char name[32];
+	uint64_t cpu_time;
+};
+
+struct stats_writer {
+	const char *path;
+	enum stats_format format;
+	int interval_ms;
+	FILE *stream;
+	pthread_t tid;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	bool started;
+	bool terminated;
+	struct qd_session *session;
+	struct qd_session_stats stats;
+	struct qd_mem_stats mem;
+	struct thread_cpu threads[STATS_MAX_THREADS];
+};
+
+static struct stats_writer g_stats = {
+	.format = STATS_FORMAT_JSON,
+	.interval_ms = 1000,
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+	.cond = PTHREAD_COND_INITIALIZER,
+};
+
+/* per thread cpu time from /proc, outside of the threads themselves */
+static int get_thread_cpu_times(struct thread_cpu *threads, int max)
+{
+	long ticks = sysconf(_SC_CLK_TCK);
+	struct dirent *ent;
+	int n = 0;
+	DIR *dir;
+
+	dir = opendir("/proc/self/task");
+	if (!dir)
+		return 0;
+
+	while (n < max && (ent = readdir(dir))) {
+		struct thread_cpu *t = &threads[n];
+		unsigned long utime, stime;
+		char path[64];
+		char buf[512];
+		char *start, *end;
+		size_t len;
+		FILE *f;
+
+		if (ent->d_name[0] == '.')
+			continue;
+
+		snprintf(path, sizeof (path), "/proc/self/task/%s/stat",
+			 ent->d_name);
+		f = fopen(path, "r");
+		if (!f)
+			continue;
+		len = fread(buf, 1, sizeof (buf) - 1, f);
+		fclose(f);
+		buf[len] = '\0';
+
+		/* comm is between parens and may contain spaces */
+		start = strchr(buf, '(');
+		end = strrchr(buf, ')');
+		if (!start || !end || end < start)
+			continue;
+
+		if (sscanf(end + 1, " %*c %*d %*d %*d %*d %*d %*u %*u %*u "
+			   "%*u %*u %lu %lu", &utime, &stime) != 2)
+			continue;
+
+		t->tid = atoi(ent->d_name);
+		len = QD_MIN((size_t)(end - start - 1), sizeof (t->name) - 1);
+		memcpy(t->name, start + 1, len);
+		t->name[len] = '\0';
+		for (char *p = t->name; *p; p++) {
+			if (*p == '"' || *p == '\\' || *p < ' ')
+				*p = '_';
+		}
+		t->cpu_time = (uint64_t)(utime + stime) * 1000000 / ticks;
+		n++;
+	}
+
+	closedir(dir);
+
+	return n;
+}
+
+static void stats_write_json(FILE *f, struct stats_writer *w, int n_threads)
+{
+	const struct qd_session_stats *stats = &w->stats;
+	const struct thread_cpu *threads = w->threads;
+	const char *sep;
+
+	fprintf(f, "{\"time\":%" PRIu64 ",\"cpu_time\":%" PRIu64,
+		qd_get_time(), get_cpu_time());
+
+	fprintf(f, ",\"threads\":[");
+	for (int i = 0; i < n_threads; i++) {
+		fprintf(f, "%s{\"tid\":%d,\"name\":\"%s\",\"cpu_time\":%" PRIu64 "}",
+			i ? "," : "", threads[i].tid, threads[i].name,
+			threads[i].cpu_time);
+	}
+
+	fprintf(f, "],\"inputs\":[");
+	sep = "";
+	for (int i = 0; i < QD_MAX_INPUTS; i++) {
+		const struct qd_input_counters *c = &stats->input_counters[i];
+
+		if (!c->active)
+			continue;
+
+		fprintf(f, "%s{\"name\":\"%s\",\"written_bytes\":%" PRIu64
+			",\"written_duration\":%" PRIu64
+			",\"buffer_full\":%" PRIu64 ",\"stalls\":%" PRIu64
+			",\"buffer_size\":%u,\"buffer_avail\":%u"
+			",\"buffer_peak\":%u,\"buffer_resizes\":%" PRIu64 "}",
+			sep, qd_input_id_to_str(i), c->written_bytes,
+			c->written_duration, c->full_count, c->stalls,
+			c->buffer_size, c->avail_bytes,
+			stats->buffers.inputs[i], c->buffer_resizes);
+		sep = ",";
+	}
+
+	fprintf(f, "],\"outputs\":[");
+	sep = "";
+	for (int i = 0; i < QD_MAX_OUTPUTS; i++) {
+		const struct qd_output_counters *c = &stats->output_counters[i];
+		const struct qd_histogram *h =
+			&stats->outputs[i][QD_OUTPUT_STAGE_LATENCY];
+
+		if (!c->enabled)
+			continue;
+
+		fprintf(f, "%s{\"name\":\"%s\",\"bytes\":%" PRIu64
+			",\"frames\":%" PRIu64 ",\"pts_resets\":%" PRIu64
+			",\"late_buffers\":%" PRIu64 ",\"overruns\":%" PRIu64
+			",\"max_lateness\":%" PRIu64
+			",\"latency_p50\":%" PRIu64 ",\"latency_p99\":%" PRIu64
+			",\"swdec_buffer_peak\":%u}",
+			sep, qd_session_get_output(w->session, i)->name,
+			c->total_bytes, c->total_frames, c->pts_resets,
+			c->late_buffers, c->overruns, c->max_lateness,
+			qd_histogram_percentile(h, 0.5),
+			qd_histogram_percentile(h, 0.99),
+			stats->buffers.outputs[i]);
+		sep = ",";
+	}
+
+	fprintf(f, "],\"memory\":{\"rss\":%" PRIu64 ",\"peak_rss\":%" PRIu64
+		",\"heap\":%" PRIu64 ",\"types\":[", w->mem.rss,
+		w->mem.peak_rss, w->mem.heap_bytes);
+	for (int i = 0; i < QD_MEM_TYPE_COUNT; i++) {
+		const struct qd_mem_counters *c = &w->mem.types[i];
+
+		fprintf(f, "%s{\"name\":\"%s\",\"bytes\":%" PRIu64
+			",\"peak_bytes\":%" PRIu64 ",\"allocs\":%" PRIu64 "}",
+			i ? "," : "", qd_mem_type_to_str(i), c->bytes,
+			c->peak_bytes, c->allocs);
+	}
+
+	fprintf(f, "]}}\n");
+	fflush(f);
+}
+
+static void prom_metric(FILE *f, const char *name, const char *type,
+			const char *help)
+{
+	fprintf(f, "# HELP qapdec_%s %s\n# TYPE qapdec_%s %s\n",
+		name, help, name, type);
+}
+
+static void stats_write_prometheus(FILE *f, struct stats_writer *w,
+				   int n_threads)
+{
+	const struct qd_session_stats *stats = &w->stats;
+	const struct thread_cpu *threads = w->threads;
+	static const struct {
+		const char *name;
+		const char *type;
+		const char *help;
+		size_t offset;
+		bool is_u32;
+	} input_metrics[] = {
+#define INPUT_METRIC(n, t, h, field, u32) \
+	{ n, t, h, offsetof(struct qd_input_counters, field), u32 }
+		INPUT_METRIC("input_written_bytes", "counter",
+			     "Bytes written to the decoder", written_bytes, false),
+		INPUT_METRIC("input_written_duration_us", "counter",
+			     "Duration of the data written to the decoder",
+			     written_duration, false),
+		INPUT_METRIC("input_buffer_full_total", "counter",
+			     "Writes rejected because the buffer was full",
+			     full_count, false),
+		INPUT_METRIC("input_stalls_total", "counter",
+			     "Buffer full for more than one second", stalls,
+			     false),
+		INPUT_METRIC("input_buffer_size_bytes", "gauge",
+			     "Decoder input buffer size", buffer_size, true),
+		INPUT_METRIC("input_buffer_avail_bytes", "gauge",
+			     "Free space in the decoder input buffer",
+			     avail_bytes, true),
+		INPUT_METRIC("input_buffer_resizes_total", "counter",
+			     "Adaptive input buffer size changes",
+			     buffer_resizes, false),
+#undef INPUT_METRIC
+	};
+	static const struct {
+		const char *name;
+		const char *type;
+		const char *help;
+		size_t offset;
+	} output_metrics[] = {
+#define OUTPUT_METRIC(n, t, h, field) \
+	{ n, t, h, offsetof(struct qd_output_counters, field) }
+		OUTPUT_METRIC("output_bytes", "counter",
+			      "Bytes rendered", total_bytes),
+		OUTPUT_METRIC("output_frames", "counter",
+			      "Frames rendered", total_frames),
+		OUTPUT_METRIC("output_pts_resets_total", "counter",
+			      "Output timestamp discontinuities", pts_resets),
+		OUTPUT_METRIC("output_late_buffers_total", "counter",
+			      "Buffers rendered late in realtime mode",
+			      late_buffers),
+		OUTPUT_METRIC("output_overruns_total", "counter",
+			      "Buffers queued over the realtime budget",
+			      overruns),
+		OUTPUT_METRIC("output_max_lateness_us", "gauge",
+			      "Largest realtime deadline miss", max_lateness),
+#undef OUTPUT_METRIC
+	};
+
+	prom_metric(f, "cpu_seconds", "counter", "Process CPU time");
+	fprintf(f, "qapdec_cpu_seconds %.6f\n", get_cpu_time() / 1e6);
+
+	prom_metric(f, "thread_cpu_seconds", "counter", "Thread CPU time");
+	for (int i = 0; i < n_threads; i++) {
+		fprintf(f, "qapdec_thread_cpu_seconds{tid=\"%d\",name=\"%s\"} %.6f\n",
+			threads[i].tid, threads[i].name,
+			threads[i].cpu_time / 1e6);
+	}
+
+	for (size_t m = 0; m < QD_N_ELEMENTS(input_metrics); m++) {
+		prom_metric(f, input_metrics[m].name, input_metrics[m].type,
+			    input_metrics[m].help);
+		for (int i = 0; i < QD_MAX_INPUTS; i++) {
+			const char *c = (const char *)&stats->input_counters[i];
+			uint64_t v;
+
+			if (!stats->input_counters[i].active)
+				continue;
+
+			if (input_metrics[m].is_u32)
+				v = *(const uint32_t *)(c + input_metrics[m].offset);
+			else
+				v = *(const uint64_t *)(c + input_metrics[m].offset);
+
+			fprintf(f, "qapdec_%s{input=\"%s\"} %" PRIu64 "\n",
+				input_metrics[m].name, qd_input_id_to_str(i), v);
+		}
+	}
+
+	for (size_t m = 0; m < QD_N_ELEMENTS(output_metrics); m++) {
+		prom_metric(f, output_metrics[m].name, output_metrics[m].type,
+			    output_metrics[m].help);
+		for (int i = 0; i < QD_MAX_OUTPUTS; i++) {
+			const char *c = (const char *)&stats->output_counters[i];
+
+			if (!stats->output_counters[i].enabled)
+				continue;
+
+			fprintf(f, "qapdec_%s{output=\"%s\"} %" PRIu64 "\n",
+				output_metrics[m].name,
+				qd_session_get_output(w->session, i)->name,
+				*(const uint64_t *)(c + output_metrics[m].offset));
+		}
+	}
+
+	prom_metric(f, "output_latency_us", "gauge",
+		    "Input to output latency percentiles");
+	for (int i = 0; i < QD_MAX_OUTPUTS; i++) {
+		const struct qd_histogram *h =
+			&stats->outputs[i][QD_OUTPUT_STAGE_LATENCY];
+		const char *name = qd_session_get_output(w->session, i)->name;
+
+		if (!stats->output_counters[i].enabled || h->count == 0)
+			continue;
+
+		fprintf(f, "qapdec_output_latency_us{output=\"%s\",quantile=\"0.5\"} %" PRIu64 "\n",
+			name, qd_histogram_percentile(h, 0.5));
+		fprintf(f, "qapdec_output_latency_us{output=\"%s\",quantile=\"0.99\"} %" PRIu64 "\n",
+			name, qd_histogram_percentile(h, 0.99));
+	}
+
+	prom_metric(f, "input_buffer_peak_bytes", "gauge",
+		    "Largest decoder input buffer size");
+	for (int i = 0; i < QD_MAX_INPUTS; i++) {
+		if (stats->buffers.inputs[i] > 0)
+			fprintf(f, "qapdec_input_buffer_peak_bytes{input=\"%s\"} %u\n",
+				qd_input_id_to_str(i), stats->buffers.inputs[i]);
+	}
+
+	prom_metric(f, "output_swdec_buffer_peak_bytes", "gauge",
+		    "Largest software decoder buffers size");
+	for (int i = 0; i < QD_MAX_OUTPUTS; i++) {
+		if (stats->buffers.outputs[i] > 0)
+			fprintf(f, "qapdec_output_swdec_buffer_peak_bytes{output=\"%s\"} %u\n",
+				qd_session_get_output(w->session, i)->name,
+				stats->buffers.outputs[i]);
+	}
+
+	prom_metric(f, "memory_rss_bytes", "gauge", "Resident set size");
+	fprintf(f, "qapdec_memory_rss_bytes %" PRIu64 "\n", w->mem.rss);
+	prom_metric(f, "memory_peak_rss_bytes", "gauge",
+		    "Peak resident set size");
+	fprintf(f, "qapdec_memory_peak_rss_bytes %" PRIu64 "\n",
+		w->mem.peak_rss);
+	prom_metric(f, "memory_heap_bytes", "gauge",
+		    "Heap memory in use, all libraries");
+	fprintf(f, "qapdec_memory_heap_bytes %" PRIu64 "\n",
+		w->mem.heap_bytes);
+
+	prom_metric(f, "memory_bytes", "gauge", "libqd memory in use");
+	for (int i = 0; i < QD_MEM_TYPE_COUNT; i++) {
+		fprintf(f, "qapdec_memory_bytes{type=\"%s\"} %" PRIu64 "\n",
+			qd_mem_type_to_str(i), w->mem.types[i].bytes);
+	}
+
+	prom_metric(f, "memory_peak_bytes", "gauge",
+		    "libqd memory high-water mark");
+	for (int i = 0; i < QD_MEM_TYPE_COUNT; i++) {
+		fprintf(f, "qapdec_memory_peak_bytes{type=\"%s\"} %" PRIu64 "\n",
+			qd_mem_type_to_str(i), w->mem.types[i].peak_bytes);
+	}
+}
+
+static void stats_write(struct stats_writer *w)
+{
+	int n_threads;
+
+	qd_session_get_stats(w->session, &w->stats);
+	qd_mem_get_stats(&w->mem);
+	n_threads = get_thread_cpu_times(w->threads, STATS_MAX_THREADS);
+
+	if (w->format == STATS_FORMAT_JSON) {
+		stats_write_json(w->stream, w, n_threads);
+	} else {
+		/* textfile collectors expect the file to be replaced
+		 * atomically */
+		char tmp_path[PATH_MAX];
+		FILE *f;
+
+		snprintf(tmp_path, sizeof (tmp_path), "%s.tmp", w->path);
+		f = fopen(tmp_path, "w");
+		if (!f) {
+			err("failed to open %s: %m", tmp_path);
+			return;
+		}
+		stats_write_prometheus(f, w, n_threads);
+		if (fclose(f) || rename(tmp_path, w->path))
+			err("failed to write %s: %m", w->path);
+	}
+}
+
+static void *stats_thread(void *userdata)
+{
+	struct stats_writer *w = userdata;
+	struct timespec deadline;
+
+	qd_thread_set_name("qapdec-stats");
+
+	clock_gettime(CLOCK_REALTIME, &deadline);
+
+	pthread_mutex_lock(&w->lock);
+	while (!w->terminated) {
+		deadline.tv_nsec += (long)(w->interval_ms % 1000) * 1000000;
+		deadline.tv_sec += w->interval_ms / 1000 +
+			deadline.tv_nsec / 1000000000;
+		deadline.tv_nsec %= 1000000000;
+
+		while (!w->terminated &&
+		       pthread_cond_timedwait(&w->cond, &w->lock,
+					      &deadline) != ETIMEDOUT)
+			;
+
+		pthread_mutex_unlock(&w->lock);
+		stats_write(w);
+		pthread_mutex_lock(&w->lock);
+	}
+	pthread_mutex_unlock(&w->lock);
+
+	return NULL;
+}
+
+static int stats_start(struct stats_writer *w, struct qd_session *session)
+{
+	w->session = session;
+
+	if (w->format == STATS_FORMAT_JSON) {
+		w->stream = fopen(w->path, "w");
+		if (!w->stream) {
+			err("failed to open %s: %m", w->path);
+			return -1;
+		}
+	}
+
+	if (pthread_create(&w->tid, NULL, stats_thread, w)) {
+		err("failed to create stats thread");
+		if (w->stream)
+			fclose(w->stream);
+		w->stream = NULL;
+		return -1;
+	}
+
+	w->started = true;
+
+	return 0;
+}
+
+/* the thread writes a last snapshot before exiting */
+static void stats_stop(struct stats_writer *w)
+{
+	if (!w->started)
+		return;
+
+	pthread_mutex_lock(&w->lock);
+	w->terminated = true;
+	pthread_cond_signal(&w->cond);
+	pthread_mutex_unlock(&w->lock);
+
+	pthread_join(w->tid, NULL);
+	w->started = false;
+
+	if (w->stream)
+		fclose(w->stream);
+	w->stream = NULL;
+}
+
+static void print_cpu(const char *prefix, const char *name, const char *stage,
+		      uint64_t cpu_time, uint64_t realtime)
+{
+	if (cpu_time == 0)
+		return;
+
+	info("%s: %s: %s: CPU %" PRIu64 ".%03" PRIu64 "s, %.1f%% of realtime",
+	     prefix, name, stage, cpu_time / QD_SECOND,
+	     cpu_time % QD_SECOND / QD_MSECOND,
+	     100.f * cpu_time / realtime);
+}
+
+/* threads created by libqd and qapdec are named, anything else running in
+ * the process was created by the QAP libraries */
+static bool is_own_thread(const struct thread_cpu *t)
+{
+	return t->tid == getpid() ||
+		!strncmp(t->name, "src-", 4) ||
+		!strncmp(t->name, "swdec-", 6) ||
+		!strncmp(t->name, "qd-", 3) ||
+		!strncmp(t->name, "qapdec-", 7);
+}
+
+static void print_cpu_stats(struct qd_session *session, uint64_t realtime)
+{
+	static struct qd_session_stats stats;
+	static struct thread_cpu threads[STATS_MAX_THREADS];
+	int n_threads;
+
+	if (realtime == 0)
+		return;
+
+	qd_session_get_stats(session, &stats);
+
+	for (int i = 0; i < QD_MAX_INPUTS; i++) {
+		const char *name = qd_input_id_to_str(i);
+		uint64_t process = stats.cpu.process[i];
+
+		print_cpu(" in", name, "demux",
+			  stats.cpu.src[i] > process ?
+			  stats.cpu.src[i] - process : 0, realtime);
+		print_cpu(" in", name, "qap_module_process", process, realtime);
+	}
+
+	for (int i = 0; i < QD_MAX_OUTPUTS; i++) {
+		struct qd_output *output = qd_session_get_output(session, i);
+		struct qd_sw_decoder_stats swdec_stats;
+
+		print_cpu("out", output->name, "callbacks",
+			  stats.cpu.callbacks[i], realtime);
+
+		if (!qd_output_get_swdec_stats(output, &swdec_stats))
+			print_cpu("out", output->name, "swdec",
+				  swdec_stats.cpu_time, realtime);
+	}
+
+	/* sum the library threads by name, exited ones are not accounted,
+	 * output callbacks run in these threads and are included */
+	n_threads = get_thread_cpu_times(threads, STATS_MAX_THREADS);
+	for (int i = 0; i < n_threads; i++) {
+		uint64_t cpu_time = threads[i].cpu_time;
+
+		if (is_own_thread(&threads[i]) || !threads[i].name[0])
+			continue;
+
+		for (int j = i + 1; j < n_threads; j++) {
+			if (!strcmp(threads[i].name, threads[j].name)) {
+				cpu_time += threads[j].cpu_time;
+				threads[j].name[0] = '\0';
+			}
+		}
+
+		print_cpu("qap", threads[i].name, "thread", cpu_time, realtime);
+	}
+
+	print_cpu("qapdec", "process", "total", get_cpu_time(), realtime);
+}
+
+static void print_mem_stats(struct qd_session *session)
+{
+	static struct qd_session_stats stats;
+	struct qd_mem_stats mem;
+	uint64_t own = 0;
+
+	qd_session_get_stats(session, &stats);
+	qd_mem_get_stats(&mem);
+
+	for (int i = 0; i < QD_MAX_INPUTS; i++) {
+		if (stats.buffers.inputs[i] > 0)
+			info(" in: %s: buffer peak %u bytes",
+			     qd_input_id_to_str(i), stats.buffers.inputs[i]);
+	}
+
+	for (int i = 0; i < QD_MAX_OUTPUTS; i++) {
+		if (stats.buffers.outputs[i] > 0)
+			info("out: %s: swdec buffers peak %u bytes",
+			     qd_session_get_output(session, i)->name,
+			     stats.buffers.outputs[i]);
+	}
+
+	for (int i = 0; i < QD_MEM_TYPE_COUNT; i++) {
+		const struct qd_mem_counters *c = &mem.types[i];
+
+		own += c->bytes;
+		if (c->allocs == 0)
+			continue;
+
+		info("mem: %s: %" PRIu64 " kB, peak %" PRIu64 " kB, "
+		     "%" PRIu64 " allocations", qd_mem_type_to_str(i),
+		     c->bytes / 1024, c->peak_bytes / 1024, c->allocs);
+	}
+
+	/* libav* and the QAP libraries cannot be accounted separately */
+	if (mem.heap_bytes > 0)
+		info("mem: heap: %" PRIu64 " kB, libqd %" PRIu64 " kB, "
+		     "other libraries %" PRIu64 " kB", mem.heap_bytes / 1024,
+		     own / 1024,
+		     mem.heap_bytes > own ? (mem.heap_bytes - own) / 1024 : 0);
+
+	info("mem: process: RSS %" PRIu64 " kB, peak RSS %" PRIu64 " kB",
+	     mem.rss / 1024, mem.peak_rss / 1024);
+}
+
 static struct qd_input *get_nth_input(int n)
 {
 	struct ffmpeg_src *src;
@@ -144,6 +763,8 @@ static void *kbd_thread(void *userdata)
 	struct pollfd fds[2];
 	int ret;
 
+	qd_thread_set_name("qapdec-kbd");
+
 	if (tcgetattr(STDIN_FILENO, &stdin_termios) < 0)
 		return NULL;
 
@@ -234,9 +855,15 @@ static void handle_quit(int sig)
 	}
 }
 
+static void handle_realtime_failed(struct qd_session *session, void *userdata)
+{
+	rt_failed = true;
+	handle_quit(SIGTERM);
+}
+
 static void usage(void)
 {
-	fprintf(stderr, "usage: qapdec [OPTS] <input>\n"
+	fprintf(stderr, "usage: qapdec [OPTS] <input> [<input>...]\n"
 		"Where OPTS is a combination of:\n"
 		"  -v, --verbose                increase debug verbosity\n"
 		"  -i, --interactive            enable keyboard control on the tty\n"
@@ -249,7 +876,32 @@ static void usage(void)
 		"  -c, --channels=<channels>    maximum number of channels to output\n"
 		"  -k, --kvpairs=<kvpairs>      pass kvpairs string to the decoder backend\n"
 		"  -l, --loops=<count>          number of times the stream will be decoded\n"
+		"      --no-reuse               recreate decoder modules on each loop\n"
+		"      --playlist               play all inputs one after the other\n"
+		"                                without gaps, instead of main and main2\n"
+		"      --swdec-format=<fmt>     sample format of software decoded outputs\n"
+		"                                (s16, s32, flt)\n"
 		"      --realtime               sync input feeding and output render to pts\n"
+		"      --rt-max-underruns=<n>   fail when more than n buffers are rendered\n"
+		"                                late, implies --realtime\n"
+		"      --rt-max-overruns=<n>    fail when more than n buffers are queued\n"
+		"                                over the budget, implies --realtime\n"
+		"      --rt-max-late=<duration> fail when a buffer is rendered later than\n"
+		"                                duration, implies --realtime\n"
+		"      --rt-budget=<duration>   max time a buffer may be queued ahead of\n"
+		"                                its deadline, implies --realtime\n"
+		"      --adaptive-buffer[=<duration>]\n"
+		"                               resize input buffers from observed stalls,\n"
+		"                                with an optional latency target, implies\n"
+		"                                --realtime\n"
+		"      --cpu-stats              account CPU time of each decode stage\n"
+		"      --latency-log=<file>     write input to output latency of each\n"
+		"                                output buffer to a CSV file\n"
+		"      --stats-file=<file>      write periodic stats snapshots to a file\n"
+		"      --stats-format=<fmt>     stats file format (json, prometheus)\n"
+		"      --stats-interval=<ms>    stats snapshot interval, default 1000ms\n"
+		"      --trace-file=<file>      record QAP calls and callbacks to a Chrome\n"
+		"                                trace JSON file, for Perfetto\n"
 		"      --seek=<pos>             seek inputs to specified position first\n"
 		"      --discard=<duration>     duration of output buffers to discard\n"
 		"      --sec-source=<url>       source for assoc/main2 module\n"
@@ -270,6 +922,20 @@ static void usage(void)
 enum {
 	OPT_SEEK = 0x200,
 	OPT_DISCARD,
+	OPT_NO_REUSE,
+	OPT_PLAYLIST,
+	OPT_SWDEC_FORMAT,
+	OPT_LATENCY_LOG,
+	OPT_STATS_FILE,
+	OPT_STATS_FORMAT,
+	OPT_STATS_INTERVAL,
+	OPT_TRACE_FILE,
+	OPT_RT_MAX_UNDERRUNS,
+	OPT_RT_MAX_OVERRUNS,
+	OPT_RT_MAX_LATE,
+	OPT_RT_BUDGET,
+	OPT_ADAPTIVE_BUFFER,
+	OPT_CPU_STATS,
 };
 
 static int current_long_opt;
@@ -288,6 +954,20 @@ static const struct option long_options[] = {
 	{ "realtime",          no_argument,       0, '0' },
 	{ "seek",              required_argument, &current_long_opt, OPT_SEEK },
 	{ "discard",           required_argument, &current_long_opt, OPT_DISCARD },
+	{ "no-reuse",          no_argument,       &current_long_opt, OPT_NO_REUSE },
+	{ "playlist",          no_argument,       &current_long_opt, OPT_PLAYLIST },
+	{ "swdec-format",      required_argument, &current_long_opt, OPT_SWDEC_FORMAT },
+	{ "latency-log",       required_argument, &current_long_opt, OPT_LATENCY_LOG },
+	{ "stats-file",        required_argument, &current_long_opt, OPT_STATS_FILE },
+	{ "stats-format",      required_argument, &current_long_opt, OPT_STATS_FORMAT },
+	{ "stats-interval",    required_argument, &current_long_opt, OPT_STATS_INTERVAL },
+	{ "trace-file",        required_argument, &current_long_opt, OPT_TRACE_FILE },
+	{ "rt-max-underruns",  required_argument, &current_long_opt, OPT_RT_MAX_UNDERRUNS },
+	{ "rt-max-overruns",   required_argument, &current_long_opt, OPT_RT_MAX_OVERRUNS },
+	{ "rt-max-late",       required_argument, &current_long_opt, OPT_RT_MAX_LATE },
+	{ "rt-budget",         required_argument, &current_long_opt, OPT_RT_BUDGET },
+	{ "adaptive-buffer",   optional_argument, &current_long_opt, OPT_ADAPTIVE_BUFFER },
+	{ "cpu-stats",         no_argument,       &current_long_opt, OPT_CPU_STATS },
 	{ "sec-source",        required_argument, 0, '1' },
 	{ "sys-source",        required_argument, 0, '2' },
 	{ "app-source",        required_argument, 0, '3' },
@@ -308,6 +988,8 @@ int main(int argc, char **argv)
 	int primary_stream_index = -1;
 	int secondary_stream_index = -1;
 	char *output_dir = NULL;
+	char *latency_log = NULL;
+	char *trace_file = NULL;
 	enum qd_output_id outputs[2];
 	unsigned int num_outputs = 0;
 	char *kvpairs = NULL;
@@ -315,12 +997,32 @@ int main(int argc, char **argv)
 	const char *src_url[QD_MAX_INPUTS] = { };
 	const char *src_format[QD_MAX_INPUTS] = { };
 	uint64_t src_duration;
+	uint64_t loop_start_time;
 	uint64_t start_time;
 	uint64_t end_time;
 	uint64_t cpu_time;
+	uint64_t startup_time;
+	uint64_t startup_first = 0;
+	uint64_t startup_total = 0;
+	uint64_t total_duration = 0;
+	uint64_t total_elapsed = 0;
+	int startup_count = 0;
+	bool reuse_inputs = true;
+	bool playlist = false;
+	enum qd_sample_format swdec_format = QD_SAMPLE_FORMAT_S16;
+	bool reuse;
 	int64_t seek_position = 0;
 	int64_t discard_duration = 0;
 	bool render_realtime = false;
+	bool cpu_stats = false;
+	struct qd_realtime_limits rt_limits = {
+		.max_underruns = -1,
+		.max_overruns = -1,
+	};
+	struct qd_buffer_policy buffer_policy = { };
+	int64_t rt_duration;
+	long rt_count;
+	char *end;
 	bool kbd_enable = false;
 	enum qd_module_type module;
 	qap_session_t qap_session_type;
@@ -445,6 +1147,98 @@ int main(int argc, char **argv)
 				return 1;
 			}
 			break;
+		case OPT_NO_REUSE:
+			reuse_inputs = false;
+			break;
+		case OPT_PLAYLIST:
+			playlist = true;
+			break;
+		case OPT_SWDEC_FORMAT:
+			if (!strcmp(optarg, "s16"))
+				swdec_format = QD_SAMPLE_FORMAT_S16;
+			else if (!strcmp(optarg, "s32"))
+				swdec_format = QD_SAMPLE_FORMAT_S32;
+			else if (!strcmp(optarg, "flt"))
+				swdec_format = QD_SAMPLE_FORMAT_FLT;
+			else {
+				err("invalid sample format %s", optarg);
+				usage();
+				return 1;
+			}
+			break;
+		case OPT_LATENCY_LOG:
+			latency_log = optarg;
+			break;
+		case OPT_STATS_FILE:
+			g_stats.path = optarg;
+			break;
+		case OPT_TRACE_FILE:
+			trace_file = optarg;
+			break;
+		case OPT_STATS_FORMAT:
+			if (!strcmp(optarg, "json"))
+				g_stats.format = STATS_FORMAT_JSON;
+			else if (!strcmp(optarg, "prometheus"))
+				g_stats.format = STATS_FORMAT_PROMETHEUS;
+			else {
+				err("invalid stats format %s", optarg);
+				usage();
+				return 1;
+			}
+			break;
+		case OPT_STATS_INTERVAL:
+			g_stats.interval_ms = atoi(optarg);
+			if (g_stats.interval_ms <= 0) {
+				err("invalid stats interval %s", optarg);
+				usage();
+				return 1;
+			}
+			break;
+		case OPT_RT_MAX_UNDERRUNS:
+		case OPT_RT_MAX_OVERRUNS:
+			rt_count = strtol(optarg, &end, 10);
+			if (*end || end == optarg || rt_count < 0 ||
+			    rt_count > INT_MAX) {
+				err("invalid count %s", optarg);
+				usage();
+				return 1;
+			}
+			if (opt == OPT_RT_MAX_UNDERRUNS)
+				rt_limits.max_underruns = rt_count;
+			else
+				rt_limits.max_overruns = rt_count;
+			render_realtime = true;
+			break;
+		case OPT_RT_MAX_LATE:
+		case OPT_RT_BUDGET:
+			if (!parse_duration(optarg, &rt_duration) ||
+			    rt_duration <= 0) {
+				err("invalid duration %s", optarg);
+				usage();
+				return 1;
+			}
+			if (opt == OPT_RT_MAX_LATE)
+				rt_limits.max_lateness = rt_duration * QD_MSECOND;
+			else
+				rt_limits.budget = rt_duration * QD_MSECOND;
+			render_realtime = true;
+			break;
+		case OPT_ADAPTIVE_BUFFER:
+			if (optarg && (!parse_duration(optarg, &rt_duration) ||
+				       rt_duration <= 0)) {
+				err("invalid duration %s", optarg);
+				usage();
+				return 1;
+			}
+			if (optarg)
+				buffer_policy.target_latency =
+					rt_duration * QD_MSECOND;
+			buffer_policy.enabled = true;
+			render_realtime = true;
+			break;
+		case OPT_CPU_STATS:
+			cpu_stats = true;
+			break;
 		default:
 			err("unknown option %c", opt);
 			usage();
@@ -473,24 +1267,40 @@ int main(int argc, char **argv)
 	if (optind < argc)
 		src_url[QD_INPUT_MAIN] = argv[optind];
 
-	if (optind + 1 < argc)
+	if (optind + 1 < argc && !playlist)
 		src_url[QD_INPUT_MAIN2] = argv[optind + 1];
 
 	qd_init();
 
+	if (trace_file && qd_trace_start(trace_file))
+		return 1;
+
 	if (kbd_enable)
 		kbd_enable = !pthread_create(&kbd_tid, NULL, kbd_thread, NULL);
 
 again:
-	/* init ffmpeg source and demuxer */
-	for (int i = 0; i < QD_MAX_INPUTS; i++)
-		src[i] = NULL;
+	loop_start_time = qd_get_time();
 
+	/* init ffmpeg source and demuxer, sources kept from the previous
+	 * loop only reopen their demuxer and reuse their modules */
 	for (int i = 0; i < QD_MAX_INPUTS; i++) {
 		if (!src_url[i])
 			continue;
 
-		src[i] = ffmpeg_src_create(src_url[i], src_format[i]);
+		if (src[i]) {
+			if (ffmpeg_src_reopen(src[i]))
+				return 1;
+			continue;
+		}
+
+		if (i == QD_INPUT_MAIN && playlist) {
+			src[i] = ffmpeg_src_create_playlist((const char * const *)
+							    argv + optind,
+							    argc - optind,
+							    src_format[i]);
+		} else {
+			src[i] = ffmpeg_src_create(src_url[i], src_format[i]);
+		}
 		if (!src[i])
 			return 1;
 	}
@@ -539,17 +1349,31 @@ again:
 
 		qd_session_configure_outputs(g_session, num_outputs, outputs);
 		qd_session_set_buffer_size_ms(g_session, 32);
+		qd_session_set_buffer_policy(g_session, &buffer_policy);
+		qd_session_set_swdec_format(g_session, swdec_format);
+		qd_session_set_cpu_stats(g_session, cpu_stats);
 		qd_session_set_output_discard_ms(g_session, discard_duration);
 		qd_session_set_realtime(g_session, render_realtime);
+		qd_session_set_realtime_limits(g_session, &rt_limits,
+					       handle_realtime_failed, NULL);
 		qd_session_set_dump_path(g_session, output_dir);
+		if (latency_log &&
+		    qd_session_set_latency_log(g_session, latency_log))
+			return 1;
+		if (g_stats.path && stats_start(&g_stats, g_session))
+			return 1;
 		if (kvpairs && qd_session_set_kvpairs(g_session, kvpairs))
 			return 1;
 	}
 
 	start_time = qd_get_time();
 
+	pthread_mutex_lock(&g_session->lock);
+	g_session->first_output_time = 0;
+	pthread_mutex_unlock(&g_session->lock);
+
 	/* setup primary source */
-	if (src[QD_INPUT_MAIN]) {
+	if (src[QD_INPUT_MAIN] && !src[QD_INPUT_MAIN]->n_streams) {
 		struct qd_input *input;
 
 		/* create primary QAP module */
@@ -571,7 +1395,7 @@ again:
 
 	/* setup additional sources */
 	for (int i = 0; i < QD_MAX_INPUTS; i++) {
-		if (i == QD_INPUT_MAIN || !src[i])
+		if (i == QD_INPUT_MAIN || !src[i] || src[i]->n_streams)
 			continue;
 		if (!ffmpeg_src_add_input(src[i], -1, g_session, i))
 			return 1;
@@ -598,6 +1422,10 @@ again:
 	/* wait for input threads to finish */
 	if (src[QD_INPUT_MAIN]) {
 		decode_err = ffmpeg_src_thread_join(src[QD_INPUT_MAIN]);
+
+		/* only the first item duration is known before playing */
+		if (playlist && src[QD_INPUT_MAIN]->end_pts > 0)
+			src_duration = src[QD_INPUT_MAIN]->end_pts;
 		if (decode_err)
 			quit = 1;
 		else {
@@ -616,8 +1444,9 @@ again:
 		ffmpeg_src_thread_join(src[i]);
 	}
 
-	/* cleanup */
-	for (int i = 0; i < QD_MAX_INPUTS; i++) {
+	/* cleanup, keep the sources around if there is another loop */
+	reuse = reuse_inputs && !quit && !decode_err && loops > 1;
+	for (int i = 0; i < QD_MAX_INPUTS && !reuse; i++) {
 		ffmpeg_src_destroy(src[i]);
 		src[i] = NULL;
 	}
@@ -625,8 +1454,28 @@ again:
 	end_time = qd_get_time();
 	cpu_time = get_cpu_time();
 
+	total_duration += src_duration;
+	total_elapsed += end_time - start_time;
+
+	pthread_mutex_lock(&g_session->lock);
+	startup_time = g_session->first_output_time;
+	pthread_mutex_unlock(&g_session->lock);
+
+	if (startup_time > 0) {
+		startup_time -= loop_start_time;
+
+		info("startup: first output after %" PRIu64 ".%03" PRIu64 "ms",
+		     startup_time / QD_MSECOND, startup_time % QD_MSECOND);
+
+		if (startup_count++ == 0)
+			startup_first = startup_time;
+		else
+			startup_total += startup_time;
+	}
+
 	for (int i = 0; i < QD_MAX_OUTPUTS; i++) {
 		struct qd_output *output;
+		struct qd_sw_decoder_stats swdec_stats;
 		uint64_t frames;
 		uint64_t duration;
 
@@ -643,14 +1492,59 @@ again:
 		     output->name, output->total_bytes, frames,
 		     output->total_bytes * 1000 / duration,
 		     frames * 1000000 / duration);
+
+		if (render_realtime) {
+			info("out: %s: realtime: %" PRIu64 " underruns, "
+			     "max lateness %" PRIu64 "us, %" PRIu64 " overruns",
+			     output->name, output->late_buffers,
+			     output->max_lateness, output->overruns);
+		}
+
+		if (!qd_output_get_swdec_stats(output, &swdec_stats) &&
+		    swdec_stats.packets > 0) {
+			info("out: %s: swdec: %" PRIu64 " packets, "
+			     "decode avg %" PRIu64 "us max %" PRIu64 "us, "
+			     "queue max depth %u, max wait %" PRIu64 "us, "
+			     "full %" PRIu64 " times",
+			     output->name, swdec_stats.packets,
+			     swdec_stats.decode_time / swdec_stats.packets,
+			     swdec_stats.max_decode_time,
+			     swdec_stats.max_queue_depth,
+			     swdec_stats.max_queue_time,
+			     swdec_stats.queue_full);
+		}
 	}
 
+	if (qd_log_enabled(2))
+		print_session_stats(g_session);
+
 	if (!quit && --loops > 0)
 		goto again;
 
+	/* media duration when known, so that percentages do not depend on
+	 * the render speed */
+	if (qd_log_enabled(2))
+		print_cpu_stats(g_session, total_duration > 0 && !quit ?
+				total_duration : total_elapsed);
+
+	if (qd_log_enabled(2))
+		print_mem_stats(g_session);
+
+	stats_stop(&g_stats);
+
 	qd_session_destroy(g_session);
 	g_session = NULL;
 
+	qd_trace_stop();
+
+	if (startup_count > 1) {
+		notice("Startup: first loop %" PRIu64 "ms, "
+		       "next loops %" PRIu64 "ms average%s",
+		       startup_first / QD_MSECOND,
+		       startup_total / (startup_count - 1) / QD_MSECOND,
+		       reuse_inputs ? "" : " (no reuse)");
+	}
+
 	if (!quit) {
 		if (src_duration > 0) {
 			notice("Elapsed: %" PRIu64 ".%" PRIu64 "s, "
@@ -672,5 +1566,10 @@ again:
 		pthread_join(kbd_tid, NULL);
 	}
 
+	if (rt_failed) {
+		err("realtime constraints not met");
+		return 1;
+	}
+
 	return decode_err;
 }
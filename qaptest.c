@@ -3,6 +3,10 @@
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
 #include <math.h>
 #include <complex.h>
 #include <fftw3.h>
@@ -10,6 +14,7 @@
 #include "munit.h"
 
 #include "qd.h"
+#include "audio_analysis.h"
 
 static const char *
 resolve_test_file(const char *filename)
@@ -17,6 +22,10 @@ resolve_test_file(const char *filename)
 	static char buf[PATH_MAX];
 	const char *tests_dir;
 
+	/* synthetic test vectors, generated on first use */
+	if (qd_gen_is_spec(filename))
+		return qd_gen_file(filename, buf, sizeof (buf)) ? NULL : buf;
+
 	tests_dir = getenv("TESTS_DIR");
 	if (!tests_dir)
 		tests_dir = ".";
@@ -25,6 +34,13 @@ resolve_test_file(const char *filename)
 	return buf;
 }
 
+/* generated equivalents of the Ref_997_200_48k_20dB conformance streams,
+ * a 997Hz tone at -20dBFS on L/R */
+#define GEN_REF_997_DDP \
+	"gen:tone:codec=eac3:freq=997:gain=-20:duration=60"
+#define GEN_REF_997_AAC \
+	"gen:tone:codec=aac:freq=997:gain=-20:duration=60"
+
 struct input_desc {
 	const char *alias;
 	enum qd_input_id input_id;
@@ -61,20 +77,38 @@ static inline bool
 int16_is_silence(int16_t *samples, size_t count)
 {
 	for (size_t i = 0; i < count; i++) {
-		if (samples[i] > 15 || samples[i] < -15)
+		if (samples[i] > AUDIO_SILENCE_THRESHOLD_S16 ||
+		    samples[i] < -AUDIO_SILENCE_THRESHOLD_S16)
 			return false;
 	}
 	return true;
 }
 
+/* number of leading silent frames in a buffer, looking at channels [first,
+ * first + count) */
+static inline size_t
+int16_silent_frames(const int16_t *data, size_t n_frames, int channels,
+		    int first, int count)
+{
+	return audio_find_non_silent_s16(data, n_frames, channels, first, count,
+					 AUDIO_SILENCE_THRESHOLD_S16);
+}
+
 /*
  * Helper to measure peak frequency and gain of a single channel of audio data
+ *
+ * FFT plans and window tables only depend on the window size, so they are
+ * shared by all analyzers of the same size and kept until the end of the
+ * test. Plans are made with FFTW_MEASURE, the resulting wisdom is saved
+ * to $FFTW_WISDOM (/tmp/qaptest.wisdom by default) so that measuring only
+ * happens on the first run.
  */
 
 enum window {
 	WIN_RECT = 0,
 	WIN_HANN,
 	WIN_HAMMING,
+	WIN_COUNT,
 };
 
 static double hann(double v, unsigned int n)
@@ -87,11 +121,142 @@ static double hamming(double v, unsigned int n)
 	return 0.54 - 0.46 * cos(2.0 * M_PI * v / (double)(n - 1));
 }
 
+#define FFT_MAX_PLANS	4
+
+struct fft_plan {
+	size_t n_samples;
+	fftw_plan plan;
+	double *windows[WIN_COUNT];
+};
+
+static struct fft_plan fft_plans[FFT_MAX_PLANS];
+static int n_fft_plans;
+static bool fft_wisdom_loaded;
+static pthread_mutex_t fft_plans_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static const char *
+fft_wisdom_path(void)
+{
+	const char *path = getenv("FFTW_WISDOM");
+
+	return path ? path : "/tmp/qaptest.wisdom";
+}
+
+/* concurrent qaptest jobs may save wisdom at the same time, write a
+ * temporary file and rename it */
+static void
+fft_wisdom_save(void)
+{
+	const char *path = fft_wisdom_path();
+	char tmp[PATH_MAX];
+
+	snprintf(tmp, sizeof (tmp), "%s.%d", path, getpid());
+
+	if (!fftw_export_wisdom_to_filename(tmp) || rename(tmp, path) < 0) {
+		unlink(tmp);
+		info("fft: unable to save wisdom to %s", path);
+	}
+}
+
+static struct fft_plan *
+fft_plan_get(size_t n_samples, enum window window)
+{
+	struct fft_plan *fp = NULL;
+	double *rdata = NULL;
+	complex double *idata = NULL;
+	double *table;
+
+	pthread_mutex_lock(&fft_plans_lock);
+
+	for (int i = 0; i < n_fft_plans; i++) {
+		if (fft_plans[i].n_samples == n_samples)
+			fp = &fft_plans[i];
+	}
+
+	if (!fp) {
+		if (n_fft_plans == FFT_MAX_PLANS)
+			goto fail;
+
+		if (!fft_wisdom_loaded) {
+			fftw_import_wisdom_from_filename(fft_wisdom_path());
+			fft_wisdom_loaded = true;
+		}
+
+		/* FFTW_MEASURE overwrites the arrays while planning, the
+		 * analyzers then execute the plan on their own buffers */
+		rdata = fftw_malloc(n_samples * sizeof (*rdata));
+		idata = fftw_malloc((n_samples / 2 + 1) * sizeof (*idata));
+		if (!rdata || !idata)
+			goto fail;
+
+		fp = &fft_plans[n_fft_plans];
+		fp->plan = fftw_plan_dft_r2c_1d(n_samples, rdata, idata,
+						FFTW_MEASURE |
+						FFTW_WISDOM_ONLY);
+		if (!fp->plan) {
+			info("fft: measuring %zu samples plan", n_samples);
+			fp->plan = fftw_plan_dft_r2c_1d(n_samples, rdata, idata,
+							FFTW_MEASURE);
+			if (!fp->plan)
+				goto fail;
+
+			fft_wisdom_save();
+		}
+
+		fp->n_samples = n_samples;
+		n_fft_plans++;
+
+		fftw_free(rdata);
+		fftw_free(idata);
+		rdata = NULL;
+		idata = NULL;
+	}
+
+	if (window != WIN_RECT && !fp->windows[window]) {
+		if (!(table = malloc(n_samples * sizeof (*table))))
+			goto fail;
+
+		for (size_t i = 0; i < n_samples; i++) {
+			table[i] = window == WIN_HANN ? hann(i, n_samples) :
+				hamming(i, n_samples);
+		}
+
+		fp->windows[window] = table;
+	}
+
+	pthread_mutex_unlock(&fft_plans_lock);
+
+	return fp;
+
+fail:
+	pthread_mutex_unlock(&fft_plans_lock);
+	fftw_free(rdata);
+	fftw_free(idata);
+	return NULL;
+}
+
+static void
+fft_plans_cleanup(void)
+{
+	pthread_mutex_lock(&fft_plans_lock);
+
+	for (int i = 0; i < n_fft_plans; i++) {
+		fftw_destroy_plan(fft_plans[i].plan);
+		for (int w = 0; w < WIN_COUNT; w++)
+			free(fft_plans[i].windows[w]);
+	}
+
+	memset(fft_plans, 0, sizeof (fft_plans));
+	n_fft_plans = 0;
+
+	pthread_mutex_unlock(&fft_plans_lock);
+}
+
 struct peak_analyzer {
 	int sample_rate;
 	size_t n_samples;
 	size_t max_samples;
-	enum window window;;
+	const double *window;
 	double *rdata;
 	complex double *idata;
 	fftw_plan plan;
@@ -100,31 +265,33 @@ struct peak_analyzer {
 static void
 peak_analyzer_cleanup(struct peak_analyzer *pa)
 {
-	free(pa->plan);
-	free(pa->rdata);
-	free(pa->idata);
+	/* the plan is shared, see fft_plans_cleanup() */
+	fftw_free(pa->rdata);
+	fftw_free(pa->idata);
 }
 
 static int
 peak_analyzer_init(struct peak_analyzer *pa, int sample_rate, size_t n_samples,
 		   enum window window)
 {
+	struct fft_plan *fp;
+
 	memset(pa, 0, sizeof (*pa));
 
 	pa->sample_rate = sample_rate;
 	pa->max_samples = n_samples;
 	pa->rdata = fftw_malloc(n_samples * sizeof (*pa->rdata));
-	pa->idata = fftw_malloc(n_samples * sizeof (*pa->idata));
-	pa->window = window;
+	pa->idata = fftw_malloc((n_samples / 2 + 1) * sizeof (*pa->idata));
 
 	if (!pa->rdata || !pa->idata)
 		goto fail;
 
-	pa->plan = fftw_plan_dft_r2c_1d(n_samples, pa->rdata, pa->idata,
-					FFTW_ESTIMATE);
-	if (!pa->plan)
+	if (!(fp = fft_plan_get(n_samples, window)))
 		goto fail;
 
+	pa->plan = fp->plan;
+	pa->window = fp->windows[window];
+
 	return 0;
 
 fail:
@@ -141,24 +308,40 @@ peak_analyzer_add_samples(struct peak_analyzer *pa,
 	avail = pa->max_samples - pa->n_samples;
 	n_samples = QD_MIN(n_samples, avail);
 
-	for (size_t i = 0; i < n_samples; i++) {
-		double d = samples[i] / 32768.0;
-		switch (pa->window) {
-		case WIN_RECT:
-			break;
-		case WIN_HANN:
-			d *= hann(pa->n_samples, pa->max_samples);
-			break;
-		case WIN_HAMMING:
-			d *= hamming(pa->n_samples, pa->max_samples);
-			break;
-		}
-		pa->rdata[pa->n_samples++] = d;
+	if (pa->window) {
+		const double *w = pa->window + pa->n_samples;
+
+		for (size_t i = 0; i < n_samples; i++)
+			pa->rdata[pa->n_samples++] = samples[i] / 32768.0 * w[i];
+	} else {
+		for (size_t i = 0; i < n_samples; i++)
+			pa->rdata[pa->n_samples++] = samples[i] / 32768.0;
 	}
 
 	return n_samples;
 }
 
+/* feed one channel of interleaved frames */
+static size_t
+peak_analyzer_add_frames(struct peak_analyzer *pa, const int16_t *data,
+			 size_t n_frames, int stride)
+{
+	size_t avail;
+
+	avail = pa->max_samples - pa->n_samples;
+	n_frames = QD_MIN(n_frames, avail);
+
+	for (size_t i = 0; i < n_frames; i++, data += stride) {
+		double d = *data / 32768.0;
+
+		if (pa->window)
+			d *= pa->window[pa->n_samples];
+		pa->rdata[pa->n_samples++] = d;
+	}
+
+	return n_frames;
+}
+
 static bool
 peak_analyzer_run(struct peak_analyzer *pa,
 		  double *out_peak_freq,
@@ -168,7 +351,7 @@ peak_analyzer_run(struct peak_analyzer *pa,
 	int n_samples;
 
 	assert(pa->n_samples == pa->max_samples);
-	fftw_execute(pa->plan);
+	fftw_execute_dft_r2c(pa->plan, pa->rdata, pa->idata);
 
 	n_samples = pa->n_samples / 2;
 	for (int i = 1; i < n_samples; i++) {
@@ -197,6 +380,354 @@ peak_analyzer_run(struct peak_analyzer *pa,
 	return true;
 }
 
+/*
+ * Helper to check a known tone is present in interleaved audio data
+ *
+ * A bank of Goertzel filters, one per DFT bin of the window around the
+ * expected frequency range, runs on every analyzed channel. The filters of a
+ * channel are packed in vectors of doubles and updated together, so whole
+ * buffers are processed without any per-sample call. The total energy of each
+ * channel is accumulated alongside, to check the tone accounts for most of
+ * the signal.
+ */
+
+#define TONE_MAX_CHANNELS	8
+#define TONE_MAX_BINS		16
+#define TONE_VEC_SIZE		4
+#define TONE_MAX_VECS		(TONE_MAX_BINS / TONE_VEC_SIZE)
+
+/* bins added on each side of the range, catching the leakage of a tone
+ * falling between two bins */
+#define TONE_GUARD_BINS		1
+
+/* energy outside the tone bins, relative to the tone */
+#define TONE_MAX_OOB_DB		-10.0
+
+typedef double tone_vec __attribute__((vector_size(TONE_VEC_SIZE * sizeof (double))));
+
+struct tone_bank {
+	tone_vec s1[TONE_MAX_VECS];
+	tone_vec s2[TONE_MAX_VECS];
+	double energy;
+};
+
+struct tone_detector {
+	int sample_rate;
+	int channels;
+	size_t n_samples;
+	size_t max_samples;
+	int n_bins;
+	int n_vecs;
+	double bin_freq[TONE_MAX_BINS];
+	tone_vec coef[TONE_MAX_VECS];
+	struct tone_bank banks[TONE_MAX_CHANNELS];
+};
+
+static void
+tone_detector_reset(struct tone_detector *td)
+{
+	memset(td->banks, 0, sizeof (td->banks));
+	td->n_samples = 0;
+}
+
+static int
+tone_detector_init(struct tone_detector *td, int sample_rate, size_t n_samples,
+		   int channels, double freq_lo, double freq_hi)
+{
+	double bin_width = sample_rate / (double)n_samples;
+	long k_lo, k_hi;
+
+	memset(td, 0, sizeof (*td));
+
+	/* bins of the DFT window covering the frequency range */
+	k_lo = lround(freq_lo / bin_width) - TONE_GUARD_BINS;
+	k_hi = lround(freq_hi / bin_width) + TONE_GUARD_BINS;
+
+	if (channels > TONE_MAX_CHANNELS || k_lo < 1 ||
+	    k_hi - k_lo + 1 > TONE_MAX_BINS)
+		return -1;
+
+	td->sample_rate = sample_rate;
+	td->channels = channels;
+	td->max_samples = n_samples;
+	td->n_bins = k_hi - k_lo + 1;
+	td->n_vecs = (td->n_bins + TONE_VEC_SIZE - 1) / TONE_VEC_SIZE;
+
+	/* padding lanes are left with a zero coefficient, never read back */
+	for (int i = 0; i < td->n_bins; i++) {
+		td->bin_freq[i] = (k_lo + i) * bin_width;
+		td->coef[i / TONE_VEC_SIZE][i % TONE_VEC_SIZE] =
+			2.0 * cos(2.0 * M_PI * (k_lo + i) / n_samples);
+	}
+
+	return 0;
+}
+
+/* feed frames of stride interleaved channels, the first td->channels being
+ * analyzed, up to the end of the window */
+static size_t
+tone_detector_add_frames(struct tone_detector *td, const int16_t *data,
+			 size_t n_frames, int stride)
+{
+	size_t avail;
+
+	avail = td->max_samples - td->n_samples;
+	n_frames = QD_MIN(n_frames, avail);
+
+	/* samples are kept unscaled, see tone_detector_run() */
+	for (size_t i = 0; i < n_frames; i++, data += stride) {
+		for (int c = 0; c < td->channels; c++) {
+			struct tone_bank *bank = &td->banks[c];
+			double x = data[c];
+
+			for (int v = 0; v < td->n_vecs; v++) {
+				tone_vec s0 = x + td->coef[v] * bank->s1[v] -
+					bank->s2[v];
+
+				bank->s2[v] = bank->s1[v];
+				bank->s1[v] = s0;
+			}
+
+			bank->energy += x * x;
+		}
+	}
+
+	td->n_samples += n_frames;
+
+	return n_frames;
+}
+
+static bool
+tone_detector_ready(const struct tone_detector *td)
+{
+	return td->n_samples == td->max_samples;
+}
+
+/* returns true if the tone is audible on the channel and dominates the rest
+ * of the signal, reporting the strongest bin and its gain, normalized like an
+ * FFT peak */
+static bool
+tone_detector_run(const struct tone_detector *td, int channel,
+		  double *out_freq, double *out_gain)
+{
+	const struct tone_bank *bank = &td->banks[channel];
+	const double scale = 1.0 / (32768.0 * 32768.0);
+	double peak_freq = 0, peak_power = 0;
+	double tone_energy = 0, oob_energy;
+	double half = td->n_samples / 2.0;
+	double gain;
+
+	assert(td->n_samples == td->max_samples);
+
+	for (int b = 0; b < td->n_bins; b++) {
+		double s1 = bank->s1[b / TONE_VEC_SIZE][b % TONE_VEC_SIZE];
+		double s2 = bank->s2[b / TONE_VEC_SIZE][b % TONE_VEC_SIZE];
+		double coef = td->coef[b / TONE_VEC_SIZE][b % TONE_VEC_SIZE];
+		double power = (s1 * s1 + s2 * s2 - coef * s1 * s2) * scale;
+
+		/* a bin and its mirror hold 2 |X|^2 / N of the signal energy */
+		tone_energy += 2.0 * power / td->n_samples;
+
+		if (power > peak_power) {
+			peak_power = power;
+			peak_freq = td->bin_freq[b];
+		}
+	}
+
+	gain = 10 * log10(peak_power / (half * half));
+	if (gain < -60.0)
+		return false;
+
+	oob_energy = QD_MAX(bank->energy * scale - tone_energy, 1e-12);
+	if (10 * log10(oob_energy / tone_energy) > TONE_MAX_OOB_DB)
+		return false;
+
+	if (out_freq)
+		*out_freq = peak_freq;
+	if (out_gain)
+		*out_gain = gain;
+
+	return true;
+}
+
+/*
+ * Helper to measure the level of output channels
+ *
+ * The peak, RMS and DC offset of each PCM output buffer are measured, and
+ * every buffer is checked for a DC offset. The RMS of the first channels is
+ * accumulated over the same window as a tone detector, so that the level of
+ * a pure tone can be compared with the gain found by the detector.
+ */
+
+#define LEVEL_MAX_CHANNELS	2
+
+/* DC offset allowed on a buffer, relative to full scale, leaving room for
+ * the residue of partial tone periods */
+#define LEVEL_MAX_DC		0.01
+
+struct level_meter {
+	double sum_sq[LEVEL_MAX_CHANNELS];
+	size_t n_frames;
+};
+
+static void
+level_meter_reset(struct level_meter *lm)
+{
+	memset(lm, 0, sizeof (*lm));
+}
+
+static void
+level_meter_add(struct level_meter *lm, struct qd_output *output,
+		qap_audio_buffer_t *buffer)
+{
+	const void *data = buffer->common_params.data;
+	int channels = output->config.channels;
+	struct audio_levels levels;
+	size_t n_frames;
+
+	n_frames = buffer->common_params.size /
+		(channels * output->config.bit_width / 8);
+
+	if (output->config.bit_width == 32)
+		assert_int(0, ==, audio_get_levels_s32(data, n_frames,
+						       channels, &levels));
+	else
+		assert_int(0, ==, audio_get_levels_s16(data, n_frames,
+						       channels, &levels));
+
+	if (!audio_levels_check_dc(&levels, LEVEL_MAX_DC)) {
+		for (int c = 0; c < channels; c++) {
+			if (fabs(levels.dc[c]) > LEVEL_MAX_DC)
+				munit_errorf("%s: ch=%d dc offset %lg at "
+					     "pts %" PRIu64, output->name, c,
+					     levels.dc[c], output->pts);
+		}
+	}
+
+	for (int c = 0; c < QD_MIN(channels, LEVEL_MAX_CHANNELS); c++)
+		lm->sum_sq[c] += levels.rms[c] * levels.rms[c] * n_frames;
+	lm->n_frames += n_frames;
+}
+
+/* level of a sine wave, in dB relative to full scale amplitude as reported
+ * by the tone detector */
+static double
+level_meter_tone_db(const struct level_meter *lm, int channel)
+{
+	double rms;
+
+	if (lm->n_frames == 0)
+		return -INFINITY;
+
+	rms = sqrt(lm->sum_sq[channel] / lm->n_frames);
+
+	return 20 * log10(rms * M_SQRT2);
+}
+
+/*
+ * Helper to locate a known marker in captured audio data
+ *
+ * The capture is cross-correlated with the reference marker in the frequency
+ * domain, the peak position is refined to a fraction of sample by fitting a
+ * parabola on its neighbours. The peak is normalized by the energy of the
+ * reference and of the matching part of the capture, so that gain changes do
+ * not matter, only the marker shape.
+ */
+
+static bool
+marker_find(const int16_t *data, size_t n_samples, const float *ref,
+	    size_t ref_samples, double *out_lag, double *out_ncc)
+{
+	fftw_plan fwd = NULL, bwd = NULL;
+	complex double *cdata = NULL, *cref = NULL;
+	double *rdata = NULL;
+	double ref_energy = 0, data_energy = 0;
+	double peak = -INFINITY, lag, ncc;
+	size_t n = 1, peak_idx = 0;
+	bool ret = false;
+
+	if (n_samples < ref_samples || ref_samples == 0)
+		return false;
+
+	/* zero padded to avoid circular wrapping */
+	while (n < n_samples + ref_samples)
+		n <<= 1;
+
+	rdata = fftw_malloc(n * sizeof (*rdata));
+	cdata = fftw_malloc((n / 2 + 1) * sizeof (*cdata));
+	cref = fftw_malloc((n / 2 + 1) * sizeof (*cref));
+	if (!rdata || !cdata || !cref)
+		goto out;
+
+	/* planning is not thread-safe, one-off plans are only estimated */
+	pthread_mutex_lock(&fft_plans_lock);
+	fwd = fftw_plan_dft_r2c_1d(n, rdata, cdata, FFTW_ESTIMATE);
+	bwd = fftw_plan_dft_c2r_1d(n, cdata, rdata, FFTW_ESTIMATE);
+	pthread_mutex_unlock(&fft_plans_lock);
+	if (!fwd || !bwd)
+		goto out;
+
+	for (size_t i = 0; i < n; i++)
+		rdata[i] = i < ref_samples ? ref[i] : 0;
+	fftw_execute_dft_r2c(fwd, rdata, cref);
+
+	for (size_t i = 0; i < n; i++)
+		rdata[i] = i < n_samples ? data[i] / 32768.0 : 0;
+	fftw_execute_dft_r2c(fwd, rdata, cdata);
+
+	for (size_t i = 0; i < n / 2 + 1; i++)
+		cdata[i] *= conj(cref[i]);
+	fftw_execute_dft_c2r(bwd, cdata, rdata);
+
+	/* only lags where the whole marker fits in the capture */
+	for (size_t i = 0; i <= n_samples - ref_samples; i++) {
+		if (rdata[i] > peak) {
+			peak = rdata[i];
+			peak_idx = i;
+		}
+	}
+
+	lag = peak_idx;
+	if (peak_idx > 0 && peak_idx < n_samples - ref_samples) {
+		double y0 = rdata[peak_idx - 1];
+		double y2 = rdata[peak_idx + 1];
+		double d = y0 - 2 * peak + y2;
+
+		if (d < 0)
+			lag += 0.5 * (y0 - y2) / d;
+	}
+
+	for (size_t i = 0; i < ref_samples; i++) {
+		double v = data[peak_idx + i] / 32768.0;
+
+		ref_energy += ref[i] * ref[i];
+		data_energy += v * v;
+	}
+
+	/* the inverse transform is not normalized */
+	ncc = peak / n / sqrt(QD_MAX(ref_energy * data_energy, 1e-24));
+
+	if (out_lag)
+		*out_lag = lag;
+	if (out_ncc)
+		*out_ncc = ncc;
+
+	ret = true;
+
+out:
+	pthread_mutex_lock(&fft_plans_lock);
+	if (fwd)
+		fftw_destroy_plan(fwd);
+	if (bwd)
+		fftw_destroy_plan(bwd);
+	pthread_mutex_unlock(&fft_plans_lock);
+	fftw_free(rdata);
+	fftw_free(cdata);
+	fftw_free(cref);
+
+	return ret;
+}
+
 //*****************************************************************************
 // MS12 Tests
 //*****************************************************************************
@@ -253,6 +784,13 @@ pretest_ms12(const MunitParameter params[], void* user_data)
 	return NULL;
 }
 
+/* runs in the process of the test, which munit forks for each test */
+static void
+posttest_ms12(void *fixture)
+{
+	fft_plans_cleanup();
+}
+
 /* setup an MS12 session with common input parameters:
  *   - session type
  *   - outputs configuration
@@ -329,74 +867,574 @@ setup_ms12_session(const MunitParameter params[])
 }
 
 /*
- * MS12: test runtime input channel config changes
+ * Golden outputs
  *
- * Input files include multiple channel configuration, changing every few
- * seconds. Verify the sequence of reported input configurations matches the
- * actual data in the files. Each reported configuration is recorded and the
- * result is checked after the full file has been played out.
+ * With $GOLDEN_DIR set, tests attaching a golden recorder to their session
+ * hash every block of 1024 frames of each PCM output, and compute a coarse
+ * fingerprint of its spectrum: the energy of 16 log-spaced bands, in 3dB
+ * steps. Blocks are compared on the fly against the golden file of the test
+ * and its parameters, and the first diverging block of each output is
+ * reported with its output timestamp.
+ *
+ * Outputs must match bit for bit, or only in their fingerprints with
+ * GOLDEN_SPECTRAL=1. A missing golden file is recorded by the run, and
+ * GOLDEN_REFRESH=1 records the whole golden set again.
  */
 
-static const qap_input_config_t chid_swp_dd_configs[] = {
-	{ .channels = 1, .ch_map = { QAP_AUDIO_PCM_CHANNEL_C } },
-	{ .channels = 2, .ch_map = { QAP_AUDIO_PCM_CHANNEL_L,
-				     QAP_AUDIO_PCM_CHANNEL_R } },
-	{ .channels = 3, .ch_map = { QAP_AUDIO_PCM_CHANNEL_L,
-				     QAP_AUDIO_PCM_CHANNEL_R,
-				     QAP_AUDIO_PCM_CHANNEL_MS } },
-	{ .channels = 4, .ch_map = { QAP_AUDIO_PCM_CHANNEL_L,
-				     QAP_AUDIO_PCM_CHANNEL_R,
-				     QAP_AUDIO_PCM_CHANNEL_LS,
-				     QAP_AUDIO_PCM_CHANNEL_RS } },
-	{ .channels = 3, .ch_map = { QAP_AUDIO_PCM_CHANNEL_L,
-				     QAP_AUDIO_PCM_CHANNEL_C,
-				     QAP_AUDIO_PCM_CHANNEL_R } },
-	{ .channels = 4, .ch_map = { QAP_AUDIO_PCM_CHANNEL_L,
-				     QAP_AUDIO_PCM_CHANNEL_C,
-				     QAP_AUDIO_PCM_CHANNEL_R,
-				     QAP_AUDIO_PCM_CHANNEL_MS } },
-	{ .channels = 5, .ch_map = { QAP_AUDIO_PCM_CHANNEL_L,
-				     QAP_AUDIO_PCM_CHANNEL_C,
-				     QAP_AUDIO_PCM_CHANNEL_R,
-				     QAP_AUDIO_PCM_CHANNEL_LS,
-				     QAP_AUDIO_PCM_CHANNEL_RS } },
-	{ .channels = 6, .ch_map = { QAP_AUDIO_PCM_CHANNEL_L,
-				     QAP_AUDIO_PCM_CHANNEL_C,
-				     QAP_AUDIO_PCM_CHANNEL_R,
-				     QAP_AUDIO_PCM_CHANNEL_LS,
-				     QAP_AUDIO_PCM_CHANNEL_RS,
-				     QAP_AUDIO_PCM_CHANNEL_LFE } },
+#define GOLDEN_VERSION		1
+#define GOLDEN_BLOCK_FRAMES	1024
+#define GOLDEN_BANDS		16
+#define GOLDEN_DB_STEP		3
+#define GOLDEN_DB_FLOOR		-120
+
+struct golden_block {
+	uint64_t pts;
+	int channels;
+	uint64_t digest;
+	uint8_t fp[GOLDEN_BANDS];
 };
 
-static const qap_input_config_t chid_swp_aac_configs[] = {
-	{ .channels = 1, .ch_map = { QAP_AUDIO_PCM_CHANNEL_C } },
-	{ .channels = 2, .ch_map = { QAP_AUDIO_PCM_CHANNEL_L,
-				     QAP_AUDIO_PCM_CHANNEL_R } },
-	{ .channels = 3, .ch_map = { QAP_AUDIO_PCM_CHANNEL_L,
-				     QAP_AUDIO_PCM_CHANNEL_R,
-				     QAP_AUDIO_PCM_CHANNEL_CS } },
-	{ .channels = 4, .ch_map = { QAP_AUDIO_PCM_CHANNEL_L,
-				     QAP_AUDIO_PCM_CHANNEL_R,
-				     QAP_AUDIO_PCM_CHANNEL_LB,
-				     QAP_AUDIO_PCM_CHANNEL_RB } },
-	{ .channels = 3, .ch_map = { QAP_AUDIO_PCM_CHANNEL_L,
-				     QAP_AUDIO_PCM_CHANNEL_R,
-				     QAP_AUDIO_PCM_CHANNEL_C } },
-	{ .channels = 4, .ch_map = { QAP_AUDIO_PCM_CHANNEL_L,
-				     QAP_AUDIO_PCM_CHANNEL_R,
-				     QAP_AUDIO_PCM_CHANNEL_C,
-				     QAP_AUDIO_PCM_CHANNEL_CS } },
-	{ .channels = 5, .ch_map = { QAP_AUDIO_PCM_CHANNEL_L,
-				     QAP_AUDIO_PCM_CHANNEL_R,
-				     QAP_AUDIO_PCM_CHANNEL_C,
-				     QAP_AUDIO_PCM_CHANNEL_LB,
-				     QAP_AUDIO_PCM_CHANNEL_RB } },
-	{ .channels = 6, .ch_map = { QAP_AUDIO_PCM_CHANNEL_L,
-				     QAP_AUDIO_PCM_CHANNEL_R,
-				     QAP_AUDIO_PCM_CHANNEL_C,
-				     QAP_AUDIO_PCM_CHANNEL_LFE,
-				     QAP_AUDIO_PCM_CHANNEL_LB,
-				     QAP_AUDIO_PCM_CHANNEL_RB } },
+struct golden_output {
+	/* reference blocks, or blocks of this run when recording */
+	struct golden_block *blocks;
+	size_t n_blocks;
+	size_t max_blocks;
+	size_t n_checked;
+	bool diverged;
+
+	/* block being filled */
+	uint8_t *data;
+	size_t frame_size;
+	size_t n_frames;
+	uint64_t pts;
+	int channels;
+	int bit_width;
+	int sample_rate;
+};
+
+struct golden {
+	pthread_mutex_t lock;
+	char path[PATH_MAX];
+	bool record;
+	bool spectral;
+	bool failed;
+	struct peak_analyzer pa;
+	int band_edges[GOLDEN_BANDS + 1];
+	struct golden_output outputs[QD_MAX_OUTPUTS];
+
+	/* output callback of the test */
+	qd_output_func_t output_cb_func;
+	void *output_cb_data;
+};
+
+static bool
+env_enabled(const char *name)
+{
+	const char *v = getenv(name);
+
+	return v && *v && strcmp(v, "0") != 0;
+}
+
+static uint64_t
+golden_hash(const uint8_t *data, size_t size)
+{
+	uint64_t hash = UINT64_C(0xcbf29ce484222325);
+
+	for (size_t i = 0; i < size; i++) {
+		hash ^= data[i];
+		hash *= UINT64_C(0x100000001b3);
+	}
+
+	return hash;
+}
+
+/* mono mix of the block, in 3dB steps below full scale per band */
+static void
+golden_fingerprint(struct golden *g, struct golden_output *out,
+		   uint8_t *fp)
+{
+	struct peak_analyzer *pa = &g->pa;
+	int n_bins = GOLDEN_BLOCK_FRAMES / 2;
+
+	for (size_t i = 0; i < GOLDEN_BLOCK_FRAMES; i++) {
+		const uint8_t *frame = out->data + i * out->frame_size;
+		double sum = 0;
+
+		for (int c = 0; c < out->channels; c++) {
+			if (out->bit_width == 16)
+				sum += ((const int16_t *)frame)[c] / 32768.0;
+			else
+				sum += ((const int32_t *)frame)[c] / 2147483648.0;
+		}
+
+		pa->rdata[i] = sum / out->channels * pa->window[i];
+	}
+
+	fftw_execute_dft_r2c(pa->plan, pa->rdata, pa->idata);
+
+	for (int b = 0; b < GOLDEN_BANDS; b++) {
+		double energy = 0;
+		double db;
+
+		for (int i = g->band_edges[b]; i < g->band_edges[b + 1]; i++) {
+			complex double di = pa->idata[i] / n_bins;
+
+			energy += creal(di) * creal(di) + cimag(di) * cimag(di);
+		}
+
+		db = energy > 0 ? 10 * log10(energy) : GOLDEN_DB_FLOOR;
+		db = QD_MIN(QD_MAX(db, GOLDEN_DB_FLOOR), 0);
+		fp[b] = lrint(-db / GOLDEN_DB_STEP);
+	}
+}
+
+static void
+golden_band_freqs(const struct golden *g, const struct golden_output *out,
+		  int band, int *low, int *high)
+{
+	*low = g->band_edges[band] * out->sample_rate / GOLDEN_BLOCK_FRAMES;
+	*high = g->band_edges[band + 1] * out->sample_rate / GOLDEN_BLOCK_FRAMES;
+}
+
+static void
+golden_check_block(struct golden *g, struct qd_output *output,
+		   struct golden_output *out, const struct golden_block *blk)
+{
+	const struct golden_block *ref;
+	int max_diff = 0;
+	int band = 0;
+	bool match;
+
+	if (out->diverged)
+		return;
+
+	if (out->n_checked >= out->n_blocks) {
+		munit_logf(MUNIT_LOG_ERROR,
+			   "golden: out %s: diverges at %0.3fs, "
+			   "output is longer than golden (%zu blocks)",
+			   output->name, blk->pts / (double)QD_SECOND,
+			   out->n_blocks);
+		out->diverged = true;
+		g->failed = true;
+		return;
+	}
+
+	ref = &out->blocks[out->n_checked];
+
+	for (int b = 0; b < GOLDEN_BANDS; b++) {
+		int diff = abs(blk->fp[b] - ref->fp[b]);
+
+		if (diff > max_diff) {
+			max_diff = diff;
+			band = b;
+		}
+	}
+
+	/* a level right on a step boundary may round either way */
+	if (g->spectral)
+		match = blk->channels == ref->channels && max_diff <= 1;
+	else
+		match = blk->channels == ref->channels &&
+			blk->digest == ref->digest;
+
+	if (!match) {
+		int low, high;
+
+		golden_band_freqs(g, out, band, &low, &high);
+		munit_logf(MUNIT_LOG_ERROR,
+			   "golden: out %s: diverges at %0.3fs (block %zu, "
+			   "golden %0.3fs): %d/%d channels, spectrum off by "
+			   "up to %ddB in %d-%dHz",
+			   output->name, blk->pts / (double)QD_SECOND,
+			   out->n_checked, ref->pts / (double)QD_SECOND,
+			   blk->channels, ref->channels,
+			   max_diff * GOLDEN_DB_STEP, low, high);
+		out->diverged = true;
+		g->failed = true;
+	}
+}
+
+static void
+golden_add_block(struct golden *g, struct qd_output *output,
+		 struct golden_output *out)
+{
+	struct golden_block blk = {
+		.pts = out->pts,
+		.channels = out->channels,
+	};
+
+	blk.digest = golden_hash(out->data, out->n_frames * out->frame_size);
+	golden_fingerprint(g, out, blk.fp);
+
+	if (g->record) {
+		if (out->n_blocks == out->max_blocks) {
+			size_t max = QD_MAX(out->max_blocks * 2, 1024);
+			struct golden_block *blocks;
+
+			blocks = realloc(out->blocks, max * sizeof (*blocks));
+			assert_not_null(blocks);
+
+			out->blocks = blocks;
+			out->max_blocks = max;
+		}
+
+		out->blocks[out->n_blocks++] = blk;
+	} else {
+		golden_check_block(g, output, out, &blk);
+	}
+
+	out->n_checked++;
+}
+
+static void
+golden_output_cb(struct qd_output *output, qap_audio_buffer_t *buffer,
+		 void *userdata)
+{
+	struct golden *g = userdata;
+	struct golden_output *out = &g->outputs[output->id];
+	const uint8_t *data = buffer->common_params.data;
+	size_t n_frames;
+	size_t frame_size;
+	size_t offset = 0;
+
+	if (!qd_format_is_pcm(output->config.format) ||
+	    output->config.channels <= 0 ||
+	    (output->config.bit_width != 16 && output->config.bit_width != 32))
+		goto out;
+
+	frame_size = output->config.channels * output->config.bit_width / 8;
+	n_frames = buffer->common_params.size / frame_size;
+
+	pthread_mutex_lock(&g->lock);
+
+	/* a new output config starts a new block, the partial block of the
+	 * previous config is dropped */
+	if (out->channels != output->config.channels ||
+	    out->bit_width != output->config.bit_width ||
+	    out->sample_rate != output->config.sample_rate) {
+		out->channels = output->config.channels;
+		out->bit_width = output->config.bit_width;
+		out->sample_rate = output->config.sample_rate;
+		out->frame_size = frame_size;
+		out->n_frames = 0;
+
+		free(out->data);
+		out->data = malloc(GOLDEN_BLOCK_FRAMES * frame_size);
+		assert_not_null(out->data);
+	}
+
+	while (offset < n_frames) {
+		size_t n = QD_MIN(n_frames - offset,
+				  GOLDEN_BLOCK_FRAMES - out->n_frames);
+
+		if (out->n_frames == 0) {
+			out->pts = output->pts +
+				offset * QD_SECOND / out->sample_rate;
+		}
+
+		memcpy(out->data + out->n_frames * frame_size,
+		       data + offset * frame_size, n * frame_size);
+		out->n_frames += n;
+		offset += n;
+
+		if (out->n_frames == GOLDEN_BLOCK_FRAMES) {
+			golden_add_block(g, output, out);
+			out->n_frames = 0;
+		}
+	}
+
+	pthread_mutex_unlock(&g->lock);
+
+out:
+	if (g->output_cb_func)
+		g->output_cb_func(output, buffer, g->output_cb_data);
+}
+
+static int
+golden_load(struct golden *g, FILE *f)
+{
+	char line[256];
+	int version = 0;
+
+	while (fgets(line, sizeof (line), f)) {
+		struct golden_output *out;
+		struct golden_block blk;
+		char name[32];
+		char fp[GOLDEN_BANDS * 2 + 1];
+		int id;
+
+		if (sscanf(line, "# qaptest golden v%d", &version) == 1)
+			continue;
+
+		if (line[0] == '#' || line[0] == '\n')
+			continue;
+
+		if (version != GOLDEN_VERSION) {
+			err("golden: %s: unsupported version %d", g->path,
+			    version);
+			return -1;
+		}
+
+		if (sscanf(line, "%d %31s %" SCNu64 " %d %" SCNx64 " %32s",
+			   &id, name, &blk.pts, &blk.channels, &blk.digest,
+			   fp) != 6 || id < 0 || id >= QD_MAX_OUTPUTS ||
+		    strlen(fp) != GOLDEN_BANDS * 2) {
+			err("golden: %s: invalid line '%s'", g->path, line);
+			return -1;
+		}
+
+		for (int b = 0; b < GOLDEN_BANDS; b++) {
+			unsigned int v;
+
+			sscanf(fp + b * 2, "%2x", &v);
+			blk.fp[b] = v;
+		}
+
+		out = &g->outputs[id];
+		if (out->n_blocks == out->max_blocks) {
+			size_t max = QD_MAX(out->max_blocks * 2, 1024);
+			struct golden_block *blocks;
+
+			blocks = realloc(out->blocks, max * sizeof (*blocks));
+			if (!blocks)
+				return -1;
+
+			out->blocks = blocks;
+			out->max_blocks = max;
+		}
+
+		out->blocks[out->n_blocks++] = blk;
+	}
+
+	return 0;
+}
+
+static int
+golden_save(struct golden *g, struct qd_session *session)
+{
+	char tmp[PATH_MAX];
+	FILE *f;
+
+	snprintf(tmp, sizeof (tmp), "%s.%d.tmp", g->path, getpid());
+
+	if (!(f = fopen(tmp, "w"))) {
+		err("golden: unable to create %s: %m", tmp);
+		return -1;
+	}
+
+	fprintf(f, "# qaptest golden v%d\n", GOLDEN_VERSION);
+	fprintf(f, "# output name pts channels digest fingerprint\n");
+
+	for (int i = 0; i < QD_MAX_OUTPUTS; i++) {
+		const struct golden_output *out = &g->outputs[i];
+
+		for (size_t n = 0; n < out->n_blocks; n++) {
+			const struct golden_block *blk = &out->blocks[n];
+
+			fprintf(f, "%d %s %" PRIu64 " %d %016" PRIx64 " ", i,
+				session->outputs[i].name, blk->pts,
+				blk->channels, blk->digest);
+			for (int b = 0; b < GOLDEN_BANDS; b++)
+				fprintf(f, "%02x", blk->fp[b]);
+			fputc('\n', f);
+		}
+	}
+
+	if (fclose(f) || rename(tmp, g->path) < 0) {
+		err("golden: unable to write %s: %m", g->path);
+		unlink(tmp);
+		return -1;
+	}
+
+	info("golden: recorded %s", g->path);
+
+	return 0;
+}
+
+/* compare the session PCM outputs against the golden set, keyed by test name
+ * and parameters; must be called once the test output callback is set */
+static struct golden *
+golden_attach(struct qd_session *session, const char *test_name,
+	      const MunitParameter params[])
+{
+	const char *dir;
+	struct golden *g;
+	size_t len;
+	FILE *f;
+
+	if (!(dir = getenv("GOLDEN_DIR")))
+		return NULL;
+
+	assert_not_null((g = calloc(1, sizeof (*g))));
+	pthread_mutex_init(&g->lock, NULL);
+
+	len = snprintf(g->path, sizeof (g->path), "%s/", dir);
+	for (const char *p = test_name + (*test_name == '/');
+	     *p && len < sizeof (g->path); p++)
+		g->path[len++] = *p == '/' ? '-' : *p;
+
+	for (const MunitParameter *p = params; p && p->name &&
+	     len < sizeof (g->path); p++)
+		len += snprintf(g->path + len, sizeof (g->path) - len,
+				"-%s=%s", p->name, p->value);
+
+	assert_true(len < sizeof (g->path) - sizeof (".golden"));
+	for (char *p = g->path + strlen(dir) + 1; *p; p++) {
+		if (*p == '+' || *p == '/' || *p == ',')
+			*p = '_';
+	}
+	strcat(g->path, ".golden");
+
+	g->spectral = env_enabled("GOLDEN_SPECTRAL");
+	g->record = env_enabled("GOLDEN_REFRESH");
+
+	if (!g->record) {
+		if ((f = fopen(g->path, "r"))) {
+			assert_int(golden_load(g, f), ==, 0);
+			fclose(f);
+		} else if (errno == ENOENT) {
+			info("golden: %s not found, recording", g->path);
+			g->record = true;
+		} else {
+			munit_errorf("golden: unable to open %s: %s", g->path,
+				     strerror(errno));
+		}
+	}
+
+	/* log-spaced bands, at least one bin wide */
+	g->band_edges[0] = 1;
+	for (int b = 1; b <= GOLDEN_BANDS; b++) {
+		int edge = lrint(pow(GOLDEN_BLOCK_FRAMES / 2,
+				     b / (double)GOLDEN_BANDS));
+
+		g->band_edges[b] = QD_MAX(edge, g->band_edges[b - 1] + 1);
+	}
+	g->band_edges[GOLDEN_BANDS] = GOLDEN_BLOCK_FRAMES / 2 + 1;
+
+	assert_int(peak_analyzer_init(&g->pa, 48000, GOLDEN_BLOCK_FRAMES,
+				      WIN_HANN), ==, 0);
+
+	g->output_cb_func = session->output_cb_func;
+	g->output_cb_data = session->output_cb_data;
+	qd_session_set_output_cb(session, golden_output_cb, g);
+
+	return g;
+}
+
+/* check the whole golden set was played, or save the recorded blocks; must be
+ * called before the session is destroyed, once outputs are drained */
+static void
+golden_detach(struct golden *g, struct qd_session *session)
+{
+	if (!g)
+		return;
+
+	qd_session_set_output_cb(session, g->output_cb_func,
+				 g->output_cb_data);
+
+	if (g->record) {
+		assert_int(golden_save(g, session), ==, 0);
+	} else {
+		for (int i = 0; i < QD_MAX_OUTPUTS; i++) {
+			struct golden_output *out = &g->outputs[i];
+
+			if (out->diverged || out->n_checked >= out->n_blocks)
+				continue;
+
+			munit_logf(MUNIT_LOG_ERROR,
+				   "golden: out %s: diverges at %0.3fs, "
+				   "output ended after %zu of %zu blocks",
+				   session->outputs[i].name,
+				   out->blocks[out->n_checked].pts /
+				   (double)QD_SECOND,
+				   out->n_checked, out->n_blocks);
+			g->failed = true;
+		}
+	}
+
+	if (!g->failed)
+		info("golden: %s matches", g->path);
+
+	assert_false(g->failed);
+
+	for (int i = 0; i < QD_MAX_OUTPUTS; i++) {
+		free(g->outputs[i].blocks);
+		free(g->outputs[i].data);
+	}
+	peak_analyzer_cleanup(&g->pa);
+	pthread_mutex_destroy(&g->lock);
+	free(g);
+}
+
+/*
+ * MS12: test runtime input channel config changes
+ *
+ * Input files include multiple channel configuration, changing every few
+ * seconds. Verify the sequence of reported input configurations matches the
+ * actual data in the files. Each reported configuration is recorded and the
+ * result is checked after the full file has been played out.
+ */
+
+static const qap_input_config_t chid_swp_dd_configs[] = {
+	{ .channels = 1, .ch_map = { QAP_AUDIO_PCM_CHANNEL_C } },
+	{ .channels = 2, .ch_map = { QAP_AUDIO_PCM_CHANNEL_L,
+				     QAP_AUDIO_PCM_CHANNEL_R } },
+	{ .channels = 3, .ch_map = { QAP_AUDIO_PCM_CHANNEL_L,
+				     QAP_AUDIO_PCM_CHANNEL_R,
+				     QAP_AUDIO_PCM_CHANNEL_MS } },
+	{ .channels = 4, .ch_map = { QAP_AUDIO_PCM_CHANNEL_L,
+				     QAP_AUDIO_PCM_CHANNEL_R,
+				     QAP_AUDIO_PCM_CHANNEL_LS,
+				     QAP_AUDIO_PCM_CHANNEL_RS } },
+	{ .channels = 3, .ch_map = { QAP_AUDIO_PCM_CHANNEL_L,
+				     QAP_AUDIO_PCM_CHANNEL_C,
+				     QAP_AUDIO_PCM_CHANNEL_R } },
+	{ .channels = 4, .ch_map = { QAP_AUDIO_PCM_CHANNEL_L,
+				     QAP_AUDIO_PCM_CHANNEL_C,
+				     QAP_AUDIO_PCM_CHANNEL_R,
+				     QAP_AUDIO_PCM_CHANNEL_MS } },
+	{ .channels = 5, .ch_map = { QAP_AUDIO_PCM_CHANNEL_L,
+				     QAP_AUDIO_PCM_CHANNEL_C,
+				     QAP_AUDIO_PCM_CHANNEL_R,
+				     QAP_AUDIO_PCM_CHANNEL_LS,
+				     QAP_AUDIO_PCM_CHANNEL_RS } },
+	{ .channels = 6, .ch_map = { QAP_AUDIO_PCM_CHANNEL_L,
+				     QAP_AUDIO_PCM_CHANNEL_C,
+				     QAP_AUDIO_PCM_CHANNEL_R,
+				     QAP_AUDIO_PCM_CHANNEL_LS,
+				     QAP_AUDIO_PCM_CHANNEL_RS,
+				     QAP_AUDIO_PCM_CHANNEL_LFE } },
+};
+
+static const qap_input_config_t chid_swp_aac_configs[] = {
+	{ .channels = 1, .ch_map = { QAP_AUDIO_PCM_CHANNEL_C } },
+	{ .channels = 2, .ch_map = { QAP_AUDIO_PCM_CHANNEL_L,
+				     QAP_AUDIO_PCM_CHANNEL_R } },
+	{ .channels = 3, .ch_map = { QAP_AUDIO_PCM_CHANNEL_L,
+				     QAP_AUDIO_PCM_CHANNEL_R,
+				     QAP_AUDIO_PCM_CHANNEL_CS } },
+	{ .channels = 4, .ch_map = { QAP_AUDIO_PCM_CHANNEL_L,
+				     QAP_AUDIO_PCM_CHANNEL_R,
+				     QAP_AUDIO_PCM_CHANNEL_LB,
+				     QAP_AUDIO_PCM_CHANNEL_RB } },
+	{ .channels = 3, .ch_map = { QAP_AUDIO_PCM_CHANNEL_L,
+				     QAP_AUDIO_PCM_CHANNEL_R,
+				     QAP_AUDIO_PCM_CHANNEL_C } },
+	{ .channels = 4, .ch_map = { QAP_AUDIO_PCM_CHANNEL_L,
+				     QAP_AUDIO_PCM_CHANNEL_R,
+				     QAP_AUDIO_PCM_CHANNEL_C,
+				     QAP_AUDIO_PCM_CHANNEL_CS } },
+	{ .channels = 5, .ch_map = { QAP_AUDIO_PCM_CHANNEL_L,
+				     QAP_AUDIO_PCM_CHANNEL_R,
+				     QAP_AUDIO_PCM_CHANNEL_C,
+				     QAP_AUDIO_PCM_CHANNEL_LB,
+				     QAP_AUDIO_PCM_CHANNEL_RB } },
+	{ .channels = 6, .ch_map = { QAP_AUDIO_PCM_CHANNEL_L,
+				     QAP_AUDIO_PCM_CHANNEL_R,
+				     QAP_AUDIO_PCM_CHANNEL_C,
+				     QAP_AUDIO_PCM_CHANNEL_LFE,
+				     QAP_AUDIO_PCM_CHANNEL_LB,
+				     QAP_AUDIO_PCM_CHANNEL_RB } },
 };
 
 struct chid_swp_file {
@@ -510,14 +1548,13 @@ static MunitParameterEnum parms_ms12_channel_sweep[] = {
  * Input files feature a single channel 997Hz tone at -20dBFS. Main is in left
  * channel and Assoc is in right channel.
  *
- * Compute an FFT on 1s chunks of audio output data and verify we get the
- * correct peak frequency and gain, testing at multiple "xu" kvpairs values.
+ * Analyze 1s chunks of audio output data and verify we get the correct tone
+ * frequency and gain, testing at multiple "xu" kvpairs values.
  */
 
 struct assoc_mix_ctx {
-	struct {
-		struct peak_analyzer pa[2];
-	} outputs[QD_MAX_OUTPUTS];
+	struct tone_detector td[QD_MAX_OUTPUTS];
+	struct level_meter lm[QD_MAX_OUTPUTS];
 	int gain[2];
 };
 
@@ -526,7 +1563,7 @@ assoc_mix_output_cb(struct qd_output *output, qap_audio_buffer_t *buffer,
 		    void *userdata)
 {
 	struct assoc_mix_ctx *ctx = userdata;
-	struct peak_analyzer *pa;
+	struct tone_detector *td;
 	size_t frame_size;
 
 	if (!qd_format_is_pcm(output->config.format))
@@ -542,35 +1579,38 @@ assoc_mix_output_cb(struct qd_output *output, qap_audio_buffer_t *buffer,
 	frame_size = output->config.channels * output->config.bit_width / 8;
 	assert_int(buffer->common_params.size % frame_size, ==, 0);
 
-	/* feed left and right channel data */
-	pa = ctx->outputs[output->id].pa;
+	/* feed left and right channel data, the software decoded outputs
+	 * are checked for DC offsets as well */
+	td = &ctx->td[output->id];
+	level_meter_add(&ctx->lm[output->id], output, buffer);
+	tone_detector_add_frames(td, buffer->common_params.data,
+				 buffer->common_params.size / frame_size,
+				 output->config.channels);
 
-	for (size_t i = 0; i < buffer->common_params.size; i += frame_size) {
-		int16_t *frame = buffer->common_params.data + i;
-		peak_analyzer_add_samples(&pa[0], frame + 0, 1);
-		peak_analyzer_add_samples(&pa[1], frame + 1, 1);
-	}
+	/* fill window before analyzing data */
+	if (!tone_detector_ready(td))
+		return;
 
 	for (int i = 0; i < 2; i++) {
 		double freq, gain;
 		bool mute;
 
-		/* fill window before running fft and analyzing data */
-		if (pa[i].n_samples != pa[i].max_samples)
-			continue;
-
-		/* verify peak frequency and gain are correct */
+		/* verify tone frequency and gain are correct */
 		mute = ctx->gain[i] <= -32;
-		assert_true(mute == !peak_analyzer_run(&pa[i], &freq, &gain));
+		assert_true(mute == !tone_detector_run(td, i, &freq, &gain));
 		if (!mute) {
 			assert_double(freq, ==, 997);
+			assert_double(fabs(level_meter_tone_db(&ctx->lm[output->id],
+							       i) - gain),
+				      <, 1.0);
 			assert_double(gain, >, -24 + ctx->gain[i] - 1.0);
 			assert_double(gain, <, -24 + ctx->gain[i] + 1.0);
 		}
-
-		/* reset window */
-		pa[i].n_samples = 0;
 	}
+
+	/* reset window */
+	tone_detector_reset(td);
+	level_meter_reset(&ctx->lm[output->id]);
 }
 
 static const struct file_alias assoc_mix_main_files[] = {
@@ -601,11 +1641,10 @@ test_ms12_assoc_mix(const MunitParameter params[],
 
 	qd_session_set_output_cb(session, assoc_mix_output_cb, &ctx);
 
-	/* setup fft to determine peak freq/gain, with a 1s window */
-	for (size_t i = 0; i < QD_N_ELEMENTS(ctx.outputs); i++) {
-		for (size_t j = 0; j < QD_N_ELEMENTS(ctx.outputs[i].pa); j++)
-			peak_analyzer_init(&ctx.outputs[i].pa[j],
-					48000, 48000, WIN_RECT);
+	/* setup tone detection on left and right, with a 1s window */
+	for (size_t i = 0; i < QD_N_ELEMENTS(ctx.td); i++) {
+		tone_detector_init(&ctx.td[i], 48000, 48000, 2, 997, 997);
+		level_meter_reset(&ctx.lm[i]);
 	}
 
 	/* set main/assoc mixing gain */
@@ -661,11 +1700,6 @@ test_ms12_assoc_mix(const MunitParameter params[],
 	ffmpeg_src_destroy(src_assoc);
 	qd_session_destroy(session);
 
-	for (size_t i = 0; i < QD_N_ELEMENTS(ctx.outputs); i++) {
-		for (size_t j = 0; j < QD_N_ELEMENTS(ctx.outputs[i].pa); j++)
-			peak_analyzer_cleanup(&ctx.outputs[i].pa[j]);
-	}
-
 	return MUNIT_OK;
 }
 
@@ -711,6 +1745,7 @@ assoc_disappearing_output_cb(struct qd_output *output, qap_audio_buffer_t *buffe
 	struct assoc_disappearing_ctx *ctx = userdata;
 	struct assoc_disappearing_output *out = &ctx->outputs[output->id];
 	size_t frame_size;
+	size_t n_frames;
 
 	/* check output config */
 	assert_int(output->config.sample_rate, ==, 48000);
@@ -724,6 +1759,13 @@ assoc_disappearing_output_cb(struct qd_output *output, qap_audio_buffer_t *buffe
 	if (output->pts < 2.5 * QD_SECOND)
 		return;
 
+	/* verify other channels are silent */
+	n_frames = buffer->common_params.size / frame_size;
+	assert_size(int16_silent_frames(buffer->common_params.data, n_frames,
+					output->config.channels, 2,
+					output->config.channels - 2),
+		    ==, n_frames);
+
 	for (size_t i = 0; i < buffer->common_params.size; i += frame_size) {
 		int16_t *frame = buffer->common_params.data + i;
 
@@ -761,10 +1803,6 @@ assoc_disappearing_output_cb(struct qd_output *output, qap_audio_buffer_t *buffe
 			out->seen_l_silence = true;
 		if (out->r_silent_frame_count > 2 * 48000)
 			out->seen_r_silence = true;
-
-		/* verify other channels are silent */
-		assert_true(int16_is_silence(frame + 2,
-					     output->config.channels - 2));
 	}
 }
 
@@ -848,15 +1886,13 @@ static MunitParameterEnum parms_ms12_assoc_disappearing[] = {
  * Input files feature a single channel 997Hz tone at -20dBFS. Main is in left
  * channel and Main2 is in right channel.
  *
- * Compute an FFT on 1s chunks of audio output data and verify we get the
- * correct peak frequency and gain, testing at multiple "main1_mixgain" and
- * "main2_mixgain" kvpairs values.
+ * Analyze 1s chunks of audio output data and verify we get the correct tone
+ * frequency and gain, testing at multiple "main1_mixgain" and "main2_mixgain"
+ * kvpairs values.
  */
 
 struct main2_mix_ctx {
-	struct {
-		struct peak_analyzer pa[2];
-	} outputs[QD_MAX_OUTPUTS];
+	struct tone_detector td[QD_MAX_OUTPUTS];
 	int gain;
 };
 
@@ -865,7 +1901,7 @@ main2_mix_output_cb(struct qd_output *output, qap_audio_buffer_t *buffer,
 		    void *userdata)
 {
 	struct main2_mix_ctx *ctx = userdata;
-	struct peak_analyzer *pa;
+	struct tone_detector *td;
 	size_t frame_size;
 
 	/* check output config */
@@ -876,30 +1912,27 @@ main2_mix_output_cb(struct qd_output *output, qap_audio_buffer_t *buffer,
 	assert_int(buffer->common_params.size % frame_size, ==, 0);
 
 	/* feed left and right channel data */
-	pa = ctx->outputs[output->id].pa;
+	td = &ctx->td[output->id];
+	tone_detector_add_frames(td, buffer->common_params.data,
+				 buffer->common_params.size / frame_size,
+				 output->config.channels);
 
-	for (size_t i = 0; i < buffer->common_params.size; i += frame_size) {
-		int16_t *frame = buffer->common_params.data + i;
-		peak_analyzer_add_samples(&pa[0], frame + 0, 1);
-		peak_analyzer_add_samples(&pa[1], frame + 1, 1);
-	}
+	/* fill window before analyzing data */
+	if (!tone_detector_ready(td))
+		return;
 
 	for (int i = 0; i < 2; i++) {
 		double freq, gain;
 
-		/* fill window before running fft and analyzing data */
-		if (pa[i].n_samples != pa[i].max_samples)
-			continue;
-
-		/* verify peak frequency and gain are correct */
-		assert_true(peak_analyzer_run(&pa[i], &freq, &gain));
+		/* verify tone frequency and gain are correct */
+		assert_true(tone_detector_run(td, i, &freq, &gain));
 		assert_double(freq, ==, 997);
 		assert_double(gain, >, -20 + ctx->gain - 1.0);
 		assert_double(gain, <, -20 + ctx->gain + 1.0);
-
-		/* reset window */
-		pa[i].n_samples = 0;
 	}
+
+	/* reset window */
+	tone_detector_reset(td);
 }
 
 static const struct file_alias main2_mix_main_files[] = {
@@ -927,12 +1960,9 @@ test_ms12_main2_mix(const MunitParameter params[],
 
 	qd_session_set_output_cb(session, main2_mix_output_cb, &ctx);
 
-	/* setup fft to determine peak freq/gain, with a 1s window */
-	for (size_t i = 0; i < QD_N_ELEMENTS(ctx.outputs); i++) {
-		for (size_t j = 0; j < QD_N_ELEMENTS(ctx.outputs[i].pa); j++)
-			peak_analyzer_init(&ctx.outputs[i].pa[j],
-					   48000, 48000, WIN_RECT);
-	}
+	/* setup tone detection on left and right, with a 1s window */
+	for (size_t i = 0; i < QD_N_ELEMENTS(ctx.td); i++)
+		tone_detector_init(&ctx.td[i], 48000, 48000, 2, 997, 997);
 
 	/* set main/main2 mixing gain */
 	v = munit_parameters_get(params, "main_mixgain");
@@ -980,11 +2010,6 @@ test_ms12_main2_mix(const MunitParameter params[],
 	ffmpeg_src_destroy(src_main2);
 	qd_session_destroy(session);
 
-	for (size_t i = 0; i < QD_N_ELEMENTS(ctx.outputs); i++) {
-		for (size_t j = 0; j < QD_N_ELEMENTS(ctx.outputs[i].pa); j++)
-			peak_analyzer_cleanup(&ctx.outputs[i].pa[j]);
-	}
-
 	return MUNIT_OK;
 }
 
@@ -1010,12 +2035,13 @@ static MunitParameterEnum parms_ms12_main2_mix[] = {
  * Input files will render a different, known fixed frequency based on the
  * stereo downmix mode.
  *
- * Compute an FFT on 1s chunks of audio output data and verify we get the
- * correct peak frequency and gain, testing with Lo/Ro and Lt/Rt downmix modes.
+ * Analyze 1s chunks of audio output data and verify we get the correct tone
+ * frequency, testing with Lo/Ro and Lt/Rt downmix modes.
  */
 
 struct stereo_downmix_ctx {
-	struct peak_analyzer pa[2];
+	struct tone_detector td;
+	struct level_meter lm;
 	int dmx;
 };
 
@@ -1034,25 +2060,28 @@ stereo_downmix_output_cb(struct qd_output *output, qap_audio_buffer_t *buffer,
 	assert_int(buffer->common_params.size % frame_size, ==, 0);
 
 	/* feed left and right channel data */
-	for (size_t i = 0; i < buffer->common_params.size; i += frame_size) {
-		int16_t *frame = buffer->common_params.data + i;
-		peak_analyzer_add_samples(&ctx->pa[0], frame + 0, 1);
-		peak_analyzer_add_samples(&ctx->pa[1], frame + 1, 1);
-	}
+	level_meter_add(&ctx->lm, output, buffer);
+	tone_detector_add_frames(&ctx->td, buffer->common_params.data,
+				 buffer->common_params.size / frame_size,
+				 output->config.channels);
+
+	/* fill window before analyzing data */
+	if (!tone_detector_ready(&ctx->td))
+		return;
 
 	for (int i = 0; i < 2; i++) {
 		double freq, gain;
 
-		/* fill window before running fft and analyzing data */
-		if (ctx->pa[i].n_samples != ctx->pa[i].max_samples)
-			continue;
-
-		/* verify peak frequency is correct */
-		assert_true(peak_analyzer_run(&ctx->pa[i], &freq, &gain));
+		/* verify tone frequency is correct */
+		assert_true(tone_detector_run(&ctx->td, i, &freq, &gain));
 
 		info("test/output: ts=%" PRIi64 " ch=%c %lgHz %lgdB",
 		     output->pts, i == 0 ? 'l' : 'r', freq, gain);
 
+		/* the channel level is the one of the tone alone */
+		assert_double(fabs(level_meter_tone_db(&ctx->lm, i) - gain),
+			      <, 1.0);
+
 		if (ctx->dmx)
 			assert_double(freq, ==, 997);
 		else {
@@ -1060,10 +2089,11 @@ stereo_downmix_output_cb(struct qd_output *output, qap_audio_buffer_t *buffer,
 			assert_double(freq, >=, 403);
 			assert_double(freq, <=, 405);
 		}
-
-		/* reset window */
-		ctx->pa[i].n_samples = 0;
 	}
+
+	/* reset window */
+	tone_detector_reset(&ctx->td);
+	level_meter_reset(&ctx->lm);
 }
 
 static const struct file_alias stereo_downmix_files[] = {
@@ -1082,21 +2112,26 @@ test_ms12_stereo_downmix(const MunitParameter params[],
 	struct ffmpeg_src *src;
 	const char *v, *f;
 	struct stereo_downmix_ctx ctx;
+	struct golden *golden;
 
 	if (!(session = setup_ms12_session(params)))
 		return MUNIT_SKIP;
 
 	qd_session_set_output_cb(session, stereo_downmix_output_cb, &ctx);
-
-	/* setup fft to determine peak freq, with a 1s window */
-	for (size_t i = 0; i < QD_N_ELEMENTS(ctx.pa); i++)
-		peak_analyzer_init(&ctx.pa[i], 48000, 48000, WIN_RECT);
+	golden = golden_attach(session, "/ms12/stereo_downmix", params);
 
 	/* set stereo downmix mode */
 	v = munit_parameters_get(params, "dmx");
 	ctx.dmx = v ? atoi(v) : 0;
 	qd_session_set_kvpairs(session, "dmx=%d", ctx.dmx);
 
+	/* setup tone detection on left and right, with a 1s window */
+	level_meter_reset(&ctx.lm);
+	if (ctx.dmx)
+		tone_detector_init(&ctx.td, 48000, 48000, 2, 997, 997);
+	else
+		tone_detector_init(&ctx.td, 48000, 48000, 2, 403, 405);
+
 	/* create main input */
 	v = munit_parameters_get(params, "f");
 	if (!(f = find_filename(stereo_downmix_files, v)))
@@ -1118,13 +2153,11 @@ test_ms12_stereo_downmix(const MunitParameter params[],
 
 	/* drain output */
 	ffmpeg_src_wait_eos(src, false, 1 * QD_SECOND);
+	golden_detach(golden, session);
 
 	ffmpeg_src_destroy(src);
 	qd_session_destroy(session);
 
-	for (size_t i = 0; i < QD_N_ELEMENTS(ctx.pa); i++)
-		peak_analyzer_cleanup(&ctx.pa[i]);
-
 	return MUNIT_OK;
 }
 
@@ -1149,12 +2182,13 @@ static MunitParameterEnum parms_ms12_stereo_downmix[] = {
  *
  * Input files will render a 440Hz tone with volume incrementing monotonocally.
  *
- * Compute an FFT on 1s chunks of audio output data and verify we get the
- * correct frequency and increasing gain, testing with Line and RF DRC modes.
+ * Analyze 1s chunks of audio output data and verify we get the correct
+ * frequency and increasing gain, testing with Line and RF DRC modes.
  */
 
 struct drc_ctx {
-	struct peak_analyzer pa[2];
+	struct tone_detector td;
+	struct level_meter lm;
 	int drc;
 };
 
@@ -1178,21 +2212,24 @@ drc_output_cb(struct qd_output *output, qap_audio_buffer_t *buffer,
 		return;
 
 	/* feed left and right channel data */
-	for (size_t i = 0; i < buffer->common_params.size; i += frame_size) {
-		int16_t *frame = buffer->common_params.data + i;
-		peak_analyzer_add_samples(&ctx->pa[0], frame + 0, 1);
-		peak_analyzer_add_samples(&ctx->pa[1], frame + 1, 1);
-	}
+	level_meter_add(&ctx->lm, output, buffer);
+	tone_detector_add_frames(&ctx->td, buffer->common_params.data,
+				 buffer->common_params.size / frame_size,
+				 output->config.channels);
+
+	/* fill window before analyzing data */
+	if (!tone_detector_ready(&ctx->td))
+		return;
 
 	for (int i = 0; i < 2; i++) {
 		double freq, gain;
 		double t;
 
-		/* fill window before running fft and analyzing data */
-		if (ctx->pa[i].n_samples != ctx->pa[i].max_samples)
-			continue;
+		assert_true(tone_detector_run(&ctx->td, i, &freq, &gain));
 
-		assert_true(peak_analyzer_run(&ctx->pa[i], &freq, &gain));
+		/* the channel level is the one of the tone alone */
+		assert_double(fabs(level_meter_tone_db(&ctx->lm, i) - gain),
+			      <, 1.0);
 
 		/* adjust gain in RF mode to match Line mode */
 		if (ctx->drc)
@@ -1216,10 +2253,11 @@ drc_output_cb(struct qd_output *output, qap_audio_buffer_t *buffer,
 			assert_double(gain, >=, -24.5 + (t - 46) / 2.0);
 			assert_double(gain, <=, -22.5 + (t - 46) / 2.0);
 		}
-
-		/* reset window */
-		ctx->pa[i].n_samples = 0;
 	}
+
+	/* reset window */
+	tone_detector_reset(&ctx->td);
+	level_meter_reset(&ctx->lm);
 }
 
 static const struct file_alias drc_files[] = {
@@ -1238,15 +2276,17 @@ test_ms12_drc(const MunitParameter params[], void *user_data_or_fixture)
 	struct ffmpeg_src *src;
 	const char *v, *f;
 	struct drc_ctx ctx;
+	struct golden *golden;
 
 	if (!(session = setup_ms12_session(params)))
 		return MUNIT_SKIP;
 
 	qd_session_set_output_cb(session, drc_output_cb, &ctx);
+	golden = golden_attach(session, "/ms12/drc", params);
 
-	/* setup fft to determine peak freq and gain, with a 1s window */
-	for (size_t i = 0; i < QD_N_ELEMENTS(ctx.pa); i++)
-		peak_analyzer_init(&ctx.pa[i], 48000, 48000, WIN_RECT);
+	/* setup tone detection on left and right, with a 1s window */
+	level_meter_reset(&ctx.lm);
+	tone_detector_init(&ctx.td, 48000, 48000, 2, 440, 440);
 
 	/* set drc mode */
 	v = munit_parameters_get(params, "drc");
@@ -1268,13 +2308,11 @@ test_ms12_drc(const MunitParameter params[], void *user_data_or_fixture)
 
 	/* drain output */
 	ffmpeg_src_wait_eos(src, false, 1 * QD_SECOND);
+	golden_detach(golden, session);
 
 	ffmpeg_src_destroy(src);
 	qd_session_destroy(session);
 
-	for (size_t i = 0; i < QD_N_ELEMENTS(ctx.pa); i++)
-		peak_analyzer_cleanup(&ctx.pa[i]);
-
 	return MUNIT_OK;
 }
 
@@ -1314,12 +2352,45 @@ struct pause_ctx {
 	pthread_mutex_t lock;
 };
 
+/* update the silent state of a channel, and verify module state has taken
+ * effect: we expect silence when paused, sound when started, with delay
+ * threshold for the command to take effect */
+static void
+pause_set_silent(struct pause_ctx *ctx, struct qd_output *output, int ch,
+		 bool silent, bool paused, uint64_t now, uint64_t change_time)
+{
+	if (silent != ctx->lr_silent[ch]) {
+		info("test/output: ts=%" PRIu64 " %s channel is now %s, "
+		     "%" PRIi64 "ms since last state change",
+		     output->pts, ch == 0 ? "left" : "right",
+		     silent ? "silent" : "noisy",
+		     (now - change_time) / 1000);
+
+		ctx->lr_silent[ch] = silent;
+	}
+
+	if (now > change_time + ctx->max_delay_ms * 1000) {
+		if (paused != silent) {
+			munit_logf(MUNIT_LOG_ERROR,
+				   "state changed to %s %dms ago, expecting %s audio",
+				   paused ? "paused" : "playing",
+				   (int)((now - change_time) / 1000),
+				   paused ? "silent" : "non-silent");
+		}
+
+		assert_int(paused, ==, silent);
+	}
+}
+
 static void
 pause_output_cb(struct qd_output *output, qap_audio_buffer_t *buffer,
 		     void *userdata)
 {
 	struct pause_ctx *ctx = userdata;
+	const int16_t *data = buffer->common_params.data;
+	int channels = output->config.channels;
 	size_t frame_size;
+	size_t n_frames;
 	uint64_t now, change_time;
 	bool paused;
 
@@ -1330,6 +2401,7 @@ pause_output_cb(struct qd_output *output, qap_audio_buffer_t *buffer,
 
 	frame_size = output->config.channels * output->config.bit_width / 8;
 	assert_int(buffer->common_params.size % frame_size, ==, 0);
+	n_frames = buffer->common_params.size / frame_size;
 
 	/* record input state */
 	pthread_mutex_lock(&ctx->lock);
@@ -1339,61 +2411,64 @@ pause_output_cb(struct qd_output *output, qap_audio_buffer_t *buffer,
 
 	now = qd_get_time();
 
-	/* process data */
-	for (size_t i = 0; i < buffer->common_params.size; i += frame_size) {
-		int16_t *frame = buffer->common_params.data + i;
-
-		/* record number of silent consecutive samples in L/R */
-		for (int i = 0; i < 2; i++) {
-			if (int16_is_silence(frame + i, 1))
-				ctx->lr_silent_samples[i]++;
-			else
-				ctx->lr_silent_samples[i] = 0;
-		}
-
-		/* check if silence was detected */
-		for (int i = 0; i < 2; i++) {
-			bool silent = ctx->lr_silent_samples[i] > 1;
-			if (silent == ctx->lr_silent[i])
-				continue;
+	/* process L/R data by runs of non-silent and silent samples, a channel
+	 * is considered silent from its second consecutive silent sample */
+	for (int ch = 0; ch < 2; ch++) {
+		size_t pos = 0;
+
+		while (pos < n_frames) {
+			size_t end;
+
+			/* non-silent run, fed to fft */
+			end = pos + audio_find_silent_s16(data + pos * channels,
+							  n_frames - pos,
+							  channels, ch, 1,
+							  AUDIO_SILENCE_THRESHOLD_S16);
+			if (end > pos) {
+				ctx->lr_silent_samples[ch] = 0;
+				pause_set_silent(ctx, output, ch, false,
+						 paused, now, change_time);
+				peak_analyzer_add_frames(&ctx->pa[ch],
+							 data + pos * channels + ch,
+							 end - pos, channels);
+				pos = end;
+			}
 
-			info("test/output: ts=%" PRIu64 " %s channel is now %s, "
-			     "%" PRIi64 "ms since last state change",
-			     output->pts, i == 0 ? "left" : "right",
-			     silent ? "silent" : "noisy",
-			     (now - change_time) / 1000);
-
-			ctx->lr_silent[i] = silent;
-		}
-
-		/* verify module state has taken effect: we expect silence when
-		 * paused, sound when started, with delay threshold for the
-		 * command to take effect */
-		if (now > change_time + ctx->max_delay_ms * 1000) {
-			if (paused != ctx->lr_silent[0] ||
-			    paused != ctx->lr_silent[1]) {
-				munit_logf(MUNIT_LOG_ERROR,
-					   "state changed to %s %dms ago, expecting %s audio",
-					   paused ? "paused" : "playing",
-					   (int)((now - change_time) / 1000),
-					   paused ? "silent" : "non-silent");
+			if (pos == n_frames)
+				break;
+
+			/* silent run */
+			end = pos + int16_silent_frames(data + pos * channels,
+							n_frames - pos,
+							channels, ch, 1);
+
+			/* the first silent sample after noise does not change
+			 * the channel state yet */
+			if (ctx->lr_silent_samples[ch] == 0) {
+				ctx->lr_silent_samples[ch]++;
+				pause_set_silent(ctx, output, ch,
+						 ctx->lr_silent[ch],
+						 paused, now, change_time);
+				if (!ctx->lr_silent[ch])
+					peak_analyzer_add_frames(&ctx->pa[ch],
+								 data + pos * channels + ch,
+								 1, channels);
+				pos++;
 			}
 
-			assert_int(paused, ==, ctx->lr_silent[0]);
-			assert_int(paused, ==, ctx->lr_silent[1]);
+			if (pos < end) {
+				ctx->lr_silent_samples[ch] += end - pos;
+				pause_set_silent(ctx, output, ch, true,
+						 paused, now, change_time);
+				pos = end;
+			}
 		}
-
-		/* feed left and right channels to fft */
-		if (!ctx->lr_silent[0])
-			peak_analyzer_add_samples(&ctx->pa[0], frame + 0, 1);
-		if (!ctx->lr_silent[1])
-			peak_analyzer_add_samples(&ctx->pa[1], frame + 1, 1);
-
-		/* verify the rest is silence */
-		assert_true(int16_is_silence(frame + 2,
-					     output->config.channels - 2));
 	}
 
+	/* verify the rest is silence */
+	assert_size(int16_silent_frames(data, n_frames, channels, 2,
+					channels - 2), ==, n_frames);
+
 	/* analyze fft */
 	for (int i = 0; i < 2; i++) {
 		double freq, gain;
@@ -1424,6 +2499,8 @@ static const struct file_alias pause_files[] = {
 	{ "ddp", "Elementary_Streams/Reference_Level/Ref_997_200_48k_20dB_ddp.ec3" },
 	{ "aac_adts", "Elementary_Streams/Reference_Level/Ref_997_200_48k_20dB_heaac.adts" },
 	{ "aac_loas", "Elementary_Streams/Reference_Level/Ref_997_200_48k_20dB_heaac.loas" },
+	{ "gen_ddp", GEN_REF_997_DDP },
+	{ "gen_aac", GEN_REF_997_AAC },
 	{ NULL, NULL }
 };
 
@@ -1520,7 +2597,7 @@ test_ms12_pause(const MunitParameter params[], void *user_data_or_fixture)
 }
 
 static char *parm_ms12_files_pause[] = {
-	"ddp", "aac_adts", "aac_loas", NULL
+	"ddp", "aac_adts", "aac_loas", "gen_ddp", "gen_aac", NULL
 };
 
 static char *parm_ms12_max_delay_pause[] = {
@@ -1561,6 +2638,7 @@ output_reconfig_output_cb(struct qd_output *output, qap_audio_buffer_t *buffer,
 	struct output_reconfig_ctx *ctx = userdata;
 	struct output_reconfig_out *out = &ctx->outputs[output->id];
 	size_t frame_size;
+	size_t n_frames;
 
 	/* check output config */
 	assert_int(output->config.sample_rate, ==, 48000);
@@ -1574,17 +2652,18 @@ output_reconfig_output_cb(struct qd_output *output, qap_audio_buffer_t *buffer,
 	if (output->pts < 500 * QD_MSECOND)
 		return;
 
-	for (size_t i = 0; i < buffer->common_params.size; i += frame_size) {
-		int16_t *frame = buffer->common_params.data + i;
-
-		/* feed left and right channel data */
-		peak_analyzer_add_samples(&out->pa[0], frame + 0, 1);
-		peak_analyzer_add_samples(&out->pa[1], frame + 1, 1);
+	/* feed left and right channel data */
+	n_frames = buffer->common_params.size / frame_size;
+	for (int i = 0; i < 2; i++)
+		peak_analyzer_add_frames(&out->pa[i],
+					 (int16_t *)buffer->common_params.data + i,
+					 n_frames, output->config.channels);
 
-		/* verify the rest is silence */
-		assert_true(int16_is_silence(frame + 2,
-					     output->config.channels - 2));
-	}
+	/* verify the rest is silence */
+	assert_size(int16_silent_frames(buffer->common_params.data, n_frames,
+					output->config.channels, 2,
+					output->config.channels - 2),
+		    ==, n_frames);
 
 	for (int i = 0; i < 2; i++) {
 		double freq, gain;
@@ -1628,6 +2707,8 @@ static const struct file_alias output_reconfig_files[] = {
 	{ "ddp", "Elementary_Streams/Reference_Level/Ref_997_200_48k_20dB_ddp.ec3" },
 	{ "aac_adts", "Elementary_Streams/Reference_Level/Ref_997_200_48k_20dB_heaac.adts" },
 	{ "aac_loas", "Elementary_Streams/Reference_Level/Ref_997_200_48k_20dB_heaac.loas" },
+	{ "gen_ddp", GEN_REF_997_DDP },
+	{ "gen_aac", GEN_REF_997_AAC },
 	{ NULL, NULL }
 };
 
@@ -1694,7 +2775,7 @@ test_ms12_output_reconfig(const MunitParameter params[], void *user_data_or_fixt
 }
 
 static char *parm_ms12_files_output_reconfig[] = {
-	"ddp", "aac_adts", "aac_loas", NULL
+	"ddp", "aac_adts", "aac_loas", "gen_ddp", "gen_aac", NULL
 };
 
 static MunitParameterEnum parms_ms12_output_reconfig[] = {
@@ -1718,6 +2799,7 @@ flush_output_cb(struct qd_output *output, qap_audio_buffer_t *buffer,
 {
 	struct flush_ctx *ctx = userdata;
 	size_t frame_size;
+	size_t n_frames;
 
 	/* check output config */
 	assert_int(output->config.sample_rate, ==, 48000);
@@ -1726,14 +2808,25 @@ flush_output_cb(struct qd_output *output, qap_audio_buffer_t *buffer,
 	frame_size = output->config.channels * output->config.bit_width / 8;
 	assert_int(buffer->common_params.size % frame_size, ==, 0);
 
-	/* feed left and right channel data */
-	for (size_t i = 0; i < buffer->common_params.size; i += frame_size) {
-		int16_t *frame = buffer->common_params.data + i;
-
-		if (!int16_is_silence(frame, 2)) {
-			peak_analyzer_add_samples(&ctx->pa[0], frame + 0, 1);
-			peak_analyzer_add_samples(&ctx->pa[1], frame + 1, 1);
-		}
+	/* feed left and right channel data, skipping silent frames */
+	n_frames = buffer->common_params.size / frame_size;
+	for (size_t pos = 0; pos < n_frames; ) {
+		const int16_t *frame = (int16_t *)buffer->common_params.data +
+			pos * output->config.channels;
+		size_t n;
+
+		n = int16_silent_frames(frame, n_frames - pos,
+					output->config.channels, 0, 2);
+		frame += n * output->config.channels;
+		pos += n;
+
+		n = audio_find_silent_s16(frame, n_frames - pos,
+					  output->config.channels, 0, 2,
+					  AUDIO_SILENCE_THRESHOLD_S16);
+		for (int i = 0; i < 2; i++)
+			peak_analyzer_add_frames(&ctx->pa[i], frame + i, n,
+						 output->config.channels);
+		pos += n;
 	}
 
 	for (int i = 0; i < 2; i++) {
@@ -1759,6 +2852,8 @@ static const struct file_alias flush_files[] = {
 	{ "ddp", "Elementary_Streams/Reference_Level/Ref_997_200_48k_20dB_ddp.ec3" },
 	{ "aac_adts", "Elementary_Streams/Reference_Level/Ref_997_200_48k_20dB_heaac.adts" },
 	{ "aac_loas", "Elementary_Streams/Reference_Level/Ref_997_200_48k_20dB_heaac.loas" },
+	{ "gen_ddp", GEN_REF_997_DDP },
+	{ "gen_aac", GEN_REF_997_AAC },
 	{ NULL, NULL }
 };
 
@@ -1847,7 +2942,7 @@ test_ms12_flush(const MunitParameter params[],
 }
 
 static char *parm_ms12_files_flush[] = {
-	"ddp", "aac_adts", "aac_loas", NULL
+	"ddp", "aac_adts", "aac_loas", "gen_ddp", "gen_aac", NULL
 };
 
 static MunitParameterEnum parms_ms12_flush[] = {
@@ -1881,7 +2976,7 @@ enum flush2_state {
 };
 
 struct flush2_ctx {
-	struct peak_analyzer pa[2];
+	struct tone_detector td;
 	int state;
 	int flush_latency;
 	int silent_frames;
@@ -1986,27 +3081,25 @@ again:
 			if (ctx->silent_frames < 48)
 				ctx->input_tone2_frames_rendered++;
 
-			peak_analyzer_add_samples(&ctx->pa[0], frame + 0, 1);
-			peak_analyzer_add_samples(&ctx->pa[1], frame + 1, 1);
+			tone_detector_add_frames(&ctx->td, frame, 1,
+						 output->config.channels);
 		}
 
+		/* fill window before analyzing data */
+		if (!tone_detector_ready(&ctx->td))
+			break;
+
 		for (int i = 0; i < 2; i++) {
 			double freq, gain;
 
-			/* fill window before running fft and analyzing data */
-			if (ctx->pa[i].n_samples != ctx->pa[i].max_samples)
-				continue;
-
-			/* verify peak frequency and gain are correct */
-			assert_true(peak_analyzer_run(&ctx->pa[i], &freq, &gain));
-
-			/* check peak frequency */
+			/* verify tone frequency is correct */
+			assert_true(tone_detector_run(&ctx->td, i, &freq, &gain));
 			assert_double(freq, >=, 403);
 			assert_double(freq, <=, 405);
-
-			/* reset window */
-			ctx->pa[i].n_samples = 0;
 		}
+
+		/* reset window */
+		tone_detector_reset(&ctx->td);
 		break;
 
 	case FLUSH2_DONE:
@@ -2041,8 +3134,7 @@ test_ms12_flush2(const MunitParameter params[],
 	/* set stereo downmix mode to get a downmixed 403Hz tone */
 	qd_session_set_kvpairs(session, "dmx=0");
 
-	for (int i = 0; i < 2; i++)
-		peak_analyzer_init(&ctx.pa[i], 48000, 48000, WIN_RECT);
+	tone_detector_init(&ctx.td, 48000, 48000, 2, 403, 405);
 
 	/* create main input */
 	v = munit_parameters_get(params, "f");
@@ -2153,9 +3245,6 @@ test_ms12_flush2(const MunitParameter params[],
 	ffmpeg_src_destroy(src);
 	qd_session_destroy(session);
 
-	for (int i = 0; i < 2; i++)
-		peak_analyzer_cleanup(&ctx.pa[i]);
-
 	return MUNIT_OK;
 }
 
@@ -2198,12 +3287,14 @@ flush3_output_cb(struct qd_output *output, qap_audio_buffer_t *buffer,
 	frame_size = output->config.channels * output->config.bit_width / 8;
 	assert_int(buffer->common_params.size % frame_size, ==, 0);
 
-	/* feed left and right channel data */
-	for (size_t i = 0; i < buffer->common_params.size; i += frame_size) {
-		int16_t *frame = buffer->common_params.data + i;
-		bool silent = int16_is_silence(frame, 2);
+	/* left and right channels must be silent once flushed */
+	if (ctx->flushed) {
+		size_t n_frames = buffer->common_params.size / frame_size;
 
-		assert_true(!ctx->flushed || silent);
+		assert_size(int16_silent_frames(buffer->common_params.data,
+						n_frames,
+						output->config.channels, 0, 2),
+			    ==, n_frames);
 	}
 }
 
@@ -2425,15 +3516,36 @@ static MunitParameterEnum parms_ms12_eos[] = {
 /*
  * MS12: test output latency with empty and full input buffers
  *
- * Input files will render a stereo 997Hz tone at -20dBFS.
+ * Generated inputs start with a 20ms chirp marker after 50ms of silence, its
+ * position in each output is found by cross-correlation, to a fraction of
+ * sample. Conformance files render a stereo 997Hz tone at -20dBFS, their
+ * latency is the number of silence frames output before the tone.
  *
- * Verify the number of silence frames inserted before the tone is reproduced
- * on the output is not too high, on all inputs.
+ * Verify the measured latency is close to the latency reported by QAP, on
+ * all inputs.
  */
 
+#define LATENCY_MARKER \
+	"gen:chirp:freq=200:freq_end=8000:gain=-6:slot=0.02:lead=0.05:duration=1"
+#define LATENCY_MARKER_MS	70
+#define LATENCY_MIN_NCC		0.5
+
+/* output captured for analysis, from the first written input frame */
+#define LATENCY_CAPTURE_FRAMES	48000
+#define LATENCY_TAIL_FRAMES	(LATENCY_MARKER_MS * 48)
+
+enum latency_state {
+	LATENCY_INIT = 0,
+	LATENCY_SILENT,
+	LATENCY_ACTIVE,
+	LATENCY_DONE,
+};
+
 struct latency_out {
-	int state;
+	enum latency_state state;
 	int silent_frames_count;
+	int16_t *capture;
+	size_t n_captured;
 };
 
 struct latency_ctx {
@@ -2464,11 +3576,15 @@ latency_output_cb(struct qd_output *output, qap_audio_buffer_t *buffer,
 {
 	struct latency_ctx *ctx = userdata;
 	struct latency_out *out = &ctx->outputs[output->id];
+	const int16_t *data;
 	size_t frame_size;
+	size_t n_frames;
+	size_t idx;
+	int channels;
 
 	if (!qd_format_is_pcm(output->config.format)) {
 		/* skip encoded output */
-		out->state = 2;
+		out->state = LATENCY_DONE;
 		return;
 	}
 
@@ -2494,47 +3610,66 @@ latency_output_cb(struct qd_output *output, qap_audio_buffer_t *buffer,
 	}
 	pthread_mutex_unlock(&ctx->output_lock);
 
-	for (size_t i = 0; i < buffer->common_params.size; i += frame_size) {
-		int16_t *frame = buffer->common_params.data + i;
-		bool silent = int16_is_silence(frame, output->config.channels);
-
-		switch (out->state) {
-		case 0: // init
-			assert_true(silent);
-			out->state = 1;
-			info("test/output %s: ts=%" PRIu64 " initial silence detected",
-			     output->name, output->pts);
-			break;
-		case 1: // silent
-			if (silent) {
-				out->silent_frames_count++;
-			} else {
-				out->state = 2;
-				info("test/output %s: ts=%" PRIu64 " output noisy after %d frames",
-				     output->name, output->pts, out->silent_frames_count);
-			}
+	n_frames = buffer->common_params.size / frame_size;
+	data = buffer->common_params.data;
+	channels = output->config.channels;
+
+	switch (out->state) {
+	case LATENCY_INIT:
+		if (n_frames == 0)
 			break;
-		case 2: // active
+		assert_size(int16_silent_frames(data, 1, channels, 0, channels),
+			    ==, 1);
+		out->state = LATENCY_SILENT;
+		info("test/output %s: ts=%" PRIu64 " initial silence detected",
+		     output->name, output->pts);
+		data += channels;
+		n_frames--;
+		/* fall through */
+	case LATENCY_SILENT:
+		idx = int16_silent_frames(data, n_frames, channels, 0, channels);
+		out->silent_frames_count += idx;
+		if (idx < n_frames) {
+			out->state = LATENCY_ACTIVE;
+			info("test/output %s: ts=%" PRIu64 " output noisy after %d frames",
+			     output->name, output->pts, out->silent_frames_count);
+		}
+		break;
+	case LATENCY_ACTIVE:
+	case LATENCY_DONE:
+		break;
+	}
+
+	if (out->state == LATENCY_DONE)
+		return;
+
+	/* capture left channel until the marker has been fully output */
+	for (size_t i = 0; i < n_frames; i++) {
+		if (out->n_captured == LATENCY_CAPTURE_FRAMES ||
+		    (out->state == LATENCY_ACTIVE &&
+		     out->n_captured >= out->silent_frames_count +
+		     LATENCY_TAIL_FRAMES)) {
+			out->state = LATENCY_DONE;
 			break;
 		}
+
+		out->capture[out->n_captured++] = data[i * channels];
 	}
 }
 
 static const struct input_desc latency_inputs[] = {
-	{ "sys", QD_INPUT_SYS_SOUND, "lavfi",
-		"sine=sample_rate=48000:frequency=997" },
-	{ "app", QD_INPUT_APP_SOUND, "lavfi",
-		"sine=sample_rate=48000:frequency=997" },
-	{ "ott", QD_INPUT_OTT_SOUND, "lavfi",
-		"sine=sample_rate=48000:frequency=997" },
-	{ "ext", QD_INPUT_EXT_PCM, "lavfi",
-		"sine=sample_rate=48000:frequency=997" },
+	{ "sys", QD_INPUT_SYS_SOUND, NULL, LATENCY_MARKER },
+	{ "app", QD_INPUT_APP_SOUND, NULL, LATENCY_MARKER },
+	{ "ott", QD_INPUT_OTT_SOUND, NULL, LATENCY_MARKER },
+	{ "ext", QD_INPUT_EXT_PCM, NULL, LATENCY_MARKER },
 	{ "ddp", QD_INPUT_MAIN, NULL,
 		"Elementary_Streams/Reference_Level/Ref_997_200_48k_20dB_ddp.ec3" },
 	{ "aac_adts", QD_INPUT_MAIN, NULL,
 		"Elementary_Streams/Reference_Level/Ref_997_200_48k_20dB_heaac.adts" },
 	{ "aac_loas", QD_INPUT_MAIN, NULL,
 		"Elementary_Streams/Reference_Level/Ref_997_200_48k_20dB_heaac.loas" },
+	{ "gen_ddp", QD_INPUT_MAIN, NULL, LATENCY_MARKER ":codec=eac3" },
+	{ "gen_aac", QD_INPUT_MAIN, NULL, LATENCY_MARKER ":codec=aac" },
 	{ },
 };
 
@@ -2548,6 +3683,8 @@ test_ms12_latency(const MunitParameter params[], void *user_data_or_fixture)
 	const char *url;
 	const char *v;
 	struct latency_ctx ctx = {};
+	float marker[LATENCY_MARKER_MS * 48];
+	bool has_marker;
 	int latency;
 
 	pthread_mutex_init(&ctx.output_lock, NULL);
@@ -2556,11 +3693,19 @@ test_ms12_latency(const MunitParameter params[], void *user_data_or_fixture)
 	if (!(session = setup_ms12_session(params)))
 		return MUNIT_SKIP;
 
+	for (size_t i = 0; i < QD_MAX_OUTPUTS; i++) {
+		ctx.outputs[i].capture =
+			calloc(LATENCY_CAPTURE_FRAMES, sizeof (int16_t));
+		assert_not_null(ctx.outputs[i].capture);
+	}
+
 	qd_session_set_output_cb(session, latency_output_cb, &ctx);
 	qd_session_set_buffer_size_ms(session, 32);
 
 	/* play a few frames of ac3 silence data */
-	assert_not_null((src = ffmpeg_src_create("/data/silence.ac3", NULL)));
+	url = resolve_test_file("gen:silence:codec=ac3:duration=1");
+	assert_not_null(url);
+	assert_not_null((src = ffmpeg_src_create(url, NULL)));
 	assert_not_null((input = ffmpeg_src_add_input(src, 0, session,
 						      QD_INPUT_MAIN)));
 
@@ -2576,10 +3721,15 @@ test_ms12_latency(const MunitParameter params[], void *user_data_or_fixture)
 	if (!(input_desc = find_input(latency_inputs, v)))
 		return MUNIT_ERROR;
 
-	if (input_desc->format && !strcmp(input_desc->format, "lavfi"))
-		url = input_desc->url;
-	else
-		url = resolve_test_file(input_desc->url);
+	/* generated inputs start with the marker, as rendered before
+	 * encoding */
+	has_marker = qd_gen_is_spec(input_desc->url);
+	if (has_marker)
+		assert_int(0, ==, qd_gen_render(input_desc->url, marker,
+						QD_N_ELEMENTS(marker)));
+
+	url = resolve_test_file(input_desc->url);
+	assert_not_null(url);
 
 	assert_not_null((src = ffmpeg_src_create(url, input_desc->format)));
 	assert_not_null((input = ffmpeg_src_add_input(src, 0, session,
@@ -2587,8 +3737,8 @@ test_ms12_latency(const MunitParameter params[], void *user_data_or_fixture)
 
 	latency = qd_input_get_latency(src->streams[0].input);
 
-	/* play starting in non-silent data */
-	if (!input_desc->format || strcmp(input_desc->format, "lavfi") != 0)
+	/* play conformance files starting in non-silent data */
+	if (!has_marker)
 		assert_int(0, ==, ffmpeg_src_seek(src, 14000));
 
 	pthread_mutex_lock(&ctx.output_lock);
@@ -2604,8 +3754,9 @@ test_ms12_latency(const MunitParameter params[], void *user_data_or_fixture)
 	pthread_mutex_unlock(&ctx.output_lock);
 
 	/* feed some more data if needed, but unlocked as we block waiting for
-	 * the input buffer to be consumed */
-	for (int i = 0; i < 3; i++)
+	 * the input buffer to be consumed, enough for the whole marker to be
+	 * output */
+	for (int i = 0; i < 11; i++)
 		ffmpeg_src_read_frame(src);
 
 	pthread_mutex_lock(&ctx.output_lock);
@@ -2616,7 +3767,7 @@ test_ms12_latency(const MunitParameter params[], void *user_data_or_fixture)
 
 		for (size_t i = 0; i < QD_MAX_OUTPUTS; i++) {
 			if (session->outputs[i].enabled &&
-			    ctx.outputs[i].state != 2)
+			    ctx.outputs[i].state != LATENCY_DONE)
 				done = false;
 		}
 
@@ -2631,25 +3782,46 @@ test_ms12_latency(const MunitParameter params[], void *user_data_or_fixture)
 	/* verify measured latency is close to latency reported by QAP */
 	for (size_t i = 0; i < QD_MAX_OUTPUTS; i++) {
 		struct qd_output *output = &session->outputs[i];
-		int measured_latency;
+		struct latency_out *out = &ctx.outputs[i];
+		double measured_latency;
+		double lag, ncc;
 
 		if (!output->enabled || !qd_format_is_pcm(output->config.format))
 			continue;
 
-		measured_latency = ctx.outputs[i].silent_frames_count *
-			1000 / output->config.sample_rate;
+		if (has_marker) {
+			assert_true(marker_find(out->capture, out->n_captured,
+						marker, QD_N_ELEMENTS(marker),
+						&lag, &ncc));
+
+			measured_latency = lag * 1000 /
+				output->config.sample_rate;
 
-		info("out %s: silent_frames=%d latency=%d measured=%d",
-		     output->name, ctx.outputs[i].silent_frames_count,
-		     latency, measured_latency);
+			info("out %s: lag=%.2f ncc=%.3f latency=%d measured=%.2fms",
+			     output->name, lag, ncc, latency,
+			     measured_latency);
+
+			/* make sure the peak is the marker and not noise */
+			assert_double(ncc, >=, LATENCY_MIN_NCC);
+		} else {
+			measured_latency = out->silent_frames_count *
+				1000.0 / output->config.sample_rate;
+
+			info("out %s: silent_frames=%d latency=%d measured=%.2fms",
+			     output->name, out->silent_frames_count,
+			     latency, measured_latency);
+		}
 
-		munit_assert_int(latency + 16, >=, measured_latency);
-		munit_assert_int(latency - 16, <=, measured_latency);
+		munit_assert_double(latency + 16, >=, measured_latency);
+		munit_assert_double(latency - 16, <=, measured_latency);
 	}
 
 	ffmpeg_src_destroy(src);
 	qd_session_destroy(session);
 
+	for (size_t i = 0; i < QD_MAX_OUTPUTS; i++)
+		free(ctx.outputs[i].capture);
+
 	pthread_cond_destroy(&ctx.output_cond);
 	pthread_mutex_destroy(&ctx.output_lock);
 
@@ -2657,7 +3829,8 @@ test_ms12_latency(const MunitParameter params[], void *user_data_or_fixture)
 }
 
 static char *parm_ms12_files_latency[] = {
-	"sys", "app", "ott", "ext", "ddp", "aac_adts", "aac_loas", NULL
+	"sys", "app", "ott", "ext", "ddp", "aac_adts", "aac_loas",
+	"gen_ddp", "gen_aac", NULL
 };
 
 static MunitParameterEnum parms_ms12_latency[] = {
@@ -2668,74 +3841,1409 @@ static MunitParameterEnum parms_ms12_latency[] = {
 };
 
 /*
- * MS12 test suite
+ * MS12: randomized soak test of input state transitions
+ *
+ * Random sequences of start, pause, stop, flush, block and send_eos commands
+ * are sent to all inputs at a high rate, while feeder threads loop generated
+ * inputs in a realtime session. The sequence only depends on the munit seed,
+ * so a failing run can be replayed with --seed. Run longer soaks with e.g.
+ * --param duration 3600.
+ *
+ * Verify that:
+ * - outputs do not stall for more than max_stall_ms while an input plays
+ * - no command takes more than max_stall_ms
+ * - output positions are monotonic, and timestamps only go back after a
+ *   flush, a stop or an input loop
+ * - all libqd allocations are released once the session is destroyed
+ *
+ * The latency distribution of each command is reported at the end.
  */
 
-static MunitTest ms12_tests[] = {
-	{ "/ms12/channel_sweep",
-	  test_ms12_channel_sweep,
-	  pretest_ms12, NULL,
-	  MUNIT_TEST_OPTION_NONE, parms_ms12_channel_sweep },
-	{ "/ms12/assoc_mix",
-	  test_ms12_assoc_mix,
-	  pretest_ms12, NULL,
-	  MUNIT_TEST_OPTION_NONE, parms_ms12_assoc_mix },
-	{ "/ms12/assoc_disappearing",
-	  test_ms12_assoc_disappearing,
-	  pretest_ms12, NULL,
-	  MUNIT_TEST_OPTION_NONE, parms_ms12_assoc_disappearing },
-	{ "/ms12/main2_mix",
-	  test_ms12_main2_mix,
-	  pretest_ms12, NULL,
-	  MUNIT_TEST_OPTION_NONE, parms_ms12_main2_mix },
-	{ "/ms12/stereo_downmix",
-	  test_ms12_stereo_downmix,
-	  pretest_ms12, NULL,
-	  MUNIT_TEST_OPTION_NONE, parms_ms12_stereo_downmix },
-	{ "/ms12/drc",
-	  test_ms12_drc,
-	  pretest_ms12, NULL,
-	  MUNIT_TEST_OPTION_NONE, parms_ms12_drc },
-	{ "/ms12/pause",
-	  test_ms12_pause,
-	  pretest_ms12, NULL,
-	  MUNIT_TEST_OPTION_NONE, parms_ms12_pause },
-	{ "/ms12/output_reconfig",
-	  test_ms12_output_reconfig,
-	  pretest_ms12, NULL,
-	  MUNIT_TEST_OPTION_NONE, parms_ms12_output_reconfig },
-	{ "/ms12/flush",
-	  test_ms12_flush,
-	  pretest_ms12, NULL,
-	  MUNIT_TEST_OPTION_NONE, parms_ms12_flush },
-	{ "/ms12/flush2",
-	  test_ms12_flush2,
-	  pretest_ms12, NULL,
-	  MUNIT_TEST_OPTION_NONE, parms_ms12_flush2 },
-	{ "/ms12/flush3",
-	  test_ms12_flush3,
-	  pretest_ms12, NULL,
-	  MUNIT_TEST_OPTION_NONE, parms_ms12_flush3 },
-	{ "/ms12/eos",
-	  test_ms12_eos,
-	  pretest_ms12, NULL,
-	  MUNIT_TEST_OPTION_NONE, parms_ms12_eos },
-	{ "/ms12/latency",
-	  test_ms12_latency,
-	  pretest_ms12, NULL,
-	  MUNIT_TEST_OPTION_NONE, parms_ms12_latency },
-	{ },
+enum soak_cmd {
+	SOAK_CMD_START,
+	SOAK_CMD_PAUSE,
+	SOAK_CMD_STOP,
+	SOAK_CMD_FLUSH,
+	SOAK_CMD_BLOCK,
+	SOAK_CMD_UNBLOCK,
+	SOAK_CMD_EOS,
+	SOAK_CMD_COUNT,
 };
 
-static const MunitSuite test_suite = {
-	"",				/* name */
-	ms12_tests,			/* tests */
-	NULL,				/* suites */
-	1,				/* iterations */
-	MUNIT_SUITE_OPTION_NONE,	/* options */
+static const char *soak_cmd_names[SOAK_CMD_COUNT] = {
+	[SOAK_CMD_START] = "start",
+	[SOAK_CMD_PAUSE] = "pause",
+	[SOAK_CMD_STOP] = "stop",
+	[SOAK_CMD_FLUSH] = "flush",
+	[SOAK_CMD_BLOCK] = "block",
+	[SOAK_CMD_UNBLOCK] = "unblock",
+	[SOAK_CMD_EOS] = "send_eos",
 };
 
-int main(int argc, char **argv)
+#define SOAK_MAX_INPUTS		3
+
+/* munit_rand_int_range() divides by the range, which must not be empty */
+static int
+random_index(int n)
+{
+	return n > 1 ? munit_rand_int_range(0, n - 1) : 0;
+}
+
+struct soak_input {
+	struct soak_ctx *ctx;
+	struct ffmpeg_src *src;
+	struct qd_input *input;
+	pthread_t tid;
+	bool blocked;
+	bool eos;
+	bool active;
+	uint64_t active_time;
+	uint64_t loops;
+	uint64_t write_errors;
+};
+
+struct soak_output {
+	uint64_t n_buffers;
+	uint64_t last_pts;
+	int64_t last_ts;
+	uint64_t last_time;
+	bool discont;
+	uint64_t max_gap;
+};
+
+struct soak_ctx {
+	pthread_mutex_t lock;
+	struct soak_input inputs[SOAK_MAX_INPUTS];
+	int n_inputs;
+	struct soak_output outputs[QD_MAX_OUTPUTS];
+	struct qd_histogram cmd_latency[SOAK_CMD_COUNT];
+};
+
+static const struct input_desc soak_inputs[] = {
+	{ "main", QD_INPUT_MAIN, NULL, GEN_REF_997_DDP },
+	{ "sys", QD_INPUT_SYS_SOUND, NULL,
+		"gen:tone:freq=440:gain=-20:duration=60" },
+	{ "app", QD_INPUT_APP_SOUND, NULL,
+		"gen:tone:freq=660:gain=-20:duration=60" },
+	{ },
+};
+
+static void
+soak_set_discont(struct soak_ctx *ctx)
+{
+	pthread_mutex_lock(&ctx->lock);
+	for (size_t i = 0; i < QD_MAX_OUTPUTS; i++)
+		ctx->outputs[i].discont = true;
+	pthread_mutex_unlock(&ctx->lock);
+}
+
+static void
+soak_output_cb(struct qd_output *output, qap_audio_buffer_t *buffer,
+	       void *userdata)
+{
+	struct soak_ctx *ctx = userdata;
+	struct soak_output *out = &ctx->outputs[output->id];
+	int64_t ts = buffer->common_params.timestamp;
+	uint64_t now = qd_get_time();
+
+	pthread_mutex_lock(&ctx->lock);
+
+	if (out->n_buffers > 0) {
+		assert_uint64(output->pts, >, out->last_pts);
+
+		if (ts < out->last_ts && !out->discont) {
+			munit_logf(MUNIT_LOG_ERROR,
+				   "out %s: timestamp went back from %" PRIi64
+				   " to %" PRIi64, output->name,
+				   out->last_ts, ts);
+		}
+		assert_true(ts >= out->last_ts || out->discont);
+
+		out->max_gap = QD_MAX(out->max_gap, now - out->last_time);
+	}
+
+	out->n_buffers++;
+	out->last_pts = output->pts;
+	out->last_ts = ts;
+	out->last_time = now;
+	out->discont = false;
+
+	pthread_mutex_unlock(&ctx->lock);
+}
+
+/* feed the input in a loop, until the source is terminated */
+static void *
+soak_feed_thread(void *userdata)
+{
+	struct soak_input *in = userdata;
+	struct soak_ctx *ctx = in->ctx;
+	int ret;
+
+	while (!in->src->terminated) {
+		ret = ffmpeg_src_read_frame(in->src);
+		if (ret == AVERROR_EOF) {
+			if (ffmpeg_src_seek(in->src, 0))
+				break;
+			in->loops++;
+			soak_set_discont(ctx);
+			continue;
+		}
+
+		/* writes may fail during transitions, keep going */
+		if (ret < 0 && !in->src->terminated) {
+			in->write_errors++;
+			usleep(10000);
+		}
+	}
+
+	return NULL;
+}
+
+static void
+soak_run_cmd(struct soak_ctx *ctx, struct soak_input *in, enum soak_cmd cmd,
+	     int max_stall_ms)
 {
+	uint64_t t, elapsed;
+	int ret = 0;
+
+	t = qd_get_time();
+
+	switch (cmd) {
+	case SOAK_CMD_START:
+		ret = qd_input_start(in->input);
+		break;
+	case SOAK_CMD_PAUSE:
+		ret = qd_input_pause(in->input);
+		break;
+	case SOAK_CMD_STOP:
+		soak_set_discont(ctx);
+		ret = qd_input_stop(in->input);
+		break;
+	case SOAK_CMD_FLUSH:
+		soak_set_discont(ctx);
+		ret = qd_input_flush(in->input);
+		break;
+	case SOAK_CMD_BLOCK:
+		ret = qd_input_block(in->input, true);
+		in->blocked = true;
+		break;
+	case SOAK_CMD_UNBLOCK:
+		ret = qd_input_block(in->input, false);
+		in->blocked = false;
+		break;
+	case SOAK_CMD_EOS:
+		ret = qd_input_send_eos(in->input);
+		break;
+	case SOAK_CMD_COUNT:
+		break;
+	}
+
+	elapsed = qd_get_time() - t;
+	qd_histogram_add(&ctx->cmd_latency[cmd], elapsed);
+
+	/* track when the input last started to play, an input waiting for
+	 * data after send_eos is not expected to produce output */
+	if (cmd == SOAK_CMD_EOS)
+		in->eos = true;
+	else if (cmd == SOAK_CMD_START || cmd == SOAK_CMD_STOP ||
+		 cmd == SOAK_CMD_FLUSH)
+		in->eos = false;
+
+	if (in->active != (in->input->state == QD_INPUT_STATE_STARTED &&
+			   !in->blocked && !in->eos)) {
+		in->active = !in->active;
+		in->active_time = t + elapsed;
+	}
+
+	if (ret || elapsed > max_stall_ms * QD_MSECOND) {
+		munit_logf(MUNIT_LOG_ERROR, "in %s: %s returned %d after %" PRIu64 "us",
+			   in->input->name, soak_cmd_names[cmd], ret, elapsed);
+	}
+
+	assert_int(ret, ==, 0);
+	assert_uint64(elapsed, <=, max_stall_ms * QD_MSECOND);
+}
+
+/* outputs are expected to run while an input has been playing for a while */
+static void
+soak_check_stalls(struct soak_ctx *ctx, struct qd_session *session,
+		  int max_stall_ms)
+{
+	uint64_t now = qd_get_time();
+	uint64_t stall = max_stall_ms * QD_MSECOND;
+	bool playing = false;
+
+	for (int i = 0; i < ctx->n_inputs; i++) {
+		struct soak_input *in = &ctx->inputs[i];
+
+		if (in->active && now - in->active_time > stall)
+			playing = true;
+	}
+
+	if (!playing)
+		return;
+
+	pthread_mutex_lock(&ctx->lock);
+	for (size_t i = 0; i < QD_MAX_OUTPUTS; i++) {
+		struct soak_output *out = &ctx->outputs[i];
+
+		if (!session->outputs[i].enabled || out->n_buffers == 0)
+			continue;
+
+		if (now - out->last_time > stall) {
+			munit_logf(MUNIT_LOG_ERROR,
+				   "out %s: no buffer for %" PRIu64 "ms",
+				   session->outputs[i].name,
+				   (now - out->last_time) / QD_MSECOND);
+		}
+		assert_uint64(now - out->last_time, <=, stall);
+	}
+	pthread_mutex_unlock(&ctx->lock);
+}
+
+static MunitResult
+test_ms12_soak(const MunitParameter params[], void *user_data_or_fixture)
+{
+	struct qd_session *session;
+	struct qd_mem_stats mem_before, mem_after;
+	struct soak_ctx ctx = {};
+	char inputs[64];
+	char *saveptr;
+	char *tok;
+	const char *v;
+	uint64_t end_time;
+	uint64_t n_cmds = 0;
+	int max_stall_ms;
+	int max_interval_ms;
+
+	qd_mem_get_stats(&mem_before);
+
+	if (!(session = setup_ms12_session(params)))
+		return MUNIT_SKIP;
+
+	pthread_mutex_init(&ctx.lock, NULL);
+
+	qd_session_set_output_cb(session, soak_output_cb, &ctx);
+	qd_session_set_realtime(session, true);
+
+	max_stall_ms = atoi(munit_parameters_get(params, "max_stall_ms"));
+	max_interval_ms = atoi(munit_parameters_get(params, "max_interval_ms"));
+	end_time = qd_get_time() +
+		atoi(munit_parameters_get(params, "duration")) * QD_SECOND;
+
+	/* create inputs and their feeder threads */
+	v = munit_parameters_get(params, "i");
+	snprintf(inputs, sizeof (inputs), "%s", v);
+
+	for (tok = strtok_r(inputs, "+", &saveptr); tok;
+	     tok = strtok_r(NULL, "+", &saveptr)) {
+		const struct input_desc *desc;
+		struct soak_input *in;
+		const char *url;
+
+		if (!(desc = find_input(soak_inputs, tok)) ||
+		    ctx.n_inputs == SOAK_MAX_INPUTS)
+			return MUNIT_ERROR;
+
+		in = &ctx.inputs[ctx.n_inputs++];
+		in->ctx = &ctx;
+
+		assert_not_null((url = resolve_test_file(desc->url)));
+		assert_not_null((in->src = ffmpeg_src_create(url, NULL)));
+		assert_not_null((in->input = ffmpeg_src_add_input(in->src, 0,
+								  session,
+								  desc->input_id)));
+		assert_int(0, ==, pthread_create(&in->tid, NULL,
+						 soak_feed_thread, in));
+	}
+
+	/* random commands on random inputs */
+	while (qd_get_time() < end_time) {
+		struct soak_input *in;
+		enum soak_cmd cmd;
+
+		in = &ctx.inputs[random_index(ctx.n_inputs)];
+		cmd = random_index(SOAK_CMD_COUNT);
+
+		soak_run_cmd(&ctx, in, cmd, max_stall_ms);
+		n_cmds++;
+
+		usleep(random_index(max_interval_ms + 1) * 1000);
+
+		soak_check_stalls(&ctx, session, max_stall_ms);
+	}
+
+	/* stop feeding */
+	for (int i = 0; i < ctx.n_inputs; i++) {
+		struct soak_input *in = &ctx.inputs[i];
+
+		qd_input_block(in->input, false);
+		ffmpeg_src_thread_stop(in->src);
+		pthread_join(in->tid, NULL);
+	}
+
+	/* report */
+	info("soak: %" PRIu64 " commands", n_cmds);
+
+	for (int i = 0; i < SOAK_CMD_COUNT; i++) {
+		const struct qd_histogram *h = &ctx.cmd_latency[i];
+
+		info("soak: %-8s count=%" PRIu64 " p50=%" PRIu64 "us p90=%"
+		     PRIu64 "us p99=%" PRIu64 "us max=%" PRIu64 "us",
+		     soak_cmd_names[i], h->count,
+		     qd_histogram_percentile(h, 0.50),
+		     qd_histogram_percentile(h, 0.90),
+		     qd_histogram_percentile(h, 0.99), h->max);
+	}
+
+	for (int i = 0; i < ctx.n_inputs; i++) {
+		struct soak_input *in = &ctx.inputs[i];
+
+		info("soak: in %s: loops=%" PRIu64 " write_errors=%" PRIu64,
+		     in->input->name, in->loops, in->write_errors);
+	}
+
+	for (size_t i = 0; i < QD_MAX_OUTPUTS; i++) {
+		if (!session->outputs[i].enabled)
+			continue;
+
+		info("soak: out %s: buffers=%" PRIu64 " max_gap=%" PRIu64 "ms",
+		     session->outputs[i].name, ctx.outputs[i].n_buffers,
+		     ctx.outputs[i].max_gap / QD_MSECOND);
+	}
+
+	for (int i = 0; i < ctx.n_inputs; i++)
+		ffmpeg_src_destroy(ctx.inputs[i].src);
+	qd_session_destroy(session);
+
+	pthread_mutex_destroy(&ctx.lock);
+
+	/* everything allocated for the session must have been released, the
+	 * log and trace buffers live as long as the process */
+	qd_mem_get_stats(&mem_after);
+
+	for (int i = 0; i < QD_MEM_TYPE_COUNT; i++) {
+		if (i == QD_MEM_LOG || i == QD_MEM_TRACE)
+			continue;
+
+		if (mem_after.types[i].bytes > mem_before.types[i].bytes) {
+			munit_logf(MUNIT_LOG_ERROR,
+				   "%s: %" PRIu64 " bytes leaked",
+				   qd_mem_type_to_str(i),
+				   mem_after.types[i].bytes -
+				   mem_before.types[i].bytes);
+		}
+		assert_uint64(mem_after.types[i].bytes, <=,
+			      mem_before.types[i].bytes);
+	}
+
+	return MUNIT_OK;
+}
+
+static char *parm_ms12_inputs_soak[] = {
+	"main", "main+sys", "main+sys+app", NULL
+};
+
+static char *parm_ms12_duration_soak[] = {
+	"10", NULL
+};
+
+static char *parm_ms12_max_stall_soak[] = {
+	"500", NULL
+};
+
+static char *parm_ms12_max_interval_soak[] = {
+	"50", NULL
+};
+
+static MunitParameterEnum parms_ms12_soak[] = {
+	{ "t", parm_ms12_sessions_ott_only },
+	{ "o", parm_ms12_outputs_pcm_stereo },
+	{ "i", parm_ms12_inputs_soak },
+	{ "duration", parm_ms12_duration_soak },
+	{ "max_stall_ms", parm_ms12_max_stall_soak },
+	{ "max_interval_ms", parm_ms12_max_interval_soak },
+	{ NULL, NULL },
+};
+
+/*
+ * MS12: test gapless playlists
+ *
+ * Play a playlist of generated tones of the same format into the main input.
+ * Verify there is no gap between items: the output must not be silent for
+ * more than a few ms once started, must last as long as all the items, and
+ * its timestamps must be continuous when the session uses them.
+ */
+
+#define PLAYLIST_ITEM_MS	2000
+#define PLAYLIST_MAX_GAP_MS	10
+
+struct playlist_ctx {
+	bool started;
+	bool silent;
+	size_t silent_frames;
+	size_t max_gap;
+	uint64_t max_gap_pts;
+	uint64_t first_pts;
+	uint64_t last_pts;
+};
+
+static void
+playlist_output_cb(struct qd_output *output, qap_audio_buffer_t *buffer,
+		   void *userdata)
+{
+	struct playlist_ctx *ctx = userdata;
+	const int16_t *data = buffer->common_params.data;
+	int channels = output->config.channels;
+	size_t frame_size;
+	size_t n_frames;
+	size_t i = 0;
+
+	assert_int(output->config.sample_rate, ==, 48000);
+	assert_int(output->config.bit_width, ==, 16);
+
+	frame_size = channels * output->config.bit_width / 8;
+	n_frames = buffer->common_params.size / frame_size;
+
+	/* alternate between silent and non-silent runs of L/R, only runs
+	 * followed by sound count as gaps */
+	while (i < n_frames) {
+		const int16_t *p = data + i * channels;
+		uint64_t pts;
+		size_t n;
+
+		if (!ctx->started || ctx->silent) {
+			n = audio_find_non_silent_s16(p, n_frames - i, channels,
+						      0, 2,
+						      AUDIO_SILENCE_THRESHOLD_S16);
+			ctx->silent_frames += n;
+			i += n;
+			if (i == n_frames)
+				break;
+
+			pts = output->pts + i * QD_SECOND / 48000;
+			if (!ctx->started) {
+				ctx->first_pts = pts;
+				ctx->started = true;
+			} else if (ctx->silent_frames > ctx->max_gap) {
+				ctx->max_gap = ctx->silent_frames;
+				ctx->max_gap_pts = pts;
+			}
+
+			ctx->silent = false;
+			ctx->silent_frames = 0;
+		} else {
+			n = audio_find_silent_s16(p, n_frames - i, channels,
+						  0, 2, AUDIO_SILENCE_THRESHOLD_S16);
+			i += n;
+			ctx->last_pts = output->pts + i * QD_SECOND / 48000;
+			if (i < n_frames)
+				ctx->silent = true;
+		}
+	}
+}
+
+static const struct file_alias playlist_codecs[] = {
+	{ "ddp", "eac3" },
+	{ "aac", "aac" },
+	{ NULL, NULL }
+};
+
+static MunitResult
+test_ms12_playlist(const MunitParameter params[], void *user_data_or_fixture)
+{
+	static const int freqs[] = { 440, 997, 1500 };
+	struct qd_session *session;
+	struct qd_output *output;
+	struct ffmpeg_src *src;
+	struct playlist_ctx ctx = {};
+	char paths[QD_N_ELEMENTS(freqs)][PATH_MAX];
+	const char *urls[QD_N_ELEMENTS(freqs)];
+	const char *v, *codec;
+	uint64_t span;
+
+	if (!(session = setup_ms12_session(params)))
+		return MUNIT_SKIP;
+
+	qd_session_set_output_cb(session, playlist_output_cb, &ctx);
+
+	v = munit_parameters_get(params, "f");
+	if (!(codec = find_filename(playlist_codecs, v)))
+		return MUNIT_ERROR;
+
+	for (size_t i = 0; i < QD_N_ELEMENTS(freqs); i++) {
+		char spec[128];
+		const char *path;
+
+		snprintf(spec, sizeof (spec),
+			 "gen:tone:codec=%s:freq=%d:gain=-20:duration=%g",
+			 codec, freqs[i], PLAYLIST_ITEM_MS / 1000.0);
+
+		assert_not_null((path = resolve_test_file(spec)));
+		snprintf(paths[i], sizeof (paths[i]), "%s", path);
+		urls[i] = paths[i];
+	}
+
+	assert_not_null((src = ffmpeg_src_create_playlist(urls,
+							  QD_N_ELEMENTS(urls),
+							  NULL)));
+	assert_not_null(ffmpeg_src_add_input(src, -1, session, QD_INPUT_MAIN));
+
+	/* play all items and drain */
+	assert_int(0, ==, ffmpeg_src_thread_start(src));
+	assert_int(0, ==, ffmpeg_src_thread_join(src));
+	assert_int(0, ==, ffmpeg_src_wait_eos(src, true, 2 * QD_SECOND));
+
+	output = qd_session_get_output(session, QD_OUTPUT_STEREO);
+	span = ctx.last_pts - ctx.first_pts;
+
+	info("playlist: %" PRIu64 "ms of audio, longest gap %zu frames at "
+	     "%" PRIu64 "ms, %" PRIu64 " pts resets", span / QD_MSECOND,
+	     ctx.max_gap, ctx.max_gap_pts / QD_MSECOND, output->pts_resets);
+
+	assert_true(ctx.started);
+	assert_size(ctx.max_gap, <=, PLAYLIST_MAX_GAP_MS * 48);
+	assert_uint64(span, >=, (QD_N_ELEMENTS(freqs) * PLAYLIST_ITEM_MS -
+				 100) * QD_MSECOND);
+
+	if (qd_session_uses_timestamps(session))
+		assert_uint64(output->pts_resets, ==, 0);
+
+	ffmpeg_src_destroy(src);
+	qd_session_destroy(session);
+
+	return MUNIT_OK;
+}
+
+static char *parm_ms12_files_playlist[] = {
+	"ddp", "aac", NULL
+};
+
+static MunitParameterEnum parms_ms12_playlist[] = {
+	{ "t", parm_ms12_sessions_all },
+	{ "o", parm_ms12_outputs_pcm_stereo },
+	{ "f", parm_ms12_files_playlist },
+	{ NULL, NULL },
+};
+
+/*
+ * Audio analysis helpers
+ *
+ * Compare the vectorized silence searches and the level measurements with
+ * scalar references, on random data of odd lengths, with every stride and
+ * channel range, so that partial vectors and lane mask periods are covered.
+ */
+
+static const size_t analysis_lengths[] = { 0, 1, 3, 7, 17, 101, 1001 };
+
+static size_t
+ref_find(const int16_t *data, size_t n_frames, int stride, int first,
+	 int count, int16_t threshold, bool silent)
+{
+	for (size_t f = 0; f < n_frames; f++) {
+		bool loud = false;
+
+		for (int c = first; c < first + count; c++) {
+			int s = data[f * stride + c];
+
+			if (s > threshold || s < -threshold)
+				loud = true;
+		}
+
+		if (loud != silent)
+			return f;
+	}
+
+	return n_frames;
+}
+
+static int16_t
+random_sample(bool loud, int16_t threshold)
+{
+	int v;
+
+	if (!loud)
+		return munit_rand_int_range(-threshold, threshold);
+
+	v = munit_rand_int_range(threshold + 1, 32768);
+
+	return munit_rand_int_range(0, 1) ? -v : QD_MIN(v, 32767);
+}
+
+static MunitResult
+test_analysis_silence(const MunitParameter params[], void *user_data)
+{
+	const int16_t thr16 = AUDIO_SILENCE_THRESHOLD_S16;
+	const int32_t thr32 = AUDIO_SILENCE_THRESHOLD_S32;
+	size_t max_samples = 1001 * AUDIO_MAX_CHANNELS;
+	int16_t *s16 = calloc(max_samples, sizeof (*s16));
+	int32_t *s32 = calloc(max_samples, sizeof (*s32));
+
+	assert_not_null(s16);
+	assert_not_null(s32);
+
+	for (size_t l = 0; l < QD_N_ELEMENTS(analysis_lengths); l++) {
+		size_t n_frames = analysis_lengths[l];
+
+		for (int stride = 1; stride <= AUDIO_MAX_CHANNELS; stride++) {
+			int first = random_index(stride);
+			int count = 1 + random_index(stride - first);
+			size_t n = n_frames * stride;
+			size_t pos = random_index(n_frames);
+
+			/* quiet data with a few loud samples from pos on,
+			 * some of them outside of the channel range */
+			for (size_t i = 0; i < n; i++) {
+				bool loud = i / stride >= pos &&
+					munit_rand_int_range(0, 3) == 0;
+
+				s16[i] = random_sample(loud, thr16);
+				s32[i] = (int32_t)s16[i] * 65536;
+			}
+
+			assert_size(audio_find_non_silent_s16(s16, n_frames,
+							      stride, first,
+							      count, thr16),
+				    ==, ref_find(s16, n_frames, stride, first,
+						 count, thr16, false));
+			assert_size(audio_find_non_silent_s32(s32, n_frames,
+							      stride, first,
+							      count, thr32),
+				    ==, ref_find(s16, n_frames, stride, first,
+						 count, thr16, false));
+			assert_size(audio_find_silent_s16(s16, n_frames,
+							  stride, first,
+							  count, thr16),
+				    ==, ref_find(s16, n_frames, stride, first,
+						 count, thr16, true));
+		}
+	}
+
+	free(s16);
+	free(s32);
+
+	return MUNIT_OK;
+}
+
+static void
+check_levels(const struct audio_levels *levels, const int16_t *data,
+	     size_t n_frames, int channels)
+{
+	assert_int(levels->channels, ==, channels);
+	assert_size(levels->n_frames, ==, n_frames);
+
+	for (int c = 0; c < channels; c++) {
+		long double sum = 0, sum_sq = 0;
+		int peak = 0;
+
+		for (size_t f = 0; f < n_frames; f++) {
+			int s = data[f * channels + c];
+
+			sum += s;
+			sum_sq += (long double)s * s;
+			peak = QD_MAX(peak, abs(s));
+		}
+
+		if (n_frames == 0) {
+			assert_double(levels->peak[c], ==, 0);
+			assert_double(levels->rms[c], ==, 0);
+			assert_double(levels->dc[c], ==, 0);
+			continue;
+		}
+
+		assert_double_equal(levels->peak[c], peak / 32768.0, 9);
+		assert_double_equal(levels->rms[c],
+				    sqrtl(sum_sq / n_frames) / 32768.0, 9);
+		assert_double_equal(levels->dc[c],
+				    sum / n_frames / 32768.0, 9);
+	}
+}
+
+static MunitResult
+test_analysis_levels(const MunitParameter params[], void *user_data)
+{
+	size_t max_samples = 1001 * AUDIO_MAX_CHANNELS;
+	int16_t *s16 = calloc(max_samples, sizeof (*s16));
+	int32_t *s32 = calloc(max_samples, sizeof (*s32));
+	struct audio_levels levels;
+
+	assert_not_null(s16);
+	assert_not_null(s32);
+
+	for (size_t l = 0; l < QD_N_ELEMENTS(analysis_lengths); l++) {
+		size_t n_frames = analysis_lengths[l];
+
+		for (int ch = 1; ch <= AUDIO_MAX_CHANNELS; ch++) {
+			/* offset every channel by its own DC, within
+			 * +/-2048 */
+			for (size_t i = 0; i < n_frames * ch; i++) {
+				int dc = (int)(i % ch) * 256 - 2048;
+
+				s16[i] = dc + munit_rand_int_range(-8000, 8000);
+				s32[i] = (int32_t)s16[i] * 65536;
+			}
+
+			assert_int(0, ==, audio_get_levels_s16(s16, n_frames,
+							       ch, &levels));
+			check_levels(&levels, s16, n_frames, ch);
+
+			assert_int(0, ==, audio_get_levels_s32(s32, n_frames,
+							       ch, &levels));
+			check_levels(&levels, s16, n_frames, ch);
+
+			/* the first channel is offset by -2048, the noise
+			 * averages out on long buffers */
+			if (n_frames >= 1001) {
+				assert_true(audio_levels_check_dc(&levels,
+								  0.1));
+				assert_false(audio_levels_check_dc(&levels,
+								   0.01));
+			}
+		}
+	}
+
+	/* full scale negative samples */
+	for (size_t i = 0; i < 16; i++)
+		s32[i] = INT32_MIN;
+	assert_int(0, ==, audio_get_levels_s32(s32, 16, 1, &levels));
+	assert_double(levels.peak[0], ==, 1.0);
+	assert_double(levels.dc[0], ==, -1.0);
+
+	assert_int(-1, ==, audio_get_levels_s16(s16, 1, 0, &levels));
+	assert_int(-1, ==, audio_get_levels_s16(s16, 1,
+						AUDIO_MAX_CHANNELS + 1,
+						&levels));
+
+	free(s16);
+	free(s32);
+
+	return MUNIT_OK;
+}
+
+/*
+ * MS12 test suite
+ */
+
+static MunitTest ms12_tests[] = {
+	{ "/analysis/silence",
+	  test_analysis_silence,
+	  NULL, NULL,
+	  MUNIT_TEST_OPTION_NONE, NULL },
+	{ "/analysis/levels",
+	  test_analysis_levels,
+	  NULL, NULL,
+	  MUNIT_TEST_OPTION_NONE, NULL },
+	{ "/ms12/channel_sweep",
+	  test_ms12_channel_sweep,
+	  pretest_ms12, posttest_ms12,
+	  MUNIT_TEST_OPTION_NONE, parms_ms12_channel_sweep },
+	{ "/ms12/assoc_mix",
+	  test_ms12_assoc_mix,
+	  pretest_ms12, posttest_ms12,
+	  MUNIT_TEST_OPTION_NONE, parms_ms12_assoc_mix },
+	{ "/ms12/assoc_disappearing",
+	  test_ms12_assoc_disappearing,
+	  pretest_ms12, posttest_ms12,
+	  MUNIT_TEST_OPTION_NONE, parms_ms12_assoc_disappearing },
+	{ "/ms12/main2_mix",
+	  test_ms12_main2_mix,
+	  pretest_ms12, posttest_ms12,
+	  MUNIT_TEST_OPTION_NONE, parms_ms12_main2_mix },
+	{ "/ms12/stereo_downmix",
+	  test_ms12_stereo_downmix,
+	  pretest_ms12, posttest_ms12,
+	  MUNIT_TEST_OPTION_NONE, parms_ms12_stereo_downmix },
+	{ "/ms12/drc",
+	  test_ms12_drc,
+	  pretest_ms12, posttest_ms12,
+	  MUNIT_TEST_OPTION_NONE, parms_ms12_drc },
+	{ "/ms12/pause",
+	  test_ms12_pause,
+	  pretest_ms12, posttest_ms12,
+	  MUNIT_TEST_OPTION_NONE, parms_ms12_pause },
+	{ "/ms12/output_reconfig",
+	  test_ms12_output_reconfig,
+	  pretest_ms12, posttest_ms12,
+	  MUNIT_TEST_OPTION_NONE, parms_ms12_output_reconfig },
+	{ "/ms12/flush",
+	  test_ms12_flush,
+	  pretest_ms12, posttest_ms12,
+	  MUNIT_TEST_OPTION_NONE, parms_ms12_flush },
+	{ "/ms12/flush2",
+	  test_ms12_flush2,
+	  pretest_ms12, posttest_ms12,
+	  MUNIT_TEST_OPTION_NONE, parms_ms12_flush2 },
+	{ "/ms12/flush3",
+	  test_ms12_flush3,
+	  pretest_ms12, posttest_ms12,
+	  MUNIT_TEST_OPTION_NONE, parms_ms12_flush3 },
+	{ "/ms12/eos",
+	  test_ms12_eos,
+	  pretest_ms12, posttest_ms12,
+	  MUNIT_TEST_OPTION_NONE, parms_ms12_eos },
+	{ "/ms12/latency",
+	  test_ms12_latency,
+	  pretest_ms12, posttest_ms12,
+	  MUNIT_TEST_OPTION_NONE, parms_ms12_latency },
+	{ "/ms12/soak",
+	  test_ms12_soak,
+	  pretest_ms12, posttest_ms12,
+	  MUNIT_TEST_OPTION_NONE, parms_ms12_soak },
+	{ "/ms12/playlist",
+	  test_ms12_playlist,
+	  pretest_ms12, posttest_ms12,
+	  MUNIT_TEST_OPTION_NONE, parms_ms12_playlist },
+	{ },
+};
+
+static const MunitSuite test_suite = {
+	"",				/* name */
+	ms12_tests,			/* tests */
+	NULL,				/* suites */
+	1,				/* iterations */
+	MUNIT_SUITE_OPTION_NONE,	/* options */
+};
+
+/*
+ * Parallel test runner
+ *
+ * With -j N, every parameter combination of every selected test becomes a
+ * job, run by a child process executing a single-test munit suite with all
+ * the parameters fixed on its command line, so munit still forks and reports
+ * crashes of the test itself. Up to N jobs run concurrently, their output is
+ * captured in a per-job log, printed in one piece when the job completes, and
+ * kept in $LOG_DIR if set.
+ */
+
+#define JOB_EXIT_SKIP	77
+
+#define ARRAY_SIZE(x)	(sizeof (x) / sizeof ((x)[0]))
+
+#ifndef MUNIT_TEST_NAME_LEN
+#define MUNIT_TEST_NAME_LEN	37
+#endif
+
+struct job {
+	const MunitTest *test;
+	MunitParameter params[8];
+	int n_params;
+	pid_t pid;
+	FILE *log;
+	struct timespec start;
+};
+
+struct job_runner {
+	char **argv;
+
+	/* options passed through to every job */
+	char *opts[32];
+	int n_opts;
+	const char *tests[32];
+	int n_tests;
+	MunitParameter params[16];
+	int n_params;
+	bool show_stderr;
+	bool fatal_failures;
+	bool has_seed;
+	char seed[16];
+
+	struct job *jobs;
+	int n_jobs;
+
+	int ok;
+	int skipped;
+	int failed;
+	int errored;
+	double test_time;
+};
+
+static MunitTestFunc job_test_func;
+static MunitResult *job_result;
+
+/* wraps the test function to tell a skip apart from a success, as
+ * munit_suite_main() reports both as EXIT_SUCCESS; the result is shared
+ * with the job process as munit runs the test in its own child */
+static MunitResult
+job_test(const MunitParameter params[], void *data)
+{
+	MunitResult result = job_test_func(params, data);
+
+	if (job_result)
+		*job_result = result;
+
+	return result;
+}
+
+static double
+job_elapsed(const struct timespec *start)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	return (now.tv_sec - start->tv_sec) +
+		(now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+static void
+job_format_params(const struct job *job, char *buf, size_t size)
+{
+	size_t len = 0;
+
+	buf[0] = '\0';
+	for (int i = 0; i < job->n_params && len < size; i++)
+		len += snprintf(buf + len, size - len, "%s%s=%s", i ? ", " : "",
+				job->params[i].name, job->params[i].value);
+}
+
+static FILE *
+job_open_log(const struct job *job)
+{
+	const char *log_dir;
+	char path[PATH_MAX];
+	size_t len;
+
+	if (!(log_dir = getenv("LOG_DIR")))
+		return tmpfile();
+
+	len = snprintf(path, sizeof (path), "%s/qaptest", log_dir);
+	for (const char *p = job->test->name; *p && len < sizeof (path); p++)
+		path[len++] = *p == '/' ? '-' : *p;
+
+	for (int i = 0; i < job->n_params && len < sizeof (path); i++)
+		len += snprintf(path + len, sizeof (path) - len, "-%s=%s",
+				job->params[i].name, job->params[i].value);
+
+	if (len >= sizeof (path) - 4)
+		return tmpfile();
+
+	for (char *p = path + strlen(log_dir) + 1; *p; p++) {
+		if (*p == '+' || *p == '/')
+			*p = '_';
+	}
+	strcat(path, ".log");
+
+	return fopen(path, "w+");
+}
+
+static bool
+job_runner_match(const struct job_runner *r, const MunitTest *test)
+{
+	if (r->n_tests == 0)
+		return true;
+
+	for (int i = 0; i < r->n_tests; i++) {
+		if (!strncmp(test->name, r->tests[i], strlen(r->tests[i])))
+			return true;
+	}
+
+	return false;
+}
+
+static const char *
+job_runner_param(const struct job_runner *r, const char *name)
+{
+	for (int i = 0; i < r->n_params; i++) {
+		if (!strcmp(r->params[i].name, name))
+			return r->params[i].value;
+	}
+
+	return NULL;
+}
+
+static int
+job_runner_add(struct job_runner *r, const struct job *job)
+{
+	struct job *jobs;
+
+	jobs = realloc(r->jobs, (r->n_jobs + 1) * sizeof (*jobs));
+	if (!jobs)
+		return -1;
+
+	r->jobs = jobs;
+	r->jobs[r->n_jobs++] = *job;
+
+	return 0;
+}
+
+/* expand the parameter matrix of a test, in the same order as munit */
+static int
+job_runner_add_test(struct job_runner *r, const MunitTest *test)
+{
+	const MunitParameterEnum *wild[8];
+	int wild_param[8];
+	int index[8] = {};
+	int n_wild = 0;
+	struct job job = { .test = test };
+
+	for (const MunitParameterEnum *pe = test->parameters;
+	     pe && pe->name; pe++) {
+		const char *v = job_runner_param(r, pe->name);
+
+		if (job.n_params == ARRAY_SIZE(job.params))
+			return -1;
+
+		if (v) {
+			job.params[job.n_params].name = pe->name;
+			job.params[job.n_params++].value = (char *)v;
+		} else if (pe->values && pe->values[0]) {
+			wild_param[n_wild] = job.n_params;
+			wild[n_wild++] = pe;
+			job.params[job.n_params++].name = pe->name;
+		}
+	}
+
+	while (1) {
+		int i;
+
+		for (i = 0; i < n_wild; i++)
+			job.params[wild_param[i]].value =
+				wild[i]->values[index[i]];
+
+		if (job_runner_add(r, &job))
+			return -1;
+
+		/* odometer, last parameter changing fastest */
+		for (i = n_wild - 1; i >= 0; i--) {
+			if (wild[i]->values[++index[i]])
+				break;
+			index[i] = 0;
+		}
+
+		if (i < 0)
+			break;
+	}
+
+	return 0;
+}
+
+static void
+job_run_child(struct job_runner *r, struct job *job)
+{
+	MunitTest tests[2] = { *job->test, { } };
+	MunitSuite suite = test_suite;
+	char *argv[ARRAY_SIZE(r->opts) + 3 * ARRAY_SIZE(job->params) + 3];
+	int argc = 0;
+	int ret;
+
+	dup2(fileno(job->log), STDOUT_FILENO);
+	dup2(fileno(job->log), STDERR_FILENO);
+
+	job_result = mmap(NULL, sizeof (*job_result), PROT_READ | PROT_WRITE,
+			  MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if (job_result == MAP_FAILED)
+		job_result = NULL;
+
+	job_test_func = tests[0].test;
+	tests[0].test = job_test;
+	suite.tests = tests;
+
+	/* the log always gets the test output, it is only printed on
+	 * failure or with --show-stderr */
+	argv[argc++] = r->argv[0];
+	argv[argc++] = "--show-stderr";
+	for (int i = 0; i < r->n_opts; i++)
+		argv[argc++] = r->opts[i];
+	for (int i = 0; i < job->n_params; i++) {
+		argv[argc++] = "--param";
+		argv[argc++] = job->params[i].name;
+		argv[argc++] = job->params[i].value;
+	}
+	argv[argc] = NULL;
+
+	ret = munit_suite_main(&suite, NULL, argc, argv);
+	fflush(stdout);
+	fflush(stderr);
+
+	if (ret == EXIT_SUCCESS && job_result && *job_result == MUNIT_SKIP)
+		_exit(JOB_EXIT_SKIP);
+
+	_exit(ret);
+}
+
+static int
+job_start(struct job_runner *r, struct job *job)
+{
+	if (!(job->log = job_open_log(job))) {
+		fprintf(stderr, "%s: unable to create log: %s\n",
+			job->test->name, strerror(errno));
+		return -1;
+	}
+
+	fflush(stdout);
+	fflush(stderr);
+
+	clock_gettime(CLOCK_MONOTONIC, &job->start);
+
+	job->pid = fork();
+	if (job->pid < 0) {
+		fprintf(stderr, "%s: unable to fork: %s\n", job->test->name,
+			strerror(errno));
+		fclose(job->log);
+		job->log = NULL;
+		return -1;
+	}
+
+	if (job->pid == 0)
+		job_run_child(r, job);
+
+	return 0;
+}
+
+static void
+job_finish(struct job_runner *r, struct job *job, int status,
+	   const struct rusage *ru)
+{
+	const char *result;
+	char params[256];
+	double elapsed;
+	double cpu;
+	bool show_log;
+
+	elapsed = job_elapsed(&job->start);
+	cpu = ru->ru_utime.tv_sec + ru->ru_utime.tv_usec / 1e6 +
+		ru->ru_stime.tv_sec + ru->ru_stime.tv_usec / 1e6;
+	r->test_time += elapsed;
+
+	if (WIFEXITED(status) && WEXITSTATUS(status) == EXIT_SUCCESS) {
+		result = "OK   ";
+		r->ok++;
+	} else if (WIFEXITED(status) && WEXITSTATUS(status) == JOB_EXIT_SKIP) {
+		result = "SKIP ";
+		r->skipped++;
+	} else if (WIFEXITED(status)) {
+		result = "FAIL ";
+		r->failed++;
+	} else {
+		result = "ERROR";
+		r->errored++;
+	}
+
+	show_log = r->show_stderr ||
+		!WIFEXITED(status) || (WEXITSTATUS(status) != EXIT_SUCCESS &&
+				       WEXITSTATUS(status) != JOB_EXIT_SKIP);
+
+	job_format_params(job, params, sizeof (params));
+	printf("%-*s [ %s ] [ %0.3f / %0.3f CPU ]\n  %s\n",
+	       MUNIT_TEST_NAME_LEN, job->test->name, result, elapsed, cpu,
+	       params);
+
+	if (WIFSIGNALED(status))
+		printf("  terminated by signal %d\n", WTERMSIG(status));
+
+	if (show_log) {
+		char buf[4096];
+		char last = '\n';
+		size_t n;
+
+		fflush(stdout);
+		rewind(job->log);
+		while ((n = fread(buf, 1, sizeof (buf), job->log)) > 0) {
+			fwrite(buf, 1, n, stdout);
+			last = buf[n - 1];
+		}
+
+		/* a crashed test may leave a partial line */
+		if (last != '\n')
+			fputc('\n', stdout);
+	}
+
+	fflush(stdout);
+	fclose(job->log);
+	job->log = NULL;
+	job->pid = 0;
+}
+
+/* split the command line between options handled here, options passed to
+ * every job, and test names; returns -1 when munit should handle it */
+static int
+job_runner_parse(struct job_runner *r, int argc, char **argv)
+{
+	static const char *passthrough[] = {
+		"seed", "iterations", "color", "log-visible", "log-fatal",
+	};
+
+	for (int i = 1; i < argc; i++) {
+		const char *opt = argv[i];
+		bool found = false;
+
+		if (strncmp(opt, "--", 2) != 0) {
+			if (r->n_tests == ARRAY_SIZE(r->tests))
+				return -1;
+			r->tests[r->n_tests++] = opt;
+			continue;
+		}
+
+		opt += 2;
+		if (!strcmp(opt, "param")) {
+			if (i + 2 >= argc ||
+			    r->n_params == ARRAY_SIZE(r->params))
+				return -1;
+			r->params[r->n_params].name = argv[++i];
+			r->params[r->n_params++].value = argv[++i];
+			continue;
+		}
+
+		if (!strcmp(opt, "show-stderr")) {
+			r->show_stderr = true;
+			continue;
+		}
+
+		if (!strcmp(opt, "fatal-failures")) {
+			r->fatal_failures = true;
+			continue;
+		}
+
+		if (!strcmp(opt, "no-fork")) {
+			if (r->n_opts == ARRAY_SIZE(r->opts))
+				return -1;
+			r->opts[r->n_opts++] = argv[i];
+			continue;
+		}
+
+		for (size_t k = 0; k < ARRAY_SIZE(passthrough); k++) {
+			if (!strcmp(opt, passthrough[k]))
+				found = true;
+		}
+
+		/* --list, --help, --single and friends run serially */
+		if (!found || i + 1 >= argc ||
+		    r->n_opts + 2 > ARRAY_SIZE(r->opts))
+			return -1;
+
+		if (!strcmp(opt, "seed"))
+			r->has_seed = true;
+
+		r->opts[r->n_opts++] = argv[i++];
+		r->opts[r->n_opts++] = argv[i];
+	}
+
+	return 0;
+}
+
+static int
+run_parallel(int max_jobs, int argc, char **argv)
+{
+	struct job_runner r = { .argv = argv };
+	struct timespec start;
+	int next = 0;
+	int running = 0;
+	int ret = EXIT_FAILURE;
+
+	if (job_runner_parse(&r, argc, argv) < 0 ||
+	    (!r.has_seed && r.n_opts + 2 > ARRAY_SIZE(r.opts)))
+		return munit_suite_main(&test_suite, NULL, argc, argv);
+
+	/* all jobs share the same seed, so a run can be reproduced */
+	if (!r.has_seed) {
+		struct timespec ts;
+
+		clock_gettime(CLOCK_REALTIME, &ts);
+		snprintf(r.seed, sizeof (r.seed), "0x%08x",
+			 (uint32_t)(ts.tv_sec ^ ts.tv_nsec ^ getpid()));
+		r.opts[r.n_opts++] = "--seed";
+		r.opts[r.n_opts++] = r.seed;
+	}
+
+	for (const MunitTest *test = test_suite.tests; test->test; test++) {
+		if (!job_runner_match(&r, test))
+			continue;
+
+		if (job_runner_add_test(&r, test) < 0) {
+			fprintf(stderr, "%s: too many parameters\n", test->name);
+			goto out;
+		}
+	}
+
+	printf("Running %d tests with %d jobs...\n", r.n_jobs, max_jobs);
+	if (!r.has_seed)
+		printf("Using seed %s\n", r.seed);
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	while (next < r.n_jobs || running > 0) {
+		struct rusage ru;
+		int status;
+		pid_t pid;
+
+		while (next < r.n_jobs && running < max_jobs &&
+		       !(r.fatal_failures && (r.failed || r.errored))) {
+			if (job_start(&r, &r.jobs[next]) < 0) {
+				r.errored++;
+				next++;
+				continue;
+			}
+			next++;
+			running++;
+		}
+
+		if (running == 0)
+			break;
+
+		pid = wait4(-1, &status, 0, &ru);
+		if (pid < 0) {
+			if (errno == EINTR)
+				continue;
+			fprintf(stderr, "wait failed: %s\n", strerror(errno));
+			goto out;
+		}
+
+		for (int i = 0; i < next; i++) {
+			if (r.jobs[i].pid == pid) {
+				job_finish(&r, &r.jobs[i], status, &ru);
+				running--;
+				break;
+			}
+		}
+	}
+
+	{
+		int run = r.ok + r.failed + r.errored;
+		double elapsed = job_elapsed(&start);
+
+		printf("%d of %d (%0.0f%%) tests successful, %d skipped\n",
+		       r.ok, run, run ? 100.0 * r.ok / run : 100.0, r.skipped);
+		printf("wall time %0.3f s, test time %0.3f s (%0.1fx)\n",
+		       elapsed, r.test_time,
+		       elapsed > 0 ? r.test_time / elapsed : 0);
+	}
+
+	if (r.failed == 0 && r.errored == 0)
+		ret = EXIT_SUCCESS;
+
+out:
+	free(r.jobs);
+	return ret;
+}
+
+int main(int argc, char **argv)
+{
+	long jobs = 1;
+	int n = 1;
+
+	/* -j N, stripped before munit parses the command line; 0 means one
+	 * job per CPU */
+	for (int i = 1; i < argc; i++) {
+		char *end;
+
+		if (strcmp(argv[i], "-j") != 0 || i + 1 >= argc) {
+			argv[n++] = argv[i];
+			continue;
+		}
+
+		jobs = strtol(argv[++i], &end, 10);
+		if (*end || jobs < 0) {
+			fprintf(stderr, "invalid job count '%s'\n", argv[i]);
+			return EXIT_FAILURE;
+		}
+
+		if (jobs == 0)
+			jobs = sysconf(_SC_NPROCESSORS_ONLN);
+	}
+	argc = n;
+	argv[argc] = NULL;
+
+	if (jobs > 1)
+		return run_parallel(jobs, argc, argv);
+
 	return munit_suite_main(&test_suite, NULL, argc, argv);
 }
@@ -1,3 +1,6 @@
+/* pthread_setname_np */
+#define _GNU_SOURCE
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdarg.h>
@@ -10,6 +13,12 @@
 #include <assert.h>
 #include <sys/stat.h>
 
+#if defined(__ARM_NEON)
+# include <arm_neon.h>
+#elif defined(__SSE2__)
+# include <emmintrin.h>
+#endif
+
 #include <libswresample/swresample.h>
 #include <libavutil/channel_layout.h>
 #include <libavutil/samplefmt.h>
@@ -35,16 +44,47 @@
 
 int qd_debug_level = 1;
 
+#ifdef QD_SDT
+/* semaphores of the probes, in the section where the tracers look for them */
+# define QD_PROBE_SEMAPHORE_DEFINE(name) \
+	volatile unsigned short qd_##name##_semaphore \
+		__attribute__((unused, section(".probes")));
+QD_PROBE_LIST(QD_PROBE_SEMAPHORE_DEFINE)
+#endif
+
 struct qd_module_handle {
 	qap_lib_handle_t handle;
 };
 
 typedef void (*qd_sw_decoder_func_t)(void *priv, qap_audio_buffer_t *buffer);
 
+#define QD_SW_DECODER_QUEUE_SIZE	32
+
+struct qd_sw_decoder_packet {
+	void *data;
+	int size;
+	int alloc_size;
+	int64_t pts;
+	uint64_t queue_time;
+};
+
 struct qd_sw_decoder {
 	AVCodecContext *codec;
 	qd_sw_decoder_func_t cb;
 	void *cb_data;
+	enum qd_sample_format sample_format;
+	bool cpu_stats;
+
+	/* decode thread, fed through a bounded packet queue */
+	pthread_t tid;
+	bool thread_started;
+	bool terminated;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	struct qd_sw_decoder_packet queue[QD_SW_DECODER_QUEUE_SIZE];
+	unsigned int queue_head;
+	unsigned int queue_count;
+	struct qd_sw_decoder_stats stats;
 
 	/* resampler */
 	SwrContext *swr;
@@ -129,6 +169,40 @@ qd_get_time(void)
 	return get_time() - qd_base_time;
 }
 
+uint64_t
+qd_get_thread_cpu_time(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+	return ts.tv_sec * UINT64_C(1000000) + ts.tv_nsec / UINT64_C(1000);
+}
+
+/* names are truncated to the 15 characters allowed by the kernel */
+void
+qd_thread_set_name(const char *fmt, ...)
+{
+	char name[16];
+	va_list ap;
+
+	va_start(ap, fmt);
+	vsnprintf(name, sizeof (name), fmt, ap);
+	va_end(ap);
+
+	pthread_setname_np(pthread_self(), name);
+}
+
+/* time reference only used by logs, the input_cmd probe and traces, skip the
+ * clock read when none of them is enabled */
+static inline uint64_t
+get_trace_time(int level)
+{
+	if (!qd_log_enabled(level) && !QD_PROBE_ENABLED(input_cmd) &&
+	    !qd_trace_enabled())
+		return 0;
+
+	return get_time();
+}
+
 static int
 mkdir_parents(const char *path, mode_t mode)
 {
@@ -326,7 +400,7 @@ audio_channel_to_str(qap_pcm_chmap channel)
 	return "??";
 }
 
-static const char *
+const char *
 qd_input_id_to_str(enum qd_input_id id)
 {
 	switch (id) {
@@ -377,40 +451,67 @@ qd_output_id_to_str(enum qd_output_id id)
 	return "UNKNOWN";
 }
 
+#define QD_CHMAP_STR_LEN 256
+
 static const char *
-audio_chmap_to_str(int channels, uint8_t *map)
+audio_chmap_to_str(char *buf, size_t len, int channels, const uint8_t *map)
 {
-	static char buf[256];
-	int len = sizeof (buf);
-	int offset = 0;
+	size_t offset = 0;
+
+	buf[0] = '\0';
 
-	for (int i = 0; i < channels && offset < len; i++) {
+	for (int i = 0; i < channels && offset < len - 1; i++) {
 		int r = snprintf(buf + offset, len - offset, "%s%s",
 				 audio_channel_to_str(map[i]),
 				 i == channels  - 1 ? "" : ",");
 		if (r > 0)
-			offset += r;
+			offset = QD_MIN(offset + r, len - 1);
 	}
 
-	buf[offset] = '\0';
-
 	return buf;
 }
 
+/* terminate and join the decode thread, further writes are rejected */
+static void
+qd_sw_decoder_stop(struct qd_sw_decoder *dec)
+{
+	if (!dec || !dec->thread_started)
+		return;
+
+	pthread_mutex_lock(&dec->lock);
+	dec->terminated = true;
+	pthread_cond_broadcast(&dec->cond);
+	pthread_mutex_unlock(&dec->lock);
+	pthread_join(dec->tid, NULL);
+
+	dec->thread_started = false;
+}
+
 static void
 qd_sw_decoder_destroy(struct qd_sw_decoder *dec)
 {
 	if (!dec)
 		return;
 
+	qd_sw_decoder_stop(dec);
+
+	for (int i = 0; i < QD_SW_DECODER_QUEUE_SIZE; i++)
+		qd_mem_free(QD_MEM_SWDEC, dec->queue[i].data);
+
+	pthread_cond_destroy(&dec->cond);
+	pthread_mutex_destroy(&dec->lock);
+
 	avcodec_free_context(&dec->codec);
 	swr_free(&dec->swr);
-	free(dec->swr_buffer);
-	free(dec);
+	qd_mem_free(QD_MEM_SWDEC, dec->swr_buffer);
+	qd_mem_free(QD_MEM_SWDEC, dec);
 }
 
+static void *qd_sw_decoder_thread_func(void *userdata);
+
 static struct qd_sw_decoder *
-qd_sw_decoder_create(qap_audio_format_t format)
+qd_sw_decoder_create(qap_audio_format_t format,
+		     enum qd_sample_format sample_format, bool cpu_stats)
 {
 	struct qd_sw_decoder *dec;
 	enum AVCodecID avcodec_id;
@@ -434,10 +535,16 @@ qd_sw_decoder_create(qap_audio_format_t format)
 		return NULL;
 	}
 
-	dec = calloc(1, sizeof (*dec));
+	dec = qd_mem_calloc(QD_MEM_SWDEC, 1, sizeof (*dec));
 	if (!dec)
 		return NULL;
 
+	pthread_mutex_init(&dec->lock, NULL);
+	pthread_cond_init(&dec->cond, NULL);
+
+	dec->sample_format = sample_format;
+	dec->cpu_stats = cpu_stats;
+
 	dec->codec = avcodec_alloc_context3(avcodec);
 	if (!dec->codec) {
 		err("swdec: failed to create %s decoder",
@@ -465,6 +572,13 @@ qd_sw_decoder_create(qap_audio_format_t format)
 
 	dec->out_format = AV_SAMPLE_FMT_NONE;
 
+	if (pthread_create(&dec->tid, NULL, qd_sw_decoder_thread_func, dec)) {
+		err("swdec: failed to create decode thread");
+		goto fail;
+	}
+
+	dec->thread_started = true;
+
 	return dec;
 
 fail:
@@ -537,55 +651,128 @@ convert_from_av_channel(uint64_t ch)
 	}
 }
 
-static int
-qd_sw_decoder_process_frame(struct qd_sw_decoder *dec)
+/* planar to interleaved copy, the stereo case is vectorized */
+static void
+interleave_samples_32(uint32_t *dst, uint8_t * const *planes,
+		      int channels, int n_samples)
 {
-	AVFrame frame = {};
-	qap_audio_buffer_t out;
-	int size;
-	int ret;
+	int i = 0;
 
-	ret = avcodec_receive_frame(dec->codec, &frame);
-	if (ret == AVERROR(EAGAIN))
-		return ret;
+	if (channels == 2) {
+		const uint32_t *l = (const uint32_t *)planes[0];
+		const uint32_t *r = (const uint32_t *)planes[1];
 
-	if (ret != 0) {
-		err("failed to read decoded audio: %s", av_err2str(ret));
-		return ret;
+#if defined(__ARM_NEON)
+		for (; i + 4 <= n_samples; i += 4) {
+			uint32x4x2_t v = { { vld1q_u32(l + i),
+					     vld1q_u32(r + i) } };
+			vst2q_u32(dst + 2 * i, v);
+		}
+#elif defined(__SSE2__)
+		for (; i + 4 <= n_samples; i += 4) {
+			__m128i a = _mm_loadu_si128((const __m128i *)(l + i));
+			__m128i b = _mm_loadu_si128((const __m128i *)(r + i));
+
+			_mm_storeu_si128((__m128i *)(dst + 2 * i),
+					 _mm_unpacklo_epi32(a, b));
+			_mm_storeu_si128((__m128i *)(dst + 2 * i + 4),
+					 _mm_unpackhi_epi32(a, b));
+		}
+#endif
+		for (; i < n_samples; i++) {
+			dst[2 * i] = l[i];
+			dst[2 * i + 1] = r[i];
+		}
+		return;
 	}
 
-	/* generate output pcm config once, based on first decoded frame */
-	if (dec->out_config.channels == 0) {
-		/* ffmpeg config */
-		dec->out_format = AV_SAMPLE_FMT_S16;
-		dec->out_sample_rate = frame.sample_rate;
-		dec->out_channels = frame.channels;
-		dec->out_channel_layout = frame.channel_layout;
+	for (; i < n_samples; i++) {
+		for (int ch = 0; ch < channels; ch++)
+			*dst++ = ((const uint32_t *)planes[ch])[i];
+	}
+}
 
-		/* same config in qap format */
-		dec->out_config.format = QAP_AUDIO_FORMAT_PCM_16_BIT;
-		dec->out_config.is_interleaved = true;
-		dec->out_config.bit_width = 16;
-		dec->out_config.sample_rate = frame.sample_rate;
-		dec->out_config.channels = frame.channels;
-		for (int i = 0; i < frame.channels; i++) {
-			uint64_t ch = av_channel_layout_extract_channel(
-				frame.channel_layout, i);
-			dec->out_config.ch_map[i] = convert_from_av_channel(ch);
+static void
+interleave_samples_16(uint16_t *dst, uint8_t * const *planes,
+		      int channels, int n_samples)
+{
+	int i = 0;
+
+	if (channels == 2) {
+		const uint16_t *l = (const uint16_t *)planes[0];
+		const uint16_t *r = (const uint16_t *)planes[1];
+
+#if defined(__ARM_NEON)
+		for (; i + 8 <= n_samples; i += 8) {
+			uint16x8x2_t v = { { vld1q_u16(l + i),
+					     vld1q_u16(r + i) } };
+			vst2q_u16(dst + 2 * i, v);
+		}
+#elif defined(__SSE2__)
+		for (; i + 8 <= n_samples; i += 8) {
+			__m128i a = _mm_loadu_si128((const __m128i *)(l + i));
+			__m128i b = _mm_loadu_si128((const __m128i *)(r + i));
+
+			_mm_storeu_si128((__m128i *)(dst + 2 * i),
+					 _mm_unpacklo_epi16(a, b));
+			_mm_storeu_si128((__m128i *)(dst + 2 * i + 8),
+					 _mm_unpackhi_epi16(a, b));
+		}
+#endif
+		for (; i < n_samples; i++) {
+			dst[2 * i] = l[i];
+			dst[2 * i + 1] = r[i];
 		}
+		return;
+	}
+
+	for (; i < n_samples; i++) {
+		for (int ch = 0; ch < channels; ch++)
+			*dst++ = ((const uint16_t *)planes[ch])[i];
 	}
+}
+
+static int
+qd_sw_decoder_alloc_buffer(struct qd_sw_decoder *dec, int size)
+{
+	void *p;
+
+	if (size == dec->swr_buffer_size)
+		return 0;
+
+	p = qd_mem_realloc(QD_MEM_SWDEC, dec->swr_buffer, size);
+	if (!p)
+		return AVERROR(ENOMEM);
+
+	pthread_mutex_lock(&dec->lock);
+	dec->stats.buffer_bytes += size - dec->swr_buffer_size;
+	dec->stats.max_buffer_bytes = QD_MAX(dec->stats.max_buffer_bytes,
+					     dec->stats.buffer_bytes);
+	pthread_mutex_unlock(&dec->lock);
+
+	dec->swr_buffer_size = size;
+	dec->swr_buffer = p;
+
+	return 0;
+}
+
+static int
+qd_sw_decoder_convert(struct qd_sw_decoder *dec, AVFrame *frame)
+{
+	int size;
+	int ret;
 
 	/* reconfigure resampler if input or output format changes */
-	if (dec->swr_in_format != frame.format ||
-	    dec->swr_in_channel_layout != frame.channel_layout ||
+	if (dec->swr_in_format != frame->format ||
+	    dec->swr_in_channel_layout != frame->channel_layout ||
 	    dec->swr_out_format != dec->out_format ||
 	    dec->swr_out_channel_layout != dec->out_channel_layout) {
 		av_opt_set_int(dec->swr, "in_channel_layout",
-			       frame.channel_layout, 0);
+			       frame->channel_layout, 0);
 		av_opt_set_int(dec->swr, "in_sample_fmt",
-			       frame.format, 0);
+			       frame->format, 0);
 		av_opt_set_int(dec->swr, "in_sample_rate",
-			       frame.sample_rate, 0);
+			       frame->sample_rate, 0);
 		av_opt_set_int(dec->swr, "out_channel_layout",
 			       dec->out_channel_layout, 0);
 		av_opt_set_int(dec->swr, "out_sample_fmt",
@@ -599,63 +786,153 @@ qd_sw_decoder_process_frame(struct qd_sw_decoder *dec)
 			return ret;
 		}
 
-		dec->swr_in_format = frame.format;
-		dec->swr_in_channel_layout = frame.channel_layout;
+		dec->swr_in_format = frame->format;
+		dec->swr_in_channel_layout = frame->channel_layout;
 		dec->swr_out_format = dec->out_format;
 		dec->swr_out_channel_layout = dec->out_channel_layout;
 	}
 
 	/* resample/convert pcm buffer */
 	size = av_samples_get_buffer_size(NULL, dec->out_channels,
-					  frame.nb_samples,
+					  frame->nb_samples,
 					  dec->out_format, 1);
 	if (size < 0) {
-		err("failed to get resampler buffer size: %s", av_err2str(ret));
-		return ret;
+		err("failed to get resampler buffer size: %s", av_err2str(size));
+		return size;
 	}
 
-	if (size != dec->swr_buffer_size) {
-		void *p;
-
-		p = realloc(dec->swr_buffer, size);
-		if (!p)
-			return AVERROR(ENOMEM);
-
-		dec->swr_buffer_size = size;
-		dec->swr_buffer = p;
-	}
+	ret = qd_sw_decoder_alloc_buffer(dec, size);
+	if (ret < 0)
+		return ret;
 
 	ret = swr_convert(dec->swr,
 			  (uint8_t **)&dec->swr_buffer, dec->swr_buffer_size,
-			  (const uint8_t **)frame.data, frame.nb_samples);
+			  (const uint8_t **)frame->extended_data,
+			  frame->nb_samples);
 	if (ret < 0) {
 		err("failed to resample audio: %s", av_err2str(ret));
 		return ret;
 	}
 
+	return 0;
+}
+
+/* convert a decoded frame to the output format and pass it to the output
+ * callback */
+static int
+qd_sw_decoder_output_frame(struct qd_sw_decoder *dec, AVFrame *frame)
+{
+	qap_audio_buffer_t out;
+	int size;
+	int ret;
+
+	/* generate output pcm config once, based on first decoded frame */
+	if (dec->out_config.channels == 0) {
+		/* ffmpeg config, QAP has no float format so float samples
+		 * are described as 32 bits pcm */
+		switch (dec->sample_format) {
+		case QD_SAMPLE_FORMAT_S32:
+			dec->out_format = AV_SAMPLE_FMT_S32;
+			dec->out_config.format = QAP_AUDIO_FORMAT_PCM_32_BIT;
+			dec->out_config.bit_width = 32;
+			break;
+		case QD_SAMPLE_FORMAT_FLT:
+			dec->out_format = AV_SAMPLE_FMT_FLT;
+			dec->out_config.format = QAP_AUDIO_FORMAT_PCM_32_BIT;
+			dec->out_config.bit_width = 32;
+			break;
+		default:
+			dec->out_format = AV_SAMPLE_FMT_S16;
+			dec->out_config.format = QAP_AUDIO_FORMAT_PCM_16_BIT;
+			dec->out_config.bit_width = 16;
+			break;
+		}
+
+		dec->out_sample_rate = frame->sample_rate;
+		dec->out_channels = frame->channels;
+		dec->out_channel_layout = frame->channel_layout;
+
+		/* same config in qap format */
+		dec->out_config.is_interleaved = true;
+		dec->out_config.sample_rate = frame->sample_rate;
+		dec->out_config.channels = frame->channels;
+		for (int i = 0; i < frame->channels; i++) {
+			uint64_t ch = av_channel_layout_extract_channel(
+				frame->channel_layout, i);
+			dec->out_config.ch_map[i] = convert_from_av_channel(ch);
+		}
+	}
+
+	if (frame->format == av_get_planar_sample_fmt(dec->out_format) &&
+	    frame->sample_rate == dec->out_sample_rate &&
+	    frame->channel_layout == dec->out_channel_layout) {
+		/* only interleaving needed, no need for the resampler */
+		size = av_samples_get_buffer_size(NULL, dec->out_channels,
+						  frame->nb_samples,
+						  dec->out_format, 1);
+		if (size < 0 || qd_sw_decoder_alloc_buffer(dec, size))
+			return AVERROR(ENOMEM);
+
+		if (av_get_bytes_per_sample(dec->out_format) == 4)
+			interleave_samples_32(dec->swr_buffer,
+					      frame->extended_data,
+					      dec->out_channels,
+					      frame->nb_samples);
+		else
+			interleave_samples_16(dec->swr_buffer,
+					      frame->extended_data,
+					      dec->out_channels,
+					      frame->nb_samples);
+	} else {
+		ret = qd_sw_decoder_convert(dec, frame);
+		if (ret < 0)
+			return ret;
+	}
+
 	/* output converted pcm buffer in qap format */
 	memset(&out, 0, sizeof (out));
 	out.common_params.data = dec->swr_buffer;
 	out.common_params.size = dec->swr_buffer_size;
-	out.common_params.timestamp = frame.pts;
+	out.common_params.timestamp = frame->pts;
 	out.buffer_parms.output_buf_params.output_config = dec->out_config;
 
 	dec->cb(dec->cb_data, &out);
 
+	return 0;
+}
+
+static int
+qd_sw_decoder_process_frame(struct qd_sw_decoder *dec)
+{
+	AVFrame frame = {};
+	int ret;
+
+	ret = avcodec_receive_frame(dec->codec, &frame);
+	if (ret == AVERROR(EAGAIN))
+		return ret;
+
+	if (ret != 0) {
+		err("failed to read decoded audio: %s", av_err2str(ret));
+		return ret;
+	}
+
+	ret = qd_sw_decoder_output_frame(dec, &frame);
+
 	av_frame_unref(&frame);
 
-	return 0;
+	return ret;
 }
 
 static int
-qd_sw_decoder_write(struct qd_sw_decoder *dec, qap_audio_buffer_t *buffer)
+qd_sw_decoder_decode(struct qd_sw_decoder *dec,
+		     struct qd_sw_decoder_packet *packet)
 {
 	AVPacket pkt = {};
 	int ret;
 
-	pkt.data = buffer->common_params.data;
-	pkt.size = buffer->common_params.size;
-	pkt.pts = buffer->common_params.timestamp;
+	pkt.data = packet->data;
+	pkt.size = packet->size;
+	pkt.pts = packet->pts;
 
 	ret = avcodec_send_packet(dec->codec, &pkt);
 	if (ret != 0) {
@@ -670,6 +947,138 @@ qd_sw_decoder_write(struct qd_sw_decoder *dec, qap_audio_buffer_t *buffer)
 	return 0;
 }
 
+static void *
+qd_sw_decoder_thread_func(void *userdata)
+{
+	struct qd_sw_decoder *dec = userdata;
+	struct qd_sw_decoder_packet *packet;
+	uint64_t queue_time;
+	uint64_t t;
+
+	qd_thread_set_name("swdec-%s", avcodec_get_name(dec->codec->codec_id));
+
+	pthread_mutex_lock(&dec->lock);
+	while (!dec->terminated) {
+		if (dec->queue_count == 0) {
+			pthread_cond_wait(&dec->cond, &dec->lock);
+			continue;
+		}
+
+		/* the packet stays queued while it is being decoded, so its
+		 * slot cannot be reused by the writer */
+		packet = &dec->queue[dec->queue_head];
+		pthread_mutex_unlock(&dec->lock);
+
+		t = get_time();
+		queue_time = t - packet->queue_time;
+		qd_sw_decoder_decode(dec, packet);
+		QD_TRACE_SLICE("swdec", NULL, packet->size, t, get_time());
+		t = get_time() - t;
+
+		pthread_mutex_lock(&dec->lock);
+		dec->queue_head = (dec->queue_head + 1) %
+			QD_SW_DECODER_QUEUE_SIZE;
+		dec->queue_count--;
+
+		dec->stats.packets++;
+		dec->stats.decode_time += t;
+		dec->stats.max_decode_time =
+			QD_MAX(dec->stats.max_decode_time, t);
+		dec->stats.max_queue_time =
+			QD_MAX(dec->stats.max_queue_time, queue_time);
+		if (dec->cpu_stats)
+			dec->stats.cpu_time = qd_get_thread_cpu_time();
+
+		pthread_cond_broadcast(&dec->cond);
+	}
+	pthread_mutex_unlock(&dec->lock);
+
+	return NULL;
+}
+
+static int
+qd_sw_decoder_write(struct qd_sw_decoder *dec, qap_audio_buffer_t *buffer)
+{
+	struct qd_sw_decoder_packet *packet;
+	int size = buffer->common_params.size;
+	int ret = 0;
+
+	pthread_mutex_lock(&dec->lock);
+
+	if (dec->queue_count == QD_SW_DECODER_QUEUE_SIZE) {
+		dbg("swdec: queue full, wait");
+		dec->stats.queue_full++;
+		while (dec->queue_count == QD_SW_DECODER_QUEUE_SIZE &&
+		       !dec->terminated)
+			pthread_cond_wait(&dec->cond, &dec->lock);
+	}
+
+	if (dec->terminated) {
+		ret = -1;
+		goto out;
+	}
+
+	packet = &dec->queue[(dec->queue_head + dec->queue_count) %
+			     QD_SW_DECODER_QUEUE_SIZE];
+
+	if (packet->alloc_size < size) {
+		void *p = qd_mem_realloc(QD_MEM_SWDEC, packet->data, size);
+		if (!p) {
+			ret = AVERROR(ENOMEM);
+			goto out;
+		}
+		dec->stats.buffer_bytes += size - packet->alloc_size;
+		dec->stats.max_buffer_bytes =
+			QD_MAX(dec->stats.max_buffer_bytes,
+			       dec->stats.buffer_bytes);
+		packet->data = p;
+		packet->alloc_size = size;
+	}
+
+	memcpy(packet->data, buffer->common_params.data, size);
+	packet->size = size;
+	packet->pts = buffer->common_params.timestamp;
+	packet->queue_time = get_time();
+
+	dec->queue_count++;
+	dec->stats.max_queue_depth =
+		QD_MAX(dec->stats.max_queue_depth, dec->queue_count);
+
+	pthread_cond_broadcast(&dec->cond);
+
+out:
+	pthread_mutex_unlock(&dec->lock);
+
+	return ret;
+}
+
+/* wait until all queued packets are decoded */
+static void
+qd_sw_decoder_drain(struct qd_sw_decoder *dec)
+{
+	pthread_mutex_lock(&dec->lock);
+	while (dec->queue_count > 0 && !dec->terminated)
+		pthread_cond_wait(&dec->cond, &dec->lock);
+	pthread_mutex_unlock(&dec->lock);
+}
+
+int
+qd_output_get_swdec_stats(struct qd_output *output,
+			  struct qd_sw_decoder_stats *stats)
+{
+	struct qd_sw_decoder *dec = output->swdec;
+
+	if (!dec)
+		return -1;
+
+	pthread_mutex_lock(&dec->lock);
+	*stats = dec->stats;
+	stats->queue_depth = dec->queue_count;
+	pthread_mutex_unlock(&dec->lock);
+
+	return 0;
+}
+
 bool
 qd_format_is_pcm(qap_audio_format_t format)
 {
@@ -838,8 +1247,8 @@ output_write_header(struct qd_output *out)
 	}
 
 	if (wav_channel_count != cfg->channels) {
-		fprintf(stderr, "dropping %d channels from output",
-			cfg->channels - wav_channel_count);
+		err("out: %s: dropping %d channels from output", out->name,
+		    cfg->channels - wav_channel_count);
 	}
 
 	memcpy(&hdr.riff_magic, "RIFF", 4);
@@ -859,15 +1268,22 @@ output_write_header(struct qd_output *out)
 	hdr.fmt.cb_size = sizeof (hdr.fmt.ext);
 	hdr.fmt.ext.valid_bits_per_sample = cfg->bit_width;
 	hdr.fmt.ext.channel_mask = channel_mask;
-	memcpy(&hdr.fmt.ext.sub_format,
-	       "\x01\x00\x00\x00\x00\x00\x10\x00\x80\x00\x00\xAA\x00\x38\x9B\x71",
-	       16);
+	if (out->float_samples) {
+		// KSDATAFORMAT_SUBTYPE_IEEE_FLOAT
+		memcpy(&hdr.fmt.ext.sub_format,
+		       "\x03\x00\x00\x00\x00\x00\x10\x00\x80\x00\x00\xAA\x00\x38\x9B\x71",
+		       16);
+	} else {
+		memcpy(&hdr.fmt.ext.sub_format,
+		       "\x01\x00\x00\x00\x00\x00\x10\x00\x80\x00\x00\xAA\x00\x38\x9B\x71",
+		       16);
+	}
 
 	memcpy(&hdr.data.chunk_label, "data", 4);
 	hdr.data.chunk_size = 0xffffffff;
 
 	if (fwrite(&hdr, sizeof (hdr), 1, out->stream) != 1) {
-		fprintf(stderr, "failed to write wav header\n");
+		err("out: %s: failed to write wav header", out->name);
 		return -1;
 	}
 
@@ -917,12 +1333,16 @@ output_write_buffer(struct qd_output *out, const qap_buffer_common_t *buffer)
 static void
 qd_output_set_config(struct qd_output *output, qap_output_config_t *cfg)
 {
+	char chmap[QD_CHMAP_STR_LEN];
+
 	info("out: %s: config: id=0x%x format=%s sr=%d ss=%d "
 	     "interleaved=%d channels=%d chmap[%s]",
 	     output->name, cfg->id,
 	     audio_format_to_str(cfg->format),
 	     cfg->sample_rate, cfg->bit_width, cfg->is_interleaved,
-	     cfg->channels, audio_chmap_to_str(cfg->channels, cfg->ch_map));
+	     cfg->channels,
+	     audio_chmap_to_str(chmap, sizeof (chmap), cfg->channels,
+				cfg->ch_map));
 
 	output->config = *cfg;
 
@@ -935,6 +1355,9 @@ qd_output_set_config(struct qd_output *output, qap_output_config_t *cfg)
 static void handle_buffer(struct qd_session *session,
 			  qap_audio_buffer_t *buffer);
 
+/* runs on the swdec thread, concurrently with the qap callback thread;
+ * per-output state is only touched from one of them, shared session
+ * state in handle_buffer is accessed under the session lock */
 static void
 handle_decoded_buffer(void *userdata, qap_audio_buffer_t *buffer)
 {
@@ -964,9 +1387,14 @@ handle_encoded_buffer(struct qd_output *output, qap_audio_buffer_t *buffer)
 		return;
 
 	if (!dec_output->swdec) {
-		dec_output->swdec = qd_sw_decoder_create(output->config.format);
+		dec_output->swdec =
+			qd_sw_decoder_create(output->config.format,
+					     output->session->swdec_format,
+					     output->session->cpu_stats);
 		if (!dec_output->swdec)
 			return;
+		dec_output->float_samples =
+			output->session->swdec_format == QD_SAMPLE_FORMAT_FLT;
 		qd_sw_decoder_set_callback(dec_output->swdec,
 					   handle_decoded_buffer,
 					   dec_output);
@@ -975,43 +1403,222 @@ handle_encoded_buffer(struct qd_output *output, qap_audio_buffer_t *buffer)
 	qd_sw_decoder_write(dec_output->swdec, buffer);
 }
 
+/* called with the session lock held */
 static void
-update_output_ts(struct qd_output *output, int64_t timestamp)
+pts_ring_reset(struct qd_pts_ring *ring)
 {
-	if ((timestamp < output->expected_ts - 1 ||
-	     timestamp > output->expected_ts + 1)) {
-		err("out: %s: pts=%" PRIu64 " does not match expected pts=%" PRId64 " (%" PRId64 " us diff), reset",
-		    output->name, timestamp, output->expected_ts,
-		    output->expected_ts - timestamp);
-		output->expected_ts = timestamp;
-	}
+	ring->head = 0;
+	ring->count = 0;
+}
 
-	if (qd_last_input_ts != AV_NOPTS_VALUE) {
-		dbg("out: %s: delta with input: %" PRId64 "ms",
-		    output->name,
-		    (qd_last_input_ts - timestamp) / QD_MSECOND);
+static void
+pts_ring_add(struct qd_session *session, enum qd_input_id id, int64_t pts,
+	     uint64_t time)
+{
+	struct qd_pts_ring *ring = &session->input_pts[id];
+	struct qd_pts_entry *last;
+
+	pthread_mutex_lock(&session->lock);
+
+	/* new stream or seek, positions restart from zero */
+	if (ring->count > 0) {
+		last = &ring->entries[(ring->head - 1) % QD_PTS_RING_SIZE];
+		if (pts - ring->base_pts < last->pos)
+			pts_ring_reset(ring);
 	}
+
+	if (ring->count == 0)
+		ring->base_pts = pts;
+
+	ring->entries[ring->head].pos = pts - ring->base_pts;
+	ring->entries[ring->head].time = time;
+	ring->head = (ring->head + 1) % QD_PTS_RING_SIZE;
+	if (ring->count < QD_PTS_RING_SIZE)
+		ring->count++;
+
+	pthread_mutex_unlock(&session->lock);
 }
 
-static void
-handle_buffer(struct qd_session *session, qap_audio_buffer_t *abuffer)
+/* find when the input data for an output position was written, from the
+ * first input that has a record of it */
+static bool
+pts_ring_lookup(struct qd_session *session, int64_t ts, bool absolute,
+		uint64_t *time)
 {
-	int id = abuffer->buffer_parms.output_buf_params.output_id;
-	struct qd_output *output = qd_session_get_output(session, id);
-	qap_buffer_common_t *buffer = &abuffer->common_params;
-	int duration;
-	int frames;
+	bool found = false;
 
 	pthread_mutex_lock(&session->lock);
-	if (session->terminated) {
-		pthread_mutex_unlock(&session->lock);
-		dbg("out: %s: drop buffer size=%u, session terminated",
-		    output->name, buffer->size);
-		return;
+
+	for (int i = 0; i < QD_MAX_INPUTS && !found; i++) {
+		struct qd_pts_ring *ring = &session->input_pts[i];
+		int64_t pos = absolute ? ts - ring->base_pts : ts;
+
+		for (unsigned int n = 1; n <= ring->count; n++) {
+			struct qd_pts_entry *e = &ring->entries[
+				(ring->head + QD_PTS_RING_SIZE - n) %
+				QD_PTS_RING_SIZE];
+
+			if (e->pos <= pos) {
+				*time = e->time;
+				found = true;
+				break;
+			}
+		}
 	}
+
 	pthread_mutex_unlock(&session->lock);
 
-	if (qd_format_is_pcm(output->config.format)) {
+	return found;
+}
+
+static void
+update_output_latency(struct qd_session *session, struct qd_output *output,
+		      int64_t timestamp, uint64_t now)
+{
+	uint64_t write_time;
+	int64_t latency;
+	bool absolute;
+	int64_t ts;
+
+	if (output->stream_restart) {
+		output->stream_start_pts = output->pts;
+		output->stream_restart = false;
+	}
+
+	absolute = qd_session_uses_timestamps(session);
+	ts = absolute ? timestamp : output->pts - output->stream_start_pts;
+
+	if (!pts_ring_lookup(session, ts, absolute, &write_time))
+		return;
+
+	latency = now - write_time;
+	__atomic_store_n(&session->last_latency, latency, __ATOMIC_RELAXED);
+
+	qd_histogram_add(&session->stats.outputs[output->id][QD_OUTPUT_STAGE_LATENCY],
+			 latency);
+
+	if (session->latency_log) {
+		fprintf(session->latency_log,
+			"%" PRIu64 ",%s,%" PRId64 ",%" PRId64 "\n",
+			now - qd_base_time, output->name, ts, latency);
+	}
+}
+
+static void
+update_output_ts(struct qd_output *output, int64_t timestamp)
+{
+	if ((timestamp < output->expected_ts - 1 ||
+	     timestamp > output->expected_ts + 1)) {
+		err("out: %s: pts=%" PRIu64 " does not match expected pts=%" PRId64 " (%" PRId64 " us diff), reset",
+		    output->name, timestamp, output->expected_ts,
+		    output->expected_ts - timestamp);
+		output->expected_ts = timestamp;
+		output->pts_resets++;
+	}
+
+	if (qd_log_enabled(3) && qd_last_input_ts != AV_NOPTS_VALUE) {
+		dbg("out: %s: delta with input: %" PRId64 "ms",
+		    output->name,
+		    (qd_last_input_ts - timestamp) / QD_MSECOND);
+	}
+}
+
+/* delay is the time left before the buffer deadline, negative when late */
+static void
+check_output_realtime(struct qd_session *session, struct qd_output *output,
+		      int64_t delay)
+{
+	struct qd_histogram *stats = session->stats.outputs[output->id];
+	struct qd_realtime_limits *limits = &session->rt_limits;
+	const char *reason = NULL;
+
+	if (output->rt_started) {
+		qd_histogram_add(&stats[QD_OUTPUT_STAGE_JITTER],
+				 llabs(delay - output->rt_last_delay));
+	}
+	output->rt_last_delay = delay;
+	output->rt_started = true;
+
+	if (delay < 0) {
+		dbg("out: %s: buffer late by %" PRIi64 "us",
+		    output->name, -delay);
+		QD_PROBE(output_late, output->id, -delay);
+
+		output->late_buffers++;
+		output->max_lateness = QD_MAX(output->max_lateness,
+					      (uint64_t)-delay);
+		qd_histogram_add(&stats[QD_OUTPUT_STAGE_LATENESS], -delay);
+
+		if (limits->max_underruns >= 0 &&
+		    output->late_buffers > (uint64_t)limits->max_underruns)
+			reason = "too many underruns";
+		else if (limits->max_lateness > 0 &&
+			 -delay > limits->max_lateness)
+			reason = "buffer too late";
+	} else if (limits->budget > 0 && delay > limits->budget) {
+		dbg("out: %s: buffer early by %" PRIi64 "us, over budget",
+		    output->name, delay);
+
+		output->overruns++;
+
+		if (limits->max_overruns >= 0 &&
+		    output->overruns > (uint64_t)limits->max_overruns)
+			reason = "too many overruns";
+	}
+
+	if (!reason)
+		return;
+
+	/* the decoded outputs are checked from their swdec threads, only
+	 * the first failure is reported */
+	pthread_mutex_lock(&session->lock);
+	if (session->rt_failed) {
+		pthread_mutex_unlock(&session->lock);
+		return;
+	}
+	session->rt_failed = true;
+	pthread_mutex_unlock(&session->lock);
+
+	err("out: %s: realtime check failed, %s: %" PRIu64 " underruns, "
+	    "%" PRIu64 " overruns, max lateness %" PRIu64 "us",
+	    output->name, reason, output->late_buffers, output->overruns,
+	    output->max_lateness);
+
+	if (session->rt_failed_func)
+		session->rt_failed_func(session, session->rt_failed_data);
+}
+
+static void
+handle_buffer(struct qd_session *session, qap_audio_buffer_t *abuffer)
+{
+	int id = abuffer->buffer_parms.output_buf_params.output_id;
+	struct qd_output *output = qd_session_get_output(session, id);
+	qap_buffer_common_t *buffer = &abuffer->common_params;
+	struct qd_histogram *stats = session->stats.outputs[output->id];
+	uint64_t t, end, cpu;
+	int duration;
+	int frames;
+
+	pthread_mutex_lock(&session->lock);
+	if (session->terminated) {
+		pthread_mutex_unlock(&session->lock);
+		dbg("out: %s: drop buffer size=%u, session terminated",
+		    output->name, buffer->size);
+		return;
+	}
+	if (!session->first_output_time)
+		session->first_output_time = qd_get_time();
+	pthread_mutex_unlock(&session->lock);
+
+	t = get_time();
+	cpu = session->cpu_stats ? qd_get_thread_cpu_time() : 0;
+	if (output->last_buffer_time) {
+		qd_histogram_add(&stats[QD_OUTPUT_STAGE_INTERVAL],
+				 t - output->last_buffer_time);
+	}
+	output->last_buffer_time = t;
+
+	if (qd_format_is_pcm(output->config.format)) {
 		output->pts = output->total_frames * 1000000 /
 			output->config.sample_rate;
 		frames = buffer->size / (output->config.bit_width / 8 *
@@ -1031,25 +1638,28 @@ handle_buffer(struct qd_session *session, qap_audio_buffer_t *abuffer)
 
 	dbg("out: %s: pcm buffer size=%u pts=%" PRIu64 " duration=%d",
 	    output->name, buffer->size, buffer->timestamp, duration);
+	QD_PROBE(output_buffer, output->id, buffer->size, buffer->timestamp,
+		 output->pts);
 
 	if (qd_session_uses_timestamps(session))
 		update_output_ts(output, buffer->timestamp);
 
-	if (session->realtime &&
-	    output == qd_session_get_primary_output(session)) {
-		uint64_t now;
+	update_output_latency(session, output, buffer->timestamp, t);
+
+	if (session->realtime) {
 		int64_t delay;
 
-		now = qd_get_time() - output->start_time;
-		delay = output->pts - now;
+		delay = output->pts - (qd_get_time() - output->start_time);
+		check_output_realtime(session, output, delay);
 
-		if (delay <= 0) {
-			dbg("out: %s: buffer late by %" PRIi64 "us",
-			    output->name, -delay);
-		} else {
+		/* the other outputs are paced by the primary one */
+		if (delay > 0 &&
+		    output == qd_session_get_primary_output(session)) {
 			dbg("out: %s: wait %" PRIi64 "us for sync",
 			    output->name, delay);
+			QD_PROBE(output_wait, output->id, delay);
 			usleep(delay);
+			t = get_time();
 		}
 	}
 
@@ -1076,6 +1686,14 @@ out:
 	output->total_frames += frames;
 	output->total_bytes += buffer->size;
 	output->expected_ts += duration;
+
+	end = get_time();
+	qd_histogram_add(&stats[QD_OUTPUT_STAGE_DELIVER], end - t);
+	if (session->cpu_stats)
+		__atomic_fetch_add(&session->stats.cpu.callbacks[output->id],
+				   qd_get_thread_cpu_time() - cpu,
+				   __ATOMIC_RELAXED);
+	QD_TRACE_SLICE("output", output->name, buffer->size, t, end);
 }
 
 static void
@@ -1119,6 +1737,16 @@ handle_output_delay(struct qd_session *session, qap_output_delay_t *delay)
 	output->delay = *delay;
 }
 
+/* make sure the software decoded outputs are complete before reporting EOS */
+static void
+drain_sw_decoders(struct qd_session *session)
+{
+	for (int i = 0; i < QD_MAX_OUTPUTS; i++) {
+		if (session->outputs[i].swdec)
+			qd_sw_decoder_drain(session->outputs[i].swdec);
+	}
+}
+
 static void
 handle_qap_session_event(qap_session_handle_t session, void *priv,
 			 qap_callback_event_t event_id, int size, void *data)
@@ -1145,6 +1773,13 @@ handle_qap_session_event(qap_session_handle_t session, void *priv,
 		break;
 	case QAP_CALLBACK_EVENT_EOS:
 		info("qap: EOS for primary");
+		drain_sw_decoders(qd_session);
+		/* do not count the gap until the next stream as an interval,
+		 * and restart the output positions */
+		for (int i = 0; i < QD_MAX_OUTPUTS; i++) {
+			qd_session->outputs[i].last_buffer_time = 0;
+			qd_session->outputs[i].stream_restart = true;
+		}
 		pthread_mutex_lock(&qd_session->lock);
 		qd_session->eos_inputs |= 1 << QD_INPUT_MAIN;
 		pthread_cond_signal(&qd_session->cond);
@@ -1152,6 +1787,7 @@ handle_qap_session_event(qap_session_handle_t session, void *priv,
 		break;
 	case QAP_CALLBACK_EVENT_MAIN_2_EOS:
 		info("qap: EOS for secondary");
+		drain_sw_decoders(qd_session);
 		pthread_mutex_lock(&qd_session->lock);
 		qd_session->eos_inputs |= 1 << QD_INPUT_MAIN2;
 		pthread_cond_signal(&qd_session->cond);
@@ -1192,11 +1828,14 @@ handle_qap_session_event(qap_session_handle_t session, void *priv,
 static void
 handle_input_config(struct qd_input *input, qap_input_config_t *cfg)
 {
+	char chmap[QD_CHMAP_STR_LEN];
+
 	info(" in: %s: codec=%s profile=%s sr=%u ss=%u channels=%u ch_map[%s]",
 	     input->name, audio_format_to_str(cfg->format),
 	     audio_profile_to_str(cfg->format, cfg->profile),
 	     cfg->sample_rate, cfg->bit_width, cfg->channels,
-	     audio_chmap_to_str(cfg->channels, cfg->ch_map));
+	     audio_chmap_to_str(chmap, sizeof (chmap), cfg->channels,
+				cfg->ch_map));
 
 	input->config = *cfg;
 
@@ -1246,6 +1885,9 @@ handle_qap_module_event(qap_module_handle_t module, void *priv,
 static void
 wait_buffer_available(struct qd_input *input)
 {
+	uint64_t t = get_time();
+	uint64_t end;
+
 	pthread_mutex_lock(&input->lock);
 	while (!input->terminated && input->buffer_full) {
 		struct timespec delay;
@@ -1258,9 +1900,16 @@ wait_buffer_available(struct qd_input *input)
 		    input->state == QD_INPUT_STATE_STARTED) {
 			err("%s: stalled, buffer has been full for 1 second",
 			    input->name);
+			input->stalls++;
 		}
 	}
 	pthread_mutex_unlock(&input->lock);
+
+	end = get_time();
+	input->adapt_wait += end - t;
+	qd_histogram_add(&input->session->stats.inputs[input->id][QD_INPUT_STAGE_WAIT],
+			 end - t);
+	QD_TRACE_SLICE("wait", input->name, -1, t, end);
 }
 
 static int
@@ -1285,29 +1934,38 @@ qd_input_start(struct qd_input *input)
 	uint64_t t;
 	int ret;
 
+	pthread_mutex_lock(&input->cmd_lock);
+
 	if (input->state == QD_INPUT_STATE_STARTED) {
 		info(" in: %s: already started", input->name);
-		return 0;
+		ret = 0;
+		goto out;
 	}
 
 	info(" in: %s: start", input->name);
 
-	t = get_time();
+	t = get_trace_time(4);
 
 	ret = qap_module_cmd(input->module, QAP_MODULE_CMD_START,
 			     0, NULL, NULL, NULL);
 	if (ret) {
 		err("QAP_SESSION_CMD_START command failed");
-		return 1;
+		ret = 1;
+		goto out;
 	}
 
 	trace(" in: %s: [t=%" PRIu64 "ms] qap_module_cmd(QAP_MODULE_CMD_START)",
 	      input->name, (get_time() - t) / 1000);
+	QD_PROBE(input_cmd, input->id, QAP_MODULE_CMD_START, get_time() - t);
+	QD_TRACE_SLICE("QAP_MODULE_CMD_START", input->name, -1, t, get_time());
 
 	input->state = QD_INPUT_STATE_STARTED;
 	input->state_change_time = qd_get_time();
 
-	return 0;
+out:
+	pthread_mutex_unlock(&input->cmd_lock);
+
+	return ret;
 }
 
 int
@@ -1316,29 +1974,38 @@ qd_input_pause(struct qd_input *input)
 	uint64_t t;
 	int ret;
 
+	pthread_mutex_lock(&input->cmd_lock);
+
 	if (input->state != QD_INPUT_STATE_STARTED) {
 		info(" in: %s: cannot pause, not started", input->name);
-		return 0;
+		ret = 0;
+		goto out;
 	}
 
 	info(" in: %s: pause", input->name);
 
-	t = get_time();
+	t = get_trace_time(4);
 
 	ret = qap_module_cmd(input->module, QAP_MODULE_CMD_PAUSE,
 			     0, NULL, NULL, NULL);
 	if (ret) {
 		err("QAP_SESSION_CMD_PAUSE command failed");
-		return 1;
+		ret = 1;
+		goto out;
 	}
 
 	trace(" in: %s: [t=%" PRIu64 "ms] qap_module_cmd(QAP_MODULE_CMD_PAUSE)",
 	      input->name, (get_time() - t) / 1000);
+	QD_PROBE(input_cmd, input->id, QAP_MODULE_CMD_PAUSE, get_time() - t);
+	QD_TRACE_SLICE("QAP_MODULE_CMD_PAUSE", input->name, -1, t, get_time());
 
 	input->state = QD_INPUT_STATE_PAUSED;
 	input->state_change_time = qd_get_time();
 
-	return 0;
+out:
+	pthread_mutex_unlock(&input->cmd_lock);
+
+	return ret;
 }
 
 int
@@ -1347,29 +2014,38 @@ qd_input_stop(struct qd_input *input)
 	uint64_t t;
 	int ret;
 
+	pthread_mutex_lock(&input->cmd_lock);
+
 	if (input->state == QD_INPUT_STATE_STOPPED) {
 		info(" in: %s: already stopped", input->name);
-		return 0;
+		ret = 0;
+		goto out;
 	}
 
 	info(" in: %s: stop", input->name);
 
-	t = get_time();
+	t = get_trace_time(4);
 
 	ret = qap_module_cmd(input->module, QAP_MODULE_CMD_STOP,
 			     0, NULL, NULL, NULL);
 	if (ret) {
 		err("QAP_SESSION_CMD_STOP command failed");
-		return 1;
+		ret = 1;
+		goto out;
 	}
 
 	trace(" in: %s: [t=%" PRIu64 "ms] qap_module_cmd(QAP_MODULE_CMD_STOP)",
 	      input->name, (get_time() - t) / 1000);
+	QD_PROBE(input_cmd, input->id, QAP_MODULE_CMD_STOP, get_time() - t);
+	QD_TRACE_SLICE("QAP_MODULE_CMD_STOP", input->name, -1, t, get_time());
 
 	input->state = QD_INPUT_STATE_STOPPED;
 	input->state_change_time = qd_get_time();
 
-	return 0;
+out:
+	pthread_mutex_unlock(&input->cmd_lock);
+
+	return ret;
 }
 
 int
@@ -1378,9 +2054,11 @@ qd_input_flush(struct qd_input *input)
 	uint64_t t;
 	int ret;
 
+	pthread_mutex_lock(&input->cmd_lock);
+
 	info(" in: %s: flush", input->name);
 
-	t = get_time();
+	t = get_trace_time(4);
 
 	pthread_mutex_lock(&input->lock);
 	input->flushing = true;
@@ -1393,13 +2071,20 @@ qd_input_flush(struct qd_input *input)
 	input->flushing = false;
 	pthread_mutex_unlock(&input->lock);
 
+	pthread_mutex_lock(&input->session->lock);
+	pts_ring_reset(&input->session->input_pts[input->id]);
+	pthread_mutex_unlock(&input->session->lock);
+
 	if (ret) {
 		err("QAP_SESSION_CMD_FLUSH command failed");
-		return 1;
+		ret = 1;
+		goto out;
 	}
 
 	trace(" in: %s: [t=%" PRIu64 "ms] qap_module_cmd(QAP_MODULE_CMD_FLUSH)",
 	      input->name, (get_time() - t) / 1000);
+	QD_PROBE(input_cmd, input->id, QAP_MODULE_CMD_FLUSH, get_time() - t);
+	QD_TRACE_SLICE("QAP_MODULE_CMD_FLUSH", input->name, -1, t, get_time());
 
 	info(" in: %s: flush done", input->name);
 
@@ -1412,7 +2097,10 @@ qd_input_flush(struct qd_input *input)
 	pthread_mutex_unlock(&input->lock);
 #endif
 
-	return 0;
+out:
+	pthread_mutex_unlock(&input->cmd_lock);
+
+	return ret;
 }
 
 int
@@ -1435,8 +2123,12 @@ qd_input_send_eos(struct qd_input *input)
 	char c = 0;
 	int ret;
 
-	if (input->state == QD_INPUT_STATE_STOPPED)
-		return 0;
+	pthread_mutex_lock(&input->cmd_lock);
+
+	if (input->state == QD_INPUT_STATE_STOPPED) {
+		ret = 0;
+		goto out;
+	}
 
 	memset(&qap_buffer, 0, sizeof (qap_buffer));
 	qap_buffer.buffer_parms.input_buf_params.flags = QAP_BUFFER_EOS;
@@ -1446,12 +2138,16 @@ qd_input_send_eos(struct qd_input *input)
 	if (ret) {
 		err("%s: failed to send eos, err %d",
 		    input->name, ret);
-		return 1;
+		ret = 1;
+		goto out;
 	}
 
 	info(" in: %s: sent EOS", input->name);
 
-	return 0;
+out:
+	pthread_mutex_unlock(&input->cmd_lock);
+
+	return ret;
 }
 
 static int
@@ -1462,7 +2158,7 @@ qd_input_get_param(struct qd_input *input, uint32_t param_id,
 	uint32_t reply_size;
 	uint64_t t;
 
-	t = get_time();
+	t = get_trace_time(4);
 
 	ret = qap_module_cmd(input->module, QAP_MODULE_CMD_GET_PARAM,
 			     sizeof (param_id), &param_id,
@@ -1470,6 +2166,8 @@ qd_input_get_param(struct qd_input *input, uint32_t param_id,
 
 	trace(" in: %s: [t=%" PRIu64 "ms] qap_module_cmd(QAP_MODULE_CMD_GET_PARAM, %u)",
 	      input->name, (get_time() - t) / 1000, param_id);
+	QD_TRACE_SLICE("QAP_MODULE_CMD_GET_PARAM", input->name, param_id,
+		       t, get_time());
 
 	assert(reply_size == size);
 
@@ -1484,13 +2182,15 @@ qd_input_set_param(struct qd_input *input,
 	qap_status_t ret;
 	uint64_t t;
 
-	t = get_time();
+	t = get_trace_time(4);
 
 	ret = qap_module_cmd(input->module, QAP_MODULE_CMD_SET_PARAM,
 			     sizeof (params), params, NULL, NULL);
 
 	trace(" in: %s: [t=%" PRIu64 "ms] qap_module_cmd(QAP_MODULE_CMD_SET_PARAM, %u)",
 	      input->name, (get_time() - t) / 1000, param_id);
+	QD_TRACE_SLICE("QAP_MODULE_CMD_SET_PARAM", input->name, param_id,
+		       t, get_time());
 
 	return ret;
 }
@@ -1511,6 +2211,15 @@ qd_input_get_buffer_size(struct qd_input *input)
 	return buffer_size;
 }
 
+static void
+update_input_buffer_stats(struct qd_input *input, uint32_t buffer_size)
+{
+	uint32_t *peak = &input->session->stats.buffers.inputs[input->id];
+
+	__atomic_store_n(peak, QD_MAX(__atomic_load_n(peak, __ATOMIC_RELAXED),
+				      buffer_size), __ATOMIC_RELAXED);
+}
+
 int
 qd_input_set_buffer_size(struct qd_input *input, uint32_t buffer_size)
 {
@@ -1528,6 +2237,8 @@ qd_input_set_buffer_size(struct qd_input *input, uint32_t buffer_size)
 
 	assert(buffer_size == qd_input_get_buffer_size(input));
 
+	update_input_buffer_stats(input, buffer_size);
+
 	return 0;
 }
 
@@ -1628,43 +2339,38 @@ qd_input_destroy(struct qd_input *input)
 
 	pthread_mutex_lock(&session->lock);
 	session->eos_inputs &= ~(1 << input->id);
+	if (session->inputs[input->id] == input)
+		session->inputs[input->id] = NULL;
 	pthread_mutex_unlock(&session->lock);
 
 	pthread_cond_destroy(&input->cond);
 	pthread_mutex_destroy(&input->lock);
+	pthread_mutex_destroy(&input->cmd_lock);
 
 	info("destroyed %s input", input->name);
 
-	free(input);
+	qd_mem_free(QD_MEM_INPUT, input);
 }
 
-struct qd_input *
-qd_input_create(struct qd_session *session, enum qd_input_id id,
-		qap_module_config_t *qap_config)
+/* init the qap module of the input and size its buffer */
+static int
+qd_input_init_module(struct qd_input *input, qap_module_config_t *qap_config)
 {
-	struct qd_input *input;
+	struct qd_session *session = input->session;
 	uint32_t buffer_size;
 
-	input = calloc(1, sizeof *input);
-	if (!input)
-		return NULL;
-
-	input->name = qd_input_id_to_str(id);
-	input->id = id;
-	input->session = session;
-
-	pthread_cond_init(&input->cond, NULL);
-	pthread_mutex_init(&input->lock, NULL);
+	input->module_config = *qap_config;
 
 	if (qap_module_init(session->handle, qap_config, &input->module)) {
 		err("failed to init module");
-		goto fail;
+		input->module = NULL;
+		return -1;
 	}
 
 	if (qap_module_set_callback(input->module,
 				    handle_qap_module_event, input)) {
 		err("failed to set module callback");
-		goto fail;
+		return -1;
 	}
 
 	buffer_size = qd_input_get_buffer_size(input);
@@ -1681,19 +2387,70 @@ qd_input_create(struct qd_session *session, enum qd_input_id id,
 				session->buffer_size_ms / 1000;
 
 			if (qd_input_set_buffer_size(input, buffer_size))
-				goto fail;
+				return -1;
 		}
 	} else {
 		buffer_size = 4 * 1024;
 		if (qd_input_set_buffer_size(input, buffer_size))
-			goto fail;
+			return -1;
 	}
 
 	input->buffer_size = buffer_size;
+	update_input_buffer_stats(input, buffer_size);
+
+	/* adaptive sizing bounds, 8ms to 128ms of PCM data, or 1KB to 16KB of
+	 * compressed data, always frame aligned for PCM */
+	if (qd_format_is_pcm(qap_config->format)) {
+		uint32_t frame_size = qap_config->channels *
+			qap_config->bit_width / 8;
+
+		input->min_buffer_size = frame_size *
+			(qap_config->sample_rate * 8 / 1000);
+		input->max_buffer_size = frame_size *
+			(qap_config->sample_rate * 128 / 1000);
+	} else {
+		input->min_buffer_size = 1024;
+		input->max_buffer_size = 16 * 1024;
+	}
+	input->adapt_start = 0;
 
 	info(" in: %s: latency %dms", input->name,
 	     qd_input_get_latency(input));
 
+	return 0;
+}
+
+struct qd_input *
+qd_input_create(struct qd_session *session, enum qd_input_id id,
+		qap_module_config_t *qap_config)
+{
+	pthread_mutexattr_t attr;
+	struct qd_input *input;
+
+	input = qd_mem_calloc(QD_MEM_INPUT, 1, sizeof *input);
+	if (!input)
+		return NULL;
+
+	input->name = qd_input_id_to_str(id);
+	input->id = id;
+	input->session = session;
+
+	pthread_cond_init(&input->cond, NULL);
+	pthread_mutex_init(&input->lock, NULL);
+
+	/* commands may nest, e.g. a reinit stops and restarts the input */
+	pthread_mutexattr_init(&attr);
+	pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+	pthread_mutex_init(&input->cmd_lock, &attr);
+	pthread_mutexattr_destroy(&attr);
+
+	pthread_mutex_lock(&session->lock);
+	session->inputs[id] = input;
+	pthread_mutex_unlock(&session->lock);
+
+	if (qd_input_init_module(input, qap_config))
+		goto fail;
+
 	if (qd_input_start(input))
 		goto fail;
 
@@ -1704,14 +2461,12 @@ fail:
 	return NULL;
 }
 
-struct qd_input *
-qd_input_create_from_avstream(struct qd_session *session, enum qd_input_id id,
-			      AVStream *avstream)
+static int
+qd_input_config_from_avstream(enum qd_input_id id, AVStream *avstream,
+			      qap_module_config_t *qap_mod_cfg)
 {
-	struct qd_input *input;
 	char channel_layout_desc[32];
 	qap_audio_format_t qap_format;
-	qap_module_config_t qap_mod_cfg;
 	qap_module_flags_t qap_flags;
 	AVCodecParameters *codecpar;
 
@@ -1739,7 +2494,7 @@ qd_input_create_from_avstream(struct qd_session *session, enum qd_input_id id,
 		break;
 	default:
 		err("unknown input id %d", id);
-		return NULL;
+		return -1;
 	}
 
 	switch (codecpar->codec_id) {
@@ -1768,19 +2523,19 @@ qd_input_create_from_avstream(struct qd_session *session, enum qd_input_id id,
 	default:
 		err("cannot decode %s format",
 		    avcodec_get_name(codecpar->codec_id));
-		return NULL;
+		return -1;
 	}
 
-	memset(&qap_mod_cfg, 0, sizeof (qap_mod_cfg));
-	qap_mod_cfg.module_type = QAP_MODULE_DECODER;
-	qap_mod_cfg.flags = qap_flags;
-	qap_mod_cfg.format = qap_format;
+	memset(qap_mod_cfg, 0, sizeof (*qap_mod_cfg));
+	qap_mod_cfg->module_type = QAP_MODULE_DECODER;
+	qap_mod_cfg->flags = qap_flags;
+	qap_mod_cfg->format = qap_format;
 
 	if (qd_format_is_raw(qap_format)) {
-		qap_mod_cfg.channels = codecpar->channels;
-		qap_mod_cfg.is_interleaved = true;
-		qap_mod_cfg.sample_rate = codecpar->sample_rate;
-		qap_mod_cfg.bit_width = codecpar->bits_per_coded_sample;
+		qap_mod_cfg->channels = codecpar->channels;
+		qap_mod_cfg->is_interleaved = true;
+		qap_mod_cfg->sample_rate = codecpar->sample_rate;
+		qap_mod_cfg->bit_width = codecpar->bits_per_coded_sample;
 	}
 
 	av_get_channel_layout_string(channel_layout_desc,
@@ -1803,9 +2558,21 @@ qd_input_create_from_avstream(struct qd_session *session, enum qd_input_id id,
 		       codecpar->bit_rate / 1000);
 	}
 
-	input = qd_input_create(session, id, &qap_mod_cfg);
-	if (!input)
-		return NULL;
+	return 0;
+}
+
+/* setup bitstream conversion needed before feeding the module */
+static int
+qd_input_setup_avstream(struct qd_input *input, AVStream *avstream)
+{
+	AVCodecParameters *codecpar = avstream->codecpar;
+
+	input->insert_adts_header = false;
+
+	if (input->avmux) {
+		avformat_free_context(input->avmux);
+		input->avmux = NULL;
+	}
 
 	if (codecpar->codec_id == AV_CODEC_ID_AAC &&
 	    codecpar->extradata_size >= 2) {
@@ -1819,7 +2586,7 @@ qd_input_create_from_avstream(struct qd_session *session, enum qd_input_id id,
 
 		if (obj_type == 0) {
 			err("invalid AOT 0");
-			goto fail;
+			return -1;
 		}
 
 		if (obj_type <= 4 && rate_idx < 15) {
@@ -1844,13 +2611,13 @@ qd_input_create_from_avstream(struct qd_session *session, enum qd_input_id id,
 								 NULL);
 			if (ret < 0) {
 				av_err(ret, "failed to create latm mux");
-				goto fail;
+				return -1;
 			}
 
 			mux_stream = avformat_new_stream(input->avmux, NULL);
 			if (!mux_stream) {
 				err("failed to create latm stream");
-				goto fail;
+				return -1;
 			}
 
 			mux_stream->time_base = avstream->time_base;
@@ -1860,40 +2627,262 @@ qd_input_create_from_avstream(struct qd_session *session, enum qd_input_id id,
 			ret = avformat_write_header(input->avmux, NULL);
 			if (ret < 0) {
 				av_err(ret, "failed to write latm header");
-				goto fail;
+				return -1;
 			}
 		}
 	}
 
-	return input;
-
-fail:
-	qd_input_destroy(input);
-	return NULL;
+	return 0;
 }
 
-int
-qd_input_write(struct qd_input *input, void *data, int size,
-	       int64_t pts, int64_t duration)
+struct qd_input *
+qd_input_create_from_avstream(struct qd_session *session, enum qd_input_id id,
+			      AVStream *avstream)
 {
-	qap_audio_buffer_t qap_buffer;
-	qap_report_frames_t report_frames;
-	int offset = 0;
-	int ret;
+	struct qd_input *input;
+	qap_module_config_t qap_mod_cfg;
 
-	if (input->written_bytes == 0)
-		input->start_time = qd_get_time();
+	if (qd_input_config_from_avstream(id, avstream, &qap_mod_cfg))
+		return NULL;
 
-	if (input->id == QD_INPUT_MAIN)
-		qd_last_input_ts = pts;
+	input = qd_input_create(session, id, &qap_mod_cfg);
+	if (!input)
+		return NULL;
 
-	memset(&qap_buffer, 0, sizeof (qap_buffer));
+	if (qd_input_setup_avstream(input, avstream)) {
+		qd_input_destroy(input);
+		return NULL;
+	}
 
-	/* XXX: don't use timestamps in OTT mode, otherwise dual decode and
-	 * pause commands do not work correctly */
-	if (pts == AV_NOPTS_VALUE ||
-	    !qd_session_uses_timestamps(input->session)) {
-		qap_buffer.common_params.timestamp = 0;
+	return input;
+}
+
+/* true if the module of the input can decode the stream */
+static bool
+qd_input_matches_avstream(struct qd_input *input, AVStream *avstream)
+{
+	qap_module_config_t qap_mod_cfg;
+	qap_module_config_t *cfg = &input->module_config;
+
+	if (qd_input_config_from_avstream(input->id, avstream, &qap_mod_cfg))
+		return false;
+
+	if (qap_mod_cfg.format != cfg->format ||
+	    qap_mod_cfg.flags != cfg->flags ||
+	    qap_mod_cfg.channels != cfg->channels ||
+	    qap_mod_cfg.sample_rate != cfg->sample_rate ||
+	    qap_mod_cfg.bit_width != cfg->bit_width) {
+		info(" in: %s: format changed, module cannot be reused",
+		     input->name);
+		return false;
+	}
+
+	return true;
+}
+
+/* replace the module when the stream format changed; the input stays valid
+ * for the other threads using it and keeps its state and blocked flag */
+static int
+qd_input_reinit(struct qd_input *input, AVStream *avstream)
+{
+	struct qd_session *session = input->session;
+	qap_module_config_t qap_mod_cfg;
+	enum qd_input_state state;
+	int ret = -1;
+
+	if (qd_input_config_from_avstream(input->id, avstream, &qap_mod_cfg))
+		return -1;
+
+	pthread_mutex_lock(&input->cmd_lock);
+
+	info(" in: %s: reinit module", input->name);
+
+	state = input->state;
+
+	if (qd_input_stop(input) || qd_input_flush(input))
+		goto out;
+
+	if (qap_module_deinit(input->module))
+		err("failed to deinit %s module", input->name);
+	input->module = NULL;
+
+	pthread_mutex_lock(&input->lock);
+	input->buffer_full = false;
+	pthread_mutex_unlock(&input->lock);
+
+	pthread_mutex_lock(&session->lock);
+	session->eos_inputs &= ~(1 << input->id);
+	pthread_mutex_unlock(&session->lock);
+
+	if (qd_input_init_module(input, &qap_mod_cfg) ||
+	    qd_input_setup_avstream(input, avstream))
+		goto out;
+
+	if (state != QD_INPUT_STATE_STOPPED && qd_input_start(input))
+		goto out;
+
+	if (state == QD_INPUT_STATE_PAUSED && qd_input_pause(input))
+		goto out;
+
+	ret = 0;
+
+out:
+	pthread_mutex_unlock(&input->cmd_lock);
+
+	return ret;
+}
+
+/* restart the input on a new stream, returns -EAGAIN when the module cannot
+ * decode it and the input must be recreated, -1 on failure */
+int
+qd_input_reset(struct qd_input *input, AVStream *avstream)
+{
+	struct qd_session *session = input->session;
+
+	if (!qd_input_matches_avstream(input, avstream))
+		return -EAGAIN;
+
+	info(" in: %s: reset", input->name);
+
+	if (qd_input_stop(input) || qd_input_flush(input))
+		return -1;
+
+	pthread_mutex_lock(&input->lock);
+	input->terminated = false;
+	input->blocked = false;
+	input->buffer_full = false;
+	pthread_mutex_unlock(&input->lock);
+
+	input->start_time = 0;
+	input->written_bytes = 0;
+	input->written_duration = 0;
+
+	pthread_mutex_lock(&session->lock);
+	session->eos_inputs &= ~(1 << input->id);
+	pthread_mutex_unlock(&session->lock);
+
+	if (qd_input_setup_avstream(input, avstream))
+		return -1;
+
+	return qd_input_start(input) ? -1 : 0;
+}
+
+/*
+ * Adaptive input buffer sizing
+ *
+ * Every period, the buffer doubles when outputs were rendered late or when
+ * writes found it drained, as the decoder may have starved. It shrinks by
+ * one minimum size when the input to output latency is over target, or when
+ * the writer spent most of the period waiting for space, data then sitting in
+ * the buffer longer than needed. Starvation is fixed quickly while latency is
+ * trimmed slowly, and each decision is measured over a full period.
+ */
+static void
+input_adapt_buffer(struct qd_input *input)
+{
+	struct qd_session *session = input->session;
+	const struct qd_buffer_policy *policy = &session->buffer_policy;
+	int64_t period = policy->period > 0 ? policy->period : 500 * QD_MSECOND;
+	uint64_t now = qd_get_time();
+	uint64_t elapsed;
+	uint64_t late = 0;
+	uint64_t new_late;
+	int64_t latency;
+	uint32_t size = input->buffer_size;
+	const char *action = NULL;
+	int wait_pct;
+
+	for (int i = 0; i < QD_MAX_OUTPUTS; i++)
+		late += session->outputs[i].late_buffers;
+
+	/* restart measuring on state changes, the buffer is expected to
+	 * drain until it fills up again */
+	if (input->adapt_start == 0 ||
+	    input->adapt_start < input->state_change_time) {
+		input->adapt_primed = false;
+		goto reset;
+	}
+
+	elapsed = now - input->adapt_start;
+	if (elapsed < (uint64_t)period)
+		return;
+
+	new_late = late - input->adapt_late;
+	latency = __atomic_load_n(&session->last_latency, __ATOMIC_RELAXED);
+	wait_pct = input->adapt_wait * 100 / elapsed;
+
+	if (input->adapt_hold > 0)
+		input->adapt_hold--;
+
+	/* hold shrinking for a few periods after growing, not to oscillate
+	 * around the starvation point */
+	if (new_late > 0 || input->adapt_drained > 0) {
+		size = QD_MIN((uint64_t)size * 2, input->max_buffer_size);
+		input->adapt_hold = 4;
+		action = "grow";
+	} else if (input->adapt_hold == 0 &&
+		   ((policy->target_latency > 0 &&
+		     latency > policy->target_latency) || wait_pct >= 50)) {
+		size = size > input->min_buffer_size * 2 ?
+			size - input->min_buffer_size : input->min_buffer_size;
+		action = "shrink";
+	}
+
+	size = QD_MAX(size, input->min_buffer_size);
+
+	dbg(" in: %s: buffer %u bytes, %" PRIu64 " late buffers, %u drained "
+	    "writes, waiting %d%%, latency %" PRIi64 "ms", input->name,
+	    input->buffer_size, new_late, input->adapt_drained, wait_pct,
+	    latency / QD_MSECOND);
+
+	if (size != input->buffer_size) {
+		info(" in: %s: %s buffer from %u to %u bytes, %" PRIu64
+		     " late buffers, %u drained writes, waiting %d%%, "
+		     "latency %" PRIi64 "ms", input->name, action,
+		     input->buffer_size, size, new_late, input->adapt_drained,
+		     wait_pct, latency / QD_MSECOND);
+
+		if (!qd_input_set_buffer_size(input, size)) {
+			input->buffer_size = size;
+			input->buffer_resizes++;
+			QD_TRACE_COUNTER("buffer_size", input->name, size,
+					 get_time());
+		}
+	}
+
+reset:
+	input->adapt_start = now;
+	input->adapt_wait = 0;
+	input->adapt_late = late;
+	input->adapt_drained = 0;
+}
+
+int
+qd_input_write(struct qd_input *input, void *data, int size,
+	       int64_t pts, int64_t duration)
+{
+	qap_audio_buffer_t qap_buffer;
+	qap_report_frames_t report_frames;
+	int offset = 0;
+	int ret;
+
+	if (input->written_bytes == 0)
+		input->start_time = qd_get_time();
+
+	if (input->session->buffer_policy.enabled &&
+	    input->session->realtime && input->buffer_size > 0)
+		input_adapt_buffer(input);
+
+	if (input->id == QD_INPUT_MAIN)
+		qd_last_input_ts = pts;
+
+	memset(&qap_buffer, 0, sizeof (qap_buffer));
+
+	/* XXX: don't use timestamps in OTT mode, otherwise dual decode and
+	 * pause commands do not work correctly */
+	if (pts == AV_NOPTS_VALUE ||
+	    !qd_session_uses_timestamps(input->session)) {
+		qap_buffer.common_params.timestamp = 0;
 		qap_buffer.buffer_parms.input_buf_params.flags =
 			QAP_BUFFER_NO_TSTAMP;
 	} else {
@@ -1905,11 +2894,12 @@ qd_input_write(struct qd_input *input, void *data, int size,
 	dbg(" in: %s: buffer size=%d pts=%" PRIi64 " -> %" PRIi64,
 	    input->name, size, pts == AV_NOPTS_VALUE ? -1 : pts,
 	    qap_buffer.common_params.timestamp);
+	QD_PROBE(input_buffer, input->id, size, pts);
 
 	assert(size <= 24 * 1024);
 
 	while (!input->terminated && offset < size) {
-		uint64_t t;
+		uint64_t t, end, cpu;
 		uint32_t avail;
 
 		qap_buffer.common_params.offset = 0;
@@ -1921,17 +2911,37 @@ qd_input_write(struct qd_input *input, void *data, int size,
 			qap_buffer.common_params.size = input->buffer_size;
 
 		avail = qd_input_get_avail_buffer_size(input);
+		input->avail_bytes = avail;
+
+		/* the decoder consumed everything written so far */
+		if (offset == 0 && input->adapt_primed &&
+		    avail >= input->buffer_size)
+			input->adapt_drained++;
+
 		dbg(" in: %s: %u bytes available", input->name, avail);
+		QD_TRACE_COUNTER("buffer_avail", input->name, avail, get_time());
 
 		pthread_mutex_lock(&input->lock);
 		input->buffer_full = true;
 		pthread_mutex_unlock(&input->lock);
 
-		t = qd_get_time();
+		t = get_time();
+		cpu = input->session->cpu_stats ? qd_get_thread_cpu_time() : 0;
 
 		ret = qap_module_process(input->module, &qap_buffer);
+		end = get_time();
+		if (input->session->cpu_stats)
+			__atomic_fetch_add(&input->session->stats.cpu.process[input->id],
+					   qd_get_thread_cpu_time() - cpu,
+					   __ATOMIC_RELAXED);
+		qd_histogram_add(&input->session->stats.inputs[input->id][QD_INPUT_STAGE_PROCESS],
+				 end - t);
+		QD_TRACE_SLICE("qap_module_process", input->name, ret, t, end);
 		if (ret == -EAGAIN) {
 			dbg(" in: %s: wait, buffer is full", input->name);
+			input->full_count++;
+			input->adapt_primed = true;
+			QD_PROBE(input_full, input->id, avail);
 			assert(avail < qap_buffer.common_params.size ||
 			       input->flushing ||
 			       input->session->type != QAP_SESSION_MS12_OTT);
@@ -1944,12 +2954,18 @@ qd_input_write(struct qd_input *input, void *data, int size,
 			    input->name);
 			break;
 		} else {
+			/* latency is measured from the time the decoder
+			 * accepted the first bytes of the frame */
+			if (offset == 0 && pts != AV_NOPTS_VALUE)
+				pts_ring_add(input->session, input->id, pts, t);
+
 			offset += ret;
 			input->written_bytes += ret;
 
 			dbg(" in: %s: written %d bytes in %dus, total %" PRIu64,
-			    input->name, ret, (int)(qd_get_time() - t),
+			    input->name, ret, (int)(get_time() - t),
 			    input->written_bytes);
+			QD_PROBE(input_process, input->id, ret, get_time() - t);
 
 			qap_buffer.common_params.timestamp = 0;
 			qap_buffer.buffer_parms.input_buf_params.flags =
@@ -1965,13 +2981,16 @@ qd_input_write(struct qd_input *input, void *data, int size,
 	if (duration != AV_NOPTS_VALUE)
 		input->written_duration += duration;
 
-	dbg(" in: %s: generated %" PRIu64 " frames", input->name,
-	    qd_input_get_output_frames(input));
+	/* these are extra module commands, only issue them when needed */
+	if (qd_log_enabled(3)) {
+		dbg(" in: %s: generated %" PRIu64 " frames", input->name,
+		    qd_input_get_output_frames(input));
 
-	if (!qd_input_get_io_info(input, &report_frames)) {
-		dbg(" in: %s: consumed=%" PRIu64 " decoded=%" PRIu64,
-		    input->name, report_frames.consumed_frames,
-		    report_frames.decoded_frames);
+		if (!qd_input_get_io_info(input, &report_frames)) {
+			dbg(" in: %s: consumed=%" PRIu64 " decoded=%" PRIu64,
+			    input->name, report_frames.consumed_frames,
+			    report_frames.decoded_frames);
+		}
 	}
 
 	return size;
@@ -1985,19 +3004,137 @@ qd_input_set_event_cb(struct qd_input *input, qd_input_event_func_t func,
 	input->event_cb_data = userdata;
 }
 
+/*
+ * Gapless playlists
+ *
+ * A playlist source plays its items one after the other into the same
+ * inputs. The demuxer of the next item is opened by a prefetch thread while
+ * the current one plays, and timestamps of each item are rebased on the end
+ * of the previous one. Modules are kept across items of the same format, so
+ * the decoder never drains; a format change recreates the module of the
+ * input once the previous item has been rendered.
+ */
+
+static AVFormatContext *
+ffmpeg_src_open_url(const char *url, AVInputFormat *input_format)
+{
+	AVFormatContext *avctx = NULL;
+	int ret;
+
+	ret = avformat_open_input(&avctx, url, input_format, NULL);
+	if (ret < 0) {
+		av_err(ret, "failed to open %s", url);
+		return NULL;
+	}
+
+	if (getenv("QD_NOPARSE")) {
+		avctx->flags |= (AVFMT_FLAG_NOFILLIN |
+				 AVFMT_FLAG_NOPARSE);
+	}
+
+	avformat_find_stream_info(avctx, NULL);
+
+	return avctx;
+}
+
+static void *
+ffmpeg_src_prefetch_func(void *userdata)
+{
+	struct ffmpeg_src *src = userdata;
+	const char *url = src->playlist[src->next_item];
+	uint64_t t = get_time();
+
+	qd_thread_set_name("src-prefetch");
+
+	src->next_avctx = ffmpeg_src_open_url(url, src->input_format);
+	if (src->next_avctx) {
+		dbg(" in: prefetched %s in %" PRIu64 "ms", url,
+		    (get_time() - t) / 1000);
+	}
+
+	return NULL;
+}
+
+/* start opening the item following the current one */
+static void
+ffmpeg_src_prefetch(struct ffmpeg_src *src)
+{
+	src->next_item = src->item + 1;
+	if (src->next_item >= src->n_items)
+		return;
+
+	if (pthread_create(&src->prefetch_tid, NULL,
+			   ffmpeg_src_prefetch_func, src)) {
+		err(" in: failed to start prefetch thread");
+		return;
+	}
+
+	src->prefetching = true;
+}
+
+/* returns the prefetched demuxer, opening it now if prefetching failed */
+static AVFormatContext *
+ffmpeg_src_prefetch_take(struct ffmpeg_src *src)
+{
+	AVFormatContext *avctx;
+
+	if (src->prefetching) {
+		pthread_join(src->prefetch_tid, NULL);
+		src->prefetching = false;
+	} else if (src->next_item < src->n_items && !src->next_avctx) {
+		src->next_avctx = ffmpeg_src_open_url(src->playlist[src->next_item],
+						      src->input_format);
+	}
+
+	avctx = src->next_avctx;
+	src->next_avctx = NULL;
+
+	return avctx;
+}
+
+static void
+ffmpeg_src_prefetch_cancel(struct ffmpeg_src *src)
+{
+	AVFormatContext *avctx = NULL;
+
+	if (src->prefetching)
+		avctx = ffmpeg_src_prefetch_take(src);
+	else
+		avctx = src->next_avctx;
+
+	src->next_avctx = NULL;
+	if (avctx)
+		avformat_close_input(&avctx);
+}
+
 void
 ffmpeg_src_destroy(struct ffmpeg_src *src)
 {
 	if (!src)
 		return;
 
+	ffmpeg_src_prefetch_cancel(src);
+
 	for (int i = 0; i < QD_MAX_STREAMS; i++)
 		qd_input_destroy(src->streams[i].input);
 
 	if (src->avctx)
 		avformat_close_input(&src->avctx);
 
-	free(src);
+	for (int i = 0; i < src->n_items; i++)
+		qd_mem_free(QD_MEM_SOURCE, src->playlist[i]);
+	qd_mem_free(QD_MEM_SOURCE, src->playlist);
+
+	qd_mem_free(QD_MEM_SOURCE, src->url);
+	qd_mem_free(QD_MEM_SOURCE, src);
+}
+
+static int
+ffmpeg_src_open(struct ffmpeg_src *src)
+{
+	src->avctx = ffmpeg_src_open_url(src->url, src->input_format);
+
+	return src->avctx ? 0 : -1;
 }
 
 struct ffmpeg_src *
@@ -2005,7 +3142,6 @@ ffmpeg_src_create(const char *url, const char *format)
 {
 	AVInputFormat *input_format = NULL;
 	struct ffmpeg_src *src;
-	int ret;
 
 	if (format) {
 		input_format = av_find_input_format(format);
@@ -2015,22 +3151,50 @@ ffmpeg_src_create(const char *url, const char *format)
 		}
 	}
 
-	src = calloc(1, sizeof *src);
+	src = qd_mem_calloc(QD_MEM_SOURCE, 1, sizeof *src);
 	if (!src)
 		return NULL;
 
-	ret = avformat_open_input(&src->avctx, url, input_format, NULL);
-	if (ret < 0) {
-		av_err(ret, "failed to open %s", url);
+	src->url = qd_mem_strdup(QD_MEM_SOURCE, url);
+	if (!src->url)
 		goto fail;
-	}
 
-	if (getenv("QD_NOPARSE")) {
-		src->avctx->flags |= (AVFMT_FLAG_NOFILLIN |
-				      AVFMT_FLAG_NOPARSE);
+	src->input_format = input_format;
+
+	if (ffmpeg_src_open(src))
+		goto fail;
+
+	return src;
+
+fail:
+	ffmpeg_src_destroy(src);
+	return NULL;
+}
+
+struct ffmpeg_src *
+ffmpeg_src_create_playlist(const char * const *urls, int n_urls,
+			   const char *format)
+{
+	struct ffmpeg_src *src;
+
+	if (n_urls <= 0)
+		return NULL;
+
+	if (!(src = ffmpeg_src_create(urls[0], format)))
+		return NULL;
+
+	src->playlist = qd_mem_calloc(QD_MEM_SOURCE, n_urls,
+				      sizeof (*src->playlist));
+	if (!src->playlist)
+		goto fail;
+
+	for (int i = 0; i < n_urls; i++) {
+		if (!(src->playlist[i] = qd_mem_strdup(QD_MEM_SOURCE, urls[i])))
+			goto fail;
+		src->n_items++;
 	}
 
-	avformat_find_stream_info(src->avctx, NULL);
+	ffmpeg_src_prefetch(src);
 
 	return src;
 
@@ -2039,6 +3203,74 @@ fail:
 	return NULL;
 }
 
+int
+ffmpeg_src_reopen(struct ffmpeg_src *src)
+{
+	int ret;
+
+	/* playlists restart from their first item */
+	if (src->n_items > 0 && src->item > 0) {
+		char *url = qd_mem_strdup(QD_MEM_SOURCE, src->playlist[0]);
+
+		if (!url)
+			return -1;
+
+		qd_mem_free(QD_MEM_SOURCE, src->url);
+		src->url = url;
+	}
+
+	ffmpeg_src_prefetch_cancel(src);
+	src->item = 0;
+	src->pts_offset = 0;
+	src->end_pts = 0;
+
+	info(" in: reopen %s", src->url);
+
+	if (src->avctx)
+		avformat_close_input(&src->avctx);
+
+	src->terminated = false;
+
+	if (ffmpeg_src_open(src))
+		return -1;
+
+	/* keep the existing modules when the stream format did not change,
+	 * only recreate the ones that cannot be reused */
+	for (int i = 0; i < src->n_streams; i++) {
+		struct ffmpeg_src_stream *stream = &src->streams[i];
+		struct qd_session *session = stream->input->session;
+		enum qd_input_id id = stream->input->id;
+		AVStream *avstream = NULL;
+
+		if (stream->index < src->avctx->nb_streams)
+			avstream = src->avctx->streams[stream->index];
+
+		if (!avstream ||
+		    avstream->codecpar->codec_type != AVMEDIA_TYPE_AUDIO) {
+			err(" in: %s: stream %d not found after reopen",
+			    stream->input->name, stream->index);
+			return -1;
+		}
+
+		ret = qd_input_reset(stream->input, avstream);
+		if (ret != -EAGAIN) {
+			if (ret)
+				return -1;
+			continue;
+		}
+
+		qd_input_destroy(stream->input);
+		stream->input = qd_input_create_from_avstream(session, id,
+							      avstream);
+		if (!stream->input)
+			return -1;
+	}
+
+	ffmpeg_src_prefetch(src);
+
+	return 0;
+}
+
 uint64_t
 ffmpeg_src_get_duration(struct ffmpeg_src *src)
 {
@@ -2132,6 +3364,105 @@ ffmpeg_src_get_avstream(struct ffmpeg_src *src, int index)
 	return src->avctx->streams[index];
 }
 
+/* find the stream of the new item matching a stream of the source, the main
+ * stream is the best audio stream and others keep their index */
+static AVStream *
+ffmpeg_src_match_stream(AVFormatContext *avctx, int n, int index)
+{
+	if (n == 0)
+		index = find_best_stream(avctx, AVMEDIA_TYPE_AUDIO, -1, -1);
+
+	if (index < 0 || index >= (int)avctx->nb_streams ||
+	    avctx->streams[index]->codecpar->codec_type != AVMEDIA_TYPE_AUDIO)
+		return NULL;
+
+	return avctx->streams[index];
+}
+
+/* switch the inputs to the next playable item, returns AVERROR_EOF at the
+ * end of the playlist */
+static int
+ffmpeg_src_next_item(struct ffmpeg_src *src)
+{
+	AVFormatContext *avctx = NULL;
+	AVStream *avstreams[QD_MAX_STREAMS];
+	char *url;
+
+	while (!avctx) {
+		if (++src->item >= src->n_items)
+			return AVERROR_EOF;
+
+		avctx = ffmpeg_src_prefetch_take(src);
+		if (!avctx) {
+			err(" in: skip playlist item %d, %s", src->item,
+			    src->playlist[src->item]);
+			ffmpeg_src_prefetch(src);
+			continue;
+		}
+
+		for (int i = 0; i < src->n_streams && avctx; i++) {
+			avstreams[i] = ffmpeg_src_match_stream(avctx, i,
+							       src->streams[i].index);
+			if (!avstreams[i]) {
+				err(" in: skip playlist item %d, %s: no audio "
+				    "stream for %s", src->item,
+				    src->playlist[src->item],
+				    src->streams[i].input->name);
+				avformat_close_input(&avctx);
+				ffmpeg_src_prefetch(src);
+			}
+		}
+	}
+
+	for (int i = 0; i < src->n_streams; i++) {
+		struct ffmpeg_src_stream *stream = &src->streams[i];
+		struct qd_input *input = stream->input;
+
+		stream->index = avstreams[i]->index;
+
+		if (qd_input_matches_avstream(input, avstreams[i])) {
+			if (qd_input_setup_avstream(input, avstreams[i]))
+				goto fail;
+			continue;
+		}
+
+		/* the end of the previous item must be rendered before the
+		 * module goes away, a paused input cannot drain */
+		if (input->state == QD_INPUT_STATE_STARTED &&
+		    (qd_input_send_eos(input) ||
+		     !qd_session_wait_eos(input->session, input->id,
+					  2 * QD_SECOND)))
+			err(" in: %s: failed to drain before reinit",
+			    input->name);
+
+		/* the input is shared with the control threads, only its
+		 * module is replaced */
+		if (qd_input_reinit(input, avstreams[i]))
+			goto fail;
+	}
+
+	if (!(url = qd_mem_strdup(QD_MEM_SOURCE, src->playlist[src->item])))
+		goto fail;
+
+	avformat_close_input(&src->avctx);
+	src->avctx = avctx;
+	qd_mem_free(QD_MEM_SOURCE, src->url);
+	src->url = url;
+	src->pts_offset = src->end_pts;
+
+	notice(" in: playlist item %d/%d, %s at %" PRIi64 "ms",
+	       src->item + 1, src->n_items, src->url,
+	       src->pts_offset / QD_MSECOND);
+
+	ffmpeg_src_prefetch(src);
+
+	return 0;
+
+fail:
+	avformat_close_input(&avctx);
+	return -1;
+}
+
 struct qd_input *
 ffmpeg_src_add_input(struct ffmpeg_src *src, int index,
 		     struct qd_session *session,
@@ -2203,6 +3534,52 @@ ffmpeg_src_find_stream_by_index(struct ffmpeg_src *src, int index)
 	return NULL;
 }
 
+static void
+input_insert_adts_header(struct qd_input *input, AVPacket *pkt)
+{
+	/* packets should have AV_INPUT_BUFFER_PADDING_SIZE padding in
+	 * them, so we can use that to avoid a copy */
+	memmove(pkt->data + ADTS_HEADER_SIZE, pkt->data, pkt->size);
+	memcpy(pkt->data, input->adts_header, ADTS_HEADER_SIZE);
+	pkt->size += ADTS_HEADER_SIZE;
+
+	/* patch ADTS header with frame size */
+	pkt->data[3] |= pkt->size >> 11;
+	pkt->data[4] |= pkt->size >> 3;
+	pkt->data[5] |= (pkt->size & 0x07) << 5;
+}
+
+/* returns the size of the LATM frame, to be freed with av_free() */
+static int
+input_mux_latm(struct qd_input *input, AVPacket *pkt, uint8_t **data)
+{
+	AVIOContext *avio;
+	int ret;
+
+	ret = avio_open_dyn_buf(&avio);
+	if (ret < 0) {
+		av_err(ret, "failed to create avio context");
+		return ret;
+	}
+
+	input->avmux->pb = avio;
+
+	pkt->stream_index = 0;
+	ret = av_write_frame(input->avmux, pkt);
+	if (ret < 0) {
+		av_err(ret, "failed to mux data");
+		avio_close_dyn_buf(input->avmux->pb, data);
+		av_free(*data);
+		input->avmux->pb = NULL;
+		return ret;
+	}
+
+	ret = avio_close_dyn_buf(input->avmux->pb, data);
+	input->avmux->pb = NULL;
+
+	return ret;
+}
+
 int
 ffmpeg_src_read_frame(struct ffmpeg_src *src)
 {
@@ -2211,12 +3588,17 @@ ffmpeg_src_read_frame(struct ffmpeg_src *src)
 	AVPacket pkt;
 	int64_t pts;
 	int64_t duration;
+	uint64_t t, end;
 	int ret;
 
 	av_init_packet(&pkt);
 
 	/* get next audio frame from ffmpeg */
+	t = get_time();
 	ret = av_read_frame(src->avctx, &pkt);
+	if (ret == AVERROR_EOF && src->item + 1 < src->n_items)
+		return ffmpeg_src_next_item(src);
+
 	if (ret < 0) {
 		if (ret != AVERROR_EOF)
 			av_err(ret, "failed to read frame from input");
@@ -2230,6 +3612,11 @@ ffmpeg_src_read_frame(struct ffmpeg_src *src)
 		goto out;
 	}
 
+	end = get_time();
+	qd_histogram_add(&input->session->stats.inputs[input->id][QD_INPUT_STAGE_READ],
+			 end - t);
+	QD_TRACE_SLICE("read", input->name, pkt.size, t, end);
+
 	avstream = src->avctx->streams[pkt.stream_index];
 
 	pthread_mutex_lock(&input->lock);
@@ -2260,45 +3647,30 @@ ffmpeg_src_read_frame(struct ffmpeg_src *src)
 		duration = av_rescale_q(duration, av_timebase, qap_timebase);
 	}
 
-	if (input->insert_adts_header) {
-		/* packets should have AV_INPUT_BUFFER_PADDING_SIZE padding in
-		 * them, so we can use that to avoid a copy */
-		memmove(pkt.data + ADTS_HEADER_SIZE, pkt.data, pkt.size);
-		memcpy(pkt.data, input->adts_header, ADTS_HEADER_SIZE);
-		pkt.size += ADTS_HEADER_SIZE;
+	/* playlist items follow each other on a continuous timeline */
+	if (pts != AV_NOPTS_VALUE) {
+		pts += src->pts_offset;
+		src->end_pts = QD_MAX(src->end_pts, pts +
+				      (duration != AV_NOPTS_VALUE ? duration : 0));
+	}
 
-		/* patch ADTS header with frame size */
-		pkt.data[3] |= pkt.size >> 11;
-		pkt.data[4] |= pkt.size >> 3;
-		pkt.data[5] |= (pkt.size & 0x07) << 5;
+	if (input->insert_adts_header) {
+		input_insert_adts_header(input, &pkt);
 
 		/* push the audio frame to the decoder */
 		ret = qd_input_write(input, pkt.data, pkt.size,
 				     pts, duration);
 
 	} else if (input->avmux) {
-		AVIOContext *avio;
 		uint8_t *data;
 		int size;
 
-		ret = avio_open_dyn_buf(&avio);
-		if (ret < 0) {
-			av_err(ret, "failed to create avio context");
+		size = input_mux_latm(input, &pkt, &data);
+		if (size < 0) {
+			ret = size;
 			goto out;
 		}
 
-		input->avmux->pb = avio;
-
-		pkt.stream_index = 0;
-		ret = av_write_frame(input->avmux, &pkt);
-		if (ret < 0) {
-			av_err(ret, "failed to mux data");
-			goto out;
-		}
-
-		size = avio_close_dyn_buf(input->avmux->pb, &data);
-		input->avmux->pb = NULL;
-
 		ret = qd_input_write(input, data, size,
 				     pts, duration);
 		av_free(data);
@@ -2324,8 +3696,14 @@ static void *
 ffmpeg_src_thread_func(void *userdata)
 {
 	struct ffmpeg_src *src = userdata;
+	struct qd_input *input = NULL;
 	intptr_t ret = 0;
 
+	if (src->n_streams > 0)
+		input = src->streams[0].input;
+
+	qd_thread_set_name("src-%s", input ? input->name : "?");
+
 	while (!src->terminated) {
 		ret = ffmpeg_src_read_frame(src);
 		if (ret == AVERROR_EOF) {
@@ -2340,6 +3718,11 @@ ffmpeg_src_thread_func(void *userdata)
 		}
 	}
 
+	if (input && input->session->cpu_stats) {
+		__atomic_fetch_add(&input->session->stats.cpu.src[input->id],
+				   qd_get_thread_cpu_time(), __ATOMIC_RELAXED);
+	}
+
 	return (void *)ret;
 }
 
@@ -2469,7 +3852,7 @@ qd_session_configure_outputs(struct qd_session *session,
 	}
 
 	/* setup outputs */
-	t = get_time();
+	t = get_trace_time(4);
 
 	ret = qap_session_cmd(session->handle, QAP_SESSION_CMD_SET_OUTPUTS,
 			      sizeof (qap_session_cfg), &qap_session_cfg,
@@ -2481,6 +3864,7 @@ qd_session_configure_outputs(struct qd_session *session,
 
 	trace("session: [t=%" PRIu64 "ms] qap_session_cmd(QAP_SESSION_CMD_SET_OUTPUTS)",
 	      (get_time() - t) / 1000);
+	QD_TRACE_SLICE("QAP_SESSION_CMD_SET_OUTPUTS", NULL, -1, t, get_time());
 
 	return 0;
 }
@@ -2502,7 +3886,7 @@ qd_session_set_kvpairs(struct qd_session *session, char *kvpairs_format, ...)
 
 	info("set kvpairs %s", buf);
 
-	t = get_time();
+	t = get_trace_time(4);
 
 	ret = qap_session_cmd(session->handle, QAP_SESSION_CMD_SET_KVPAIRS,
 			      len, buf, NULL, NULL);
@@ -2513,6 +3897,7 @@ qd_session_set_kvpairs(struct qd_session *session, char *kvpairs_format, ...)
 
 	trace("session: [t=%" PRIu64 "ms] qap_session_cmd(QAP_SESSION_CMD_SET_KVPAIRS)",
 	      (get_time() - t) / 1000);
+	QD_TRACE_SLICE("QAP_SESSION_CMD_SET_KVPAIRS", NULL, -1, t, get_time());
 
 	return 0;
 }
@@ -2524,17 +3909,76 @@ qd_session_set_buffer_size_ms(struct qd_session *session,
 	session->buffer_size_ms = buffer_size_ms;
 }
 
+void
+qd_session_set_buffer_policy(struct qd_session *session,
+			     const struct qd_buffer_policy *policy)
+{
+	session->buffer_policy = *policy;
+}
+
+void
+qd_session_set_swdec_format(struct qd_session *session,
+			    enum qd_sample_format format)
+{
+	session->swdec_format = format;
+}
+
+void
+qd_session_set_cpu_stats(struct qd_session *session, bool enable)
+{
+	session->cpu_stats = enable;
+}
+
 void
 qd_session_set_realtime(struct qd_session *session, bool realtime)
 {
 	session->realtime = realtime;
 }
 
+void
+qd_session_set_realtime_limits(struct qd_session *session,
+			       const struct qd_realtime_limits *limits,
+			       qd_realtime_failed_func_t func, void *userdata)
+{
+	session->rt_limits = *limits;
+	session->rt_failed_func = func;
+	session->rt_failed_data = userdata;
+}
+
+bool
+qd_session_realtime_failed(struct qd_session *session)
+{
+	return session->rt_failed;
+}
+
 void
 qd_session_set_dump_path(struct qd_session *session, const char *path)
 {
-	free(session->output_dir);
-	session->output_dir = path ? strdup(path) : NULL;
+	qd_mem_free(QD_MEM_SESSION, session->output_dir);
+	session->output_dir = path ? qd_mem_strdup(QD_MEM_SESSION, path) : NULL;
+}
+
+int
+qd_session_set_latency_log(struct qd_session *session, const char *path)
+{
+	FILE *f = NULL;
+
+	if (path) {
+		f = fopen(path, "w");
+		if (!f) {
+			err("failed to open %s: %m", path);
+			return -1;
+		}
+		fprintf(f, "time,output,position,latency\n");
+	}
+
+	pthread_mutex_lock(&session->lock);
+	if (session->latency_log)
+		fclose(session->latency_log);
+	session->latency_log = f;
+	pthread_mutex_unlock(&session->lock);
+
+	return 0;
 }
 
 void
@@ -2632,23 +4076,33 @@ qd_session_destroy(struct qd_session *session)
 
 	dbg("destroy session");
 
+	/* the decode threads write to the decoded output streams, stop them
+	 * first; they stay allocated so that late encoded buffers from the
+	 * qap callback are rejected until the session is closed */
+	for (int i = 0; i < QD_MAX_OUTPUTS; i++)
+		qd_sw_decoder_stop(session->outputs[i].swdec);
+
 	if (session->handle)
 		qap_session_close(session->handle);
 
 	for (int i = 0; i < QD_MAX_OUTPUTS; i++) {
 		struct qd_output *output = &session->outputs[i];
+		qd_sw_decoder_destroy(output->swdec);
+		output->swdec = NULL;
 		if (output->stream)
 			fclose(output->stream);
-		qd_sw_decoder_destroy(output->swdec);
 	}
 
+	if (session->latency_log)
+		fclose(session->latency_log);
+
 	pthread_cond_destroy(&session->cond);
 	pthread_mutex_destroy(&session->lock);
 
 	qd_module_unload(session->module);
 
-	free(session->output_dir);
-	free(session);
+	qd_mem_free(QD_MEM_SESSION, session->output_dir);
+	qd_mem_free(QD_MEM_SESSION, session);
 }
 
 static void
@@ -2690,7 +4144,7 @@ qd_session_create(enum qd_module_type module, qap_session_t type)
 	qap_lib_set_log_callback(lib_handle, handle_log_msg);
 	qap_lib_set_log_level(lib_handle, qd_debug_level - 3);
 
-	session = calloc(1, sizeof (*session));
+	session = qd_mem_calloc(QD_MEM_SESSION, 1, sizeof (*session));
 	if (!session) {
 		qd_module_unload(module);
 		return NULL;
@@ -2703,6 +4157,9 @@ qd_session_create(enum qd_module_type module, qap_session_t type)
 	 * broadcast mode */
 	session->ignore_timestamps = -1;
 
+	session->rt_limits.max_underruns = -1;
+	session->rt_limits.max_overruns = -1;
+
 	pthread_mutex_init(&session->lock, NULL);
 	pthread_cond_init(&session->cond, NULL);
 
@@ -2751,10 +4208,94 @@ qd_session_uses_timestamps(struct qd_session *session)
 		 session->type != QAP_SESSION_MS12_OTT);
 }
 
+void
+qd_session_get_stats(struct qd_session *session,
+		     struct qd_session_stats *stats)
+{
+	for (int i = 0; i < QD_MAX_INPUTS; i++) {
+		for (int j = 0; j < QD_INPUT_STAGE_COUNT; j++) {
+			qd_histogram_snapshot(&session->stats.inputs[i][j],
+					      &stats->inputs[i][j]);
+		}
+	}
+
+	for (int i = 0; i < QD_MAX_OUTPUTS; i++) {
+		struct qd_output_counters *c = &stats->output_counters[i];
+		struct qd_output *output = &session->outputs[i];
+
+		for (int j = 0; j < QD_OUTPUT_STAGE_COUNT; j++) {
+			qd_histogram_snapshot(&session->stats.outputs[i][j],
+					      &stats->outputs[i][j]);
+		}
+
+		c->enabled = output->enabled;
+		c->total_bytes = output->total_bytes;
+		c->total_frames = output->total_frames;
+		c->pts_resets = output->pts_resets;
+		c->late_buffers = output->late_buffers;
+		c->overruns = output->overruns;
+		c->max_lateness = output->max_lateness;
+
+		stats->buffers.outputs[i] = 0;
+		if (output->swdec) {
+			pthread_mutex_lock(&output->swdec->lock);
+			stats->buffers.outputs[i] =
+				output->swdec->stats.max_buffer_bytes;
+			pthread_mutex_unlock(&output->swdec->lock);
+		}
+	}
+
+	for (int i = 0; i < QD_MAX_INPUTS; i++) {
+		stats->buffers.inputs[i] =
+			__atomic_load_n(&session->stats.buffers.inputs[i],
+					__ATOMIC_RELAXED);
+	}
+
+	for (int i = 0; i < QD_MAX_INPUTS; i++) {
+		stats->cpu.src[i] = __atomic_load_n(&session->stats.cpu.src[i],
+						    __ATOMIC_RELAXED);
+		stats->cpu.process[i] =
+			__atomic_load_n(&session->stats.cpu.process[i],
+					__ATOMIC_RELAXED);
+	}
+
+	for (int i = 0; i < QD_MAX_OUTPUTS; i++) {
+		stats->cpu.callbacks[i] =
+			__atomic_load_n(&session->stats.cpu.callbacks[i],
+					__ATOMIC_RELAXED);
+	}
+
+	/* inputs can be destroyed concurrently, they are unregistered from
+	 * the session under its lock */
+	pthread_mutex_lock(&session->lock);
+	for (int i = 0; i < QD_MAX_INPUTS; i++) {
+		struct qd_input_counters *c = &stats->input_counters[i];
+		struct qd_input *input = session->inputs[i];
+
+		memset(c, 0, sizeof (*c));
+		if (!input)
+			continue;
+
+		c->active = true;
+		c->written_bytes = input->written_bytes;
+		c->written_duration = input->written_duration;
+		c->full_count = input->full_count;
+		c->stalls = input->stalls;
+		c->buffer_size = input->buffer_size;
+		c->avail_bytes = input->avail_bytes;
+		c->buffer_resizes = input->buffer_resizes;
+	}
+	pthread_mutex_unlock(&session->lock);
+}
+
 int
 qd_init(void)
 {
 	qd_base_time = get_time();
+
+	if (qd_log_start())
+		err("failed to start logging thread");
+
 	av_log_set_level(get_av_log_level());
 	avformat_network_init();
 	avdevice_register_all();
@@ -14,11 +14,25 @@
 
 extern int qd_debug_level;
 
+void qd_log_write(int level, const char *fmt, ...)
+	__attribute__((format(printf, 2, 3)));
+void qd_log_flush(void);
+int qd_log_start(void);
+void qd_log_stop(void);
+
+/* messages above this level are compiled out, e.g. build with
+ * QD_LOG_MAX_LEVEL=2 to drop dbg() and trace() from release builds */
+#ifndef QD_LOG_MAX_LEVEL
+# define QD_LOG_MAX_LEVEL	4
+#endif
+
+#define qd_log_enabled(l) \
+	((l) <= QD_LOG_MAX_LEVEL && qd_debug_level >= (l))
+
 #define log(l, msg, ...)						\
 	do {								\
-		if (qd_debug_level >= l)				\
-			fprintf(stderr, "[%08" PRIu64 "] " msg,		\
-				qd_get_time() / 1000, ##__VA_ARGS__);	\
+		if (qd_log_enabled(l))					\
+			qd_log_write(l, msg, ##__VA_ARGS__);		\
 	} while (0)
 
 #define err(msg, ...) \
@@ -36,6 +50,68 @@ extern int qd_debug_level;
 #define trace(msg, ...) \
 	log(4, msg "\n", ##__VA_ARGS__)
 
+/* static trace points, built as USDT probes when QD_SDT is defined, e.g.
+ * perf probe -x qapdec sdt_qd:output_buffer
+ *
+ * each probe has a semaphore, incremented by the tracer while attached, so
+ * that the probe arguments are only computed when someone is listening */
+#define QD_PROBE_LIST(X)	\
+	X(input_buffer)		\
+	X(input_cmd)		\
+	X(input_full)		\
+	X(input_process)	\
+	X(output_buffer)	\
+	X(output_late)		\
+	X(output_wait)
+
+#ifdef QD_SDT
+# define _SDT_HAS_SEMAPHORES	1
+# include <sys/sdt.h>
+# define QD_PROBE_SEMAPHORE(name) \
+	extern volatile unsigned short qd_##name##_semaphore;
+QD_PROBE_LIST(QD_PROBE_SEMAPHORE)
+# define QD_PROBE_ENABLED(name) \
+	__builtin_expect(qd_##name##_semaphore, 0)
+# define QD_PROBE(name, ...)						\
+	do {								\
+		if (QD_PROBE_ENABLED(name))				\
+			STAP_PROBEV(qd, name, ##__VA_ARGS__);		\
+	} while (0)
+#else
+# define QD_PROBE_ENABLED(name)	0
+static inline void qd_probe_nop(int unused, ...) { }
+# define QD_PROBE(name, ...)						\
+	do {								\
+		if (0)							\
+			qd_probe_nop(0, ##__VA_ARGS__);			\
+	} while (0)
+#endif
+
+/* chrome trace-event recorder, slices and counters use get_time() values */
+extern int qd_trace_active;
+
+#define qd_trace_enabled() \
+	__builtin_expect(__atomic_load_n(&qd_trace_active, __ATOMIC_RELAXED), 0)
+
+int qd_trace_start(const char *path);
+void qd_trace_stop(void);
+void qd_trace_slice(const char *name, const char *target, int64_t value,
+		    uint64_t start, uint64_t end);
+void qd_trace_counter(const char *name, const char *series, int64_t value,
+		      uint64_t time);
+
+#define QD_TRACE_SLICE(name, target, value, start, end)			\
+	do {								\
+		if (qd_trace_enabled())					\
+			qd_trace_slice(name, target, value, start, end); \
+	} while (0)
+
+#define QD_TRACE_COUNTER(name, series, value, time)			\
+	do {								\
+		if (qd_trace_enabled())					\
+			qd_trace_counter(name, series, value, time);	\
+	} while (0)
+
 #define QD_N_ELEMENTS(x) (sizeof (x) / sizeof (*(x)))
 #define QD_MIN(a, b)	((a) < (b) ? (a) : (b))
 #define QD_MAX(a, b)	((a) > (b) ? (a) : (b))
@@ -71,6 +147,151 @@ enum qd_input_id {
 
 struct qd_sw_decoder;
 
+/* pcm sample format of the software decoded outputs */
+enum qd_sample_format {
+	QD_SAMPLE_FORMAT_S16,
+	QD_SAMPLE_FORMAT_S32,
+	QD_SAMPLE_FORMAT_FLT,
+};
+
+struct qd_sw_decoder_stats {
+	uint64_t packets;
+	unsigned int queue_depth;
+	unsigned int max_queue_depth;
+	uint64_t queue_full;		/* writer had to wait for the decoder */
+	uint64_t decode_time;		/* total, in us */
+	uint64_t max_decode_time;
+	uint64_t max_queue_time;
+	uint64_t cpu_time;		/* decode thread CPU time, in us */
+	uint32_t buffer_bytes;		/* packet queue and conversion buffers */
+	uint32_t max_buffer_bytes;
+};
+
+/* log-linear latency histogram, 4 buckets per power of two, in us */
+#define QD_HISTOGRAM_SUB_BITS	2
+#define QD_HISTOGRAM_BUCKETS	128
+
+struct qd_histogram {
+	uint64_t count;
+	uint64_t sum;
+	uint64_t max;
+	uint64_t buckets[QD_HISTOGRAM_BUCKETS];
+};
+
+enum qd_input_stage {
+	QD_INPUT_STAGE_READ,		/* ffmpeg_src_read_frame demuxing */
+	QD_INPUT_STAGE_PROCESS,		/* qap_module_process call */
+	QD_INPUT_STAGE_WAIT,		/* wait_buffer_available blocking */
+	QD_INPUT_STAGE_COUNT,
+};
+
+enum qd_output_stage {
+	QD_OUTPUT_STAGE_DELIVER,	/* buffer write and output callback */
+	QD_OUTPUT_STAGE_INTERVAL,	/* time between two output buffers */
+	QD_OUTPUT_STAGE_LATENCY,	/* input write to output delivery */
+	QD_OUTPUT_STAGE_JITTER,		/* realtime deadline variation */
+	QD_OUTPUT_STAGE_LATENESS,	/* realtime deadline misses */
+	QD_OUTPUT_STAGE_COUNT,
+};
+
+struct qd_input_counters {
+	bool active;
+	uint64_t written_bytes;
+	uint64_t written_duration;	/* in us */
+	uint64_t full_count;		/* qap_module_process returned EAGAIN */
+	uint64_t stalls;		/* buffer full for more than a second */
+	uint32_t buffer_size;
+	uint32_t avail_bytes;		/* last MS12_STREAM_GET_AVAIL_BUF_SIZE */
+	uint64_t buffer_resizes;	/* adaptive buffer size changes */
+};
+
+struct qd_output_counters {
+	bool enabled;
+	uint64_t total_bytes;
+	uint64_t total_frames;
+	uint64_t pts_resets;		/* timestamp discontinuities */
+	uint64_t late_buffers;		/* realtime underruns */
+	uint64_t overruns;		/* realtime queue over budget */
+	uint64_t max_lateness;		/* in us */
+};
+
+/* thread CPU time spent in each stage, in us, only sampled when enabled with
+ * qd_session_set_cpu_stats() as it costs a syscall around each stage */
+struct qd_cpu_stats {
+	uint64_t src[QD_MAX_INPUTS];		/* whole source threads */
+	uint64_t process[QD_MAX_INPUTS];	/* qap_module_process calls */
+	uint64_t callbacks[QD_MAX_OUTPUTS];	/* output buffer callbacks */
+};
+
+/* high-water marks of the buffer sizes, in bytes */
+struct qd_buffer_stats {
+	uint32_t inputs[QD_MAX_INPUTS];		/* QAP input buffers */
+	uint32_t outputs[QD_MAX_OUTPUTS];	/* swdec queue and conversion */
+};
+
+struct qd_session_stats {
+	struct qd_histogram inputs[QD_MAX_INPUTS][QD_INPUT_STAGE_COUNT];
+	struct qd_histogram outputs[QD_MAX_OUTPUTS][QD_OUTPUT_STAGE_COUNT];
+	struct qd_input_counters input_counters[QD_MAX_INPUTS];
+	struct qd_output_counters output_counters[QD_MAX_OUTPUTS];
+	struct qd_cpu_stats cpu;
+	struct qd_buffer_stats buffers;
+};
+
+enum qd_mem_type {
+	QD_MEM_SESSION,
+	QD_MEM_INPUT,
+	QD_MEM_SOURCE,
+	QD_MEM_SWDEC,
+	QD_MEM_LOG,
+	QD_MEM_TRACE,
+	QD_MEM_TYPE_COUNT,
+};
+
+struct qd_mem_counters {
+	uint64_t allocs;
+	uint64_t bytes;			/* currently allocated */
+	uint64_t peak_bytes;
+};
+
+struct qd_mem_stats {
+	struct qd_mem_counters types[QD_MEM_TYPE_COUNT];
+	uint64_t heap_bytes;		/* malloc heap in use, all libraries */
+	uint64_t rss;
+	uint64_t peak_rss;
+};
+
+void *qd_mem_malloc(enum qd_mem_type type, size_t size);
+void *qd_mem_calloc(enum qd_mem_type type, size_t nmemb, size_t size);
+void *qd_mem_realloc(enum qd_mem_type type, void *ptr, size_t size);
+char *qd_mem_strdup(enum qd_mem_type type, const char *s);
+void qd_mem_free(enum qd_mem_type type, void *ptr);
+void qd_mem_get_stats(struct qd_mem_stats *stats);
+const char *qd_mem_type_to_str(enum qd_mem_type type);
+
+void qd_histogram_add(struct qd_histogram *h, uint64_t value);
+void qd_histogram_snapshot(const struct qd_histogram *h,
+			   struct qd_histogram *copy);
+uint64_t qd_histogram_percentile(const struct qd_histogram *h, double p);
+const char *qd_input_stage_to_str(enum qd_input_stage stage);
+const char *qd_output_stage_to_str(enum qd_output_stage stage);
+
+/* wall clock time at which input pts entered the decoder, positions are
+ * relative to the first pts written since the last reset */
+#define QD_PTS_RING_SIZE	256
+
+struct qd_pts_entry {
+	int64_t pos;
+	uint64_t time;
+};
+
+struct qd_pts_ring {
+	struct qd_pts_entry entries[QD_PTS_RING_SIZE];
+	unsigned int head;
+	unsigned int count;
+	int64_t base_pts;
+};
+
 struct qd_output {
 	const char *name;
 	enum qd_output_id id;
@@ -89,6 +310,16 @@ struct qd_output {
 	FILE *stream;
 	struct qd_session *session;
 	struct qd_sw_decoder *swdec;
+	bool float_samples;
+	uint64_t last_buffer_time;
+	int64_t stream_start_pts;
+	bool stream_restart;
+	uint64_t pts_resets;
+	uint64_t late_buffers;
+	uint64_t overruns;
+	uint64_t max_lateness;
+	int64_t rt_last_delay;
+	bool rt_started;
 };
 
 enum qd_input_state {
@@ -113,9 +344,11 @@ struct qd_input {
 	uint8_t adts_header[ADTS_HEADER_SIZE];
 	bool insert_adts_header;
 	qap_module_handle_t module;
+	qap_module_config_t module_config;
 	qap_input_config_t config;
 	pthread_mutex_t lock;
 	pthread_cond_t cond;
+	pthread_mutex_t cmd_lock;	/* serializes module commands */
 	unsigned int buffer_size;
 	bool buffer_full;
 	bool terminated;
@@ -126,6 +359,21 @@ struct qd_input {
 	uint64_t state_change_time;
 	uint64_t written_bytes;
 	uint64_t written_duration;
+	uint64_t full_count;
+	uint64_t stalls;
+	uint32_t avail_bytes;
+
+	/* adaptive buffer sizing, see input_adapt_buffer() */
+	uint32_t min_buffer_size;
+	uint32_t max_buffer_size;
+	uint64_t adapt_start;
+	uint64_t adapt_wait;
+	uint64_t adapt_late;
+	uint32_t adapt_drained;
+	uint32_t adapt_hold;
+	bool adapt_primed;
+	uint64_t buffer_resizes;
+
 	struct qd_session *session;
 	qd_input_event_func_t event_cb_func;
 	void *event_cb_data;
@@ -137,6 +385,29 @@ enum qd_module_type {
 	QD_MAX_MODULES,
 };
 
+/* realtime pass/fail thresholds, a run fails when any of them is exceeded */
+struct qd_realtime_limits {
+	int max_underruns;		/* -1 for no limit */
+	int max_overruns;		/* -1 for no limit */
+	int64_t max_lateness;		/* in us, 0 for no limit */
+	int64_t budget;			/* max output advance in us, 0 to
+					 * disable overrun detection */
+};
+
+/* adaptive input buffer sizing, only applied in realtime sessions */
+struct qd_buffer_policy {
+	bool enabled;
+	int64_t target_latency;		/* in us, 0 for no target */
+	int64_t period;			/* in us between two decisions, 0 for
+					 * the default 500ms */
+};
+
+typedef void (*qd_realtime_failed_func_t)(struct qd_session *session,
+					  void *userdata);
+
+/* output and realtime failure callbacks run on the qap callback thread,
+ * except for the AC3/EAC3 decoded outputs which are delivered from their
+ * own software decoder thread, so callbacks may run concurrently */
 typedef void (*qd_output_func_t)(struct qd_output *output,
 				 qap_audio_buffer_t *buffer,
 				 void *userdata);
@@ -158,8 +429,20 @@ struct qd_session {
 	char *output_dir;
 	int64_t output_discard_ms;
 	uint32_t buffer_size_ms;
+	enum qd_sample_format swdec_format;
 	qd_output_func_t output_cb_func;
 	void *output_cb_data;
+	uint64_t first_output_time;
+	struct qd_session_stats stats;
+	struct qd_pts_ring input_pts[QD_MAX_INPUTS];
+	FILE *latency_log;
+	struct qd_realtime_limits rt_limits;
+	bool rt_failed;
+	qd_realtime_failed_func_t rt_failed_func;
+	void *rt_failed_data;
+	struct qd_buffer_policy buffer_policy;
+	int64_t last_latency;
+	bool cpu_stats;
 };
 
 #define QD_MAX_STREAMS	2
@@ -170,16 +453,33 @@ struct ffmpeg_src_stream {
 };
 
 struct ffmpeg_src {
+	char *url;
+	AVInputFormat *input_format;
 	AVFormatContext *avctx;
 	struct ffmpeg_src_stream streams[QD_MAX_STREAMS];
 	int n_streams;
 	pthread_t tid;
 	bool terminated;
+
+	/* gapless playlist, the next item is opened ahead */
+	char **playlist;
+	int n_items;
+	int item;
+	int next_item;
+	AVFormatContext *next_avctx;
+	pthread_t prefetch_tid;
+	bool prefetching;
+	int64_t pts_offset;		/* in us, start of the current item */
+	int64_t end_pts;		/* in us, end of the last frame read */
 };
 
 int qd_init(void);
 uint64_t qd_get_time(void);
+uint64_t qd_get_thread_cpu_time(void);
+void qd_thread_set_name(const char *fmt, ...)
+	__attribute__((format(printf, 1, 2)));
 
+const char *qd_input_id_to_str(enum qd_input_id id);
 bool qd_format_is_pcm(qap_audio_format_t format);
 bool qd_format_is_raw(qap_audio_format_t format);
 
@@ -189,15 +489,26 @@ void qd_session_destroy(struct qd_session *session);
 int qd_session_set_kvpairs(struct qd_session *session,
 			   char *kvpairs_format, ...);
 void qd_session_set_realtime(struct qd_session *session, bool realtime);
+void qd_session_set_realtime_limits(struct qd_session *session,
+				    const struct qd_realtime_limits *limits,
+				    qd_realtime_failed_func_t func,
+				    void *userdata);
+bool qd_session_realtime_failed(struct qd_session *session);
 void qd_session_set_output_discard_ms(struct qd_session *session,
 				      int64_t discard_ms);
 void qd_session_set_buffer_size_ms(struct qd_session *session,
 				   uint32_t buffer_size_ms);
+void qd_session_set_buffer_policy(struct qd_session *session,
+				  const struct qd_buffer_policy *policy);
+void qd_session_set_swdec_format(struct qd_session *session,
+				 enum qd_sample_format format);
+void qd_session_set_cpu_stats(struct qd_session *session, bool enable);
 void qd_session_ignore_timestamps(struct qd_session *session, bool ignore);
 int qd_session_configure_outputs(struct qd_session *session,
 				 int num_outputs,
 				 const enum qd_output_id *outputs);
 void qd_session_set_dump_path(struct qd_session *session, const char *path);
+int qd_session_set_latency_log(struct qd_session *session, const char *path);
 bool qd_session_wait_eos(struct qd_session *session, enum qd_input_id input_id,
 			 int timeout_us);
 bool qd_session_get_eos(struct qd_session *session, enum qd_input_id input_id);
@@ -207,6 +518,11 @@ struct qd_output *qd_session_get_output(struct qd_session *session,
 void qd_session_set_output_cb(struct qd_session *session, qd_output_func_t func,
 			      void *userdata);
 bool qd_session_uses_timestamps(struct qd_session *session);
+void qd_session_get_stats(struct qd_session *session,
+			  struct qd_session_stats *stats);
+
+int qd_output_get_swdec_stats(struct qd_output *output,
+			      struct qd_sw_decoder_stats *stats);
 
 int qd_input_start(struct qd_input *input);
 int qd_input_pause(struct qd_input *input);
@@ -228,13 +544,24 @@ struct qd_input *qd_input_create(struct qd_session *session,
 struct qd_input *qd_input_create_from_avstream(struct qd_session *session,
 					       enum qd_input_id id,
 					       AVStream *avstream);
+int qd_input_reset(struct qd_input *input, AVStream *avstream);
 int qd_input_write(struct qd_input *input, void *data, int size,
 		   int64_t pts, int64_t duration);
 void qd_input_set_event_cb(struct qd_input *input, qd_input_event_func_t func,
 			   void *userdata);
 
+/* synthetic test vectors, generated on first use and cached on disk, e.g.
+ * gen:tone:codec=eac3:layout=5.1:freq=997:gain=-20:duration=30 */
+bool qd_gen_is_spec(const char *url);
+int qd_gen_file(const char *spec, char *path, size_t size);
+/* first channel of the signal, as fed to the encoder */
+int qd_gen_render(const char *spec, float *data, size_t n_frames);
+
 void ffmpeg_src_destroy(struct ffmpeg_src *src);
 struct ffmpeg_src *ffmpeg_src_create(const char *url, const char *format);
+struct ffmpeg_src *ffmpeg_src_create_playlist(const char * const *urls,
+					      int n_urls, const char *format);
+int ffmpeg_src_reopen(struct ffmpeg_src *src);
 uint64_t ffmpeg_src_get_duration(struct ffmpeg_src *src);
 AVStream *ffmpeg_src_get_avstream(struct ffmpeg_src *src, int index);
 struct qd_input *ffmpeg_src_add_input(struct ffmpeg_src *src, int index,
@@ -0,0 +1,779 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <inttypes.h>
+#include <errno.h>
+#include <limits.h>
+#include <math.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <libavutil/channel_layout.h>
+
+#include "qd.h"
+
+/*
+ * Synthetic test vectors
+ *
+ * Test stimuli are described by a spec string, e.g.
+ *
+ *   gen:tone:codec=eac3:layout=5.1:freq=997:gain=-20:duration=30
+ *
+ * and generated on first use, encoded with libavcodec. Files are cached in
+ * $QD_GEN_DIR (/tmp/qd-gen by default), named after a hash of the canonical
+ * description, which includes the generator and libavcodec versions since
+ * the encoded data depends on both. Concurrent generations of the same file
+ * are safe, each of them writes a temporary file renamed when complete.
+ *
+ * Signals:
+ *   tone      sine at freq on all channels
+ *   sweep     logarithmic sine sweep from freq to freq_end
+ *   chirp     linear sweep from freq to freq_end lasting slot seconds, at the
+ *             start of the stream and followed by silence, usable as a
+ *             timing marker
+ *   chid      channel identification, a tone on each channel in turn, for
+ *             slot seconds each, following the layout order
+ *   silence   digital silence
+ *
+ * A lead of silence can be added before the signal with lead=<s>. For coded
+ * formats the encoder delay is taken from it, so that the signal starts at
+ * the same position once decoded.
+ *
+ * Several layouts can be given, separated by commas, to generate a stream
+ * changing channel configuration every duration seconds. This is only
+ * supported for coded formats, since each frame carries its own
+ * configuration.
+ */
+
+#define av_err(errnum, fmt, ...) \
+	err(fmt ": %s", ##__VA_ARGS__, av_err2str(errnum))
+
+#define QD_GEN_VERSION		1
+#define QD_GEN_MAX_LAYOUTS	8
+#define QD_GEN_PCM_FRAMES	1024
+
+enum qd_gen_signal {
+	QD_GEN_TONE,
+	QD_GEN_SWEEP,
+	QD_GEN_CHIRP,
+	QD_GEN_CHID,
+	QD_GEN_SILENCE,
+};
+
+enum qd_gen_codec {
+	QD_GEN_PCM,
+	QD_GEN_AC3,
+	QD_GEN_EAC3,
+	QD_GEN_AAC,
+};
+
+static const char *qd_gen_signal_names[] = {
+	[QD_GEN_TONE] = "tone",
+	[QD_GEN_SWEEP] = "sweep",
+	[QD_GEN_CHIRP] = "chirp",
+	[QD_GEN_CHID] = "chid",
+	[QD_GEN_SILENCE] = "silence",
+};
+
+static const struct {
+	const char *name;
+	const char *ext;
+	enum AVCodecID codec_id;
+} qd_gen_codecs[] = {
+	[QD_GEN_PCM] = { "pcm", "wav", AV_CODEC_ID_NONE },
+	[QD_GEN_AC3] = { "ac3", "ac3", AV_CODEC_ID_AC3 },
+	[QD_GEN_EAC3] = { "eac3", "eac3", AV_CODEC_ID_EAC3 },
+	[QD_GEN_AAC] = { "aac", "aac", AV_CODEC_ID_AAC },
+};
+
+struct qd_gen_desc {
+	enum qd_gen_signal signal;
+	enum qd_gen_codec codec;
+	uint64_t layouts[QD_GEN_MAX_LAYOUTS];
+	int n_layouts;
+	int sample_rate;
+	int bit_rate;
+	double duration;
+	double freq;
+	double freq_end;
+	double gain;
+	double slot;
+	double lead;
+};
+
+struct qd_gen_state {
+	const struct qd_gen_desc *desc;
+	uint64_t n_frames;
+	uint64_t total_frames;
+	uint64_t slot_frames;
+	uint64_t lead_frames;
+	double amplitude;
+	double phase;
+};
+
+struct qd_gen_writer {
+	FILE *f;
+	AVCodecContext *codec;
+	AVFrame *frame;
+	AVPacket *pkt;
+	uint64_t data_size;
+};
+
+static int
+qd_gen_parse(const char *spec, struct qd_gen_desc *desc)
+{
+	char buf[256];
+	char *saveptr;
+	char *tok;
+	bool has_freq = false;
+	bool has_freq_end = false;
+	size_t i;
+
+	if (!qd_gen_is_spec(spec))
+		return -1;
+
+	snprintf(buf, sizeof (buf), "%s", spec + 4);
+
+	memset(desc, 0, sizeof (*desc));
+	desc->codec = QD_GEN_PCM;
+	desc->sample_rate = 48000;
+	desc->duration = 10;
+	desc->freq = 997;
+	desc->gain = -20;
+	desc->slot = 1;
+
+	tok = strtok_r(buf, ":", &saveptr);
+	if (!tok)
+		return -1;
+
+	for (i = 0; i < QD_N_ELEMENTS(qd_gen_signal_names); i++) {
+		if (!strcmp(tok, qd_gen_signal_names[i]))
+			break;
+	}
+	if (i == QD_N_ELEMENTS(qd_gen_signal_names)) {
+		err("gen: unknown signal %s", tok);
+		return -1;
+	}
+	desc->signal = i;
+
+	while ((tok = strtok_r(NULL, ":", &saveptr))) {
+		char *value = strchr(tok, '=');
+
+		if (!value) {
+			err("gen: invalid option %s", tok);
+			return -1;
+		}
+		*value++ = '\0';
+
+		if (!strcmp(tok, "codec")) {
+			for (i = 0; i < QD_N_ELEMENTS(qd_gen_codecs); i++) {
+				if (!strcmp(value, qd_gen_codecs[i].name))
+					break;
+			}
+			if (i == QD_N_ELEMENTS(qd_gen_codecs)) {
+				err("gen: unknown codec %s", value);
+				return -1;
+			}
+			desc->codec = i;
+		} else if (!strcmp(tok, "layout")) {
+			char *layout_saveptr;
+			char *layout;
+
+			desc->n_layouts = 0;
+			for (layout = strtok_r(value, ",", &layout_saveptr);
+			     layout;
+			     layout = strtok_r(NULL, ",", &layout_saveptr)) {
+				uint64_t l = av_get_channel_layout(layout);
+
+				if (!l || desc->n_layouts >= QD_GEN_MAX_LAYOUTS) {
+					err("gen: invalid layout %s", layout);
+					return -1;
+				}
+				desc->layouts[desc->n_layouts++] = l;
+			}
+		} else if (!strcmp(tok, "rate")) {
+			desc->sample_rate = atoi(value);
+		} else if (!strcmp(tok, "bitrate")) {
+			desc->bit_rate = atoi(value);
+		} else if (!strcmp(tok, "duration")) {
+			desc->duration = atof(value);
+		} else if (!strcmp(tok, "freq")) {
+			desc->freq = atof(value);
+			has_freq = true;
+		} else if (!strcmp(tok, "freq_end")) {
+			desc->freq_end = atof(value);
+			has_freq_end = true;
+		} else if (!strcmp(tok, "gain")) {
+			desc->gain = atof(value);
+		} else if (!strcmp(tok, "slot")) {
+			desc->slot = atof(value);
+		} else if (!strcmp(tok, "lead")) {
+			desc->lead = atof(value);
+		} else {
+			err("gen: unknown option %s", tok);
+			return -1;
+		}
+	}
+
+	if (desc->n_layouts == 0)
+		desc->layouts[desc->n_layouts++] = AV_CH_LAYOUT_STEREO;
+
+	/* full audio band by default for sweeps */
+	if (desc->signal == QD_GEN_SWEEP || desc->signal == QD_GEN_CHIRP) {
+		if (!has_freq)
+			desc->freq = 20;
+		if (!has_freq_end)
+			desc->freq_end = 20000;
+	} else {
+		desc->freq_end = desc->freq;
+	}
+
+	if (desc->sample_rate <= 0 || desc->duration <= 0 ||
+	    desc->slot <= 0 || desc->lead < 0 || desc->freq <= 0 || desc->freq_end <= 0 ||
+	    desc->freq >= desc->sample_rate / 2 ||
+	    desc->freq_end >= desc->sample_rate / 2) {
+		err("gen: invalid parameters in %s", spec);
+		return -1;
+	}
+
+	if (desc->codec == QD_GEN_PCM && desc->n_layouts > 1) {
+		err("gen: channel configuration changes require a coded format");
+		return -1;
+	}
+
+	return 0;
+}
+
+/* description with all parameters in a fixed format, so that equivalent
+ * specs share the same cache entry */
+static void
+qd_gen_canonical(const struct qd_gen_desc *desc, char *buf, size_t size)
+{
+	char layouts[128] = "";
+	size_t len = 0;
+
+	for (int i = 0; i < desc->n_layouts; i++) {
+		if (i > 0 && len < sizeof (layouts) - 1)
+			layouts[len++] = ',';
+		av_get_channel_layout_string(layouts + len,
+					     sizeof (layouts) - len, 0,
+					     desc->layouts[i]);
+		len = strlen(layouts);
+	}
+
+	snprintf(buf, size, "%s:codec=%s:layout=%s:rate=%d:bitrate=%d:"
+		 "duration=%g:freq=%g:freq_end=%g:gain=%g:slot=%g:lead=%g",
+		 qd_gen_signal_names[desc->signal],
+		 qd_gen_codecs[desc->codec].name, layouts, desc->sample_rate,
+		 desc->bit_rate, desc->duration, desc->freq, desc->freq_end,
+		 desc->gain, desc->slot, desc->lead);
+}
+
+/* 64-bit FNV-1a */
+static uint64_t
+qd_gen_hash(uint64_t hash, const char *s)
+{
+	for (; *s; s++) {
+		hash ^= (uint8_t)*s;
+		hash *= UINT64_C(0x100000001b3);
+	}
+
+	return hash;
+}
+
+static double
+qd_gen_sample(struct qd_gen_state *st, int ch, int channels)
+{
+	const struct qd_gen_desc *desc = st->desc;
+	uint64_t slot;
+
+	if (st->lead_frames)
+		return 0;
+
+	switch (desc->signal) {
+	case QD_GEN_TONE:
+	case QD_GEN_SWEEP:
+		return st->amplitude * sin(st->phase);
+	case QD_GEN_CHIRP:
+		if (st->n_frames >= st->slot_frames)
+			return 0;
+		return st->amplitude * sin(st->phase);
+	case QD_GEN_CHID:
+		slot = st->n_frames / st->slot_frames;
+		if (slot % channels != (uint64_t)ch)
+			return 0;
+		return st->amplitude * sin(st->phase);
+	case QD_GEN_SILENCE:
+	default:
+		return 0;
+	}
+}
+
+static void
+qd_gen_advance(struct qd_gen_state *st)
+{
+	const struct qd_gen_desc *desc = st->desc;
+	double freq = desc->freq;
+	double t;
+
+	if (st->lead_frames) {
+		st->lead_frames--;
+		return;
+	}
+
+	if (desc->signal == QD_GEN_SWEEP) {
+		t = (double)st->n_frames / st->total_frames;
+		freq = desc->freq * pow(desc->freq_end / desc->freq, t);
+	} else if (desc->signal == QD_GEN_CHIRP) {
+		t = (double)st->n_frames / st->slot_frames;
+		freq = desc->freq + (desc->freq_end - desc->freq) * t;
+	}
+
+	st->phase += 2.0 * M_PI * freq / desc->sample_rate;
+	if (st->phase >= 2.0 * M_PI)
+		st->phase -= 2.0 * M_PI;
+
+	st->n_frames++;
+}
+
+static int16_t
+qd_gen_to_s16(double v)
+{
+	long s = lrint(v * 32767.0);
+
+	return s > INT16_MAX ? INT16_MAX : s < INT16_MIN ? INT16_MIN : s;
+}
+
+static void
+qd_gen_fill_s16(struct qd_gen_state *st, int16_t *data, int n_frames,
+		int channels)
+{
+	for (int i = 0; i < n_frames; i++) {
+		for (int ch = 0; ch < channels; ch++)
+			*data++ = qd_gen_to_s16(qd_gen_sample(st, ch, channels));
+		qd_gen_advance(st);
+	}
+}
+
+static void
+qd_gen_fill_frame(struct qd_gen_state *st, AVFrame *frame)
+{
+	int channels = frame->channels;
+
+	if (frame->format == AV_SAMPLE_FMT_S16) {
+		qd_gen_fill_s16(st, (int16_t *)frame->data[0],
+				frame->nb_samples, channels);
+		return;
+	}
+
+	/* AV_SAMPLE_FMT_FLTP */
+	for (int i = 0; i < frame->nb_samples; i++) {
+		for (int ch = 0; ch < channels; ch++) {
+			float *samples = (float *)frame->extended_data[ch];
+			samples[i] = qd_gen_sample(st, ch, channels);
+		}
+		qd_gen_advance(st);
+	}
+}
+
+static void
+qd_gen_write_le(FILE *f, uint64_t v, int bytes)
+{
+	for (int i = 0; i < bytes; i++)
+		fputc((v >> (8 * i)) & 0xff, f);
+}
+
+/* WAVE_FORMAT_EXTENSIBLE header, so that the channel mask is preserved,
+ * libavutil channel masks match the WAVE ones */
+static void
+qd_gen_write_wav_header(FILE *f, const struct qd_gen_desc *desc,
+			uint64_t data_size)
+{
+	static const uint8_t pcm_guid[16] = {
+		0x01, 0x00, 0x00, 0x00, 0x00, 0x00, 0x10, 0x00,
+		0x80, 0x00, 0x00, 0xaa, 0x00, 0x38, 0x9b, 0x71,
+	};
+	int channels = av_get_channel_layout_nb_channels(desc->layouts[0]);
+
+	fwrite("RIFF", 1, 4, f);
+	qd_gen_write_le(f, 4 + 8 + 40 + 8 + data_size, 4);
+	fwrite("WAVEfmt ", 1, 8, f);
+	qd_gen_write_le(f, 40, 4);
+	qd_gen_write_le(f, 0xfffe, 2);
+	qd_gen_write_le(f, channels, 2);
+	qd_gen_write_le(f, desc->sample_rate, 4);
+	qd_gen_write_le(f, desc->sample_rate * channels * 2, 4);
+	qd_gen_write_le(f, channels * 2, 2);
+	qd_gen_write_le(f, 16, 2);
+	qd_gen_write_le(f, 22, 2);
+	qd_gen_write_le(f, 16, 2);
+	qd_gen_write_le(f, desc->layouts[0], 4);
+	fwrite(pcm_guid, 1, sizeof (pcm_guid), f);
+	fwrite("data", 1, 4, f);
+	qd_gen_write_le(f, data_size, 4);
+}
+
+static int
+qd_gen_write_pcm(struct qd_gen_writer *w, struct qd_gen_state *st,
+		 uint64_t n_frames)
+{
+	const struct qd_gen_desc *desc = st->desc;
+	int channels = av_get_channel_layout_nb_channels(desc->layouts[0]);
+	int16_t data[QD_GEN_PCM_FRAMES * 8];
+	int max_frames = QD_N_ELEMENTS(data) / channels;
+
+	qd_gen_write_wav_header(w->f, desc, 0);
+
+	while (n_frames > 0) {
+		int n = QD_MIN(n_frames, (uint64_t)max_frames);
+
+		qd_gen_fill_s16(st, data, n, channels);
+		if (fwrite(data, n * channels * 2, 1, w->f) != 1)
+			return -1;
+
+		w->data_size += n * channels * 2;
+		n_frames -= n;
+	}
+
+	/* patch sizes */
+	if (fseek(w->f, 0, SEEK_SET))
+		return -1;
+	qd_gen_write_wav_header(w->f, desc, w->data_size);
+
+	return 0;
+}
+
+static const int qd_gen_aac_rates[] = {
+	96000, 88200, 64000, 48000, 44100, 32000,
+	24000, 22050, 16000, 12000, 11025, 8000, 7350,
+};
+
+/* raw AAC frames are wrapped in ADTS, so that each frame carries its own
+ * configuration, like AC3 and EAC3 frames do */
+static int
+qd_gen_write_adts_header(struct qd_gen_writer *w, int size)
+{
+	AVCodecContext *codec = w->codec;
+	uint8_t h[7];
+	int obj_type;
+	int rate_idx;
+	int channels_idx;
+	int len = size + sizeof (h);
+
+	obj_type = codec->profile == FF_PROFILE_UNKNOWN ?
+		2 : codec->profile + 1;
+
+	for (rate_idx = 0; rate_idx < (int)QD_N_ELEMENTS(qd_gen_aac_rates);
+	     rate_idx++) {
+		if (qd_gen_aac_rates[rate_idx] == codec->sample_rate)
+			break;
+	}
+
+	channels_idx = codec->channels == 8 ? 7 : codec->channels;
+
+	if (obj_type > 4 || rate_idx == QD_N_ELEMENTS(qd_gen_aac_rates) ||
+	    channels_idx > 7 || len >= (1 << 13))
+		return -1;
+
+	h[0] = 0xff;
+	h[1] = 0xf1;
+	h[2] = (obj_type - 1) << 6 | rate_idx << 2 | (channels_idx & 4) >> 2;
+	h[3] = (channels_idx & 3) << 6 | len >> 11;
+	h[4] = (len >> 3) & 0xff;
+	h[5] = (len & 7) << 5 | 0x1f;
+	h[6] = 0xfc;
+
+	return fwrite(h, sizeof (h), 1, w->f) == 1 ? 0 : -1;
+}
+
+static int
+qd_gen_write_packets(struct qd_gen_writer *w, const AVFrame *frame)
+{
+	int ret;
+
+	ret = avcodec_send_frame(w->codec, frame);
+	if (ret < 0) {
+		av_err(ret, "gen: failed to encode frame");
+		return -1;
+	}
+
+	while (1) {
+		ret = avcodec_receive_packet(w->codec, w->pkt);
+		if (ret == AVERROR(EAGAIN) || ret == AVERROR_EOF)
+			return 0;
+		if (ret < 0) {
+			av_err(ret, "gen: failed to encode frame");
+			return -1;
+		}
+
+		if (w->codec->codec_id == AV_CODEC_ID_AAC &&
+		    qd_gen_write_adts_header(w, w->pkt->size)) {
+			err("gen: unsupported aac configuration");
+			av_packet_unref(w->pkt);
+			return -1;
+		}
+
+		ret = fwrite(w->pkt->data, w->pkt->size, 1, w->f);
+		w->data_size += w->pkt->size;
+		av_packet_unref(w->pkt);
+		if (ret != 1)
+			return -1;
+	}
+}
+
+static enum AVSampleFormat
+qd_gen_find_sample_format(const AVCodec *avcodec)
+{
+	for (const enum AVSampleFormat *f = avcodec->sample_fmts;
+	     f && *f != AV_SAMPLE_FMT_NONE; f++) {
+		if (*f == AV_SAMPLE_FMT_FLTP || *f == AV_SAMPLE_FMT_S16)
+			return *f;
+	}
+
+	return AV_SAMPLE_FMT_NONE;
+}
+
+/* encode one channel configuration segment */
+static int
+qd_gen_write_coded(struct qd_gen_writer *w, struct qd_gen_state *st,
+		   uint64_t layout, uint64_t n_frames)
+{
+	const struct qd_gen_desc *desc = st->desc;
+	AVCodec *avcodec;
+	int ret = -1;
+
+	avcodec = avcodec_find_encoder(qd_gen_codecs[desc->codec].codec_id);
+	if (!avcodec) {
+		err("gen: no %s encoder available",
+		    qd_gen_codecs[desc->codec].name);
+		return -1;
+	}
+
+	/* e.g. the eac3 encoder stops at 5.1 */
+	if (avcodec->channel_layouts) {
+		const uint64_t *l = avcodec->channel_layouts;
+		char name[64];
+
+		while (*l && *l != layout)
+			l++;
+
+		if (!*l) {
+			av_get_channel_layout_string(name, sizeof (name), 0,
+						     layout);
+			err("gen: layout %s not supported by the %s encoder",
+			    name, qd_gen_codecs[desc->codec].name);
+			return -1;
+		}
+	}
+
+	w->codec = avcodec_alloc_context3(avcodec);
+	w->frame = av_frame_alloc();
+	if (!w->codec || !w->frame)
+		goto out;
+
+	w->codec->sample_rate = desc->sample_rate;
+	w->codec->channel_layout = layout;
+	w->codec->channels = av_get_channel_layout_nb_channels(layout);
+	w->codec->sample_fmt = qd_gen_find_sample_format(avcodec);
+	w->codec->time_base = (AVRational){ 1, desc->sample_rate };
+	if (desc->bit_rate)
+		w->codec->bit_rate = desc->bit_rate;
+
+	if (w->codec->sample_fmt == AV_SAMPLE_FMT_NONE) {
+		err("gen: no supported sample format for %s encoder",
+		    qd_gen_codecs[desc->codec].name);
+		goto out;
+	}
+
+	ret = avcodec_open2(w->codec, avcodec, NULL);
+	if (ret < 0) {
+		av_err(ret, "gen: failed to open %s encoder",
+		       qd_gen_codecs[desc->codec].name);
+		ret = -1;
+		goto out;
+	}
+	ret = -1;
+
+	/* the decoded stream starts with the encoder delay, take it from the
+	 * lead so that the signal lands where expected */
+	if (st->lead_frames) {
+		uint64_t delay = QD_MIN((uint64_t)w->codec->initial_padding,
+					st->lead_frames);
+
+		if (delay < (uint64_t)w->codec->initial_padding)
+			dbg("gen: lead shorter than the %d samples encoder delay",
+			    w->codec->initial_padding);
+
+		st->lead_frames -= delay;
+		n_frames += st->lead_frames;
+	}
+
+	w->frame->format = w->codec->sample_fmt;
+	w->frame->sample_rate = w->codec->sample_rate;
+	w->frame->channel_layout = w->codec->channel_layout;
+	w->frame->channels = w->codec->channels;
+	w->frame->nb_samples = w->codec->frame_size ?
+		w->codec->frame_size : QD_GEN_PCM_FRAMES;
+	if (av_frame_get_buffer(w->frame, 0))
+		goto out;
+
+	/* whole frames only, the last one may go past the duration */
+	for (uint64_t n = 0; n < n_frames; n += w->frame->nb_samples) {
+		if (av_frame_make_writable(w->frame))
+			goto out;
+
+		w->frame->pts = st->n_frames;
+		qd_gen_fill_frame(st, w->frame);
+
+		if (qd_gen_write_packets(w, w->frame))
+			goto out;
+	}
+
+	/* drain */
+	if (qd_gen_write_packets(w, NULL))
+		goto out;
+
+	ret = 0;
+
+out:
+	av_frame_free(&w->frame);
+	avcodec_free_context(&w->codec);
+	return ret;
+}
+
+static void
+qd_gen_state_init(struct qd_gen_state *st, const struct qd_gen_desc *desc)
+{
+	memset(st, 0, sizeof (*st));
+	st->desc = desc;
+	st->total_frames = (uint64_t)(desc->duration * desc->sample_rate) *
+		desc->n_layouts;
+	st->slot_frames = QD_MAX((uint64_t)(desc->slot * desc->sample_rate), 1);
+	st->lead_frames = desc->lead * desc->sample_rate;
+	st->amplitude = pow(10.0, desc->gain / 20.0);
+}
+
+static int
+qd_gen_write(const struct qd_gen_desc *desc, const char *path)
+{
+	struct qd_gen_writer w = {};
+	struct qd_gen_state st;
+	uint64_t segment_frames = desc->duration * desc->sample_rate;
+	int ret = -1;
+
+	qd_gen_state_init(&st, desc);
+
+	w.f = fopen(path, "wb");
+	if (!w.f) {
+		err("gen: failed to create %s: %m", path);
+		return -1;
+	}
+
+	if (desc->codec == QD_GEN_PCM) {
+		ret = qd_gen_write_pcm(&w, &st,
+				       segment_frames + st.lead_frames);
+	} else {
+		w.pkt = av_packet_alloc();
+		if (!w.pkt)
+			goto out;
+
+		for (int i = 0; i < desc->n_layouts; i++) {
+			ret = qd_gen_write_coded(&w, &st, desc->layouts[i],
+						 segment_frames);
+			if (ret)
+				break;
+		}
+	}
+
+out:
+	av_packet_free(&w.pkt);
+
+	if (fclose(w.f))
+		ret = -1;
+
+	return ret;
+}
+
+int
+qd_gen_render(const char *spec, float *data, size_t n_frames)
+{
+	struct qd_gen_desc desc;
+	struct qd_gen_state st;
+	int channels;
+
+	if (qd_gen_parse(spec, &desc))
+		return -1;
+
+	qd_gen_state_init(&st, &desc);
+	channels = av_get_channel_layout_nb_channels(desc.layouts[0]);
+
+	for (size_t i = 0; i < n_frames; i++) {
+		data[i] = qd_gen_sample(&st, 0, channels);
+		qd_gen_advance(&st);
+	}
+
+	return 0;
+}
+
+bool
+qd_gen_is_spec(const char *url)
+{
+	return url && !strncmp(url, "gen:", 4);
+}
+
+int
+qd_gen_file(const char *spec, char *path, size_t size)
+{
+	struct qd_gen_desc desc;
+	char canonical[512];
+	char tmp_path[PATH_MAX];
+	const char *dir;
+	uint64_t hash;
+	char version[32];
+
+	if (qd_gen_parse(spec, &desc))
+		return -1;
+
+	qd_gen_canonical(&desc, canonical, sizeof (canonical));
+
+	snprintf(version, sizeof (version), "v%d", QD_GEN_VERSION);
+	hash = qd_gen_hash(UINT64_C(0xcbf29ce484222325), canonical);
+	hash = qd_gen_hash(hash, version);
+	hash = qd_gen_hash(hash, LIBAVCODEC_IDENT);
+
+	dir = getenv("QD_GEN_DIR");
+	if (!dir)
+		dir = "/tmp/qd-gen";
+
+	if (mkdir(dir, 0755) && errno != EEXIST) {
+		err("gen: failed to create %s: %m", dir);
+		return -1;
+	}
+
+	snprintf(path, size, "%s/%016" PRIx64 ".%s", dir, hash,
+		 qd_gen_codecs[desc.codec].ext);
+
+	if (access(path, R_OK) == 0) {
+		dbg("gen: %s: using cached %s", canonical, path);
+		return 0;
+	}
+
+	info("gen: %s: generating %s", canonical, path);
+
+	snprintf(tmp_path, sizeof (tmp_path), "%s.%d.tmp", path, getpid());
+
+	if (qd_gen_write(&desc, tmp_path)) {
+		err("gen: %s: failed to generate", canonical);
+		unlink(tmp_path);
+		return -1;
+	}
+
+	if (rename(tmp_path, path)) {
+		err("gen: failed to rename %s: %m", tmp_path);
+		unlink(tmp_path);
+		return -1;
+	}
+
+	return 0;
+}
@@ -0,0 +1,800 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <string.h>
+#include <inttypes.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "qd.h"
+
+/*
+ * Asynchronous logging backend
+ *
+ * Each thread logging a message gets its own single producer/single consumer
+ * ring buffer. The producer side does not format anything: it walks the
+ * printf format string and copies the raw arguments (and strings) into a
+ * binary record. A background drain thread merges the rings in timestamp
+ * order, formats the records and writes them to stderr.
+ *
+ * When the drain thread is not running (before qd_init(), after fork, or when
+ * QD_LOG_SYNC is set in the environment), messages are written synchronously
+ * as before. Errors and notices always drain the rings before returning.
+ */
+
+#define QD_LOG_RING_SIZE	(64 * 1024)
+#define QD_LOG_MAX_RECORD	2048
+#define QD_LOG_MAX_LINE		4096
+#define QD_LOG_DRAIN_PERIOD_MS	5
+
+struct qd_log_record {
+	uint32_t size;
+	int32_t saved_errno;
+	uint64_t time;
+	const char *fmt;
+	/* argument blob follows */
+};
+
+#define QD_LOG_ALIGN(x)	(((x) + 7) & ~(size_t)7)
+
+struct qd_log_ring {
+	struct qd_log_ring *next;
+	uint8_t *buf;
+	_Atomic size_t head;
+	_Atomic size_t tail;
+	_Atomic uint64_t dropped;
+	atomic_bool dead;
+};
+
+static pthread_mutex_t qd_log_rings_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t qd_log_drain_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t qd_log_drain_cond = PTHREAD_COND_INITIALIZER;
+static struct qd_log_ring *qd_log_rings;
+static pthread_once_t qd_log_once = PTHREAD_ONCE_INIT;
+static pthread_key_t qd_log_key;
+static __thread struct qd_log_ring *qd_log_tls_ring;
+
+static atomic_bool qd_log_async;
+static bool qd_log_terminated;
+static pthread_t qd_log_tid;
+
+/*
+ * format string parsing, shared by the capture and formatting sides
+ */
+
+enum qd_log_arg {
+	QD_LOG_ARG_NONE,
+	QD_LOG_ARG_INT,
+	QD_LOG_ARG_LONG,
+	QD_LOG_ARG_LLONG,
+	QD_LOG_ARG_SIZE,
+	QD_LOG_ARG_PTRDIFF,
+	QD_LOG_ARG_INTMAX,
+	QD_LOG_ARG_DOUBLE,
+	QD_LOG_ARG_LDOUBLE,
+	QD_LOG_ARG_PTR,
+	QD_LOG_ARG_STR,
+	QD_LOG_ARG_ERRNO,
+};
+
+struct qd_log_spec {
+	const char *start;
+	const char *end;
+	bool star_width;
+	bool star_prec;
+	enum qd_log_arg arg;
+	char conv;
+};
+
+/* parse the conversion specification starting right after '%' */
+static const char *
+qd_log_parse_spec(const char *p, struct qd_log_spec *spec)
+{
+	int len = 0;
+
+	memset(spec, 0, sizeof (*spec));
+	spec->start = p - 1;
+
+	while (*p && strchr("-+ #0'I", *p))
+		p++;
+
+	if (*p == '*') {
+		spec->star_width = true;
+		p++;
+	} else {
+		while (*p >= '0' && *p <= '9')
+			p++;
+	}
+
+	if (*p == '.') {
+		p++;
+		if (*p == '*') {
+			spec->star_prec = true;
+			p++;
+		} else {
+			while (*p >= '0' && *p <= '9')
+				p++;
+		}
+	}
+
+	/* length modifiers: 1=h/hh 2=l 3=ll 4=z 5=t 6=j 7=L */
+	for (;;) {
+		if (*p == 'h') {
+			len = 1;
+		} else if (*p == 'l') {
+			len = len == 2 ? 3 : 2;
+		} else if (*p == 'q') {
+			len = 3;
+		} else if (*p == 'z') {
+			len = 4;
+		} else if (*p == 't') {
+			len = 5;
+		} else if (*p == 'j') {
+			len = 6;
+		} else if (*p == 'L') {
+			len = 7;
+		} else {
+			break;
+		}
+		p++;
+	}
+
+	spec->conv = *p;
+
+	switch (*p) {
+	case 'd': case 'i': case 'u': case 'x': case 'X': case 'o': case 'c':
+		switch (len) {
+		case 2: spec->arg = QD_LOG_ARG_LONG; break;
+		case 3: spec->arg = QD_LOG_ARG_LLONG; break;
+		case 4: spec->arg = QD_LOG_ARG_SIZE; break;
+		case 5: spec->arg = QD_LOG_ARG_PTRDIFF; break;
+		case 6: spec->arg = QD_LOG_ARG_INTMAX; break;
+		default: spec->arg = QD_LOG_ARG_INT; break;
+		}
+		break;
+	case 'f': case 'F': case 'e': case 'E': case 'g': case 'G':
+	case 'a': case 'A':
+		spec->arg = len == 7 ? QD_LOG_ARG_LDOUBLE : QD_LOG_ARG_DOUBLE;
+		break;
+	case 'p':
+		spec->arg = QD_LOG_ARG_PTR;
+		break;
+	case 's':
+		spec->arg = QD_LOG_ARG_STR;
+		break;
+	case 'm':
+		spec->arg = QD_LOG_ARG_ERRNO;
+		break;
+	case '\0':
+		spec->end = p;
+		return p;
+	default:
+		/* %%, %n and unknown conversions do not consume arguments
+		 * we know about */
+		spec->arg = QD_LOG_ARG_NONE;
+		break;
+	}
+
+	spec->end = p + 1;
+
+	return p + 1;
+}
+
+/*
+ * producer side: binary argument capture
+ */
+
+struct qd_log_blob {
+	uint8_t *p;
+	uint8_t *end;
+	bool truncated;
+};
+
+static void
+qd_log_blob_put(struct qd_log_blob *b, const void *data, size_t size)
+{
+	size_t aligned = QD_LOG_ALIGN(size);
+
+	/* once an argument has been dropped, drop all the following ones so
+	 * that the formatting side does not get out of sync */
+	if (b->truncated || b->p + aligned > b->end) {
+		b->truncated = true;
+		return;
+	}
+
+	memcpy(b->p, data, size);
+	b->p += aligned;
+}
+
+static void
+qd_log_blob_put_str(struct qd_log_blob *b, const char *s, int prec)
+{
+	uint32_t len;
+	size_t avail;
+
+	if (!s)
+		s = "(null)";
+
+	len = prec >= 0 ? strnlen(s, prec) : strlen(s);
+
+	/* keep room for the length and the other arguments */
+	avail = b->end - b->p;
+	if (avail < 64) {
+		b->truncated = true;
+		len = 0;
+	} else if (len > avail - 64) {
+		len = avail - 64;
+	}
+
+	qd_log_blob_put(b, &len, sizeof (len));
+	qd_log_blob_put(b, s, len);
+}
+
+static void
+qd_log_capture(struct qd_log_blob *b, const char *fmt, va_list ap)
+{
+	struct qd_log_spec spec;
+	const char *p = fmt;
+
+	while ((p = strchr(p, '%')) != NULL) {
+		int width = 0, prec = -1;
+
+		p = qd_log_parse_spec(p + 1, &spec);
+
+		if (spec.star_width) {
+			width = va_arg(ap, int);
+			qd_log_blob_put(b, &width, sizeof (width));
+		}
+
+		if (spec.star_prec) {
+			prec = va_arg(ap, int);
+			qd_log_blob_put(b, &prec, sizeof (prec));
+		}
+
+		switch (spec.arg) {
+		case QD_LOG_ARG_INT: {
+			int v = va_arg(ap, int);
+			qd_log_blob_put(b, &v, sizeof (v));
+			break;
+		}
+		case QD_LOG_ARG_LONG: {
+			long v = va_arg(ap, long);
+			qd_log_blob_put(b, &v, sizeof (v));
+			break;
+		}
+		case QD_LOG_ARG_LLONG: {
+			long long v = va_arg(ap, long long);
+			qd_log_blob_put(b, &v, sizeof (v));
+			break;
+		}
+		case QD_LOG_ARG_SIZE: {
+			size_t v = va_arg(ap, size_t);
+			qd_log_blob_put(b, &v, sizeof (v));
+			break;
+		}
+		case QD_LOG_ARG_PTRDIFF: {
+			ptrdiff_t v = va_arg(ap, ptrdiff_t);
+			qd_log_blob_put(b, &v, sizeof (v));
+			break;
+		}
+		case QD_LOG_ARG_INTMAX: {
+			intmax_t v = va_arg(ap, intmax_t);
+			qd_log_blob_put(b, &v, sizeof (v));
+			break;
+		}
+		case QD_LOG_ARG_DOUBLE: {
+			double v = va_arg(ap, double);
+			qd_log_blob_put(b, &v, sizeof (v));
+			break;
+		}
+		case QD_LOG_ARG_LDOUBLE: {
+			long double v = va_arg(ap, long double);
+			qd_log_blob_put(b, &v, sizeof (v));
+			break;
+		}
+		case QD_LOG_ARG_PTR: {
+			void *v = va_arg(ap, void *);
+			qd_log_blob_put(b, &v, sizeof (v));
+			break;
+		}
+		case QD_LOG_ARG_STR:
+			qd_log_blob_put_str(b, va_arg(ap, const char *), prec);
+			break;
+		case QD_LOG_ARG_ERRNO:
+		case QD_LOG_ARG_NONE:
+			break;
+		}
+
+		if (*p == '\0')
+			break;
+	}
+}
+
+/*
+ * consumer side: formatting of captured records
+ */
+
+struct qd_log_reader {
+	const uint8_t *p;
+	const uint8_t *end;
+};
+
+static const void *
+qd_log_reader_get(struct qd_log_reader *r, size_t size)
+{
+	const void *data = r->p;
+
+	if (r->p + QD_LOG_ALIGN(size) > r->end)
+		return NULL;
+
+	r->p += QD_LOG_ALIGN(size);
+
+	return data;
+}
+
+#define READ_ARG(r, type, dflt) ({					\
+		const __typeof__(type) *_v =				\
+			qd_log_reader_get(r, sizeof (type));		\
+		_v ? *_v : (dflt);					\
+	})
+
+static int
+qd_log_format(char *out, size_t out_size, const struct qd_log_record *rec)
+{
+	struct qd_log_reader r;
+	struct qd_log_spec spec;
+	const char *p = rec->fmt;
+	size_t len = 0;
+
+	r.p = (const uint8_t *)(rec + 1);
+	r.end = (const uint8_t *)rec + rec->size;
+
+#define APPEND(...) do {						\
+		int _n = snprintf(out + len, out_size - len, __VA_ARGS__); \
+		if (_n > 0)						\
+			len = QD_MIN(len + _n, out_size - 1);		\
+	} while (0)
+
+	APPEND("[%08" PRIu64 "] ", rec->time / 1000);
+
+	while (*p && len < out_size - 1) {
+		const char *pct = strchr(p, '%');
+		char spec_fmt[32];
+		int width = 0, prec = -1;
+		size_t spec_len;
+
+		if (!pct) {
+			APPEND("%s", p);
+			break;
+		}
+
+		if (pct > p)
+			APPEND("%.*s", (int)(pct - p), p);
+
+		p = qd_log_parse_spec(pct + 1, &spec);
+
+		/* rebuild a single conversion spec, substituting '*' width
+		 * and precision with the captured values */
+		if (spec.star_width)
+			width = READ_ARG(&r, int, 0);
+		if (spec.star_prec)
+			prec = READ_ARG(&r, int, -1);
+
+		spec_len = 0;
+		for (const char *s = spec.start; s < spec.end &&
+		     spec_len < sizeof (spec_fmt) - 12; s++) {
+			if (*s == '*') {
+				spec_len += snprintf(spec_fmt + spec_len,
+						     sizeof (spec_fmt) - spec_len,
+						     "%d",
+						     s > spec.start &&
+						     s[-1] == '.' ? prec : width);
+			} else {
+				spec_fmt[spec_len++] = *s;
+			}
+		}
+		spec_fmt[spec_len] = '\0';
+
+		switch (spec.arg) {
+		case QD_LOG_ARG_INT:
+			APPEND(spec_fmt, READ_ARG(&r, int, 0));
+			break;
+		case QD_LOG_ARG_LONG:
+			APPEND(spec_fmt, READ_ARG(&r, long, 0));
+			break;
+		case QD_LOG_ARG_LLONG:
+			APPEND(spec_fmt, READ_ARG(&r, long long, 0));
+			break;
+		case QD_LOG_ARG_SIZE:
+			APPEND(spec_fmt, READ_ARG(&r, size_t, 0));
+			break;
+		case QD_LOG_ARG_PTRDIFF:
+			APPEND(spec_fmt, READ_ARG(&r, ptrdiff_t, 0));
+			break;
+		case QD_LOG_ARG_INTMAX:
+			APPEND(spec_fmt, READ_ARG(&r, intmax_t, 0));
+			break;
+		case QD_LOG_ARG_DOUBLE:
+			APPEND(spec_fmt, READ_ARG(&r, double, 0));
+			break;
+		case QD_LOG_ARG_LDOUBLE:
+			APPEND(spec_fmt, READ_ARG(&r, long double, 0));
+			break;
+		case QD_LOG_ARG_PTR:
+			APPEND(spec_fmt, READ_ARG(&r, void *, NULL));
+			break;
+		case QD_LOG_ARG_STR: {
+			uint32_t slen = READ_ARG(&r, uint32_t, 0);
+			const char *s = qd_log_reader_get(&r, slen);
+			/* captured string is not nul terminated, use the
+			 * captured length as precision */
+			spec_fmt[spec_len - 1] = '\0';
+			if (strchr(spec_fmt, '.'))
+				*strchr(spec_fmt, '.') = '\0';
+			strcat(spec_fmt, ".*s");
+			APPEND(spec_fmt, s ? (int)slen : 0, s ? s : "");
+			break;
+		}
+		case QD_LOG_ARG_ERRNO:
+			APPEND("%s", strerror(rec->saved_errno));
+			break;
+		case QD_LOG_ARG_NONE:
+			if (spec.conv == '%')
+				APPEND("%%");
+			break;
+		}
+	}
+
+#undef APPEND
+
+	return len;
+}
+
+/*
+ * rings management
+ */
+
+static void
+qd_log_ring_release(void *data)
+{
+	struct qd_log_ring *ring = data;
+
+	/* the drain thread frees the ring once it has been emptied */
+	atomic_store(&ring->dead, true);
+}
+
+static void
+qd_log_atfork_child(void)
+{
+	/* the drain thread does not exist in the child, and locks may have
+	 * been held by other threads at fork time */
+	pthread_mutex_init(&qd_log_rings_lock, NULL);
+	pthread_mutex_init(&qd_log_drain_lock, NULL);
+	pthread_cond_init(&qd_log_drain_cond, NULL);
+	atomic_store(&qd_log_async, false);
+	qd_log_terminated = false;
+}
+
+static void
+qd_log_init_once(void)
+{
+	pthread_key_create(&qd_log_key, qd_log_ring_release);
+	pthread_atfork(NULL, NULL, qd_log_atfork_child);
+	atexit(qd_log_stop);
+}
+
+static struct qd_log_ring *
+qd_log_get_ring(void)
+{
+	struct qd_log_ring *ring = qd_log_tls_ring;
+
+	if (ring)
+		return ring;
+
+	ring = qd_mem_calloc(QD_MEM_LOG, 1, sizeof (*ring));
+	if (!ring)
+		return NULL;
+
+	ring->buf = qd_mem_malloc(QD_MEM_LOG, QD_LOG_RING_SIZE);
+	if (!ring->buf) {
+		qd_mem_free(QD_MEM_LOG, ring);
+		return NULL;
+	}
+
+	pthread_mutex_lock(&qd_log_rings_lock);
+	ring->next = qd_log_rings;
+	qd_log_rings = ring;
+	pthread_mutex_unlock(&qd_log_rings_lock);
+
+	pthread_setspecific(qd_log_key, ring);
+	qd_log_tls_ring = ring;
+
+	return ring;
+}
+
+static bool
+qd_log_ring_push(struct qd_log_ring *ring, const struct qd_log_record *rec)
+{
+	size_t head, tail, offset, room, size;
+
+	head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+	tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+
+	size = rec->size;
+	offset = head % QD_LOG_RING_SIZE;
+	room = QD_LOG_RING_SIZE - offset;
+
+	/* records never wrap, skip the end of the buffer if needed */
+	if (room < size) {
+		if (head + room + size - tail > QD_LOG_RING_SIZE)
+			goto full;
+
+		if (room >= sizeof (struct qd_log_record)) {
+			struct qd_log_record *pad =
+				(struct qd_log_record *)(ring->buf + offset);
+			pad->size = room;
+			pad->fmt = NULL;
+		}
+		head += room;
+		offset = 0;
+	} else if (head + size - tail > QD_LOG_RING_SIZE) {
+		goto full;
+	}
+
+	memcpy(ring->buf + offset, rec, size);
+	atomic_store_explicit(&ring->head, head + size, memory_order_release);
+
+	return true;
+
+full:
+	return false;
+}
+
+static const struct qd_log_record *
+qd_log_ring_peek(struct qd_log_ring *ring)
+{
+	const struct qd_log_record *rec;
+	size_t head, tail, offset;
+
+	tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+
+	for (;;) {
+		head = atomic_load_explicit(&ring->head, memory_order_acquire);
+		if (tail == head)
+			return NULL;
+
+		offset = tail % QD_LOG_RING_SIZE;
+
+		/* implicit padding too small to hold a record header */
+		if (QD_LOG_RING_SIZE - offset < sizeof (struct qd_log_record)) {
+			tail += QD_LOG_RING_SIZE - offset;
+			atomic_store_explicit(&ring->tail, tail,
+					      memory_order_release);
+			continue;
+		}
+
+		rec = (const struct qd_log_record *)(ring->buf + offset);
+		if (rec->fmt)
+			return rec;
+
+		/* explicit padding record */
+		tail += rec->size;
+		atomic_store_explicit(&ring->tail, tail, memory_order_release);
+	}
+}
+
+static void
+qd_log_ring_pop(struct qd_log_ring *ring, const struct qd_log_record *rec)
+{
+	atomic_fetch_add_explicit(&ring->tail, rec->size,
+				  memory_order_release);
+}
+
+/* called with qd_log_drain_lock held, returns the number of lines written */
+static int
+qd_log_drain(void)
+{
+	char line[QD_LOG_MAX_LINE];
+	struct qd_log_ring **pring, *ring;
+	int count = 0;
+
+	pthread_mutex_lock(&qd_log_rings_lock);
+
+	for (ring = qd_log_rings; ring; ring = ring->next) {
+		uint64_t dropped = atomic_exchange(&ring->dropped, 0);
+		if (dropped > 0) {
+			fprintf(stderr, "[%08" PRIu64 "] log: %" PRIu64
+				" messages dropped\n", qd_get_time() / 1000,
+				dropped);
+		}
+	}
+
+	/* merge all rings in timestamp order */
+	for (;;) {
+		const struct qd_log_record *best = NULL;
+		struct qd_log_ring *best_ring = NULL;
+		int len;
+
+		for (ring = qd_log_rings; ring; ring = ring->next) {
+			const struct qd_log_record *rec =
+				qd_log_ring_peek(ring);
+			if (rec && (!best || rec->time < best->time)) {
+				best = rec;
+				best_ring = ring;
+			}
+		}
+
+		if (!best)
+			break;
+
+		len = qd_log_format(line, sizeof (line), best);
+		fwrite(line, len, 1, stderr);
+		qd_log_ring_pop(best_ring, best);
+		count++;
+	}
+
+	/* release the rings of exited threads */
+	pring = &qd_log_rings;
+	while ((ring = *pring) != NULL) {
+		if (atomic_load(&ring->dead) && !qd_log_ring_peek(ring)) {
+			*pring = ring->next;
+			qd_mem_free(QD_MEM_LOG, ring->buf);
+			qd_mem_free(QD_MEM_LOG, ring);
+		} else {
+			pring = &ring->next;
+		}
+	}
+
+	pthread_mutex_unlock(&qd_log_rings_lock);
+
+	if (count > 0)
+		fflush(stderr);
+
+	return count;
+}
+
+static void *
+qd_log_thread_func(void *userdata)
+{
+	struct timespec deadline;
+
+	qd_thread_set_name("qd-log");
+
+	pthread_mutex_lock(&qd_log_drain_lock);
+	while (!qd_log_terminated) {
+		qd_log_drain();
+
+		clock_gettime(CLOCK_REALTIME, &deadline);
+		deadline.tv_nsec += QD_LOG_DRAIN_PERIOD_MS * 1000000L;
+		if (deadline.tv_nsec >= 1000000000L) {
+			deadline.tv_nsec -= 1000000000L;
+			deadline.tv_sec++;
+		}
+
+		pthread_cond_timedwait(&qd_log_drain_cond, &qd_log_drain_lock,
+				       &deadline);
+	}
+	qd_log_drain();
+	pthread_mutex_unlock(&qd_log_drain_lock);
+
+	return NULL;
+}
+
+static void
+qd_log_write_sync(int level, const char *fmt, va_list ap)
+{
+	fprintf(stderr, "[%08" PRIu64 "] ", qd_get_time() / 1000);
+	vfprintf(stderr, fmt, ap);
+}
+
+void
+qd_log_write(int level, const char *fmt, ...)
+{
+	union {
+		struct qd_log_record rec;
+		uint8_t data[QD_LOG_MAX_RECORD];
+	} u;
+	struct qd_log_ring *ring;
+	struct qd_log_blob blob;
+	int saved_errno = errno;
+	va_list ap;
+
+	va_start(ap, fmt);
+
+	if (!atomic_load_explicit(&qd_log_async, memory_order_relaxed) ||
+	    !(ring = qd_log_get_ring())) {
+		errno = saved_errno;
+		qd_log_write_sync(level, fmt, ap);
+		va_end(ap);
+		return;
+	}
+
+	blob.p = (uint8_t *)(&u.rec + 1);
+	blob.end = u.data + sizeof (u.data);
+	blob.truncated = false;
+
+	qd_log_capture(&blob, fmt, ap);
+	va_end(ap);
+
+	u.rec.size = blob.p - u.data;
+	u.rec.saved_errno = saved_errno;
+	u.rec.time = qd_get_time();
+	u.rec.fmt = fmt;
+
+	if (level <= 1) {
+		/* errors are written out before returning, so that they are
+		 * not lost on abort or crash; the queued records are drained
+		 * along to keep the order */
+		pthread_mutex_lock(&qd_log_drain_lock);
+		if (!qd_log_ring_push(ring, &u.rec)) {
+			qd_log_drain();
+			if (!qd_log_ring_push(ring, &u.rec))
+				atomic_fetch_add_explicit(&ring->dropped, 1,
+							  memory_order_relaxed);
+		}
+		qd_log_drain();
+		pthread_mutex_unlock(&qd_log_drain_lock);
+	} else if (!qd_log_ring_push(ring, &u.rec)) {
+		atomic_fetch_add_explicit(&ring->dropped, 1,
+					  memory_order_relaxed);
+	}
+
+	errno = saved_errno;
+}
+
+void
+qd_log_flush(void)
+{
+	if (!atomic_load(&qd_log_async))
+		return;
+
+	pthread_mutex_lock(&qd_log_drain_lock);
+	qd_log_drain();
+	pthread_mutex_unlock(&qd_log_drain_lock);
+}
+
+int
+qd_log_start(void)
+{
+	pthread_once(&qd_log_once, qd_log_init_once);
+
+	if (atomic_load(&qd_log_async))
+		return 0;
+
+	if (getenv("QD_LOG_SYNC"))
+		return 0;
+
+	qd_log_terminated = false;
+
+	if (pthread_create(&qd_log_tid, NULL, qd_log_thread_func, NULL))
+		return -1;
+
+	atomic_store(&qd_log_async, true);
+
+	return 0;
+}
+
+void
+qd_log_stop(void)
+{
+	if (!atomic_load(&qd_log_async))
+		return;
+
+	pthread_mutex_lock(&qd_log_drain_lock);
+	qd_log_terminated = true;
+	pthread_cond_signal(&qd_log_drain_cond);
+	pthread_mutex_unlock(&qd_log_drain_lock);
+
+	pthread_join(qd_log_tid, NULL);
+
+	atomic_store(&qd_log_async, false);
+
+	/* catch messages written while the thread was exiting */
+	pthread_mutex_lock(&qd_log_drain_lock);
+	qd_log_drain();
+	pthread_mutex_unlock(&qd_log_drain_lock);
+}
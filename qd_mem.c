@@ -0,0 +1,176 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <malloc.h>
+
+#include "qd.h"
+
+/*
+ * Memory accounting
+ *
+ * libqd allocations go through these wrappers, which keep per type counters
+ * of the allocated bytes and their high-water mark. Sizes are taken from
+ * malloc_usable_size(), so that nothing needs to be stored next to the
+ * allocations. libav* and the QAP libraries cannot be hooked, their usage is
+ * only visible in the process heap and RSS figures.
+ */
+
+static struct qd_mem_counters qd_mem_counters[QD_MEM_TYPE_COUNT];
+
+static void
+qd_mem_account(enum qd_mem_type type, int64_t delta)
+{
+	struct qd_mem_counters *c = &qd_mem_counters[type];
+	uint64_t bytes;
+	uint64_t peak;
+
+	bytes = __atomic_add_fetch(&c->bytes, delta, __ATOMIC_RELAXED);
+
+	peak = __atomic_load_n(&c->peak_bytes, __ATOMIC_RELAXED);
+	while (bytes > peak &&
+	       !__atomic_compare_exchange_n(&c->peak_bytes, &peak, bytes, true,
+					    __ATOMIC_RELAXED,
+					    __ATOMIC_RELAXED))
+		;
+}
+
+void *
+qd_mem_malloc(enum qd_mem_type type, size_t size)
+{
+	void *p = malloc(size);
+
+	if (p) {
+		__atomic_fetch_add(&qd_mem_counters[type].allocs, 1,
+				   __ATOMIC_RELAXED);
+		qd_mem_account(type, malloc_usable_size(p));
+	}
+
+	return p;
+}
+
+void *
+qd_mem_calloc(enum qd_mem_type type, size_t nmemb, size_t size)
+{
+	void *p = calloc(nmemb, size);
+
+	if (p) {
+		__atomic_fetch_add(&qd_mem_counters[type].allocs, 1,
+				   __ATOMIC_RELAXED);
+		qd_mem_account(type, malloc_usable_size(p));
+	}
+
+	return p;
+}
+
+void *
+qd_mem_realloc(enum qd_mem_type type, void *ptr, size_t size)
+{
+	size_t old_size = ptr ? malloc_usable_size(ptr) : 0;
+	void *p = realloc(ptr, size);
+
+	if (p) {
+		__atomic_fetch_add(&qd_mem_counters[type].allocs, 1,
+				   __ATOMIC_RELAXED);
+		qd_mem_account(type, (int64_t)malloc_usable_size(p) - old_size);
+	}
+
+	return p;
+}
+
+char *
+qd_mem_strdup(enum qd_mem_type type, const char *s)
+{
+	size_t len = strlen(s) + 1;
+	char *p = qd_mem_malloc(type, len);
+
+	if (p)
+		memcpy(p, s, len);
+
+	return p;
+}
+
+void
+qd_mem_free(enum qd_mem_type type, void *ptr)
+{
+	if (!ptr)
+		return;
+
+	qd_mem_account(type, -(int64_t)malloc_usable_size(ptr));
+	free(ptr);
+}
+
+/* VmRSS and VmHWM, the kernel keeps track of the peak for us */
+static void
+qd_mem_read_rss(struct qd_mem_stats *stats)
+{
+	char line[128];
+	unsigned long long kb;
+	FILE *f;
+
+	f = fopen("/proc/self/status", "r");
+	if (!f)
+		return;
+
+	while (fgets(line, sizeof (line), f)) {
+		if (sscanf(line, "VmRSS: %llu kB", &kb) == 1)
+			stats->rss = kb * 1024;
+		else if (sscanf(line, "VmHWM: %llu kB", &kb) == 1)
+			stats->peak_rss = kb * 1024;
+	}
+
+	fclose(f);
+}
+
+void
+qd_mem_get_stats(struct qd_mem_stats *stats)
+{
+	memset(stats, 0, sizeof (*stats));
+
+	for (int i = 0; i < QD_MEM_TYPE_COUNT; i++) {
+		struct qd_mem_counters *c = &qd_mem_counters[i];
+
+		stats->types[i].allocs =
+			__atomic_load_n(&c->allocs, __ATOMIC_RELAXED);
+		stats->types[i].bytes =
+			__atomic_load_n(&c->bytes, __ATOMIC_RELAXED);
+		stats->types[i].peak_bytes =
+			__atomic_load_n(&c->peak_bytes, __ATOMIC_RELAXED);
+	}
+
+	/* chunks in use, including the ones served by mmap */
+#ifdef __GLIBC__
+# if __GLIBC_PREREQ(2, 33)
+	struct mallinfo2 mi = mallinfo2();
+	stats->heap_bytes = mi.uordblks + mi.hblkhd;
+# else
+	struct mallinfo mi = mallinfo();
+	stats->heap_bytes = (unsigned int)mi.uordblks +
+		(unsigned int)mi.hblkhd;
+# endif
+#endif
+
+	qd_mem_read_rss(stats);
+}
+
+const char *
+qd_mem_type_to_str(enum qd_mem_type type)
+{
+	switch (type) {
+	case QD_MEM_SESSION:
+		return "session";
+	case QD_MEM_INPUT:
+		return "input";
+	case QD_MEM_SOURCE:
+		return "source";
+	case QD_MEM_SWDEC:
+		return "swdec";
+	case QD_MEM_LOG:
+		return "log";
+	case QD_MEM_TRACE:
+		return "trace";
+	default:
+		return "unknown";
+	}
+}
@@ -0,0 +1,139 @@
+#include <stdint.h>
+#include <string.h>
+
+#include "qd.h"
+
+/*
+ * Latency histograms
+ *
+ * Values are stored in log-linear buckets: values below 4 get their own
+ * bucket, larger values are split into 4 sub-buckets per power of two, so
+ * the relative error of a percentile is bounded to 25%. Counters are updated
+ * with relaxed atomics, writers never block and readers get a slightly
+ * inconsistent but usable snapshot.
+ */
+
+#define QD_HISTOGRAM_SUB_COUNT	(1 << QD_HISTOGRAM_SUB_BITS)
+
+static unsigned int
+qd_histogram_bucket(uint64_t value)
+{
+	unsigned int msb;
+	unsigned int index;
+
+	if (value < QD_HISTOGRAM_SUB_COUNT)
+		return value;
+
+	msb = 63 - __builtin_clzll(value);
+	index = (msb - QD_HISTOGRAM_SUB_BITS + 1) * QD_HISTOGRAM_SUB_COUNT +
+		((value >> (msb - QD_HISTOGRAM_SUB_BITS)) &
+		 (QD_HISTOGRAM_SUB_COUNT - 1));
+
+	return QD_MIN(index, QD_HISTOGRAM_BUCKETS - 1);
+}
+
+/* upper bound of the values stored in a bucket */
+static uint64_t
+qd_histogram_bucket_max(unsigned int index)
+{
+	unsigned int msb;
+	uint64_t sub;
+
+	if (index < QD_HISTOGRAM_SUB_COUNT)
+		return index;
+
+	msb = index / QD_HISTOGRAM_SUB_COUNT + QD_HISTOGRAM_SUB_BITS - 1;
+	sub = index % QD_HISTOGRAM_SUB_COUNT;
+
+	return (((UINT64_C(1) << QD_HISTOGRAM_SUB_BITS | sub) + 1) <<
+		(msb - QD_HISTOGRAM_SUB_BITS)) - 1;
+}
+
+void
+qd_histogram_add(struct qd_histogram *h, uint64_t value)
+{
+	uint64_t max;
+
+	__atomic_fetch_add(&h->buckets[qd_histogram_bucket(value)], 1,
+			   __ATOMIC_RELAXED);
+	__atomic_fetch_add(&h->sum, value, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&h->count, 1, __ATOMIC_RELAXED);
+
+	max = __atomic_load_n(&h->max, __ATOMIC_RELAXED);
+	while (value > max &&
+	       !__atomic_compare_exchange_n(&h->max, &max, value, true,
+					    __ATOMIC_RELAXED,
+					    __ATOMIC_RELAXED))
+		;
+}
+
+void
+qd_histogram_snapshot(const struct qd_histogram *h, struct qd_histogram *copy)
+{
+	copy->count = 0;
+	for (int i = 0; i < QD_HISTOGRAM_BUCKETS; i++) {
+		copy->buckets[i] = __atomic_load_n(&h->buckets[i],
+						   __ATOMIC_RELAXED);
+		copy->count += copy->buckets[i];
+	}
+	copy->sum = __atomic_load_n(&h->sum, __ATOMIC_RELAXED);
+	copy->max = __atomic_load_n(&h->max, __ATOMIC_RELAXED);
+}
+
+/* value below which a fraction p (0..1) of the samples fall, as the upper
+ * bound of the matching bucket, capped by the observed maximum */
+uint64_t
+qd_histogram_percentile(const struct qd_histogram *h, double p)
+{
+	uint64_t target;
+	uint64_t n = 0;
+
+	if (h->count == 0)
+		return 0;
+
+	target = (uint64_t)(p * h->count + 0.5);
+	if (target == 0)
+		target = 1;
+
+	for (int i = 0; i < QD_HISTOGRAM_BUCKETS; i++) {
+		n += h->buckets[i];
+		if (n >= target)
+			return QD_MIN(qd_histogram_bucket_max(i), h->max);
+	}
+
+	return h->max;
+}
+
+const char *
+qd_input_stage_to_str(enum qd_input_stage stage)
+{
+	switch (stage) {
+	case QD_INPUT_STAGE_READ:
+		return "read";
+	case QD_INPUT_STAGE_PROCESS:
+		return "process";
+	case QD_INPUT_STAGE_WAIT:
+		return "wait";
+	default:
+		return "unknown";
+	}
+}
+
+const char *
+qd_output_stage_to_str(enum qd_output_stage stage)
+{
+	switch (stage) {
+	case QD_OUTPUT_STAGE_DELIVER:
+		return "deliver";
+	case QD_OUTPUT_STAGE_INTERVAL:
+		return "interval";
+	case QD_OUTPUT_STAGE_LATENCY:
+		return "latency";
+	case QD_OUTPUT_STAGE_JITTER:
+		return "jitter";
+	case QD_OUTPUT_STAGE_LATENESS:
+		return "lateness";
+	default:
+		return "unknown";
+	}
+}
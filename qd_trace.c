@@ -0,0 +1,264 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <inttypes.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/prctl.h>
+#include <sys/syscall.h>
+
+#include "qd.h"
+
+/*
+ * Chrome trace-event recorder
+ *
+ * Events are stored in a per-thread buffer, and written as JSON to the
+ * trace file when the buffer is full or when tracing is stopped. Each
+ * thread gets its own track, named after the thread. The resulting file
+ * can be loaded in Perfetto (ui.perfetto.dev) or chrome://tracing.
+ */
+
+#define QD_TRACE_BUF_EVENTS	512
+
+struct qd_trace_event {
+	const char *name;
+	const char *target;
+	int64_t value;
+	uint64_t ts;
+	uint64_t dur;
+	char ph;
+};
+
+struct qd_trace_buf {
+	struct qd_trace_buf *next;
+	pthread_mutex_t lock;
+	int tid;
+	char name[16];
+	char written_name[16];
+	unsigned int count;
+	struct qd_trace_event events[QD_TRACE_BUF_EVENTS];
+};
+
+int qd_trace_active;
+
+static pthread_mutex_t qd_trace_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t qd_trace_once = PTHREAD_ONCE_INIT;
+static pthread_key_t qd_trace_key;
+static __thread struct qd_trace_buf *qd_trace_tls_buf;
+static struct qd_trace_buf *qd_trace_bufs;
+static FILE *qd_trace_stream;
+static bool qd_trace_first_event;
+static int qd_trace_pid;
+
+/* called with qd_trace_lock held */
+static void
+qd_trace_write_event(const struct qd_trace_buf *buf,
+		     const struct qd_trace_event *ev)
+{
+	FILE *f = qd_trace_stream;
+
+	fprintf(f, "%s\n{\"ph\":\"%c\",\"pid\":%d,\"tid\":%d,\"ts\":%" PRIu64,
+		qd_trace_first_event ? "" : ",", ev->ph, qd_trace_pid,
+		buf->tid, ev->ts);
+	qd_trace_first_event = false;
+
+	switch (ev->ph) {
+	case 'X':
+		fprintf(f, ",\"dur\":%" PRIu64 ",\"name\":\"%s\"", ev->dur,
+			ev->name);
+		if (ev->target || ev->value >= 0) {
+			fprintf(f, ",\"args\":{");
+			if (ev->target)
+				fprintf(f, "\"target\":\"%s\"", ev->target);
+			if (ev->value >= 0) {
+				fprintf(f, "%s\"value\":%" PRId64,
+					ev->target ? "," : "", ev->value);
+			}
+			fprintf(f, "}");
+		}
+		break;
+	case 'C':
+		fprintf(f, ",\"name\":\"%s\",\"args\":{\"%s\":%" PRId64 "}",
+			ev->name, ev->target, ev->value);
+		break;
+	}
+
+	fprintf(f, "}");
+}
+
+/* called with qd_trace_lock and the buffer lock held */
+static void
+qd_trace_flush_buf(struct qd_trace_buf *buf)
+{
+	if (!qd_trace_stream) {
+		buf->count = 0;
+		return;
+	}
+
+	if (strcmp(buf->name, buf->written_name)) {
+		fprintf(qd_trace_stream,
+			"%s\n{\"ph\":\"M\",\"pid\":%d,\"tid\":%d,"
+			"\"name\":\"thread_name\",\"args\":{\"name\":\"%s\"}}",
+			qd_trace_first_event ? "" : ",", qd_trace_pid,
+			buf->tid, buf->name);
+		qd_trace_first_event = false;
+		strcpy(buf->written_name, buf->name);
+	}
+
+	for (unsigned int i = 0; i < buf->count; i++)
+		qd_trace_write_event(buf, &buf->events[i]);
+
+	buf->count = 0;
+}
+
+static void
+qd_trace_buf_release(void *data)
+{
+	struct qd_trace_buf *buf = data;
+	struct qd_trace_buf **p;
+
+	pthread_mutex_lock(&qd_trace_lock);
+	pthread_mutex_lock(&buf->lock);
+	qd_trace_flush_buf(buf);
+	pthread_mutex_unlock(&buf->lock);
+
+	for (p = &qd_trace_bufs; *p; p = &(*p)->next) {
+		if (*p == buf) {
+			*p = buf->next;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&qd_trace_lock);
+
+	pthread_mutex_destroy(&buf->lock);
+	qd_mem_free(QD_MEM_TRACE, buf);
+}
+
+static void
+qd_trace_init_once(void)
+{
+	pthread_key_create(&qd_trace_key, qd_trace_buf_release);
+}
+
+static struct qd_trace_buf *
+qd_trace_get_buf(void)
+{
+	struct qd_trace_buf *buf = qd_trace_tls_buf;
+
+	if (buf)
+		return buf;
+
+	buf = qd_mem_calloc(QD_MEM_TRACE, 1, sizeof (*buf));
+	if (!buf)
+		return NULL;
+
+	pthread_mutex_init(&buf->lock, NULL);
+	buf->tid = syscall(SYS_gettid);
+	prctl(PR_GET_NAME, buf->name);
+
+	pthread_mutex_lock(&qd_trace_lock);
+	buf->next = qd_trace_bufs;
+	qd_trace_bufs = buf;
+	pthread_mutex_unlock(&qd_trace_lock);
+
+	pthread_setspecific(qd_trace_key, buf);
+	qd_trace_tls_buf = buf;
+
+	return buf;
+}
+
+static void
+qd_trace_add(char ph, const char *name, const char *target, int64_t value,
+	     uint64_t ts, uint64_t dur)
+{
+	struct qd_trace_buf *buf = qd_trace_get_buf();
+	struct qd_trace_event *ev;
+
+	if (!buf)
+		return;
+
+	pthread_mutex_lock(&buf->lock);
+
+	if (buf->count == QD_TRACE_BUF_EVENTS) {
+		/* threads may have been renamed since the last flush */
+		prctl(PR_GET_NAME, buf->name);
+
+		pthread_mutex_unlock(&buf->lock);
+		pthread_mutex_lock(&qd_trace_lock);
+		pthread_mutex_lock(&buf->lock);
+		qd_trace_flush_buf(buf);
+		pthread_mutex_unlock(&qd_trace_lock);
+	}
+
+	ev = &buf->events[buf->count++];
+	ev->ph = ph;
+	ev->name = name;
+	ev->target = target;
+	ev->value = value;
+	ev->ts = ts;
+	ev->dur = dur;
+
+	pthread_mutex_unlock(&buf->lock);
+}
+
+void
+qd_trace_slice(const char *name, const char *target, int64_t value,
+	       uint64_t start, uint64_t end)
+{
+	qd_trace_add('X', name, target, value, start, end - start);
+}
+
+void
+qd_trace_counter(const char *name, const char *series, int64_t value,
+		 uint64_t time)
+{
+	qd_trace_add('C', name, series, value, time, 0);
+}
+
+int
+qd_trace_start(const char *path)
+{
+	FILE *f;
+
+	pthread_once(&qd_trace_once, qd_trace_init_once);
+
+	f = fopen(path, "w");
+	if (!f) {
+		err("failed to open %s: %m", path);
+		return -1;
+	}
+
+	pthread_mutex_lock(&qd_trace_lock);
+	qd_trace_stream = f;
+	qd_trace_pid = getpid();
+	qd_trace_first_event = true;
+	fprintf(f, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[");
+	pthread_mutex_unlock(&qd_trace_lock);
+
+	__atomic_store_n(&qd_trace_active, 1, __ATOMIC_RELEASE);
+
+	return 0;
+}
+
+void
+qd_trace_stop(void)
+{
+	if (!__atomic_exchange_n(&qd_trace_active, 0, __ATOMIC_ACQ_REL))
+		return;
+
+	pthread_mutex_lock(&qd_trace_lock);
+
+	for (struct qd_trace_buf *buf = qd_trace_bufs; buf; buf = buf->next) {
+		pthread_mutex_lock(&buf->lock);
+		qd_trace_flush_buf(buf);
+		pthread_mutex_unlock(&buf->lock);
+	}
+
+	fprintf(qd_trace_stream, "\n]}\n");
+	fclose(qd_trace_stream);
+	qd_trace_stream = NULL;
+
+	pthread_mutex_unlock(&qd_trace_lock);
+}
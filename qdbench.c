@@ -0,0 +1,578 @@
+/*
+ * qdbench: microbenchmarks of the libqd hot paths
+ *
+ * qd.c is built into this file so that its static helpers can be called in
+ * isolation, without a QAP session or input data. Link it with qap_stub.o to
+ * run it on the host (make host/qdbench).
+ *
+ * Each benchmark is run with a growing number of calls until it lasts the
+ * minimum run time, and reports the time per call, per byte of audio data
+ * produced, and the number of heap allocations per call.
+ */
+
+#include "qd.c"
+
+#include <getopt.h>
+
+#define BENCH_FRAMES		1536	/* 32ms at 48kHz, MS12 output size */
+#define BENCH_AAC_PAYLOAD	768
+#define BENCH_LATM_PAYLOAD	400
+
+#ifdef __GLIBC__
+/* count heap allocations by interposing the allocator, including the ones
+ * made by the ffmpeg libraries */
+# define BENCH_COUNT_ALLOCS	1
+
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t nmemb, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+extern void *__libc_memalign(size_t alignment, size_t size);
+extern void __libc_free(void *ptr);
+
+static __thread uint64_t bench_allocs;
+
+void *
+malloc(size_t size)
+{
+	bench_allocs++;
+	return __libc_malloc(size);
+}
+
+void *
+calloc(size_t nmemb, size_t size)
+{
+	bench_allocs++;
+	return __libc_calloc(nmemb, size);
+}
+
+void *
+realloc(void *ptr, size_t size)
+{
+	bench_allocs++;
+	return __libc_realloc(ptr, size);
+}
+
+void *
+memalign(size_t alignment, size_t size)
+{
+	bench_allocs++;
+	return __libc_memalign(alignment, size);
+}
+
+void *
+aligned_alloc(size_t alignment, size_t size)
+{
+	bench_allocs++;
+	return __libc_memalign(alignment, size);
+}
+
+int
+posix_memalign(void **memptr, size_t alignment, size_t size)
+{
+	void *p;
+
+	bench_allocs++;
+	p = __libc_memalign(alignment, size);
+	if (!p)
+		return ENOMEM;
+
+	*memptr = p;
+	return 0;
+}
+
+void
+free(void *ptr)
+{
+	__libc_free(ptr);
+}
+#else
+# define BENCH_COUNT_ALLOCS	0
+
+static uint64_t bench_allocs;
+#endif
+
+typedef void (*bench_func_t)(void *ctx);
+
+static uint64_t bench_min_time = 200 * QD_MSECOND;
+static char **bench_filters;
+static int bench_n_filters;
+
+static bool
+bench_selected(const char *name)
+{
+	if (bench_n_filters == 0)
+		return true;
+
+	for (int i = 0; i < bench_n_filters; i++) {
+		if (strstr(name, bench_filters[i]))
+			return true;
+	}
+
+	return false;
+}
+
+static void
+bench_run(const char *name, size_t bytes, bench_func_t func, void *ctx)
+{
+	uint64_t n_calls = 1;
+	uint64_t elapsed;
+	uint64_t allocs;
+	uint64_t start;
+
+	/* first call may allocate buffers that are reused afterwards */
+	func(ctx);
+
+	while (1) {
+		allocs = bench_allocs;
+		start = get_time();
+
+		for (uint64_t i = 0; i < n_calls; i++)
+			func(ctx);
+
+		elapsed = get_time() - start;
+		allocs = bench_allocs - allocs;
+
+		if (elapsed >= bench_min_time)
+			break;
+
+		n_calls *= 2;
+	}
+
+	printf("%-36s %10" PRIu64 " %10.1f %8.3f", name, n_calls,
+	       elapsed * 1000. / n_calls,
+	       bytes ? elapsed * 1000. / n_calls / bytes : 0.);
+
+	if (BENCH_COUNT_ALLOCS)
+		printf(" %8.2f\n", (double)allocs / n_calls);
+	else
+		printf(" %8s\n", "n/a");
+}
+
+/*
+ * output_write_buffer: WAV channel reorder, or plain write, to /dev/null
+ */
+
+struct write_ctx {
+	struct qd_output output;
+	qap_buffer_common_t buffer;
+};
+
+static void
+bench_write_func(void *userdata)
+{
+	struct write_ctx *ctx = userdata;
+
+	output_write_buffer(&ctx->output, &ctx->buffer);
+}
+
+static void
+bench_output_write(const char *name, int channels, int bit_width, bool wav)
+{
+	/* 5.1 with LFE last, as output by MS12, to exercise the reorder */
+	static const int wav_order[] = { 0, 1, 2, 5, 3, 4, 6, 7 };
+	struct write_ctx ctx = {};
+	int sample_size = bit_width / 8;
+
+	if (!bench_selected(name))
+		return;
+
+	ctx.output.name = name;
+	ctx.output.config.channels = channels;
+	ctx.output.config.bit_width = bit_width;
+	ctx.output.wav_enabled = wav;
+	ctx.output.wav_channel_count = channels;
+	for (int ch = 0; ch < channels; ch++)
+		ctx.output.wav_channel_offset[ch] = wav_order[ch] * sample_size;
+
+	ctx.output.stream = fopen("/dev/null", "w");
+	ctx.buffer.size = BENCH_FRAMES * channels * sample_size;
+	ctx.buffer.data = calloc(1, ctx.buffer.size);
+	if (!ctx.output.stream || !ctx.buffer.data) {
+		err("%s: setup failed", name);
+		goto out;
+	}
+
+	bench_run(name, ctx.buffer.size, bench_write_func, &ctx);
+
+out:
+	if (ctx.output.stream)
+		fclose(ctx.output.stream);
+	free(ctx.buffer.data);
+}
+
+/*
+ * AAC input packing: ADTS header insertion and LATM muxing
+ */
+
+struct aac_ctx {
+	struct qd_input input;
+	AVFormatContext *avctx;
+	AVPacket *pkt;
+	int payload_size;
+	int64_t ts;
+};
+
+static void
+bench_adts_func(void *userdata)
+{
+	struct aac_ctx *ctx = userdata;
+
+	ctx->pkt->size = ctx->payload_size;
+	input_insert_adts_header(&ctx->input, ctx->pkt);
+}
+
+static void
+bench_latm_func(void *userdata)
+{
+	struct aac_ctx *ctx = userdata;
+	AVPacket pkt = *ctx->pkt;
+	uint8_t *data;
+
+	pkt.pts = pkt.dts = ctx->ts;
+	ctx->ts += pkt.duration;
+
+	if (input_mux_latm(&ctx->input, &pkt, &data) >= 0)
+		av_free(data);
+}
+
+static void
+aac_ctx_cleanup(struct aac_ctx *ctx)
+{
+	if (ctx->input.avmux)
+		avformat_free_context(ctx->input.avmux);
+	avformat_free_context(ctx->avctx);
+	av_packet_free(&ctx->pkt);
+}
+
+static int
+aac_ctx_init(struct aac_ctx *ctx, const uint8_t *config, int config_size,
+	     int payload_size)
+{
+	AVStream *avstream;
+
+	memset(ctx, 0, sizeof (*ctx));
+
+	ctx->input.name = "main";
+	ctx->payload_size = payload_size;
+
+	ctx->avctx = avformat_alloc_context();
+	if (!ctx->avctx)
+		goto fail;
+
+	avstream = avformat_new_stream(ctx->avctx, NULL);
+	if (!avstream)
+		goto fail;
+
+	avstream->time_base = (AVRational){ 1, 48000 };
+	avstream->codecpar->codec_type = AVMEDIA_TYPE_AUDIO;
+	avstream->codecpar->codec_id = AV_CODEC_ID_AAC;
+	avstream->codecpar->sample_rate = 48000;
+	avstream->codecpar->channels = 2;
+	avstream->codecpar->channel_layout = AV_CH_LAYOUT_STEREO;
+	avstream->codecpar->extradata =
+		av_mallocz(config_size + AV_INPUT_BUFFER_PADDING_SIZE);
+	if (!avstream->codecpar->extradata)
+		goto fail;
+	memcpy(avstream->codecpar->extradata, config, config_size);
+	avstream->codecpar->extradata_size = config_size;
+
+	if (qd_input_setup_avstream(&ctx->input, avstream))
+		goto fail;
+
+	/* ADTS insertion needs room for the header in the packet padding */
+	ctx->pkt = av_packet_alloc();
+	if (!ctx->pkt || av_new_packet(ctx->pkt, payload_size))
+		goto fail;
+
+	/* zeroed payload, so that it is not mistaken for an ADTS stream */
+	memset(ctx->pkt->data, 0, payload_size);
+	ctx->pkt->duration = 1024;
+
+	return 0;
+
+fail:
+	aac_ctx_cleanup(ctx);
+	return -1;
+}
+
+static void
+bench_adts(void)
+{
+	/* AAC LC, 48kHz, stereo */
+	static const uint8_t config[] = { 0x11, 0x90 };
+	const char *name = "input_insert_adts_header/aac_lc";
+	struct aac_ctx ctx;
+
+	if (!bench_selected(name))
+		return;
+
+	if (aac_ctx_init(&ctx, config, sizeof (config), BENCH_AAC_PAYLOAD)) {
+		err("%s: setup failed", name);
+		return;
+	}
+
+	if (ctx.input.insert_adts_header)
+		bench_run(name, BENCH_AAC_PAYLOAD + ADTS_HEADER_SIZE,
+			  bench_adts_func, &ctx);
+	else
+		err("%s: ADTS insertion not enabled", name);
+
+	aac_ctx_cleanup(&ctx);
+}
+
+static void
+bench_latm(void)
+{
+	/* HE-AAC, 24kHz core with 48kHz SBR, stereo */
+	static const uint8_t config[] = { 0x2b, 0x11, 0x88, 0x00 };
+	const char *name = "input_mux_latm/he_aac";
+	struct aac_ctx ctx;
+
+	if (!bench_selected(name))
+		return;
+
+	if (aac_ctx_init(&ctx, config, sizeof (config), BENCH_LATM_PAYLOAD)) {
+		err("%s: setup failed", name);
+		return;
+	}
+
+	if (ctx.input.avmux)
+		bench_run(name, BENCH_LATM_PAYLOAD, bench_latm_func, &ctx);
+	else
+		err("%s: LATM muxer not enabled", name);
+
+	aac_ctx_cleanup(&ctx);
+}
+
+/*
+ * qd_sw_decoder_output_frame: decoded frame conversion to the output format
+ */
+
+struct swdec_ctx {
+	struct qd_sw_decoder dec;
+	AVFrame *frame;
+};
+
+static void
+bench_swdec_cb(void *userdata, qap_audio_buffer_t *buffer)
+{
+}
+
+static void
+bench_swdec_func(void *userdata)
+{
+	struct swdec_ctx *ctx = userdata;
+
+	qd_sw_decoder_output_frame(&ctx->dec, ctx->frame);
+}
+
+static void
+bench_swdec(const char *name, uint64_t channel_layout,
+	    enum qd_sample_format sample_format)
+{
+	struct swdec_ctx ctx = {};
+	AVFrame *frame;
+	size_t bytes;
+
+	if (!bench_selected(name))
+		return;
+
+	ctx.dec.sample_format = sample_format;
+	ctx.dec.swr_out_format = AV_SAMPLE_FMT_NONE;
+	ctx.dec.swr_in_format = AV_SAMPLE_FMT_NONE;
+	ctx.dec.out_format = AV_SAMPLE_FMT_NONE;
+	ctx.dec.cb = bench_swdec_cb;
+	ctx.dec.swr = swr_alloc();
+	pthread_mutex_init(&ctx.dec.lock, NULL);
+
+	/* planar float frame, as output by the ffmpeg AC3 decoders */
+	ctx.frame = frame = av_frame_alloc();
+	if (!ctx.dec.swr || !frame)
+		goto fail;
+
+	frame->format = AV_SAMPLE_FMT_FLTP;
+	frame->sample_rate = 48000;
+	frame->channel_layout = channel_layout;
+	frame->channels = av_get_channel_layout_nb_channels(channel_layout);
+	frame->nb_samples = BENCH_FRAMES;
+	if (av_frame_get_buffer(frame, 0))
+		goto fail;
+
+	/* 500Hz sawtooth, so that sample values are not all zeroes */
+	for (int ch = 0; ch < frame->channels; ch++) {
+		float *samples = (float *)frame->extended_data[ch];
+		for (int i = 0; i < frame->nb_samples; i++)
+			samples[i] = (i % 96) / 48.f - 1.f;
+	}
+
+	bytes = av_samples_get_buffer_size(NULL, frame->channels,
+					   frame->nb_samples,
+					   sample_format == QD_SAMPLE_FORMAT_S16 ?
+					   AV_SAMPLE_FMT_S16 : AV_SAMPLE_FMT_S32,
+					   1);
+
+	bench_run(name, bytes, bench_swdec_func, &ctx);
+
+	goto out;
+
+fail:
+	err("%s: setup failed", name);
+out:
+	av_frame_free(&ctx.frame);
+	swr_free(&ctx.dec.swr);
+	qd_mem_free(QD_MEM_SWDEC, ctx.dec.swr_buffer);
+	pthread_mutex_destroy(&ctx.dec.lock);
+}
+
+/*
+ * handle_buffer: per buffer bookkeeping, with a null output callback
+ */
+
+struct handle_buffer_ctx {
+	struct qd_session *session;
+	struct qd_output *output;
+	qap_audio_buffer_t buffer;
+};
+
+static void
+bench_output_cb(struct qd_output *output, qap_audio_buffer_t *buffer,
+		void *userdata)
+{
+}
+
+static void
+bench_handle_buffer_func(void *userdata)
+{
+	struct handle_buffer_ctx *ctx = userdata;
+
+	/* keep timestamps continuous, resets are not the common case */
+	ctx->buffer.common_params.timestamp = ctx->output->expected_ts;
+	handle_buffer(ctx->session, &ctx->buffer);
+}
+
+static void
+bench_handle_buffer(const char *name, enum qd_output_id id, int channels)
+{
+	struct handle_buffer_ctx ctx = {};
+	struct qd_session *session;
+	struct qd_output *output;
+
+	if (!bench_selected(name))
+		return;
+
+	session = calloc(1, sizeof (*session));
+	if (!session) {
+		err("%s: setup failed", name);
+		return;
+	}
+
+	session->type = QAP_SESSION_BROADCAST;
+	session->ignore_timestamps = -1;
+	session->output_cb_func = bench_output_cb;
+	pthread_mutex_init(&session->lock, NULL);
+	pthread_cond_init(&session->cond, NULL);
+
+	for (int i = 0; i < QD_MAX_OUTPUTS; i++) {
+		session->outputs[i].id = i;
+		session->outputs[i].name = qd_output_id_to_str(i);
+		session->outputs[i].session = session;
+	}
+
+	output = &session->outputs[id];
+	output->enabled = true;
+	output->config.format = QAP_AUDIO_FORMAT_PCM_16_BIT;
+	output->config.sample_rate = 48000;
+	output->config.channels = channels;
+	output->config.bit_width = 16;
+	output->start_time = qd_get_time();
+
+	ctx.session = session;
+	ctx.output = output;
+	ctx.buffer.buffer_parms.output_buf_params.output_id = id;
+	ctx.buffer.common_params.size = BENCH_FRAMES * channels * 2;
+	ctx.buffer.common_params.data = calloc(1, ctx.buffer.common_params.size);
+
+	if (ctx.buffer.common_params.data)
+		bench_run(name, ctx.buffer.common_params.size,
+			  bench_handle_buffer_func, &ctx);
+	else
+		err("%s: setup failed", name);
+
+	free(ctx.buffer.common_params.data);
+	pthread_cond_destroy(&session->cond);
+	pthread_mutex_destroy(&session->lock);
+	free(session);
+}
+
+static void usage(void)
+{
+	fprintf(stderr, "usage: qdbench [OPTS] [filter...]\n"
+		"Run the benchmarks whose name contains one of the filters,\n"
+		"or all of them. Where OPTS is a combination of:\n"
+		"  -v, --verbose                increase debug verbosity\n"
+		"  -t, --time=<ms>              minimum run time of each benchmark,\n"
+		"                                default 200ms\n"
+		"\n");
+}
+
+static const struct option long_options[] = {
+	{ "verbose",           no_argument,       0, 'v' },
+	{ "time",              required_argument, 0, 't' },
+	{ "help",              no_argument,       0, 'h' },
+	{ 0, 0, 0, 0 }
+};
+
+int main(int argc, char **argv)
+{
+	int opt;
+
+	while ((opt = getopt_long(argc, argv, "ht:v",
+				  long_options, NULL)) != -1) {
+		switch (opt) {
+		case 'v':
+			qd_debug_level++;
+			break;
+		case 't':
+			if (atoi(optarg) <= 0) {
+				err("invalid time %s", optarg);
+				usage();
+				return 1;
+			}
+			bench_min_time = atoi(optarg) * QD_MSECOND;
+			break;
+		case 'h':
+			usage();
+			return 0;
+		default:
+			usage();
+			return 1;
+		}
+	}
+
+	bench_filters = argv + optind;
+	bench_n_filters = argc - optind;
+
+	/* no logging thread, messages are written synchronously */
+	av_log_set_level(get_av_log_level());
+
+	printf("%-36s %10s %10s %8s %8s\n", "benchmark", "calls", "ns/call",
+	       "ns/byte", "allocs");
+
+	bench_output_write("output_write_buffer/raw_5.1_s16", 6, 16, false);
+	bench_output_write("output_write_buffer/wav_5.1_s16", 6, 16, true);
+	bench_output_write("output_write_buffer/wav_7.1_s32", 8, 32, true);
+	bench_adts();
+	bench_latm();
+	bench_swdec("swdec_output_frame/2.0_fltp_flt", AV_CH_LAYOUT_STEREO,
+		    QD_SAMPLE_FORMAT_FLT);
+	bench_swdec("swdec_output_frame/5.1_fltp_flt", AV_CH_LAYOUT_5POINT1,
+		    QD_SAMPLE_FORMAT_FLT);
+	bench_swdec("swdec_output_frame/5.1_fltp_s16", AV_CH_LAYOUT_5POINT1,
+		    QD_SAMPLE_FORMAT_S16);
+	bench_swdec("swdec_output_frame/5.1_fltp_s32", AV_CH_LAYOUT_5POINT1,
+		    QD_SAMPLE_FORMAT_S32);
+	bench_handle_buffer("handle_buffer/2.0_s16", QD_OUTPUT_STEREO, 2);
+	bench_handle_buffer("handle_buffer/5.1_s16", QD_OUTPUT_5DOT1, 6);
+
+	return 0;
+}